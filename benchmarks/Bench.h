@@ -0,0 +1,320 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Shared helpers for the benchmark executables, timing, summary statistics,
+// command line parsing, loopback socket pairs and a minimal JSON writer so every
+// benchmark emits the same machine readable format
+namespace bench
+{
+	using Clock = std::chrono::steady_clock;
+
+	inline double elapsedNs(Clock::time_point start, Clock::time_point end)
+	{
+		return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	}
+
+	struct Summary
+	{
+		size_t count = 0;
+		double mean = 0;
+		double min = 0;
+		double p50 = 0;
+		double p90 = 0;
+		double p99 = 0;
+		double p999 = 0;
+		double max = 0;
+	};
+
+	// Sorts the samples in place
+	inline Summary summarize(std::vector<double>& samples)
+	{
+		Summary s;
+		if (samples.empty())
+			return s;
+
+		std::sort(samples.begin(), samples.end());
+		auto at = [&samples](double q)
+		{
+			size_t i = static_cast<size_t>(q * (samples.size() - 1) + 0.5);
+			return samples[std::min(i, samples.size() - 1)];
+		};
+
+		double total = 0;
+		for (double v : samples)
+			total += v;
+
+		s.count = samples.size();
+		s.mean = total / samples.size();
+		s.min = samples.front();
+		s.p50 = at(0.50);
+		s.p90 = at(0.90);
+		s.p99 = at(0.99);
+		s.p999 = at(0.999);
+		s.max = samples.back();
+		return s;
+	}
+
+	// Accepts plain byte counts or K/M/G suffixes (powers of 1024), ex.) 16, 4K, 64M
+	inline uint64_t parseSize(const std::string& str)
+	{
+		if (str.empty())
+			return 0;
+
+		uint64_t multiplier = 1;
+		char suffix = str.back();
+		std::string digits = str;
+		if (suffix == 'K' || suffix == 'k') multiplier = 1ULL << 10;
+		else if (suffix == 'M' || suffix == 'm') multiplier = 1ULL << 20;
+		else if (suffix == 'G' || suffix == 'g') multiplier = 1ULL << 30;
+		if (multiplier != 1)
+			digits.pop_back();
+
+		return std::stoull(digits) * multiplier;
+	}
+
+	inline std::vector<uint64_t> parseSizeList(const std::string& list)
+	{
+		std::vector<uint64_t> sizes;
+		std::istringstream stream(list);
+		std::string part;
+		while (std::getline(stream, part, ','))
+		{
+			if (!part.empty())
+				sizes.push_back(parseSize(part));
+		}
+		return sizes;
+	}
+
+	inline std::string formatBytes(uint64_t bytes)
+	{
+		const char* units[] = { "B", "KiB", "MiB", "GiB" };
+		int i = 0;
+		while (i < 3 && bytes >= 1024 && bytes % 1024 == 0)
+		{
+			bytes /= 1024;
+			i++;
+		}
+		return std::to_string(bytes) + " " + units[i];
+	}
+
+	// Returns the value following flag, ex.) --out results.json
+	inline std::string getArg(int argc, char** argv, const std::string& flag, const std::string& fallback)
+	{
+		for (int i = 1; i < argc - 1; i++)
+		{
+			if (flag == argv[i])
+				return argv[i + 1];
+		}
+		return fallback;
+	}
+
+	inline bool hasFlag(int argc, char** argv, const std::string& flag)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			if (flag == argv[i])
+				return true;
+		}
+		return false;
+	}
+
+	inline std::string escape(const std::string& str)
+	{
+		std::string out;
+		out.reserve(str.size() + 2);
+		for (char c : str)
+		{
+			switch (c)
+			{
+			case '"': out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n"; break;
+			case '\t': out += "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char hex[8];
+					std::snprintf(hex, sizeof(hex), "\\u%04x", c);
+					out += hex;
+				}
+				else
+					out += c;
+			}
+		}
+		return out;
+	}
+
+	// Streaming JSON writer, tracks when a comma is needed so callers only describe structure
+	class JsonWriter
+	{
+	private:
+		std::ostringstream out;
+		std::vector<bool> first; // One entry per open object/array
+		bool pendingKey = false;
+
+		void separate()
+		{
+			if (pendingKey)
+			{
+				pendingKey = false;
+				return;
+			}
+			if (!first.empty())
+			{
+				if (!first.back())
+					out << ",";
+				first.back() = false;
+			}
+		}
+
+	public:
+		JsonWriter()
+		{
+			out.precision(6);
+			out << std::fixed;
+		}
+
+		JsonWriter& beginObject() { separate(); out << "{"; first.push_back(true); return *this; }
+		JsonWriter& endObject() { out << "}"; first.pop_back(); return *this; }
+		JsonWriter& beginArray() { separate(); out << "["; first.push_back(true); return *this; }
+		JsonWriter& endArray() { out << "]"; first.pop_back(); return *this; }
+
+		JsonWriter& key(const std::string& k)
+		{
+			separate();
+			out << "\"" << escape(k) << "\":";
+			pendingKey = true;
+			return *this;
+		}
+
+		JsonWriter& value(const std::string& v) { separate(); out << "\"" << escape(v) << "\""; return *this; }
+		JsonWriter& value(const char* v) { return value(std::string(v)); }
+		JsonWriter& value(double v) { separate(); out << v; return *this; }
+		JsonWriter& value(uint64_t v) { separate(); out << v; return *this; }
+		JsonWriter& value(int v) { separate(); out << v; return *this; }
+		JsonWriter& value(bool v) { separate(); out << (v ? "true" : "false"); return *this; }
+
+		template <typename T>
+		JsonWriter& field(const std::string& k, const T& v)
+		{
+			key(k);
+			return value(v);
+		}
+
+		JsonWriter& summary(const std::string& k, const Summary& s)
+		{
+			key(k).beginObject();
+			field("count", static_cast<uint64_t>(s.count));
+			field("mean", s.mean);
+			field("min", s.min);
+			field("p50", s.p50);
+			field("p90", s.p90);
+			field("p99", s.p99);
+			field("p999", s.p999);
+			field("max", s.max);
+			return endObject();
+		}
+
+		std::string str() const
+		{
+			return out.str();
+		}
+	};
+
+	// Count, mean and percentiles of an HdrHistogram under key, in the histograms unit
+	template <typename Histogram>
+	void latencySummary(JsonWriter& json, const std::string& key, const Histogram& latency)
+	{
+		json.key(key).beginObject();
+		json.field("count", latency.count());
+		json.field("mean", latency.mean());
+		json.field("p50", latency.percentile(0.5));
+		json.field("p90", latency.percentile(0.9));
+		json.field("p99", latency.percentile(0.99));
+		json.field("p999", latency.percentile(0.999));
+		json.field("max", latency.max());
+		json.endObject();
+	}
+
+	// Send and receive buffers of sock, size 0 keeps the system default
+	inline void setBuffers(SOCKET sock, int size)
+	{
+		if (size <= 0)
+			return;
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&size), sizeof(size));
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&size), sizeof(size));
+	}
+
+	// Loopback listener on an ephemeral port
+	inline SOCKET listenLoopback(unsigned short& port)
+	{
+		SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = 0;
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR)
+			return INVALID_SOCKET;
+
+		int length = sizeof(addr);
+		getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+		port = ntohs(addr.sin_port);
+		return listener;
+	}
+
+	// Both ends of one loopback connection through listener, bufferSize as in setBuffers
+	inline bool connectPair(SOCKET listener, unsigned short port, SOCKET& serverSide, SOCKET& clientSide, int bufferSize = 0)
+	{
+		clientSide = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		setBuffers(clientSide, bufferSize);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (connect(clientSide, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR)
+			return false;
+
+		sockaddr_in peer;
+		int peerSize = sizeof(peer);
+		serverSide = accept(listener, reinterpret_cast<sockaddr*>(&peer), &peerSize);
+		if (serverSide == INVALID_SOCKET)
+			return false;
+		setBuffers(serverSide, bufferSize);
+		return true;
+	}
+
+	// Writes to the --out file when given, stdout otherwise
+	inline void emit(const std::string& json, const std::string& path)
+	{
+		if (path.empty() || path == "-")
+		{
+			std::cout << json << std::endl;
+			return;
+		}
+
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cerr << "[-] Could not open " << path << "\n";
+			std::cout << json << std::endl;
+			return;
+		}
+		file << json << "\n";
+		std::cerr << "[+] Results written to " << path << "\n";
+	}
+}
+
+#endif
@@ -0,0 +1,404 @@
+// Microbenchmarks for the encryption primitives used by the chat room, util::encrypt/decrypt,
+// util::generate_key_pair and the SHA-256 hash used by FileTransfer, alongside the libsodium
+// alternatives (beforenm/afternm, secretbox, secretstream and AEAD) they could be replaced with.
+//
+// Usage: crypto_bench [--sizes 16,1K,64M] [--threads 1,2,4] [--min-time-ms 200]
+//                     [--max-iters 100000] [--ops name,name] [--out results.json]
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/Util.h"
+#include "Bench.h"
+
+namespace
+{
+	typedef std::vector<unsigned char> Bytes;
+
+	// Size of each secretstream message, files would be pushed in chunks of this size
+	const size_t STREAM_CHUNK = 64 * 1024;
+
+	struct Op
+	{
+		std::string name;
+		std::string api;
+		bool sizeIndependent;
+
+		// Builds per thread state for the payload size and returns the timed operation
+		std::function<std::function<void()>(size_t)> prepare;
+	};
+
+	Bytes randomBytes(size_t size)
+	{
+		Bytes data(size);
+		if (size > 0)
+			randombytes_buf(data.data(), size);
+		return data;
+	}
+
+	std::vector<Op> buildOps()
+	{
+		std::vector<Op> ops;
+
+		ops.push_back({ "generate_key_pair", "util::generate_key_pair", true, [](size_t)
+		{
+			return []() { util::generate_key_pair(); };
+		} });
+
+		ops.push_back({ "box_beforenm", "crypto_box_beforenm", true, [](size_t)
+		{
+			auto peer = std::make_shared<std::pair<Bytes, Bytes>>(util::generate_key_pair());
+			auto own = std::make_shared<std::pair<Bytes, Bytes>>(util::generate_key_pair());
+			auto shared = std::make_shared<Bytes>(crypto_box_BEFORENMBYTES);
+			return [peer, own, shared]() { crypto_box_beforenm(shared->data(), peer->first.data(), own->second.data()); };
+		} });
+
+		ops.push_back({ "box_encrypt", "util::encrypt", false, [](size_t size)
+		{
+			auto keys = std::make_shared<std::pair<Bytes, Bytes>>(util::generate_key_pair());
+			auto data = std::make_shared<Bytes>(randomBytes(size));
+			return [keys, data]() { util::encrypt(*data, keys->first, keys->second); };
+		} });
+
+		ops.push_back({ "box_decrypt", "util::decrypt", false, [](size_t size)
+		{
+			auto keys = std::make_shared<std::pair<Bytes, Bytes>>(util::generate_key_pair());
+			Bytes data = randomBytes(size);
+			auto cipher = std::make_shared<Bytes>(util::encrypt(data, keys->first, keys->second));
+			return [keys, cipher]() { util::decrypt(*cipher, keys->first, keys->second); };
+		} });
+
+		ops.push_back({ "box_afternm_encrypt", "crypto_box_easy_afternm", false, [](size_t size)
+		{
+			auto keys = util::generate_key_pair();
+			auto shared = std::make_shared<Bytes>(crypto_box_BEFORENMBYTES);
+			crypto_box_beforenm(shared->data(), keys.first.data(), keys.second.data());
+			auto data = std::make_shared<Bytes>(randomBytes(size));
+			auto out = std::make_shared<Bytes>(crypto_box_NONCEBYTES + crypto_box_MACBYTES + size);
+			return [shared, data, out]()
+			{
+				unsigned char* nonce = out->data();
+				randombytes_buf(nonce, crypto_box_NONCEBYTES);
+				crypto_box_easy_afternm(nonce + crypto_box_NONCEBYTES, data->data(), data->size(), nonce, shared->data());
+			};
+		} });
+
+		ops.push_back({ "box_afternm_decrypt", "crypto_box_open_easy_afternm", false, [](size_t size)
+		{
+			auto keys = util::generate_key_pair();
+			auto shared = std::make_shared<Bytes>(crypto_box_BEFORENMBYTES);
+			crypto_box_beforenm(shared->data(), keys.first.data(), keys.second.data());
+			Bytes data = randomBytes(size);
+			auto cipher = std::make_shared<Bytes>(crypto_box_NONCEBYTES + crypto_box_MACBYTES + size);
+			randombytes_buf(cipher->data(), crypto_box_NONCEBYTES);
+			crypto_box_easy_afternm(cipher->data() + crypto_box_NONCEBYTES, data.data(), data.size(), cipher->data(), shared->data());
+			auto out = std::make_shared<Bytes>(size + 1);
+			return [shared, cipher, out]()
+			{
+				crypto_box_open_easy_afternm(out->data(), cipher->data() + crypto_box_NONCEBYTES,
+					cipher->size() - crypto_box_NONCEBYTES, cipher->data(), shared->data());
+			};
+		} });
+
+		ops.push_back({ "secretbox_encrypt", "crypto_secretbox_easy", false, [](size_t size)
+		{
+			auto key = std::make_shared<Bytes>(crypto_secretbox_KEYBYTES);
+			crypto_secretbox_keygen(key->data());
+			auto data = std::make_shared<Bytes>(randomBytes(size));
+			auto out = std::make_shared<Bytes>(crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + size);
+			return [key, data, out]()
+			{
+				unsigned char* nonce = out->data();
+				randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
+				crypto_secretbox_easy(nonce + crypto_secretbox_NONCEBYTES, data->data(), data->size(), nonce, key->data());
+			};
+		} });
+
+		ops.push_back({ "secretbox_decrypt", "crypto_secretbox_open_easy", false, [](size_t size)
+		{
+			auto key = std::make_shared<Bytes>(crypto_secretbox_KEYBYTES);
+			crypto_secretbox_keygen(key->data());
+			Bytes data = randomBytes(size);
+			auto cipher = std::make_shared<Bytes>(crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + size);
+			randombytes_buf(cipher->data(), crypto_secretbox_NONCEBYTES);
+			crypto_secretbox_easy(cipher->data() + crypto_secretbox_NONCEBYTES, data.data(), data.size(), cipher->data(), key->data());
+			auto out = std::make_shared<Bytes>(size + 1);
+			return [key, cipher, out]()
+			{
+				crypto_secretbox_open_easy(out->data(), cipher->data() + crypto_secretbox_NONCEBYTES,
+					cipher->size() - crypto_secretbox_NONCEBYTES, cipher->data(), key->data());
+			};
+		} });
+
+		// A fresh stream per payload, pushed in STREAM_CHUNK messages with the final tag on the last one
+		ops.push_back({ "secretstream_push", "crypto_secretstream_xchacha20poly1305_push", false, [](size_t size)
+		{
+			auto key = std::make_shared<Bytes>(crypto_secretstream_xchacha20poly1305_KEYBYTES);
+			crypto_secretstream_xchacha20poly1305_keygen(key->data());
+			auto data = std::make_shared<Bytes>(randomBytes(size));
+			auto out = std::make_shared<Bytes>(std::min(size, STREAM_CHUNK) + crypto_secretstream_xchacha20poly1305_ABYTES);
+			return [key, data, out]()
+			{
+				crypto_secretstream_xchacha20poly1305_state state;
+				unsigned char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+				crypto_secretstream_xchacha20poly1305_init_push(&state, header, key->data());
+
+				size_t offset = 0;
+				do
+				{
+					size_t chunk = std::min(STREAM_CHUNK, data->size() - offset);
+					bool last = offset + chunk == data->size();
+					unsigned char tag = last ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+					crypto_secretstream_xchacha20poly1305_push(&state, out->data(), NULL, data->data() + offset, chunk, NULL, 0, tag);
+					offset += chunk;
+				} while (offset < data->size());
+			};
+		} });
+
+		ops.push_back({ "secretstream_pull", "crypto_secretstream_xchacha20poly1305_pull", false, [](size_t size)
+		{
+			auto key = std::make_shared<Bytes>(crypto_secretstream_xchacha20poly1305_KEYBYTES);
+			crypto_secretstream_xchacha20poly1305_keygen(key->data());
+			Bytes data = randomBytes(size);
+
+			// Encrypt the whole stream once, the timed operation only pulls
+			auto header = std::make_shared<Bytes>(crypto_secretstream_xchacha20poly1305_HEADERBYTES);
+			auto chunks = std::make_shared<std::vector<Bytes>>();
+			crypto_secretstream_xchacha20poly1305_state state;
+			crypto_secretstream_xchacha20poly1305_init_push(&state, header->data(), key->data());
+			size_t offset = 0;
+			do
+			{
+				size_t chunk = std::min(STREAM_CHUNK, data.size() - offset);
+				bool last = offset + chunk == data.size();
+				Bytes cipher(chunk + crypto_secretstream_xchacha20poly1305_ABYTES);
+				unsigned char tag = last ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+				crypto_secretstream_xchacha20poly1305_push(&state, cipher.data(), NULL, data.data() + offset, chunk, NULL, 0, tag);
+				chunks->push_back(std::move(cipher));
+				offset += chunk;
+			} while (offset < data.size());
+
+			auto out = std::make_shared<Bytes>(std::min(size, STREAM_CHUNK) + 1);
+			return [key, header, chunks, out]()
+			{
+				crypto_secretstream_xchacha20poly1305_state pull_state;
+				crypto_secretstream_xchacha20poly1305_init_pull(&pull_state, header->data(), key->data());
+				unsigned char tag;
+				for (Bytes& cipher : *chunks)
+				{
+					crypto_secretstream_xchacha20poly1305_pull(&pull_state, out->data(), NULL, &tag, cipher.data(), cipher.size(), NULL, 0);
+				}
+			};
+		} });
+
+		ops.push_back({ "aead_xchacha20poly1305_encrypt", "crypto_aead_xchacha20poly1305_ietf_encrypt", false, [](size_t size)
+		{
+			auto key = std::make_shared<Bytes>(crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
+			crypto_aead_xchacha20poly1305_ietf_keygen(key->data());
+			auto data = std::make_shared<Bytes>(randomBytes(size));
+			auto out = std::make_shared<Bytes>(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + crypto_aead_xchacha20poly1305_ietf_ABYTES + size);
+			return [key, data, out]()
+			{
+				unsigned char* nonce = out->data();
+				randombytes_buf(nonce, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+				crypto_aead_xchacha20poly1305_ietf_encrypt(nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, NULL,
+					data->data(), data->size(), NULL, 0, NULL, nonce, key->data());
+			};
+		} });
+
+		ops.push_back({ "aead_xchacha20poly1305_decrypt", "crypto_aead_xchacha20poly1305_ietf_decrypt", false, [](size_t size)
+		{
+			auto key = std::make_shared<Bytes>(crypto_aead_xchacha20poly1305_ietf_KEYBYTES);
+			crypto_aead_xchacha20poly1305_ietf_keygen(key->data());
+			Bytes data = randomBytes(size);
+			auto cipher = std::make_shared<Bytes>(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + crypto_aead_xchacha20poly1305_ietf_ABYTES + size);
+			unsigned char* nonce = cipher->data();
+			randombytes_buf(nonce, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+			crypto_aead_xchacha20poly1305_ietf_encrypt(nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, NULL,
+				data.data(), data.size(), NULL, 0, NULL, nonce, key->data());
+			auto out = std::make_shared<Bytes>(size + 1);
+			return [key, cipher, out]()
+			{
+				crypto_aead_xchacha20poly1305_ietf_decrypt(out->data(), NULL, NULL,
+					cipher->data() + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, cipher->size() - crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+					NULL, 0, cipher->data(), key->data());
+			};
+		} });
+
+		// AES-GCM needs hardware support, the op is skipped on machines without it
+		if (crypto_aead_aes256gcm_is_available())
+		{
+			ops.push_back({ "aead_aes256gcm_encrypt", "crypto_aead_aes256gcm_encrypt", false, [](size_t size)
+			{
+				auto key = std::make_shared<Bytes>(crypto_aead_aes256gcm_KEYBYTES);
+				crypto_aead_aes256gcm_keygen(key->data());
+				auto data = std::make_shared<Bytes>(randomBytes(size));
+				auto out = std::make_shared<Bytes>(crypto_aead_aes256gcm_NPUBBYTES + crypto_aead_aes256gcm_ABYTES + size);
+				return [key, data, out]()
+				{
+					unsigned char* nonce = out->data();
+					randombytes_buf(nonce, crypto_aead_aes256gcm_NPUBBYTES);
+					crypto_aead_aes256gcm_encrypt(nonce + crypto_aead_aes256gcm_NPUBBYTES, NULL,
+						data->data(), data->size(), NULL, 0, NULL, nonce, key->data());
+				};
+			} });
+		}
+
+		ops.push_back({ "sha256", "crypto_hash_sha256", false, [](size_t size)
+		{
+			auto data = std::make_shared<Bytes>(randomBytes(size));
+			auto hash = std::make_shared<Bytes>(crypto_hash_sha256_BYTES);
+			return [data, hash]() { crypto_hash_sha256(hash->data(), data->data(), data->size()); };
+		} });
+
+		return ops;
+	}
+
+	struct RunResult
+	{
+		uint64_t iterations = 0;
+		double wallNs = 0;
+		bench::Summary latency;
+	};
+
+	// Runs op on every thread at once, each thread loops until minTimeNs has passed or maxIters is reached
+	RunResult runOp(const Op& op, size_t size, int threads, double minTimeNs, uint64_t maxIters)
+	{
+		std::vector<std::function<void()>> work;
+		for (int i = 0; i < threads; i++)
+		{
+			work.push_back(op.prepare(size));
+		}
+
+		std::vector<std::vector<double>> samples(threads);
+		std::atomic<int> ready(0);
+		std::atomic<bool> go(false);
+
+		std::vector<std::thread> pool;
+		for (int t = 0; t < threads; t++)
+		{
+			pool.emplace_back([&, t]()
+			{
+				std::function<void()>& run = work[t];
+				run(); // Warm up caches and lazy allocations
+
+				ready++;
+				while (!go.load())
+					std::this_thread::yield();
+
+				bench::Clock::time_point begin = bench::Clock::now();
+				uint64_t iters = 0;
+				while (iters < maxIters)
+				{
+					bench::Clock::time_point start = bench::Clock::now();
+					run();
+					bench::Clock::time_point end = bench::Clock::now();
+					samples[t].push_back(bench::elapsedNs(start, end));
+					iters++;
+
+					if (iters >= 3 && bench::elapsedNs(begin, end) >= minTimeNs)
+						break;
+				}
+			});
+		}
+
+		while (ready.load() < threads)
+			std::this_thread::yield();
+
+		bench::Clock::time_point begin = bench::Clock::now();
+		go = true;
+		for (auto& thread : pool)
+		{
+			thread.join();
+		}
+		bench::Clock::time_point end = bench::Clock::now();
+
+		std::vector<double> all;
+		for (auto& s : samples)
+		{
+			all.insert(all.end(), s.begin(), s.end());
+		}
+
+		RunResult result;
+		result.iterations = all.size();
+		result.wallNs = bench::elapsedNs(begin, end);
+		result.latency = bench::summarize(all);
+		return result;
+	}
+
+	bool selected(const std::string& list, const std::string& name)
+	{
+		if (list.empty())
+			return true;
+		return ("," + list + ",").find("," + name + ",") != std::string::npos;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (!util::sodium_startup())
+	{
+		std::cerr << "[-] Sodium Startup Failed\n";
+		return 1;
+	}
+
+	unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+	std::string defaultThreads = "1,2,4";
+	if (hw > 4)
+		defaultThreads += "," + std::to_string(hw);
+
+	std::vector<uint64_t> sizes = bench::parseSizeList(bench::getArg(argc, argv, "--sizes", "16,64,256,1K,4K,16K,64K,256K,1M,4M,16M,64M"));
+	std::vector<uint64_t> threadCounts = bench::parseSizeList(bench::getArg(argc, argv, "--threads", defaultThreads));
+	double minTimeNs = std::stod(bench::getArg(argc, argv, "--min-time-ms", "200")) * 1e6;
+	uint64_t maxIters = std::stoull(bench::getArg(argc, argv, "--max-iters", "100000"));
+	std::string opFilter = bench::getArg(argc, argv, "--ops", "");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "crypto");
+	json.field("hardware_threads", static_cast<uint64_t>(hw));
+	json.field("min_time_ms", minTimeNs / 1e6);
+	json.key("results").beginArray();
+
+	for (const Op& op : buildOps())
+	{
+		if (!selected(opFilter, op.name))
+			continue;
+
+		// Key generation and beforenm do not take a payload, run them once per thread count
+		std::vector<uint64_t> opSizes = op.sizeIndependent ? std::vector<uint64_t>{ 0 } : sizes;
+		for (uint64_t size : opSizes)
+		{
+			for (uint64_t threads : threadCounts)
+			{
+				std::cerr << "[*] " << op.name << " " << bench::formatBytes(size) << " x" << threads << "\n";
+				RunResult r = runOp(op, size, static_cast<int>(threads), minTimeNs, maxIters);
+
+				double seconds = r.wallNs / 1e9;
+				double opsPerSec = seconds > 0 ? r.iterations / seconds : 0;
+
+				json.beginObject();
+				json.field("op", op.name);
+				json.field("api", op.api);
+				json.field("bytes", size);
+				json.field("threads", threads);
+				json.field("iterations", r.iterations);
+				json.field("wall_ns", r.wallNs);
+				json.summary("latency_ns", r.latency);
+				json.field("ops_per_sec", opsPerSec);
+				json.field("mib_per_sec", opsPerSec * size / (1024.0 * 1024.0));
+				json.endObject();
+			}
+		}
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+	return 0;
+}
@@ -0,0 +1,281 @@
+// Server::broadcastMessage in process, a real Server with fake users whose sockets are loopback pairs
+// (Winsock has no socketpair) drained by reader threads, so the measured path is the servers own
+// fan-out, outbox queueing, per user encryption and send with no network in between.
+// For each room size, message size and sender count it reports broadcast and delivery throughput,
+// the cost of the broadcastMessage call, and delivery latency from the frames send timestamp to the
+// reader (every SAMPLE_EVERY'th frame is decrypted to read it). Every configuration runs one warmup
+// and --repeats measured runs, the median is the headline and cv_pct shows the run to run spread,
+// a regression smaller than about twice the cv is noise.
+//
+// Usage: fanout_bench [--users 8,64,256] [--sizes 64,1K,16K] [--senders 1,4] [--messages 1000]
+//                     [--repeats 5] [--window 64] [--reader-threads 4] [--out results.json]
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/Server.h"
+#include "Bench.h"
+
+#pragma comment (lib, "Ws2_32.lib")
+
+namespace
+{
+	typedef std::vector<unsigned char> Bytes;
+
+	const uint64_t SAMPLE_EVERY = 16;
+
+	struct FakeUser
+	{
+		SOCKET serverSide = INVALID_SOCKET;
+		SOCKET clientSide = INVALID_SOCKET;
+		Bytes pk;
+		Bytes sk;
+		User* user = nullptr;
+		uint64_t received = 0; // Reader thread only
+	};
+
+	struct Run
+	{
+		double seconds = 0;
+		double broadcastsPerSec = 0;
+		double deliveriesPerSec = 0;
+		std::vector<double> callNs;
+		std::vector<double> latencyUs;
+	};
+
+	// Drains its share of the fake users until each has received expected frames
+	void readerLoop(std::vector<FakeUser*> mine, uint64_t expected, Bytes serverPk, std::atomic <uint64_t>& delivered,
+		std::vector<double>& latencyUs)
+	{
+		Bytes encrypted;
+		size_t done = 0;
+		while (done < mine.size())
+		{
+			fd_set readable;
+			FD_ZERO(&readable);
+			SOCKET maxSock = 0;
+			for (FakeUser* fake : mine)
+			{
+				if (fake->received < expected)
+				{
+					FD_SET(fake->clientSide, &readable);
+					maxSock = std::max(maxSock, fake->clientSide);
+				}
+			}
+			timeval timeout{ 1, 0 };
+			if (select(static_cast<int>(maxSock) + 1, &readable, nullptr, nullptr, &timeout) <= 0)
+				continue;
+
+			for (FakeUser* fake : mine)
+			{
+				if (fake->received >= expected || !FD_ISSET(fake->clientSide, &readable))
+					continue;
+				if (!protocol::recvEncrypted(fake->clientSide, encrypted))
+				{
+					std::cerr << "[-] Reader lost its connection\n";
+					fake->received = expected;
+					done++;
+					continue;
+				}
+
+				if (fake->received % SAMPLE_EVERY == 0)
+				{
+					Bytes data = util::decrypt(encrypted, serverPk, fake->sk);
+					Frame frame;
+					if (protocol::decode(data.data(), data.size(), frame) && (frame.flags & TIMESTAMPED))
+						latencyUs.push_back(static_cast<double>(protocol::monotonicMicros() - frame.stamps.sent));
+				}
+				fake->received++;
+				delivered.fetch_add(1, std::memory_order_relaxed);
+				if (fake->received == expected)
+					done++;
+			}
+		}
+	}
+
+	Run runOnce(size_t userCount, size_t size, size_t senders, uint64_t messages, uint64_t window, size_t readerThreads,
+		SOCKET listener, unsigned short port, std::pair<Bytes, Bytes>& serverKeys)
+	{
+		Run run;
+		Server server;
+		server.set_encryption_keys(serverKeys.first, serverKeys.second);
+		OutboxLimits unlimited; // The window bounds the queues, policing would only add noise
+		unlimited.dropBytes = unlimited.snapshotBytes = unlimited.disconnectBytes = SIZE_MAX;
+		unlimited.snapshotAgeMs = unlimited.disconnectAgeMs = UINT32_MAX;
+		server.setOutboxLimits(unlimited);
+
+		std::vector<FakeUser> fakes(userCount);
+		for (size_t i = 0; i < userCount; i++)
+		{
+			if (!bench::connectPair(listener, port, fakes[i].serverSide, fakes[i].clientSide))
+			{
+				std::cerr << "[-] Could not connect a loopback pair\n";
+				return run;
+			}
+			std::pair<Bytes, Bytes> keys = util::generate_key_pair();
+			fakes[i].pk = keys.first;
+			fakes[i].sk = keys.second;
+			fakes[i].user = server.addConnection(fakes[i].serverSide, fakes[i].pk, "127.0.0.1");
+			fakes[i].user->setUsername("</fake" + std::to_string(i) + "> ");
+		}
+
+		uint64_t perSender = messages / senders;
+		uint64_t total = perSender * senders;
+		std::atomic <uint64_t> delivered = 0;
+		std::atomic <uint64_t> sent = 0;
+		std::vector<std::vector<double>> latencies(readerThreads);
+		std::vector<std::thread> readers;
+		for (size_t r = 0; r < readerThreads; r++)
+		{
+			std::vector<FakeUser*> mine;
+			for (size_t i = r; i < userCount; i += readerThreads)
+				mine.push_back(&fakes[i]);
+			readers.emplace_back(readerLoop, mine, total, serverKeys.first, std::ref(delivered), std::ref(latencies[r]));
+		}
+
+		std::vector<std::vector<double>> calls(senders);
+		std::vector<std::thread> workers;
+		std::atomic <bool> go = false;
+		for (size_t s = 0; s < senders; s++)
+		{
+			workers.emplace_back([&, s]()
+			{
+				std::string body(size, 'x');
+				std::string sender = "</sender" + std::to_string(s) + "> ";
+				calls[s].reserve(perSender / SAMPLE_EVERY + 1);
+				while (!go)
+					std::this_thread::yield();
+
+				for (uint64_t i = 0; i < perSender; i++)
+				{
+					// Closed loop, at most window broadcasts in flight over every sender
+					while ((sent.load(std::memory_order_relaxed) - window) * userCount > delivered.load(std::memory_order_relaxed)
+						&& sent.load(std::memory_order_relaxed) > window)
+						std::this_thread::yield();
+
+					Frame chat(Opcode::CHAT, { sender, body });
+					protocol::stamp(chat);
+					bench::Clock::time_point start = bench::Clock::now();
+					server.broadcastMessage(chat);
+					if (i % SAMPLE_EVERY == 0)
+						calls[s].push_back(bench::elapsedNs(start, bench::Clock::now()));
+					sent++;
+				}
+			});
+		}
+
+		bench::Clock::time_point start = bench::Clock::now();
+		go = true;
+		for (std::thread& worker : workers)
+			worker.join();
+		for (std::thread& reader : readers)
+			reader.join();
+		run.seconds = bench::elapsedNs(start, bench::Clock::now()) / 1e9;
+		run.broadcastsPerSec = total / run.seconds;
+		run.deliveriesPerSec = total * userCount / run.seconds;
+
+		for (auto& c : calls)
+			run.callNs.insert(run.callNs.end(), c.begin(), c.end());
+		for (auto& l : latencies)
+			run.latencyUs.insert(run.latencyUs.end(), l.begin(), l.end());
+
+		for (FakeUser& fake : fakes)
+		{
+			server.disconnectUser(fake.user);
+			closesocket(fake.clientSide);
+		}
+		return run;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<uint64_t> userCounts = bench::parseSizeList(bench::getArg(argc, argv, "--users", "8,64,256"));
+	std::vector<uint64_t> sizes = bench::parseSizeList(bench::getArg(argc, argv, "--sizes", "64,1K,16K"));
+	std::vector<uint64_t> senderCounts = bench::parseSizeList(bench::getArg(argc, argv, "--senders", "1,4"));
+	uint64_t messages = std::stoull(bench::getArg(argc, argv, "--messages", "1000"));
+	size_t repeats = static_cast<size_t>(std::stoul(bench::getArg(argc, argv, "--repeats", "5")));
+	uint64_t window = std::stoull(bench::getArg(argc, argv, "--window", "64"));
+	size_t readerThreads = static_cast<size_t>(std::stoul(bench::getArg(argc, argv, "--reader-threads", "4")));
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0 || !util::sodium_startup())
+	{
+		std::cerr << "[-] Startup failed\n";
+		return 1;
+	}
+
+	unsigned short port = 0;
+	SOCKET listener = bench::listenLoopback(port);
+	if (listener == INVALID_SOCKET)
+	{
+		std::cerr << "[-] Could not listen on loopback\n";
+		return 1;
+	}
+	std::pair<Bytes, Bytes> serverKeys = util::generate_key_pair();
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "fanout");
+	json.field("messages", messages);
+	json.field("repeats", static_cast<uint64_t>(repeats));
+	json.field("window", window);
+	json.field("reader_threads", static_cast<uint64_t>(readerThreads));
+	json.key("results").beginArray();
+
+	for (uint64_t users : userCounts)
+	{
+		for (uint64_t size : sizes)
+		{
+			for (uint64_t senders : senderCounts)
+			{
+				std::cerr << "[*] users " << users << " size " << bench::formatBytes(size) << " senders " << senders << "\n";
+				runOnce(users, size, senders, messages, window, std::min<size_t>(readerThreads, users), listener, port, serverKeys); // Warmup
+
+				std::vector<double> throughput;
+				std::vector<double> callNs, latencyUs;
+				for (size_t r = 0; r < repeats; r++)
+				{
+					Run run = runOnce(users, size, senders, messages, window, std::min<size_t>(readerThreads, users), listener, port, serverKeys);
+					throughput.push_back(run.deliveriesPerSec);
+					callNs.insert(callNs.end(), run.callNs.begin(), run.callNs.end());
+					latencyUs.insert(latencyUs.end(), run.latencyUs.begin(), run.latencyUs.end());
+				}
+
+				double mean = 0, variance = 0;
+				for (double t : throughput)
+					mean += t / throughput.size();
+				for (double t : throughput)
+					variance += (t - mean) * (t - mean) / throughput.size();
+				bench::Summary runs = bench::summarize(throughput);
+
+				json.beginObject();
+				json.field("users", users);
+				json.field("message_bytes", size);
+				json.field("senders", senders);
+				json.field("deliveries_per_sec", runs.p50);
+				json.field("broadcasts_per_sec", runs.p50 / users);
+				json.field("deliveries_per_sec_min", runs.min);
+				json.field("deliveries_per_sec_max", runs.max);
+				json.field("cv_pct", mean > 0 ? 100 * std::sqrt(variance) / mean : 0.0);
+				json.summary("call_ns", bench::summarize(callNs));
+				json.summary("latency_us", bench::summarize(latencyUs));
+				json.endObject();
+			}
+		}
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+
+	closesocket(listener);
+	WSACleanup();
+	return 0;
+}
@@ -0,0 +1,508 @@
+// Load generator, thousands of simulated users in one process against a running server on loopback.
+// Every user logs in through the Client class (key exchange, LOGIN, encrypted frames) and follows a
+// scripted profile:
+//   chatty    a timestamped chat to its room every --chat-interval-ms
+//   idle      only reads
+//   whisper   a timestamped whisper to a random user every --whisper-interval-ms
+//   uploader  a transfer offer to its own idle partner every --upload-interval-ms, the partner
+//             declines, so the offer and decision path is loaded without the peer to peer transfer
+// Intervals are jittered by +-50%. Users are spread over --threads workers, each waits on its users
+// sockets with select and sends whatever is due. Reports connect rate, messages per second and
+// delivery latency percentiles from the in-frame timestamps (same host, so every hop is exact).
+//
+// Usage: loadgen [--server 127.0.0.1] [--users 1000] [--threads 8] [--seconds 30]
+//                [--connect-rate 200] [--mix chatty=60,idle=30,whisper=8,uploader=2]
+//                [--chat-interval-ms 1000] [--whisper-interval-ms 2000] [--upload-interval-ms 5000]
+//                [--size 64] [--prefix lg] [--out results.json]
+#define FD_SETSIZE 1024 // Users per worker at most, Winsock defaults to 64
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../client/Client.h"
+#include "../client/HdrHistogram.h"
+#include "Bench.h"
+
+namespace
+{
+	enum class Profile : uint8_t
+	{
+		CHATTY = 0x01, IDLE = 0x02, WHISPER = 0x03, UPLOADER = 0x04,
+	};
+
+	const char* profileName(Profile profile)
+	{
+		switch (profile)
+		{
+		case Profile::CHATTY: return "chatty";
+		case Profile::IDLE: return "idle";
+		case Profile::WHISPER: return "whisper";
+		case Profile::UPLOADER: return "uploader";
+		}
+		return "?";
+	}
+
+	struct SimUser
+	{
+		Client client;
+		Profile profile = Profile::IDLE;
+		std::string username;
+		std::string partner; // Uploaders only
+		bench::Clock::time_point nextAt;
+		bench::Clock::time_point offeredAt;
+		bool offerPending = false;
+		bool alive = true;
+	};
+
+	struct Settings
+	{
+		std::string server = "127.0.0.1";
+		unsigned chatIntervalMs = 1000;
+		unsigned whisperIntervalMs = 2000;
+		unsigned uploadIntervalMs = 5000;
+		size_t size = 64;
+	};
+
+	// Counters shared by every worker
+	struct Totals
+	{
+		std::atomic <uint64_t> chats = 0;
+		std::atomic <uint64_t> whispers = 0;
+		std::atomic <uint64_t> offers = 0;
+		std::atomic <uint64_t> received = 0;
+		std::atomic <uint64_t> disconnects = 0;
+		HdrHistogram chatLatency; // us, sender -> recipient
+		HdrHistogram whisperLatency;
+		HdrHistogram offerLatency; // us, offer -> TRANSFER_RESULT
+	};
+
+	class Worker
+	{
+	private:
+		std::vector<SimUser*> users;
+		std::vector<SimUser*> inbox; // Logged in, not yet picked up
+		std::mutex inbox_mutex;
+		const Settings& settings;
+		Totals& totals;
+		const std::vector<std::string>& usernames;
+		std::mt19937_64 rng;
+		std::thread thread;
+
+		bench::Clock::time_point after(unsigned intervalMs)
+		{
+			std::uniform_real_distribution<double> jitter(0.5, 1.5);
+			return bench::Clock::now() + std::chrono::microseconds(static_cast<int64_t>(intervalMs * 1000 * jitter(rng)));
+		}
+
+		void schedule(SimUser& user)
+		{
+			switch (user.profile)
+			{
+			case Profile::CHATTY: user.nextAt = after(settings.chatIntervalMs); break;
+			case Profile::WHISPER: user.nextAt = after(settings.whisperIntervalMs); break;
+			case Profile::UPLOADER: user.nextAt = after(settings.uploadIntervalMs); break;
+			case Profile::IDLE: user.nextAt = bench::Clock::time_point::max(); break;
+			}
+		}
+
+		void act(SimUser& user)
+		{
+			std::string body(settings.size, 'x');
+			switch (user.profile)
+			{
+			case Profile::CHATTY:
+			{
+				Frame chat(Opcode::CHAT, { body });
+				protocol::stamp(chat);
+				user.client.sendFrame(chat);
+				totals.chats++;
+				break;
+			}
+			case Profile::WHISPER:
+			{
+				std::string recipient = usernames[rng() % usernames.size()];
+				if (recipient == user.username)
+					break;
+				Frame whisper(Opcode::WHISPER, { recipient, body });
+				protocol::stamp(whisper);
+				user.client.sendFrame(whisper);
+				totals.whispers++;
+				break;
+			}
+			case Profile::UPLOADER:
+				if (user.offerPending || user.partner.empty())
+					break;
+				user.client.sendFrame(Frame(Opcode::TRANSFER_OFFER, { user.partner, "loadgen.bin", "1048576" }));
+				user.offeredAt = bench::Clock::now();
+				user.offerPending = true;
+				totals.offers++;
+				break;
+			case Profile::IDLE:
+				break;
+			}
+			schedule(user);
+		}
+
+		void receive(SimUser& user)
+		{
+			Frame frame;
+			if (!user.client.recvFrame(frame))
+			{
+				user.alive = false;
+				totals.disconnects++;
+				return;
+			}
+			totals.received++;
+
+			switch (frame.opcode)
+			{
+			case Opcode::CHAT:
+			case Opcode::WHISPER:
+				if ((frame.flags & TIMESTAMPED) && frame.stamps.sent != 0)
+				{
+					uint64_t now = protocol::monotonicMicros();
+					if (now >= frame.stamps.sent)
+						(frame.opcode == Opcode::CHAT ? totals.chatLatency : totals.whisperLatency).record(now - frame.stamps.sent);
+				}
+				return;
+			case Opcode::TRANSFER_OFFER: // Idle partners always decline
+				user.client.sendFrame(Frame(Opcode::TRANSFER_DECISION, { protocol::byteField(0) }));
+				return;
+			case Opcode::TRANSFER_RESULT:
+				if (user.offerPending)
+				{
+					totals.offerLatency.record(static_cast<uint64_t>(bench::elapsedNs(user.offeredAt, bench::Clock::now()) / 1000));
+					user.offerPending = false;
+				}
+				return;
+			case Opcode::SHUTDOWN:
+				user.alive = false;
+				totals.disconnects++;
+				return;
+			default:
+				return;
+			}
+		}
+
+		void loop()
+		{
+			while (running)
+			{
+				{
+					std::lock_guard <std::mutex> lock(inbox_mutex);
+					for (SimUser* user : inbox)
+						schedule(*user);
+					users.insert(users.end(), inbox.begin(), inbox.end());
+					inbox.clear();
+				}
+
+				fd_set readable;
+				FD_ZERO(&readable);
+				SOCKET maxSock = 0;
+				size_t watched = 0;
+				bench::Clock::time_point wake = bench::Clock::now() + std::chrono::milliseconds(50);
+				for (SimUser* user : users)
+				{
+					if (!user->alive)
+						continue;
+					FD_SET(user->client.getSocket(), &readable);
+					maxSock = std::max(maxSock, user->client.getSocket());
+					wake = std::min(wake, user->nextAt);
+					watched++;
+				}
+				if (watched == 0) // select rejects empty sets on Windows
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					continue;
+				}
+
+				int64_t waitUs = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(wake - bench::Clock::now()).count());
+				timeval timeout{ static_cast<long>(waitUs / 1000000), static_cast<long>(waitUs % 1000000) };
+				if (select(static_cast<int>(maxSock) + 1, &readable, nullptr, nullptr, &timeout) == SOCKET_ERROR)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					continue;
+				}
+
+				for (SimUser* user : users)
+				{
+					if (!user->alive || !FD_ISSET(user->client.getSocket(), &readable))
+						continue;
+					try
+					{
+						receive(*user);
+					}
+					catch (std::exception&)
+					{
+						user->alive = false;
+						totals.disconnects++;
+					}
+				}
+
+				bench::Clock::time_point now = bench::Clock::now();
+				for (SimUser* user : users)
+				{
+					if (!user->alive || user->nextAt > now)
+						continue;
+					try
+					{
+						act(*user);
+					}
+					catch (std::exception&)
+					{
+						user->alive = false;
+						totals.disconnects++;
+					}
+				}
+			}
+		}
+
+	public:
+		std::atomic <bool> running = true;
+
+		Worker(const Settings& settings, Totals& totals, const std::vector<std::string>& usernames, uint64_t seed)
+			: settings(settings), totals(totals), usernames(usernames), rng(seed)
+		{
+		}
+
+		void start()
+		{
+			thread = std::thread(&Worker::loop, this);
+		}
+
+		void adopt(SimUser* user)
+		{
+			std::lock_guard <std::mutex> lock(inbox_mutex);
+			inbox.push_back(user);
+		}
+
+		// Sends QUIT for every user still connected and closes its socket
+		void stop()
+		{
+			running = false;
+			thread.join();
+			for (SimUser* user : users)
+			{
+				if (user->alive)
+				{
+					try
+					{
+						user->client.sendFrame(Frame(Opcode::QUIT));
+					}
+					catch (std::exception&)
+					{
+					}
+				}
+				closesocket(user->client.getSocket());
+			}
+		}
+	};
+
+	// Handshake and LOGIN as ClientChatRoom does, throws on failure
+	void login(SimUser& user, const std::string& server)
+	{
+		std::string ip = server;
+		user.client.initializeClient();
+		user.client.connectToServer(ip);
+
+		std::pair<std::vector<unsigned char>, std::vector<unsigned char>> keys = util::generate_key_pair();
+		user.client.set_encryption_keys(keys.first, keys.second);
+		if (!user.client.recv_server_pk() || !user.client.send_pk())
+			throw std::runtime_error("[-] Key exchange failed");
+
+		user.client.setUsername(user.username);
+		user.client.sendFrame(Frame(Opcode::LOGIN, { user.username }));
+		Frame result;
+		while (user.client.recvFrame(result))
+		{
+			if (result.opcode != Opcode::LOGIN_RESULT)
+				continue;
+			if (static_cast<LoginStatus>(result.byte(0)) != LoginStatus::ACCEPTED)
+				throw std::runtime_error("[-] Login refused for " + user.username);
+			return;
+		}
+		throw std::runtime_error("[-] Connection closed during login");
+	}
+
+	// ex.) "chatty=60,idle=30" -> one profile per user in those proportions, shuffled
+	std::vector<Profile> assignProfiles(const std::string& mix, size_t users, std::mt19937_64& rng)
+	{
+		std::vector<std::pair<Profile, double>> weights;
+		double total = 0;
+		std::istringstream stream(mix);
+		for (std::string part; std::getline(stream, part, ',');)
+		{
+			size_t eq = part.find('=');
+			std::string name = part.substr(0, eq);
+			double weight = eq == std::string::npos ? 1 : std::stod(part.substr(eq + 1));
+			Profile profile;
+			if (name == "chatty") profile = Profile::CHATTY;
+			else if (name == "idle") profile = Profile::IDLE;
+			else if (name == "whisper") profile = Profile::WHISPER;
+			else if (name == "uploader") profile = Profile::UPLOADER;
+			else
+			{
+				std::cerr << "[!] Unknown profile " << name << "\n";
+				continue;
+			}
+			weights.push_back({ profile, weight });
+			total += weight;
+		}
+
+		std::vector<Profile> profiles;
+		double carried = 0;
+		for (auto& weight : weights)
+		{
+			carried += users * weight.second / total;
+			while (profiles.size() < static_cast<size_t>(carried + 0.5))
+				profiles.push_back(weight.first);
+		}
+		profiles.resize(users, Profile::IDLE);
+		std::shuffle(profiles.begin(), profiles.end(), rng);
+		return profiles;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	settings.server = bench::getArg(argc, argv, "--server", "127.0.0.1");
+	size_t userCount = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--users", "1000")));
+	size_t threads = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--threads", "8")));
+	unsigned seconds = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--seconds", "30")));
+	double connectRate = std::stod(bench::getArg(argc, argv, "--connect-rate", "200"));
+	std::string mix = bench::getArg(argc, argv, "--mix", "chatty=60,idle=30,whisper=8,uploader=2");
+	settings.chatIntervalMs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--chat-interval-ms", "1000")));
+	settings.whisperIntervalMs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--whisper-interval-ms", "2000")));
+	settings.uploadIntervalMs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--upload-interval-ms", "5000")));
+	settings.size = static_cast<size_t>(bench::parseSize(bench::getArg(argc, argv, "--size", "64")));
+	std::string prefix = bench::getArg(argc, argv, "--prefix", "lg");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	if (!util::sodium_startup())
+	{
+		std::cerr << "[-] Sodium startup failed\n";
+		return 1;
+	}
+
+	std::mt19937_64 rng(42);
+	std::vector<Profile> profiles = assignProfiles(mix, userCount, rng);
+	std::vector<std::unique_ptr<SimUser>> users;
+	std::vector<std::string> usernames;
+	std::vector<SimUser*> idle;
+	for (size_t i = 0; i < userCount; i++)
+	{
+		users.push_back(std::make_unique<SimUser>());
+		users.back()->profile = profiles[i];
+		users.back()->username = "</" + prefix + std::to_string(i) + "> ";
+		usernames.push_back(users.back()->username);
+		if (profiles[i] == Profile::IDLE)
+			idle.push_back(users.back().get());
+	}
+
+	// Each uploader offers to an idle user of its own, the server expects one offer per recipient at a time
+	size_t partners = 0;
+	for (auto& user : users)
+	{
+		if (user->profile != Profile::UPLOADER)
+			continue;
+		if (partners < idle.size())
+			user->partner = idle[partners++]->username;
+		else
+			std::cerr << "[!] No idle partner left for " << user->username << ", it will not upload\n";
+	}
+
+	threads = std::max<size_t>({ threads, 1, (userCount + FD_SETSIZE - 2) / (FD_SETSIZE - 1) });
+	Totals totals;
+	std::vector<std::unique_ptr<Worker>> workers;
+	for (size_t i = 0; i < threads; i++)
+	{
+		workers.push_back(std::make_unique<Worker>(settings, totals, usernames, 1000 + i));
+		workers.back()->start();
+	}
+
+	// Ramp up at connectRate, traffic starts per user as soon as it is logged in
+	std::cerr << "[*] Connecting " << userCount << " users to " << settings.server << " over " << threads << " workers\n";
+	std::vector<double> connectTimes;
+	uint64_t failedConnects = 0;
+	bench::Clock::time_point rampStart = bench::Clock::now();
+	for (size_t i = 0; i < users.size(); i++)
+	{
+		std::this_thread::sleep_until(rampStart + std::chrono::microseconds(static_cast<int64_t>(i * 1e6 / connectRate)));
+		bench::Clock::time_point start = bench::Clock::now();
+		try
+		{
+			login(*users[i], settings.server);
+			connectTimes.push_back(bench::elapsedNs(start, bench::Clock::now()) / 1e6);
+			workers[i % threads]->adopt(users[i].get());
+		}
+		catch (std::exception& e)
+		{
+			users[i]->alive = false;
+			failedConnects++;
+			if (failedConnects <= 5)
+				std::cerr << e.what() << "\n";
+		}
+	}
+	double rampSeconds = bench::elapsedNs(rampStart, bench::Clock::now()) / 1e9;
+	uint64_t connected = connectTimes.size();
+	bench::Summary connectLatency = bench::summarize(connectTimes);
+
+	// Steady state window, rates are taken over it only
+	uint64_t chats = totals.chats, whispers = totals.whispers, offers = totals.offers, received = totals.received;
+	uint64_t delivered = totals.chatLatency.count() + totals.whisperLatency.count();
+	bench::Clock::time_point windowStart = bench::Clock::now();
+	for (unsigned s = 1; s <= seconds; s++)
+	{
+		std::this_thread::sleep_until(windowStart + std::chrono::seconds(s));
+		std::cerr << "[*] " << s << "s sent " << (totals.chats + totals.whispers - chats - whispers) / s << " msg/s, delivered "
+			<< (totals.chatLatency.count() + totals.whisperLatency.count() - delivered) / s << " msg/s, chat p99 "
+			<< totals.chatLatency.percentile(0.99) << " us, disconnects " << totals.disconnects << "\n";
+	}
+	double windowSeconds = bench::elapsedNs(windowStart, bench::Clock::now()) / 1e9;
+	uint64_t sentInWindow = totals.chats + totals.whispers - chats - whispers;
+	uint64_t deliveredInWindow = totals.chatLatency.count() + totals.whisperLatency.count() - delivered;
+	uint64_t framesInWindow = totals.received - received;
+	uint64_t offersInWindow = totals.offers - offers;
+
+	for (auto& worker : workers)
+		worker->stop();
+
+	std::vector<uint64_t> profileCounts(5, 0);
+	for (Profile profile : profiles)
+		profileCounts[static_cast<size_t>(profile)]++;
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "loadgen");
+	json.field("server", settings.server);
+	json.field("users", static_cast<uint64_t>(userCount));
+	json.field("threads", static_cast<uint64_t>(threads));
+	json.key("profiles").beginObject();
+	for (Profile profile : { Profile::CHATTY, Profile::IDLE, Profile::WHISPER, Profile::UPLOADER })
+		json.field(profileName(profile), profileCounts[static_cast<size_t>(profile)]);
+	json.endObject();
+	json.field("message_bytes", static_cast<uint64_t>(settings.size));
+	json.field("connected", connected);
+	json.field("failed_connects", failedConnects);
+	json.field("connect_per_sec", rampSeconds > 0 ? connected / rampSeconds : 0.0);
+	json.summary("connect_ms", connectLatency);
+	json.field("window_seconds", windowSeconds);
+	json.field("sent_per_sec", sentInWindow / windowSeconds);
+	json.field("delivered_per_sec", deliveredInWindow / windowSeconds);
+	json.field("frames_received_per_sec", framesInWindow / windowSeconds);
+	json.field("offers_per_sec", offersInWindow / windowSeconds);
+	json.field("disconnects", totals.disconnects.load());
+	bench::latencySummary(json, "chat_latency_us", totals.chatLatency);
+	bench::latencySummary(json, "whisper_latency_us", totals.whisperLatency);
+	bench::latencySummary(json, "offer_round_trip_us", totals.offerLatency);
+	json.endObject();
+	bench::emit(json.str(), outPath);
+
+	WSACleanup();
+	return 0;
+}
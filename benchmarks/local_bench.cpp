@@ -0,0 +1,227 @@
+// Round trip latency between two clients on the server's machine, over TCP with crypto_box against the
+// shared memory rings of server/SharedMemory.h. For each transport a pinger and an echoer log in through
+// the Client class, the pinger whispers the echoer, which whispers the same body straight back, one
+// message in flight at a time. Each round trip crosses the server twice, so it includes four frame
+// transfers and two passes through the servers dispatch, whisper log append included.
+// The server must run on the same host with shared memory on and the rate limits off, ex.)
+//   ServerChatApp --headless --host bench --shared_memory true --rate_messages_per_sec 0 --rate_bytes_per_sec 0
+// Reports round trip percentiles and round trips per second per transport.
+//
+// Usage: local_bench [--server 127.0.0.1] [--transports tcp,shm] [--messages 10000] [--warmup 500]
+//                    [--size 64] [--prefix lb] [--out results.json]
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../client/Client.h"
+#include "../client/HdrHistogram.h"
+#include "Bench.h"
+
+namespace
+{
+	// Handshake, then LOCAL_ATTACH when shared, then LOGIN as ClientChatRoom does, throws on failure
+	void login(Client& client, const std::string& server, const std::string& username, bool shared)
+	{
+		std::string ip = server;
+		client.initializeClient();
+		client.connectToServer(ip);
+
+		std::pair<std::vector<unsigned char>, std::vector<unsigned char>> keys = util::generate_key_pair();
+		client.set_encryption_keys(keys.first, keys.second);
+		if (!client.recv_server_pk() || !client.send_pk())
+			throw std::runtime_error("[-] Key exchange failed");
+		if (shared && !client.attachSharedMemory())
+			throw std::runtime_error("[-] Shared memory refused, run the server on this host with --shared_memory true");
+
+		client.setUsername(username);
+		client.sendFrame(Frame(Opcode::LOGIN, { username }));
+		Frame result;
+		while (client.recvFrame(result))
+		{
+			if (result.opcode != Opcode::LOGIN_RESULT)
+				continue;
+			if (static_cast<LoginStatus>(result.byte(0)) != LoginStatus::ACCEPTED)
+				throw std::runtime_error("[-] Login refused for " + username);
+			return;
+		}
+		throw std::runtime_error("[-] Connection closed during login");
+	}
+
+	// Waits for the next whisper, skipping presence and notices, false when the connection closed
+	bool recvWhisper(Client& client, Frame& frame)
+	{
+		while (client.recvFrame(frame))
+		{
+			if (frame.opcode == Opcode::WHISPER)
+				return true;
+		}
+		return false;
+	}
+
+	struct Result
+	{
+		std::string transport;
+		uint64_t roundTrips = 0;
+		double seconds = 0;
+		HdrHistogram rtt; // us
+		std::string error;
+	};
+
+	void run(Result& result, const std::string& server, const std::string& prefix, size_t messages, size_t warmup, size_t size)
+	{
+		bool shared = result.transport == "shm";
+		std::string pingName = "</" + prefix + result.transport + "ping> ";
+		std::string echoName = "</" + prefix + result.transport + "echo> ";
+		Client pinger, echoer;
+		try
+		{
+			login(pinger, server, pingName, shared);
+			login(echoer, server, echoName, shared);
+		}
+		catch (std::exception& e)
+		{
+			result.error = e.what();
+			return;
+		}
+
+		// Whispers back whatever reaches it until the connection closes
+		std::thread echo([&]
+		{
+			Frame frame;
+			while (recvWhisper(echoer, frame))
+			{
+				try
+				{
+					echoer.sendFrame(Frame(Opcode::WHISPER, { pingName, std::string(frame.field(1)) }));
+				}
+				catch (std::exception&)
+				{
+					return;
+				}
+			}
+		});
+
+		std::string body(size, 'x');
+		Frame ping(Opcode::WHISPER, { echoName, body });
+		Frame pong;
+		bench::Clock::time_point start;
+		try
+		{
+			for (size_t i = 0; i < warmup + messages; i++)
+			{
+				if (i == warmup)
+					start = bench::Clock::now();
+				bench::Clock::time_point sent = bench::Clock::now();
+				pinger.sendFrame(ping);
+				if (!recvWhisper(pinger, pong))
+					throw std::runtime_error("[-] Connection closed, is the server rate limiting? See the usage above");
+				if (i >= warmup)
+				{
+					result.rtt.record(static_cast<uint64_t>(bench::elapsedNs(sent, bench::Clock::now()) / 1e3));
+					result.roundTrips++;
+				}
+			}
+			result.seconds = bench::elapsedNs(start, bench::Clock::now()) / 1e9;
+		}
+		catch (std::exception& e)
+		{
+			result.error = e.what();
+		}
+
+		for (Client* client : { &pinger, &echoer })
+		{
+			try
+			{
+				client->sendFrame(Frame(Opcode::QUIT));
+			}
+			catch (std::exception&)
+			{
+			}
+		}
+		echo.join(); // The server closes the echoers connection on QUIT
+		closesocket(pinger.getSocket());
+		closesocket(echoer.getSocket());
+	}
+
+	std::vector<std::string> split(const std::string& list)
+	{
+		std::vector<std::string> items;
+		std::stringstream stream(list);
+		std::string item;
+		while (std::getline(stream, item, ','))
+		{
+			if (!item.empty())
+				items.push_back(item);
+		}
+		return items;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string server = bench::getArg(argc, argv, "--server", "127.0.0.1");
+	std::vector<std::string> transports = split(bench::getArg(argc, argv, "--transports", "tcp,shm"));
+	size_t messages = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--messages", "10000")));
+	size_t warmup = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--warmup", "500")));
+	size_t size = static_cast<size_t>(bench::parseSize(bench::getArg(argc, argv, "--size", "64")));
+	std::string prefix = bench::getArg(argc, argv, "--prefix", "lb");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	if (!util::sodium_startup())
+	{
+		std::cerr << "[-] Sodium failed to start\n";
+		return 1;
+	}
+
+	std::vector<std::unique_ptr<Result>> results;
+	for (const std::string& transport : transports)
+	{
+		if (transport != "tcp" && transport != "shm")
+		{
+			std::cerr << "[-] Unknown transport " << transport << ", expected tcp or shm\n";
+			return 1;
+		}
+		results.push_back(std::make_unique<Result>());
+		Result& result = *results.back();
+		result.transport = transport;
+		std::cerr << "[*] " << transport << ": " << messages << " round trips of " << size << " bytes\n";
+		run(result, server, prefix, messages, warmup, size);
+		if (!result.error.empty())
+			std::cerr << result.error << "\n";
+		else
+			std::cerr << "[+] " << transport << ": p50 " << result.rtt.percentile(0.5) << " us, p99 " << result.rtt.percentile(0.99) << " us\n";
+	}
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "local_bench");
+	json.field("server", server);
+	json.field("messages", static_cast<uint64_t>(messages));
+	json.field("size", static_cast<uint64_t>(size));
+	json.key("results").beginArray();
+	for (auto& result : results)
+	{
+		json.beginObject();
+		json.field("transport", result->transport);
+		json.field("round_trips", result->roundTrips);
+		json.field("round_trips_per_sec", result->seconds > 0 ? result->roundTrips / result->seconds : 0.0);
+		json.key("rtt_us").beginObject();
+		json.field("mean", result->rtt.mean());
+		json.field("p50", result->rtt.percentile(0.5));
+		json.field("p90", result->rtt.percentile(0.9));
+		json.field("p99", result->rtt.percentile(0.99));
+		json.field("p999", result->rtt.percentile(0.999));
+		json.field("max", result->rtt.max());
+		json.endObject();
+		if (!result->error.empty())
+			json.field("error", result->error);
+		json.endObject();
+	}
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+	return 0;
+}
@@ -0,0 +1,188 @@
+// Cost of util::print style logging to the calling threads, the old global print mutex with a synchronous
+// console write per line against the asynchronous logging::Logger, with several threads printing at once.
+// The console is simulated by a sink that costs --write-us per flush, a real terminal is often slower.
+//
+// Usage: log_bench [--lines 200000] [--threads 1,4,8] [--size 64] [--write-us 20]
+//                  [--modes mutex,async] [--out results.json]
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/Log.h"
+#include "Bench.h"
+
+namespace
+{
+	// Every n'th call is timed on its own, timing all of them would dominate the cost
+	const uint64_t SAMPLE_EVERY = 16;
+
+	// Discards what is written, each flush busy waits writeUs like a console round trip
+	class SlowSink : public std::streambuf
+	{
+	private:
+		unsigned writeUs;
+
+	public:
+		std::atomic <uint64_t> bytes = 0;
+		std::atomic <uint64_t> flushes = 0;
+
+		SlowSink(unsigned writeUs) : writeUs(writeUs)
+		{
+		}
+
+	protected:
+		int_type overflow(int_type c) override
+		{
+			if (c != traits_type::eof())
+				bytes++;
+			return c;
+		}
+
+		std::streamsize xsputn(const char*, std::streamsize count) override
+		{
+			bytes += static_cast<uint64_t>(count);
+			return count;
+		}
+
+		int sync() override
+		{
+			flushes++;
+			bench::Clock::time_point until = bench::Clock::now() + std::chrono::microseconds(writeUs);
+			while (bench::Clock::now() < until)
+			{
+			}
+			return 0;
+		}
+	};
+
+	// util::print before the async logger
+	struct MutexPrinter
+	{
+		std::mutex print_mutex;
+		std::ostream& console;
+
+		void print(const std::string& message)
+		{
+			std::lock_guard <std::mutex> lock(print_mutex);
+			console << "\033[2K\r";
+			console << message << "\n> ";
+			console.flush();
+		}
+	};
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t lines = std::stoull(bench::getArg(argc, argv, "--lines", "200000"));
+	std::vector<uint64_t> threadCounts = bench::parseSizeList(bench::getArg(argc, argv, "--threads", "1,4,8"));
+	size_t size = static_cast<size_t>(bench::parseSize(bench::getArg(argc, argv, "--size", "64")));
+	unsigned writeUs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--write-us", "20")));
+	std::string modeList = bench::getArg(argc, argv, "--modes", "mutex,async");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	std::vector<std::string> modes;
+	std::istringstream stream(modeList);
+	for (std::string mode; std::getline(stream, mode, ',');)
+	{
+		if (mode == "mutex" || mode == "async")
+			modes.push_back(mode);
+		else
+			std::cerr << "[!] Unknown mode " << mode << "\n";
+	}
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "log");
+	json.field("lines", lines);
+	json.field("line_bytes", static_cast<uint64_t>(size));
+	json.field("write_us", static_cast<uint64_t>(writeUs));
+	json.key("results").beginArray();
+
+	for (const std::string& mode : modes)
+	{
+		for (uint64_t threads : threadCounts)
+		{
+			std::cerr << "[*] " << mode << " x" << threads << "\n";
+			SlowSink sink(writeUs);
+			std::ostream console(&sink);
+			MutexPrinter printer{ {}, console };
+			std::unique_ptr<logging::Logger> logger;
+			if (mode == "async")
+				logger = std::make_unique<logging::Logger>(console);
+
+			std::vector<std::vector<double>> samples(threads);
+			std::vector<std::thread> workers;
+			std::atomic <bool> go = false;
+			uint64_t perThread = lines / threads;
+
+			for (uint64_t t = 0; t < threads; t++)
+			{
+				workers.emplace_back([&, t]()
+				{
+					std::string message = "</user" + std::to_string(t) + "> " + std::string(size, 'x');
+					samples[t].reserve(perThread / SAMPLE_EVERY + 1);
+					while (!go)
+						std::this_thread::yield();
+
+					for (uint64_t i = 0; i < perThread; i++)
+					{
+						bench::Clock::time_point start;
+						if (i % SAMPLE_EVERY == 0)
+							start = bench::Clock::now();
+
+						if (logger)
+							logger->write(logging::Level::PRINT, message);
+						else
+							printer.print(message);
+
+						if (i % SAMPLE_EVERY == 0)
+							samples[t].push_back(bench::elapsedNs(start, bench::Clock::now()));
+					}
+				});
+			}
+
+			bench::Clock::time_point start = bench::Clock::now();
+			go = true;
+			for (std::thread& worker : workers)
+				worker.join();
+			bench::Clock::time_point returned = bench::Clock::now();
+			uint64_t dropped = 0;
+			if (logger)
+			{
+				logger->flush();
+				dropped = logger->getDropped();
+			}
+			bench::Clock::time_point drained = bench::Clock::now();
+
+			std::vector<double> latencies;
+			for (auto& s : samples)
+				latencies.insert(latencies.end(), s.begin(), s.end());
+			bench::Summary callLatency = bench::summarize(latencies);
+
+			uint64_t total = perThread * threads;
+			double callSeconds = bench::elapsedNs(start, returned) / 1e9;
+			double drainSeconds = bench::elapsedNs(start, drained) / 1e9;
+
+			json.beginObject();
+			json.field("mode", mode);
+			json.field("threads", threads);
+			json.field("printed", total - dropped);
+			json.field("dropped", dropped);
+			json.field("console_writes", sink.flushes.load());
+			json.field("lines_per_write", sink.flushes > 0 ? static_cast<double>(total - dropped) / sink.flushes : 0.0);
+			json.field("calls_per_sec", callSeconds > 0 ? total / callSeconds : 0.0);
+			json.field("written_per_sec", drainSeconds > 0 ? (total - dropped) / drainSeconds : 0.0);
+			json.summary("call_ns", callLatency);
+			json.endObject();
+		}
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+	return 0;
+}
@@ -0,0 +1,200 @@
+// Throughput of the on disk MessageLog, appends per second seen by the broadcasting threads,
+// how long until the same records are written and fsynced, and read back speed through the
+// sparse index for full scans and random ranges.
+//
+// Usage: msglog_bench [--dir msglog_bench_data] [--messages 1000000] [--size 128] [--threads 1,4]
+//                     [--policies never,interval,every_commit] [--interval-ms 100]
+//                     [--segment-size 64M] [--keep] [--out results.json]
+#include <atomic>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/MessageLog.h"
+#include "Bench.h"
+
+namespace
+{
+	// Every n'th append is timed on its own, timing all of them would dominate the cost
+	const uint64_t SAMPLE_EVERY = 64;
+
+	struct Policy
+	{
+		std::string name;
+		FsyncPolicy policy;
+	};
+
+	std::vector<Policy> parsePolicies(const std::string& list)
+	{
+		std::vector<Policy> policies;
+		std::istringstream stream(list);
+		std::string part;
+		while (std::getline(stream, part, ','))
+		{
+			if (part == "never") policies.push_back({ part, FsyncPolicy::NEVER });
+			else if (part == "interval") policies.push_back({ part, FsyncPolicy::INTERVAL });
+			else if (part == "every_commit") policies.push_back({ part, FsyncPolicy::EVERY_COMMIT });
+			else std::cerr << "[!] Unknown policy " << part << "\n";
+		}
+		return policies;
+	}
+
+	size_t countSegments(const std::string& dir)
+	{
+		size_t count = 0;
+		for (auto& entry : std::filesystem::directory_iterator(dir))
+		{
+			if (entry.path().extension() == ".log")
+				count++;
+		}
+		return count;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = bench::getArg(argc, argv, "--dir", "msglog_bench_data");
+	uint64_t messages = std::stoull(bench::getArg(argc, argv, "--messages", "1000000"));
+	size_t size = static_cast<size_t>(bench::parseSize(bench::getArg(argc, argv, "--size", "128")));
+	std::vector<uint64_t> threadCounts = bench::parseSizeList(bench::getArg(argc, argv, "--threads", "1,4"));
+	std::vector<Policy> policies = parsePolicies(bench::getArg(argc, argv, "--policies", "never,interval,every_commit"));
+	unsigned intervalMs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--interval-ms", "100")));
+	size_t segmentSize = static_cast<size_t>(bench::parseSize(bench::getArg(argc, argv, "--segment-size", "64M")));
+	bool keep = bench::hasFlag(argc, argv, "--keep");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	std::vector<unsigned char> frame(size, 'x');
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "msglog");
+	json.field("messages", messages);
+	json.field("message_bytes", static_cast<uint64_t>(size));
+	json.field("segment_size", static_cast<uint64_t>(segmentSize));
+	json.field("interval_ms", static_cast<uint64_t>(intervalMs));
+	json.key("results").beginArray();
+
+	for (const Policy& policy : policies)
+	{
+		for (uint64_t threads : threadCounts)
+		{
+			std::cerr << "[*] " << policy.name << " x" << threads << "\n";
+			std::filesystem::remove_all(dir);
+
+			MessageLog log(dir, policy.policy, intervalMs, segmentSize);
+			if (!log.open())
+			{
+				std::cerr << "[-] Could not open " << dir << "\n";
+				return 1;
+			}
+
+			// Appends, as the broadcast path would make them
+			std::vector<std::vector<double>> samples(threads);
+			std::vector<std::thread> workers;
+			std::atomic <bool> go = false;
+			uint64_t perThread = messages / threads;
+
+			for (uint64_t t = 0; t < threads; t++)
+			{
+				workers.emplace_back([&, t]()
+				{
+					std::string channel = "#room" + std::to_string(t);
+					samples[t].reserve(perThread / SAMPLE_EVERY + 1);
+					while (!go)
+						std::this_thread::yield();
+
+					for (uint64_t i = 0; i < perThread; i++)
+					{
+						if (i % SAMPLE_EVERY == 0)
+						{
+							bench::Clock::time_point start = bench::Clock::now();
+							log.append(channel, frame);
+							samples[t].push_back(bench::elapsedNs(start, bench::Clock::now()));
+						}
+						else
+						{
+							log.append(channel, frame);
+						}
+					}
+				});
+			}
+
+			bench::Clock::time_point start = bench::Clock::now();
+			go = true;
+			for (std::thread& worker : workers)
+				worker.join();
+			bench::Clock::time_point appended = bench::Clock::now();
+			log.flush(true);
+			bench::Clock::time_point durable = bench::Clock::now();
+
+			std::vector<double> latencies;
+			for (auto& s : samples)
+				latencies.insert(latencies.end(), s.begin(), s.end());
+			bench::Summary appendLatency = bench::summarize(latencies);
+
+			uint64_t total = perThread * threads;
+			uint64_t dropped = log.getDropped();
+			double appendSeconds = bench::elapsedNs(start, appended) / 1e9;
+			double durableSeconds = bench::elapsedNs(start, durable) / 1e9;
+
+			// Full scan in pages, what a history export would do
+			const size_t PAGE = 4096;
+			uint64_t readCount = 0;
+			bench::Clock::time_point scanStart = bench::Clock::now();
+			for (uint64_t from = 0;;)
+			{
+				std::vector<LogRecord> page = log.read(from, PAGE);
+				if (page.empty())
+					break;
+				readCount += page.size();
+				from = page.back().sequence + 1;
+			}
+			double scanSeconds = bench::elapsedNs(scanStart, bench::Clock::now()) / 1e9;
+
+			// Random short ranges, a client scrolling back
+			std::mt19937_64 rng(42);
+			std::vector<double> rangeLatencies;
+			uint64_t written = log.getNextSequence();
+			for (int i = 0; i < 1000 && written > 0; i++)
+			{
+				uint64_t from = rng() % written;
+				bench::Clock::time_point rangeStart = bench::Clock::now();
+				std::vector<LogRecord> range = log.read(from, 100);
+				rangeLatencies.push_back(bench::elapsedNs(rangeStart, bench::Clock::now()));
+				if (range.empty() || range.front().sequence != from)
+				{
+					std::cerr << "[-] Range read at " << from << " returned the wrong records\n";
+					return 1;
+				}
+			}
+			bench::Summary rangeLatency = bench::summarize(rangeLatencies);
+			size_t segments = countSegments(dir);
+			log.close();
+
+			json.beginObject();
+			json.field("policy", policy.name);
+			json.field("threads", threads);
+			json.field("appended", total - dropped);
+			json.field("dropped", dropped);
+			json.field("segments", static_cast<uint64_t>(segments));
+			json.field("append_per_sec", appendSeconds > 0 ? total / appendSeconds : 0.0);
+			json.field("durable_per_sec", durableSeconds > 0 ? (total - dropped) / durableSeconds : 0.0);
+			json.field("durable_mb_per_sec", durableSeconds > 0 ? (total - dropped) * size / durableSeconds / (1 << 20) : 0.0);
+			json.summary("append_ns", appendLatency);
+			json.field("scan_records", readCount);
+			json.field("scan_per_sec", scanSeconds > 0 ? readCount / scanSeconds : 0.0);
+			json.summary("range_100_ns", rangeLatency);
+			json.endObject();
+		}
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+
+	if (!keep)
+		std::filesystem::remove_all(dir);
+	return 0;
+}
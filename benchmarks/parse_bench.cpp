@@ -0,0 +1,155 @@
+// Cost per parsed chat message, the old util::getSender/getCommand/getRecipient/getMessage
+// helpers (kept here as legacy::) against the single pass util::parseMessage.
+//
+// Usage: parse_bench [--iterations 2000000] [--repeats 5] [--out results.json]
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../server/Util.h"
+#include "Bench.h"
+
+namespace legacy
+{
+	std::string getSender(const std::string& message)
+	{
+		int pos = message.find(' ');
+		std::string sender = message.substr(0, pos + 1);
+		return sender;
+	}
+
+	std::string getCommand(const std::string& message)
+	{
+		int start = message.find(' ');
+		int end = message.find(' ', start + 1);
+		std::string command = message.substr(start + 1, end - start - 1);
+		return command;
+	}
+
+	std::string getRecipient(const std::string& message)
+	{
+		int pos = message.find(' ');
+		int start = message.find(' ', pos + 1);
+		int end = message.find(' ', start + 1);
+		std::string recipient = message.substr(start + 1, end - start);
+		return recipient;
+	}
+
+	std::string getMessage(const std::string& message)
+	{
+		std::string str = message;
+		int pos = message.find(' ');
+		int start = message.find(' ', pos + 1);
+		int end = message.find(' ', start + 1);
+		end = message.find(' ', end);
+		str.erase(0, end + 1);
+		return str;
+	}
+}
+
+namespace
+{
+	// Keeps the compiler from discarding the parse results
+	volatile size_t sink = 0;
+
+	struct Case
+	{
+		std::string name;
+		std::string message;
+	};
+
+	// Returns the best (lowest) ns per message over the repeats
+	template <typename Func>
+	double measure(const std::string& message, uint64_t iterations, int repeats, Func&& parse)
+	{
+		double best = 0;
+		for (int r = 0; r < repeats; r++)
+		{
+			size_t total = 0;
+			bench::Clock::time_point start = bench::Clock::now();
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				total += parse(message);
+			}
+			bench::Clock::time_point end = bench::Clock::now();
+			sink = sink + total;
+
+			double ns = bench::elapsedNs(start, end) / iterations;
+			if (r == 0 || ns < best)
+				best = ns;
+		}
+		return best;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t iterations = std::stoull(bench::getArg(argc, argv, "--iterations", "2000000"));
+	int repeats = std::stoi(bench::getArg(argc, argv, "--repeats", "5"));
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	std::string longBody(1024, 'x');
+	std::vector<Case> cases =
+	{
+		{ "chat_short", "</alice> hello everyone" },
+		{ "chat_1k", "</alice> " + longBody },
+		{ "whisper_short", "</alice> /whisper </bob> are you there?" },
+		{ "whisper_1k", "</alice> /whisper </bob> " + longBody },
+		{ "upload", "</alice> /upload </bob> report.pdf(1.20 MB)" },
+	};
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "parse");
+	json.field("iterations", iterations);
+	json.field("repeats", repeats);
+	json.key("results").beginArray();
+
+	for (const Case& c : cases)
+	{
+		std::cerr << "[*] " << c.name << "\n";
+
+		// The views must match what the old helpers returned for commands
+		util::MessageView check = util::parseMessage(c.message);
+		if (!check.command.empty() && (check.sender != legacy::getSender(c.message)
+			|| check.target != legacy::getRecipient(c.message) || check.body != legacy::getMessage(c.message)))
+		{
+			std::cerr << "[-] parseMessage disagrees with the legacy helpers on " << c.name << "\n";
+			return 1;
+		}
+
+		// Every field, what a handler needing all four paid before
+		double legacyAll = measure(c.message, iterations, repeats, [](const std::string& m)
+		{
+			return legacy::getSender(m).size() + legacy::getCommand(m).size()
+				+ legacy::getRecipient(m).size() + legacy::getMessage(m).size();
+		});
+
+		// The calls the old whisperCMD made for one /whisper
+		double legacyWhisper = measure(c.message, iterations, repeats, [](const std::string& m)
+		{
+			return legacy::getRecipient(m).size() + legacy::getSender(m).size() + legacy::getMessage(m).size();
+		});
+
+		double parsed = measure(c.message, iterations, repeats, [](const std::string& m)
+		{
+			util::MessageView view = util::parseMessage(m);
+			return view.sender.size() + view.command.size() + view.target.size() + view.body.size();
+		});
+
+		json.beginObject();
+		json.field("case", c.name);
+		json.field("bytes", static_cast<uint64_t>(c.message.size()));
+		json.field("legacy_all_fields_ns", legacyAll);
+		json.field("legacy_whisper_path_ns", legacyWhisper);
+		json.field("parse_message_ns", parsed);
+		json.field("speedup", parsed > 0 ? legacyAll / parsed : 0.0);
+		json.endObject();
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+	return 0;
+}
@@ -0,0 +1,240 @@
+// Reconnect storm against a running server, every simulated user drops at once and comes back, either with a
+// full login (new key pair, key exchange, LOGIN until the old session is cleaned up and the name is free) or
+// with the resumption ticket the server sent it (same key pair, RESUME, see server/Ticket.h).
+// Per mode --users users log in, wait for their TICKET, then all of their connections are shut down together
+// and --threads threads reconnect them as fast as they can. Reports the time until every user was back,
+// reconnects per second and the per user reconnect latency, from its attempt starting to LOGIN_RESULT.
+// The server needs a thread per user, ex.) ServerChatApp --headless --host bench --threads 1100 for 1000 users.
+//
+// Usage: reconnect_bench [--server 127.0.0.1] [--users 500] [--threads 32] [--modes full,resume]
+//                        [--prefix rb] [--out results.json]
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../client/Client.h"
+#include "../client/HdrHistogram.h"
+#include "Bench.h"
+
+namespace
+{
+	const unsigned TAKEN_RETRY_MS = 10; // A full login retries while the server still holds the dropped session
+	const unsigned TAKEN_RETRY_LIMIT = 500;
+
+	struct SimUser
+	{
+		std::unique_ptr<Client> client;
+		std::string username;
+		bool back = false;
+	};
+
+	struct Totals
+	{
+		std::atomic <uint64_t> reconnects = 0;
+		std::atomic <uint64_t> failures = 0;
+		std::atomic <uint64_t> takenRetries = 0;
+		HdrHistogram latency; // us
+	};
+
+	// Handshake and LOGIN as ClientChatRoom does, retrying while the name is taken, throws on failure
+	// Returns the LOGIN attempts that found the name taken
+	uint64_t login(Client& client, const std::string& server, const std::string& username)
+	{
+		std::string ip = server;
+		client.initializeClient();
+		client.connectToServer(ip);
+
+		std::pair<std::vector<unsigned char>, std::vector<unsigned char>> keys = util::generate_key_pair();
+		client.set_encryption_keys(keys.first, keys.second);
+		if (!client.recv_server_pk() || !client.send_pk())
+			throw std::runtime_error("[-] Key exchange failed");
+
+		client.setUsername(username);
+		for (uint64_t taken = 0; taken < TAKEN_RETRY_LIMIT; taken++)
+		{
+			client.sendFrame(Frame(Opcode::LOGIN, { username }));
+			Frame result;
+			do
+			{
+				if (!client.recvFrame(result))
+					throw std::runtime_error("[-] Connection closed during login");
+			} while (result.opcode != Opcode::LOGIN_RESULT);
+			if (static_cast<LoginStatus>(result.byte(0)) == LoginStatus::ACCEPTED)
+				return taken;
+			std::this_thread::sleep_for(std::chrono::milliseconds(TAKEN_RETRY_MS));
+		}
+		throw std::runtime_error("[-] Username still taken: " + username);
+	}
+
+	// Reads up to the TICKET the server sends after the join, false if none comes
+	bool awaitTicket(Client& client)
+	{
+		Frame frame;
+		while (client.recvFrame(frame))
+		{
+			if (frame.opcode == Opcode::TICKET)
+			{
+				client.setTicket(std::string(frame.field(0)));
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void reconnect(SimUser& user, bool resume, const std::string& server, Totals& totals)
+	{
+		bench::Clock::time_point start = bench::Clock::now();
+		try
+		{
+			if (resume)
+			{
+				bool refused;
+				if (!user.client->resume(refused))
+					throw std::runtime_error(refused ? "[-] Ticket refused for " + user.username : "[-] Server unreachable");
+			}
+			else
+			{
+				closesocket(user.client->getSocket());
+				user.client = std::make_unique<Client>();
+				totals.takenRetries += login(*user.client, server, user.username);
+			}
+		}
+		catch (std::exception& e)
+		{
+			if (totals.failures++ < 5)
+				std::cerr << e.what() << "\n";
+			return;
+		}
+		totals.latency.record(static_cast<uint64_t>(bench::elapsedNs(start, bench::Clock::now()) / 1e3));
+		totals.reconnects++;
+		user.back = true;
+	}
+
+	std::vector<std::string> split(const std::string& list)
+	{
+		std::vector<std::string> items;
+		std::stringstream stream(list);
+		std::string item;
+		while (std::getline(stream, item, ','))
+		{
+			if (!item.empty())
+				items.push_back(item);
+		}
+		return items;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string server = bench::getArg(argc, argv, "--server", "127.0.0.1");
+	size_t userCount = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--users", "500")));
+	size_t threads = std::max<size_t>(1, static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--threads", "32"))));
+	std::vector<std::string> modes = split(bench::getArg(argc, argv, "--modes", "full,resume"));
+	std::string prefix = bench::getArg(argc, argv, "--prefix", "rb");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	if (!util::sodium_startup())
+	{
+		std::cerr << "[-] Sodium startup failed\n";
+		return 1;
+	}
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "reconnect_bench");
+	json.field("server", server);
+	json.field("users", static_cast<uint64_t>(userCount));
+	json.field("threads", static_cast<uint64_t>(threads));
+	json.key("results").beginArray();
+	for (const std::string& mode : modes)
+	{
+		if (mode != "full" && mode != "resume")
+		{
+			std::cerr << "[-] Unknown mode " << mode << ", expected full or resume\n";
+			return 1;
+		}
+		bool resume = mode == "resume";
+
+		std::cerr << "[*] " << mode << ": logging in " << userCount << " users\n";
+		std::vector<std::unique_ptr<SimUser>> users;
+		for (size_t i = 0; i < userCount; i++)
+		{
+			std::unique_ptr<SimUser> user = std::make_unique<SimUser>();
+			user->client = std::make_unique<Client>();
+			user->username = "</" + prefix + mode + std::to_string(i) + "> ";
+			try
+			{
+				login(*user->client, server, user->username);
+				if (!awaitTicket(*user->client) && resume)
+					throw std::runtime_error("[-] No ticket, is ticket_lifetime_s 0 on the server?");
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << e.what() << "\n";
+				return 1;
+			}
+			users.push_back(std::move(user));
+		}
+
+		// The blip, every connection drops at once and the server sees them close
+		for (auto& user : users)
+			::shutdown(user->client->getSocket(), SD_BOTH);
+
+		Totals totals;
+		std::atomic <size_t> next = 0;
+		bench::Clock::time_point start = bench::Clock::now();
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([&]
+			{
+				for (size_t i = next++; i < users.size(); i = next++)
+					reconnect(*users[i], resume, server, totals);
+			});
+		}
+		for (std::thread& worker : workers)
+			worker.join();
+		double stormSeconds = bench::elapsedNs(start, bench::Clock::now()) / 1e9;
+		std::cerr << "[+] " << mode << ": " << totals.reconnects << " back in " << stormSeconds << "s, p50 "
+			<< totals.latency.percentile(0.5) << " us, p99 " << totals.latency.percentile(0.99) << " us\n";
+
+		json.beginObject();
+		json.field("mode", mode);
+		json.field("reconnects", totals.reconnects.load());
+		json.field("failures", totals.failures.load());
+		json.field("taken_retries", totals.takenRetries.load());
+		json.field("storm_seconds", stormSeconds);
+		json.field("reconnects_per_sec", totals.reconnects / stormSeconds);
+		json.key("latency_us").beginObject();
+		json.field("mean", totals.latency.mean());
+		json.field("p50", totals.latency.percentile(0.5));
+		json.field("p90", totals.latency.percentile(0.9));
+		json.field("p99", totals.latency.percentile(0.99));
+		json.field("max", totals.latency.max());
+		json.endObject();
+		json.endObject();
+
+		for (auto& user : users)
+		{
+			if (user->back)
+			{
+				try
+				{
+					user->client->sendFrame(Frame(Opcode::QUIT));
+				}
+				catch (std::exception&)
+				{
+				}
+			}
+			closesocket(user->client->getSocket());
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(1)); // The server frees the names before the next mode
+	}
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+	return 0;
+}
@@ -0,0 +1,478 @@
+// Replays a capture recorded with /capture against a running server at --speed times the recorded pace,
+// ex.) 1, 10 or 100. Every captured connection becomes a Client that connects, sends its frames and
+// disconnects at the scaled times of its records, so the test server sees the same users, rooms, commands
+// and bursts as the captured one. Frames go out as captured except that:
+//   CHAT and WHISPER are timestamped, to measure delivery latency
+//   a TRANSFER_DECISION waits for the offer it answers (the server blocks on it), up to DECISION_WAIT_MS
+//   offers the capture never answered are declined
+// Approved transfers are not carried out, those bytes go peer to peer and never reach the server.
+// Sessions are spread over --threads workers, each waits on its sockets with select like loadgen.
+// Reports how late the sends ran against the schedule, frames per second and delivery latency.
+//
+// Usage: replay --capture chat_capture.cap [--server 127.0.0.1] [--speed 1] [--threads 8]
+//               [--drain-ms 2000] [--prefix name] [--out results.json]
+#define FD_SETSIZE 1024 // Sessions per worker at most, Winsock defaults to 64
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../client/Client.h"
+#include "../client/HdrHistogram.h"
+#include "../server/Capture.h"
+#include "Bench.h"
+
+namespace
+{
+	const unsigned DECISION_WAIT_MS = 5000;
+
+	// One captured connection, from its CONNECT (or first frame) to its DISCONNECT
+	struct Session
+	{
+		std::vector<capture::Record> records;
+		size_t next = 0;
+		size_t decisionsLeft = 0; // TRANSFER_DECISION records not yet sent
+		Client client;
+		bool connected = false;
+		bool alive = true;
+		bool quit = false; // Sent the captured QUIT, the server closes the socket
+		uint64_t offersPending = 0; // Offers received and not yet answered
+		bool holding = false;
+		bench::Clock::time_point heldSince;
+	};
+
+	struct Totals
+	{
+		std::atomic <uint64_t> sent = 0;
+		std::atomic <uint64_t> received = 0;
+		std::atomic <uint64_t> connects = 0;
+		std::atomic <uint64_t> failedConnects = 0;
+		std::atomic <uint64_t> disconnects = 0; // By the server or an error, not captured ones
+		std::atomic <uint64_t> loginsRefused = 0;
+		std::atomic <uint64_t> decisionsSkipped = 0;
+		std::atomic <uint64_t> offersDeclined = 0;
+		HdrHistogram lag; // us, actual send - scheduled send
+		HdrHistogram chatLatency; // us, sender -> recipient
+		HdrHistogram whisperLatency;
+	};
+
+	// ex.) "</alice> " -> "</r1alice> " so a replay can run next to users of an earlier one
+	std::string rename(std::string_view username, const std::string& prefix)
+	{
+		if (prefix.empty())
+			return std::string(username);
+		if (username.compare(0, 2, "</") == 0)
+			return "</" + prefix + std::string(username.substr(2));
+		return prefix + std::string(username);
+	}
+
+	class Worker
+	{
+	private:
+		std::vector<Session*> sessions;
+		const std::string& server;
+		const std::string& prefix;
+		double speed;
+		Totals& totals;
+		std::thread thread;
+
+		bench::Clock::time_point scheduledAt(const Session& session)
+		{
+			if (session.next >= session.records.size())
+				return bench::Clock::time_point::max();
+			return start + std::chrono::microseconds(static_cast<int64_t>(session.records[session.next].micros / speed));
+		}
+
+		// When the worker next has to act for session, a held decision is retried every 10 ms
+		bench::Clock::time_point wakeAt(const Session& session)
+		{
+			if (session.holding)
+				return bench::Clock::now() + std::chrono::milliseconds(10);
+			return scheduledAt(session);
+		}
+
+		// Key exchange as ClientChatRoom does, the LOGIN frame comes from the capture
+		bool connect(Session& session)
+		{
+			try
+			{
+				std::string ip = server;
+				session.client.initializeClient();
+				session.client.connectToServer(ip);
+
+				std::pair<std::vector<unsigned char>, std::vector<unsigned char>> keys = util::generate_key_pair();
+				session.client.set_encryption_keys(keys.first, keys.second);
+				if (!session.client.recv_server_pk() || !session.client.send_pk())
+					throw std::runtime_error("[-] Key exchange failed");
+			}
+			catch (std::exception& e)
+			{
+				if (totals.failedConnects++ < 5)
+					std::cerr << e.what() << "\n";
+				session.alive = false;
+				return false;
+			}
+			session.connected = true;
+			totals.connects++;
+			return true;
+		}
+
+		// Sends the frame of record, false to hold it until its offer arrives
+		bool send(Session& session, const capture::Record& record, bench::Clock::time_point due)
+		{
+			Frame frame = record.frame;
+			switch (frame.opcode)
+			{
+			case Opcode::TRANSFER_DECISION:
+				if (session.offersPending == 0)
+				{
+					if (!session.holding)
+					{
+						session.holding = true;
+						session.heldSince = bench::Clock::now();
+					}
+					if (bench::Clock::now() - session.heldSince < std::chrono::milliseconds(DECISION_WAIT_MS))
+						return false;
+					session.holding = false;
+					session.decisionsLeft--;
+					totals.decisionsSkipped++;
+					return true;
+				}
+				session.holding = false;
+				session.offersPending--;
+				session.decisionsLeft--;
+				session.client.sendFrame(frame);
+				totals.sent++; // Not in lag, it waited on the offer rather than the schedule
+				return true;
+			case Opcode::CHAT:
+				protocol::stamp(frame);
+				break;
+			case Opcode::WHISPER:
+				protocol::stamp(frame);
+				[[fallthrough]];
+			case Opcode::LOGIN:
+			case Opcode::TRANSFER_OFFER:
+				if (!frame.fields.empty())
+					frame.fields[0] = rename(frame.fields[0], prefix);
+				break;
+			default:
+				break;
+			}
+
+			session.client.sendFrame(frame);
+			session.quit = session.quit || frame.opcode == Opcode::QUIT;
+			bench::Clock::time_point now = bench::Clock::now();
+			totals.lag.record(now > due ? static_cast<uint64_t>(bench::elapsedNs(due, now) / 1000) : 0);
+			totals.sent++;
+			return true;
+		}
+
+		// Everything in the capture that is due, in order
+		void act(Session& session, bench::Clock::time_point now)
+		{
+			while (session.alive && session.next < session.records.size())
+			{
+				bench::Clock::time_point due = scheduledAt(session);
+				if (due > now)
+					return;
+
+				const capture::Record& record = session.records[session.next];
+				if (!session.connected && !connect(session))
+					return;
+
+				if (record.event == capture::Event::FRAME)
+				{
+					if (!send(session, record, due))
+						return;
+				}
+				else if (record.event == capture::Event::DISCONNECT)
+				{
+					closesocket(session.client.getSocket());
+					session.alive = false;
+				}
+				session.next++;
+			}
+		}
+
+		void receive(Session& session)
+		{
+			Frame frame;
+			if (!session.client.recvFrame(frame))
+			{
+				session.alive = false;
+				if (!session.quit)
+					totals.disconnects++;
+				return;
+			}
+			totals.received++;
+
+			switch (frame.opcode)
+			{
+			case Opcode::CHAT:
+			case Opcode::WHISPER:
+				if ((frame.flags & TIMESTAMPED) && frame.stamps.sent != 0)
+				{
+					uint64_t now = protocol::monotonicMicros();
+					if (now >= frame.stamps.sent)
+						(frame.opcode == Opcode::CHAT ? totals.chatLatency : totals.whisperLatency).record(now - frame.stamps.sent);
+				}
+				return;
+			case Opcode::LOGIN_RESULT:
+				if (static_cast<LoginStatus>(frame.byte(0)) != LoginStatus::ACCEPTED)
+					totals.loginsRefused++;
+				return;
+			case Opcode::TRANSFER_OFFER:
+				session.offersPending++;
+				if (session.offersPending > session.decisionsLeft) // The capture never answers it
+				{
+					session.client.sendFrame(Frame(Opcode::TRANSFER_DECISION, { protocol::byteField(0) }));
+					session.offersPending--;
+					totals.offersDeclined++;
+				}
+				return;
+			case Opcode::SHUTDOWN:
+				session.alive = false;
+				totals.disconnects++;
+				return;
+			default:
+				return;
+			}
+		}
+
+		void loop()
+		{
+			while (running)
+			{
+				fd_set readable;
+				FD_ZERO(&readable);
+				SOCKET maxSock = 0;
+				size_t watched = 0;
+				bench::Clock::time_point wake = bench::Clock::now() + std::chrono::milliseconds(50);
+				bool pending = false;
+				for (Session* session : sessions)
+				{
+					if (!session->alive)
+						continue;
+					if (session->next < session->records.size())
+					{
+						pending = true;
+						wake = std::min(wake, wakeAt(*session));
+					}
+					if (session->connected)
+					{
+						FD_SET(session->client.getSocket(), &readable);
+						maxSock = std::max(maxSock, session->client.getSocket());
+						watched++;
+					}
+				}
+				finished = !pending;
+
+				int64_t waitUs = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(wake - bench::Clock::now()).count());
+				if (watched == 0) // select rejects empty sets on Windows
+				{
+					std::this_thread::sleep_for(std::chrono::microseconds(std::min<int64_t>(waitUs, 10000)));
+				}
+				else
+				{
+					timeval timeout{ static_cast<long>(waitUs / 1000000), static_cast<long>(waitUs % 1000000) };
+					if (select(static_cast<int>(maxSock) + 1, &readable, nullptr, nullptr, &timeout) == SOCKET_ERROR)
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+						continue;
+					}
+
+					for (Session* session : sessions)
+					{
+						if (!session->alive || !session->connected || !FD_ISSET(session->client.getSocket(), &readable))
+							continue;
+						try
+						{
+							receive(*session);
+						}
+						catch (std::exception&)
+						{
+							session->alive = false;
+							totals.disconnects++;
+						}
+					}
+				}
+
+				bench::Clock::time_point now = bench::Clock::now();
+				for (Session* session : sessions)
+				{
+					try
+					{
+						act(*session, now);
+					}
+					catch (std::exception&)
+					{
+						session->alive = false;
+						totals.disconnects++;
+					}
+				}
+			}
+		}
+
+	public:
+		std::atomic <bool> running = true;
+		std::atomic <bool> finished = false; // Every record of every session sent
+		bench::Clock::time_point start;
+
+		Worker(const std::string& server, const std::string& prefix, double speed, Totals& totals)
+			: server(server), prefix(prefix), speed(speed), totals(totals)
+		{
+		}
+
+		void adopt(Session* session)
+		{
+			sessions.push_back(session);
+		}
+
+		void run(bench::Clock::time_point start)
+		{
+			this->start = start;
+			thread = std::thread(&Worker::loop, this);
+		}
+
+		// Sessions the capture left connected send QUIT, every socket is closed
+		void stop()
+		{
+			running = false;
+			thread.join();
+			for (Session* session : sessions)
+			{
+				if (session->alive && session->connected)
+				{
+					try
+					{
+						session->client.sendFrame(Frame(Opcode::QUIT));
+					}
+					catch (std::exception&)
+					{
+					}
+					closesocket(session->client.getSocket());
+				}
+			}
+		}
+	};
+
+	// Splits the capture into one session per connection lifetime, connection ids are reused after DISCONNECT
+	std::vector<std::unique_ptr<Session>> loadSessions(capture::Reader& reader, uint64_t& records, uint64_t& lastMicros)
+	{
+		std::vector<std::unique_ptr<Session>> sessions;
+		std::unordered_map<uint64_t, Session*> open;
+		capture::Record record;
+		while (reader.next(record))
+		{
+			records++;
+			lastMicros = record.micros;
+
+			auto it = open.find(record.connection);
+			if (record.event == capture::Event::CONNECT || it == open.end())
+			{
+				sessions.push_back(std::make_unique<Session>());
+				it = open.insert_or_assign(record.connection, sessions.back().get()).first;
+			}
+
+			Session& session = *it->second;
+			session.records.push_back(record);
+			if (record.event == capture::Event::FRAME && record.frame.opcode == Opcode::TRANSFER_DECISION)
+				session.decisionsLeft++;
+			if (record.event == capture::Event::DISCONNECT)
+				open.erase(it);
+		}
+		return sessions;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string capturePath = bench::getArg(argc, argv, "--capture", "chat_capture.cap");
+	std::string server = bench::getArg(argc, argv, "--server", "127.0.0.1");
+	double speed = std::stod(bench::getArg(argc, argv, "--speed", "1"));
+	size_t threads = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--threads", "8")));
+	unsigned drainMs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--drain-ms", "2000")));
+	std::string prefix = bench::getArg(argc, argv, "--prefix", "");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	if (speed <= 0 || !util::sodium_startup())
+	{
+		std::cerr << "[-] Speed must be above 0 and sodium must start\n";
+		return 1;
+	}
+
+	capture::Reader reader;
+	if (!reader.open(capturePath))
+	{
+		std::cerr << "[-] " << capturePath << " is not a capture\n";
+		return 1;
+	}
+	uint64_t records = 0, captureMicros = 0;
+	std::vector<std::unique_ptr<Session>> sessions = loadSessions(reader, records, captureMicros);
+	std::cerr << "[*] " << records << " records, " << sessions.size() << " sessions over " << captureMicros / 1e6
+		<< "s, replaying at " << speed << "x\n";
+
+	threads = std::max<size_t>({ threads, 1, (sessions.size() + FD_SETSIZE - 2) / (FD_SETSIZE - 1) });
+	Totals totals;
+	std::vector<std::unique_ptr<Worker>> workers;
+	for (size_t i = 0; i < threads; i++)
+		workers.push_back(std::make_unique<Worker>(server, prefix, speed, totals));
+	for (size_t i = 0; i < sessions.size(); i++)
+		workers[i % threads]->adopt(sessions[i].get());
+
+	bench::Clock::time_point start = bench::Clock::now() + std::chrono::milliseconds(100);
+	for (auto& worker : workers)
+		worker->run(start);
+
+	// Progress once a second until every worker has sent its last record
+	uint64_t lastSent = 0;
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		bool finished = true;
+		for (auto& worker : workers)
+			finished = finished && worker->finished;
+
+		double replayed = std::max(0.0, bench::elapsedNs(start, bench::Clock::now()) / 1e3 * speed);
+		std::cerr << "[*] " << std::min(100.0, 100 * replayed / std::max<uint64_t>(captureMicros, 1)) << "% sent "
+			<< totals.sent - lastSent << " frames/s, lag p99 " << totals.lag.percentile(0.99) << " us, disconnects " << totals.disconnects << "\n";
+		lastSent = totals.sent;
+		if (finished)
+			break;
+	}
+	double replaySeconds = bench::elapsedNs(start, bench::Clock::now()) / 1e9;
+	std::this_thread::sleep_for(std::chrono::milliseconds(drainMs)); // Deliveries still in flight
+
+	for (auto& worker : workers)
+		worker->stop();
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "replay");
+	json.field("capture", capturePath);
+	json.field("server", server);
+	json.field("speed", speed);
+	json.field("records", records);
+	json.field("sessions", static_cast<uint64_t>(sessions.size()));
+	json.field("capture_seconds", captureMicros / 1e6);
+	json.field("replay_seconds", replaySeconds);
+	json.field("frames_sent", totals.sent.load());
+	json.field("frames_received", totals.received.load());
+	json.field("sent_per_sec", totals.sent / replaySeconds);
+	json.field("connects", totals.connects.load());
+	json.field("failed_connects", totals.failedConnects.load());
+	json.field("logins_refused", totals.loginsRefused.load());
+	json.field("disconnects", totals.disconnects.load());
+	json.field("decisions_skipped", totals.decisionsSkipped.load());
+	json.field("offers_declined", totals.offersDeclined.load());
+	bench::latencySummary(json, "lag_us", totals.lag);
+	bench::latencySummary(json, "chat_latency_us", totals.chatLatency);
+	bench::latencySummary(json, "whisper_latency_us", totals.whisperLatency);
+	json.endObject();
+	bench::emit(json.str(), outPath);
+
+	WSACleanup();
+	return 0;
+}
@@ -0,0 +1,191 @@
+// SearchIndex over a synthetic chat history, how fast the indexer catches up with the log,
+// how compact the varint posting lists are, and /search latency for rare, medium and
+// common terms with one to three words per query.
+//
+// Usage: search_bench [--dir search_bench_data] [--messages 1000000] [--vocabulary 50000]
+//                     [--queries 2000] [--keep] [--out results.json]
+#include <cmath>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../server/SearchIndex.h"
+#include "Bench.h"
+
+namespace
+{
+	// Zipf distributed word ranks, chat vocabulary is heavily skewed
+	class Zipf
+	{
+	private:
+		std::vector<double> cumulative;
+
+	public:
+		Zipf(size_t n, double s = 1.0)
+		{
+			cumulative.resize(n);
+			double total = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				total += 1.0 / std::pow(static_cast<double>(i + 1), s);
+				cumulative[i] = total;
+			}
+			for (double& c : cumulative)
+				c /= total;
+		}
+
+		template <typename Rng>
+		size_t operator()(Rng& rng)
+		{
+			double u = std::uniform_real_distribution<double>(0, 1)(rng);
+			return static_cast<size_t>(std::lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin());
+		}
+	};
+
+	std::string word(size_t rank)
+	{
+		// Distinct, tokenizer friendly words, ex.) w0, w1a, ...
+		std::string w = "w";
+		do
+		{
+			w.push_back(static_cast<char>('a' + rank % 26));
+			rank /= 26;
+		} while (rank > 0);
+		return w;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = bench::getArg(argc, argv, "--dir", "search_bench_data");
+	uint64_t messages = std::stoull(bench::getArg(argc, argv, "--messages", "1000000"));
+	size_t vocabulary = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--vocabulary", "50000")));
+	size_t queries = static_cast<size_t>(std::stoull(bench::getArg(argc, argv, "--queries", "2000")));
+	bool keep = bench::hasFlag(argc, argv, "--keep");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	std::filesystem::remove_all(dir);
+	MessageLog log(dir, FsyncPolicy::NEVER);
+	if (!log.open())
+	{
+		std::cerr << "[-] Could not open " << dir << "\n";
+		return 1;
+	}
+
+	// Fill the log the way the server would, encoded CHAT frames in room channels
+	std::cerr << "[*] Writing " << messages << " messages\n";
+	std::mt19937_64 rng(7);
+	Zipf zipf(vocabulary);
+	uint64_t postings = 0;
+	uint64_t textBytes = 0;
+	std::unordered_set<size_t> unique;
+	for (uint64_t i = 0; i < messages; i++)
+	{
+		size_t words = 4 + rng() % 13;
+		std::string text;
+		unique.clear();
+		for (size_t w = 0; w < words; w++)
+		{
+			size_t rank = zipf(rng);
+			unique.insert(rank);
+			text += word(rank) + " ";
+		}
+		postings += unique.size();
+		textBytes += text.size();
+
+		Frame frame(Opcode::CHAT, { "</user" + std::to_string(i % 500) + "> ", text });
+		while (log.append("#room" + std::to_string(i % 20), protocol::encode(frame)) == UINT64_MAX)
+			log.flush(); // Writer fell behind, the server would drop here
+	}
+	log.flush();
+
+	// Index from scratch, as after a restart
+	std::cerr << "[*] Indexing\n";
+	SearchIndex index(log);
+	bench::Clock::time_point start = bench::Clock::now();
+	index.start();
+	while (index.indexed() < log.getNextSequence())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	double indexSeconds = bench::elapsedNs(start, bench::Clock::now()) / 1e9;
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "search");
+	json.field("messages", messages);
+	json.field("vocabulary", static_cast<uint64_t>(vocabulary));
+	json.field("text_bytes", textBytes);
+	json.field("index_seconds", indexSeconds);
+	json.field("index_per_sec", indexSeconds > 0 ? messages / indexSeconds : 0.0);
+	json.field("terms", static_cast<uint64_t>(index.termCount()));
+	json.field("postings", postings);
+	json.field("posting_bytes", static_cast<uint64_t>(index.postingSize()));
+	json.field("bytes_per_posting", postings > 0 ? static_cast<double>(index.postingSize()) / postings : 0.0);
+	json.key("queries").beginArray();
+
+	// Rank bands, most frequent words down to the long tail
+	struct Band
+	{
+		std::string name;
+		size_t low;
+		size_t high;
+	};
+	std::vector<Band> bands = { { "common", 0, 10 }, { "medium", 100, 1000 }, { "rare", vocabulary / 2, vocabulary } };
+
+	for (const Band& band : bands)
+	{
+		for (int terms = 1; terms <= 3; terms++)
+		{
+			std::cerr << "[*] " << band.name << " x" << terms << "\n";
+			std::vector<double> queryNs, topNs;
+			uint64_t totalMatches = 0;
+			for (size_t q = 0; q < queries; q++)
+			{
+				std::string text;
+				for (int t = 0; t < terms; t++)
+					text += word(band.low + rng() % (band.high - band.low)) + " ";
+
+				bench::Clock::time_point queryStart = bench::Clock::now();
+				std::vector<uint64_t> matches = index.query(text);
+				bench::Clock::time_point queried = bench::Clock::now();
+
+				// What /search adds on top, reading back the ten newest hits
+				std::vector<uint64_t> top(matches.begin(), matches.begin() + std::min<size_t>(matches.size(), 10));
+				std::vector<LogRecord> records = log.read(top);
+				for (size_t i = 0; i < top.size(); i++)
+				{
+					if (i >= records.size() || records[i].sequence != top[i])
+					{
+						std::cerr << "[-] Log read back the wrong record for " << top[i] << "\n";
+						return 1;
+					}
+				}
+				bench::Clock::time_point fetched = bench::Clock::now();
+
+				queryNs.push_back(bench::elapsedNs(queryStart, queried));
+				topNs.push_back(bench::elapsedNs(queryStart, fetched));
+				totalMatches += matches.size();
+			}
+
+			json.beginObject();
+			json.field("band", band.name);
+			json.field("terms", terms);
+			json.field("mean_matches", queries > 0 ? static_cast<double>(totalMatches) / queries : 0.0);
+			json.summary("query_ns", bench::summarize(queryNs));
+			json.summary("query_and_top10_ns", bench::summarize(topNs));
+			json.endObject();
+		}
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+
+	index.stop();
+	log.close();
+	if (!keep)
+		std::filesystem::remove_all(dir);
+	return 0;
+}
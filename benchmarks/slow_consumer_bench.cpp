@@ -0,0 +1,250 @@
+// Room wide delivery latency with deliberately stalled readers, the old synchronous
+// broadcast (one blocking send per member) against per user Outbox queues with the
+// slow consumer policies. Healthy readers measure latency from each messages scheduled
+// send time, so a stalled broadcaster shows up instead of hiding (no coordinated omission).
+//
+// Usage: slow_consumer_bench [--modes sync,outbox] [--readers 16] [--stalled 2]
+//                            [--rate 200] [--seconds 8] [--size 256] [--stall-ms 3000]
+//                            [--sockbuf 32K] [--out results.json]
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/Outbox.h"
+#include "Bench.h"
+
+#pragma comment (lib, "Ws2_32.lib")
+
+namespace
+{
+	typedef std::vector<unsigned char> Bytes;
+
+	struct Reader
+	{
+		SOCKET serverSide = INVALID_SOCKET;
+		SOCKET clientSide = INVALID_SOCKET;
+		Bytes pk;
+		Bytes sk;
+		bool stalled = false;
+		std::unique_ptr<Outbox> outbox;
+		std::thread thread;
+
+		// Latency samples as {ms since start, latency us}, healthy readers only
+		std::vector<std::pair<double, double>> samples;
+		uint64_t received = 0;
+	};
+
+	double percentile(std::vector<double> values, double q)
+	{
+		if (values.empty())
+			return 0;
+		std::sort(values.begin(), values.end());
+		size_t i = static_cast<size_t>(q * (values.size() - 1) + 0.5);
+		return values[std::min(i, values.size() - 1)];
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string modes = bench::getArg(argc, argv, "--modes", "sync,outbox");
+	size_t readerCount = static_cast<size_t>(std::stoul(bench::getArg(argc, argv, "--readers", "16")));
+	size_t stalledCount = static_cast<size_t>(std::stoul(bench::getArg(argc, argv, "--stalled", "2")));
+	double rate = std::stod(bench::getArg(argc, argv, "--rate", "200"));
+	double seconds = std::stod(bench::getArg(argc, argv, "--seconds", "8"));
+	size_t size = static_cast<size_t>(bench::parseSize(bench::getArg(argc, argv, "--size", "256")));
+	unsigned stallMs = static_cast<unsigned>(std::stoul(bench::getArg(argc, argv, "--stall-ms", "3000")));
+	int sockbuf = static_cast<int>(bench::parseSize(bench::getArg(argc, argv, "--sockbuf", "32K")));
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0 || !util::sodium_startup())
+	{
+		std::cerr << "[-] Startup failed\n";
+		return 1;
+	}
+
+	std::pair<Bytes, Bytes> serverKeys = util::generate_key_pair();
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "slow_consumer");
+	json.field("readers", static_cast<uint64_t>(readerCount));
+	json.field("stalled", static_cast<uint64_t>(stalledCount));
+	json.field("rate", rate);
+	json.field("seconds", seconds);
+	json.field("message_bytes", static_cast<uint64_t>(size));
+	json.field("stall_ms", static_cast<uint64_t>(stallMs));
+	json.field("sockbuf", static_cast<uint64_t>(sockbuf));
+	json.key("results").beginArray();
+
+	std::istringstream modeStream(modes);
+	std::string mode;
+	while (std::getline(modeStream, mode, ','))
+	{
+		bool useOutbox = mode == "outbox";
+		std::cerr << "[*] " << mode << "\n";
+
+		unsigned short port = 0;
+		SOCKET listener = bench::listenLoopback(port);
+		if (listener == INVALID_SOCKET)
+		{
+			std::cerr << "[-] Listen failed\n";
+			return 1;
+		}
+
+		std::vector<std::unique_ptr<Reader>> readers;
+		for (size_t i = 0; i < readerCount; i++)
+		{
+			auto reader = std::make_unique<Reader>();
+			if (!bench::connectPair(listener, port, reader->serverSide, reader->clientSide, sockbuf))
+			{
+				std::cerr << "[-] Connect failed\n";
+				return 1;
+			}
+			std::pair<Bytes, Bytes> keys = util::generate_key_pair();
+			reader->pk = keys.first;
+			reader->sk = keys.second;
+			reader->stalled = i < stalledCount;
+			if (useOutbox)
+			{
+				reader->outbox = std::make_unique<Outbox>();
+				reader->outbox->start(reader->serverSide, reader->pk, serverKeys.second, OutboxLimits());
+			}
+			readers.push_back(std::move(reader));
+		}
+		closesocket(listener);
+
+		bench::Clock::time_point start = bench::Clock::now();
+		for (auto& r : readers)
+		{
+			Reader* reader = r.get();
+			reader->thread = std::thread([reader, start, stallMs, &serverKeys]()
+			{
+				if (reader->stalled)
+					std::this_thread::sleep_for(std::chrono::milliseconds(stallMs));
+
+				Bytes serverPk = serverKeys.first;
+				Frame frame;
+				while (protocol::recvFrame(reader->clientSide, frame, serverPk, reader->sk))
+				{
+					reader->received++;
+					if (reader->stalled || frame.opcode != Opcode::CHAT)
+						continue;
+
+					// Body starts with the scheduled send time in ns since start
+					double scheduled = std::stod(std::string(frame.field(1).substr(0, 20)));
+					double now = bench::elapsedNs(start, bench::Clock::now());
+					reader->samples.emplace_back(now / 1e6, (now - scheduled) / 1e3);
+				}
+			});
+		}
+
+		// Paced broadcaster, the server fanning room chat out to every member
+		uint64_t total = static_cast<uint64_t>(rate * seconds);
+		uint64_t disconnects = 0, snapshots = 0;
+		for (uint64_t i = 0; i < total; i++)
+		{
+			double scheduledNs = i * 1e9 / rate;
+			while (bench::elapsedNs(start, bench::Clock::now()) < scheduledNs)
+				std::this_thread::yield();
+
+			char stamp[32];
+			std::snprintf(stamp, sizeof(stamp), "%020.0f", scheduledNs);
+			std::string body(stamp);
+			body.resize(std::max(size, body.size()), 'x');
+			Frame frame(Opcode::CHAT, { "</bench> ", body });
+
+			for (auto& reader : readers)
+			{
+				if (!useOutbox)
+				{
+					protocol::sendFrame(reader->serverSide, frame, reader->pk, serverKeys.second);
+					continue;
+				}
+
+				switch (reader->outbox->push(frame))
+				{
+				case OutboxAction::SNAPSHOT:
+					snapshots++;
+					reader->outbox->push(protocol::notice("[!] You Fell Behind"));
+					break;
+				case OutboxAction::DISCONNECT:
+					disconnects++;
+					::shutdown(reader->serverSide, SD_BOTH);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+		double sendSeconds = bench::elapsedNs(start, bench::Clock::now()) / 1e9;
+
+		// Let the healthy readers drain, then tear down
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		OutboxStats stalledStats;
+		for (auto& reader : readers)
+		{
+			if (reader->outbox && reader->stalled)
+			{
+				OutboxStats s = reader->outbox->stats();
+				stalledStats.skipped += s.skipped;
+				stalledStats.dropped += s.dropped;
+				stalledStats.snapshots += s.snapshots;
+				stalledStats.disconnected = stalledStats.disconnected || s.disconnected;
+			}
+			::shutdown(reader->serverSide, SD_BOTH);
+			::shutdown(reader->clientSide, SD_BOTH);
+		}
+		for (auto& reader : readers)
+		{
+			reader->thread.join();
+			if (reader->outbox)
+				reader->outbox->close();
+			closesocket(reader->serverSide);
+			closesocket(reader->clientSide);
+		}
+
+		// Overall and per second latency at the healthy readers
+		std::vector<double> all;
+		std::vector<std::vector<double>> perSecond(static_cast<size_t>(seconds) + 2);
+		uint64_t healthyReceived = 0;
+		for (auto& reader : readers)
+		{
+			if (reader->stalled)
+				continue;
+			healthyReceived += reader->received;
+			for (auto& sample : reader->samples)
+			{
+				all.push_back(sample.second);
+				size_t second = std::min(static_cast<size_t>(sample.first / 1000), perSecond.size() - 1);
+				perSecond[second].push_back(sample.second);
+			}
+		}
+
+		json.beginObject();
+		json.field("mode", mode);
+		json.field("messages", total);
+		json.field("send_seconds", sendSeconds);
+		json.field("healthy_received", healthyReceived);
+		json.summary("healthy_latency_us", bench::summarize(all));
+		json.key("p99_us_per_second").beginArray();
+		for (auto& bucket : perSecond)
+			json.value(percentile(bucket, 0.99));
+		json.endArray();
+		json.field("snapshots", snapshots);
+		json.field("disconnects", disconnects);
+		json.field("stalled_skipped", stalledStats.skipped);
+		json.field("stalled_dropped", stalledStats.dropped);
+		json.endObject();
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+	WSACleanup();
+	return 0;
+}
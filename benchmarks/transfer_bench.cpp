@@ -0,0 +1,231 @@
+// FileTransfer::upload against FileTransfer::download over loopback in one process, across file sizes,
+// chunk sizes and TransferCipher modes. It reports MB/s and CPU seconds per GB for both ends together.
+// It also reports peak working set above the baseline, sampled every millisecond, and time to first
+// byte, from the upload call until download has the first chunk.
+// Sizes of 2 GiB and up are reported as skipped, the wire carries the file size as an int32.
+//
+// Usage: transfer_bench [--sizes 1K,64K,1M,16M,256M,1G,8G] [--chunks 16K,64K,1M] [--ciphers box,stream]
+//                       [--repeats 3] [--dir .] [--out results.json]
+#include <WinSock2.h>
+#include <Windows.h>
+#include <psapi.h>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/FileTransfer.h"
+#include "Bench.h"
+
+#pragma comment (lib, "Ws2_32.lib")
+#pragma comment (lib, "Psapi.lib")
+
+namespace
+{
+	typedef std::vector<unsigned char> Bytes;
+
+	const unsigned TRANSFER_PORT = 51000; // FileTransfer::download always listens here
+	const unsigned LISTEN_WAIT_MS = 100; // download has no ready signal, the app relies on the same head start
+	const uint64_t MAX_FILE_SIZE = 0x7FFFFFFF;
+
+	double processCpuSeconds()
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+			return 0;
+
+		auto seconds = [](const FILETIME& time)
+		{
+			return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; // 100ns units
+		};
+		return seconds(kernel) + seconds(user);
+	}
+
+	size_t workingSet()
+	{
+		PROCESS_MEMORY_COUNTERS counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return 0;
+		return static_cast<size_t>(counters.WorkingSetSize);
+	}
+
+	bool writeSourceFile(const std::string& path, uint64_t size)
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		Bytes block(1 << 20);
+		for (uint64_t written = 0; written < size && file; written += block.size())
+		{
+			size_t count = static_cast<size_t>(std::min<uint64_t>(block.size(), size - written));
+			randombytes_buf(block.data(), count);
+			file.write(reinterpret_cast<char*>(block.data()), count);
+		}
+		return static_cast<bool>(file);
+	}
+
+	struct Run
+	{
+		bool ok = false;
+		TransferStatus upStatus = TransferStatus::FAILURE;
+		TransferStatus downStatus = TransferStatus::FAILURE;
+		double seconds = 0;
+		double cpuSeconds = 0;
+		double ttfbUs = 0;
+		size_t peakBytes = 0;
+	};
+
+	// The keys are paired the way the server hands them out, upload seals with the downloader's public key
+	Run runOnce(const std::string& path, const TransferOptions& options, std::pair<Bytes, Bytes>& uploader, std::pair<Bytes, Bytes>& downloader)
+	{
+		Run run;
+		size_t baseline = workingSet();
+		std::atomic <size_t> peak = baseline;
+		std::atomic <bool> sampling = true;
+		std::thread sampler([&]()
+		{
+			while (sampling)
+			{
+				size_t current = workingSet();
+				if (current > peak)
+					peak = current;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+
+		std::chrono::steady_clock::time_point firstChunk;
+		std::thread receiver([&]()
+		{
+			FileTransfer ft(uploader.first, downloader.second);
+			ft.setOptions(options);
+			run.downStatus = ft.download();
+			firstChunk = ft.getFirstChunkTime();
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(LISTEN_WAIT_MS));
+
+		double cpuStart = processCpuSeconds();
+		bench::Clock::time_point start = bench::Clock::now();
+		{
+			FileTransfer ft("127.0.0.1", TRANSFER_PORT, downloader.first, uploader.second);
+			ft.setOptions(options);
+			std::string fileName = path;
+			run.upStatus = ft.upload(fileName);
+		}
+		receiver.join();
+		bench::Clock::time_point end = bench::Clock::now();
+		run.cpuSeconds = processCpuSeconds() - cpuStart;
+
+		sampling = false;
+		sampler.join();
+
+		run.ok = run.upStatus == TransferStatus::SUCCESS && run.downStatus == TransferStatus::SUCCESS;
+		run.seconds = bench::elapsedNs(start, end) / 1e9;
+		run.ttfbUs = bench::elapsedNs(start, firstChunk) / 1e3;
+		run.peakBytes = peak - baseline;
+		return run;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<uint64_t> sizes = bench::parseSizeList(bench::getArg(argc, argv, "--sizes", "1K,64K,1M,16M,256M,1G,8G"));
+	std::vector<uint64_t> chunks = bench::parseSizeList(bench::getArg(argc, argv, "--chunks", "16K,64K,1M"));
+	std::string cipherList = bench::getArg(argc, argv, "--ciphers", "box,stream");
+	size_t repeats = static_cast<size_t>(std::stoul(bench::getArg(argc, argv, "--repeats", "3")));
+	std::string dir = bench::getArg(argc, argv, "--dir", ".");
+	std::string outPath = bench::getArg(argc, argv, "--out", "");
+
+	std::vector<std::pair<std::string, TransferCipher>> ciphers;
+	std::istringstream stream(cipherList);
+	for (std::string cipher; std::getline(stream, cipher, ',');)
+	{
+		if (cipher == "box")
+			ciphers.push_back({ cipher, TransferCipher::BOX });
+		else if (cipher == "stream")
+			ciphers.push_back({ cipher, TransferCipher::STREAM });
+		else
+			std::cerr << "[!] Unknown cipher " << cipher << "\n";
+	}
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0 || !util::sodium_startup())
+	{
+		std::cerr << "[-] Startup failed\n";
+		return 1;
+	}
+	std::pair<Bytes, Bytes> uploader = util::generate_key_pair();
+	std::pair<Bytes, Bytes> downloader = util::generate_key_pair();
+
+	bench::JsonWriter json;
+	json.beginObject();
+	json.field("benchmark", "transfer");
+	json.field("repeats", static_cast<uint64_t>(repeats));
+	json.key("results").beginArray();
+
+	for (uint64_t size : sizes)
+	{
+		if (size == 0 || size > MAX_FILE_SIZE)
+		{
+			std::cerr << "[!] Skipping " << bench::formatBytes(size) << ", the file size is sent as an int32\n";
+			json.beginObject();
+			json.field("file_bytes", size);
+			json.field("skipped", "file size outside the int32 size field");
+			json.endObject();
+			continue;
+		}
+
+		std::string path = dir + "/transfer_bench_" + std::to_string(size) + ".bin";
+		if (!writeSourceFile(path, size))
+		{
+			std::cerr << "[-] Could not write " << path << "\n";
+			continue;
+		}
+
+		for (uint64_t chunk : chunks)
+		{
+			for (const auto& cipher : ciphers)
+			{
+				std::cerr << "[*] " << bench::formatBytes(size) << " chunk " << bench::formatBytes(chunk) << " " << cipher.first << "\n";
+				TransferOptions options;
+				options.chunkSize = static_cast<size_t>(chunk);
+				options.cipher = cipher.second;
+
+				std::vector<double> mbPerSec, cpuPerGb, peakBytes, ttfbUs;
+				size_t failures = 0;
+				for (size_t r = 0; r < repeats; r++)
+				{
+					Run run = runOnce(path, options, uploader, downloader);
+					if (!run.ok)
+					{
+						std::cerr << "[-] Transfer failed, upload " << static_cast<int>(run.upStatus)
+							<< " download " << static_cast<int>(run.downStatus) << "\n";
+						failures++;
+						continue;
+					}
+					mbPerSec.push_back(size / 1e6 / run.seconds);
+					cpuPerGb.push_back(run.cpuSeconds / (size / 1e9));
+					peakBytes.push_back(static_cast<double>(run.peakBytes));
+					ttfbUs.push_back(run.ttfbUs);
+				}
+
+				json.beginObject();
+				json.field("file_bytes", size);
+				json.field("chunk_bytes", chunk);
+				json.field("cipher", cipher.first);
+				json.field("failures", static_cast<uint64_t>(failures));
+				json.field("mb_per_sec", bench::summarize(mbPerSec).p50);
+				json.field("cpu_sec_per_gb", bench::summarize(cpuPerGb).p50);
+				json.field("peak_rss_bytes", bench::summarize(peakBytes).p50);
+				json.field("ttfb_us", bench::summarize(ttfbUs).p50);
+				json.endObject();
+			}
+		}
+		std::remove(path.c_str());
+	}
+
+	json.endArray();
+	json.endObject();
+	bench::emit(json.str(), outPath);
+
+	WSACleanup();
+	return 0;
+}
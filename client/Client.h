@@ -3,7 +3,11 @@
 
 #include "FileTransfer.h"
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include "Util.h"
+#include "Protocol.h"
+#include "SharedMemory.h"
 
 #pragma comment (lib,  "Ws2_32.lib")
 
@@ -22,12 +26,23 @@ private:
 	std::vector <unsigned char> public_key;
 	std::vector <unsigned char> secret_key;
 
+	std::shared_ptr<SharedChannel> channel; // Set by attachSharedMemory, then frames skip the socket and encryption
+	std::mutex connection_mutex; // Guards clientSock and channel, resume replaces them while other threads send
+
+	std::string ticket; // Latest TICKET from the server, see resume
+	std::mutex ticket_mutex;
+
 public:
 
 	// Close the clients connection
 	void closeClient()
 	{
-		closesocket(clientSock);
+		{
+			std::lock_guard <std::mutex> lock(connection_mutex);
+			if (channel)
+				channel->close(); // Wakes the receive thread
+			closesocket(clientSock);
+		}
 		WSACleanup();
 		util::print("[+] Connection Closed.");
 		std::cout << "\033[2K\r"; // Remove "> " from terminal
@@ -50,12 +65,16 @@ public:
 	{
 		size_t res;
 		std::string str;
-		std::cout << "\033[2K\r[+] Downloading ...";
+		util::print("\033[2K\r[+] Downloading ...", 0);
 		try
 		{
-			std::vector<unsigned char> encrypted_peer_pk(crypto_box_PUBLICKEYBYTES+crypto_box_MACBYTES + crypto_box_NONCEBYTES);
-			int res = recv(clientSock, reinterpret_cast<char*>(encrypted_peer_pk.data()), encrypted_peer_pk.size(), 0);
-			std::vector<unsigned char> peer_pk = util::decrypt(encrypted_peer_pk, server_public_key, secret_key);
+			// Receive the uploaders public key
+			Frame info;
+			if (!recvFrame(info) || info.opcode != Opcode::TRANSFER_INFO || info.field(0).size() != crypto_box_PUBLICKEYBYTES)
+			{
+				throw std::runtime_error("[-] Error receiving public key");
+			}
+			std::vector<unsigned char> peer_pk(info.field(0).begin(), info.field(0).end());
 
 			FileTransfer ft(peer_pk, secret_key);
 			TransferStatus download_status = ft.download();
@@ -69,6 +88,7 @@ public:
 			util::print(str);
 
 			std::string filename;
+			logging::logger().flush(); // Queued output before the prompt
 			while (true)
 			{
 				std::cout << "\033[2K\r[*] Save as: ";
@@ -108,28 +128,24 @@ public:
 	{
 		try
 		{
-			std::cout << "\033[2K\r[+] Uploading ...";
+			util::print("\033[2K\r[+] Uploading ...", 0);
 		
-			// Receive the IP address
-			std::vector <unsigned char> encrypted_peer_pk(crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES + crypto_box_NONCEBYTES);
-			int res = recv(clientSock, reinterpret_cast<char*>(encrypted_peer_pk.data()), encrypted_peer_pk.size(), 0);
-			if (res == SOCKET_ERROR)
+			// Receive the downloaders public key, port and IP
+			Frame info;
+			if (!recvFrame(info) || info.opcode != Opcode::TRANSFER_INFO || info.field(0).size() != crypto_box_PUBLICKEYBYTES)
 			{
 				throw std::runtime_error("[-] Error receiving public key");
 			}
-			std::vector<unsigned char> peer_pk = util::decrypt(encrypted_peer_pk, server_public_key, secret_key);
+			std::vector<unsigned char> peer_pk(info.field(0).begin(), info.field(0).end());
 
-			// Receive the port
-			std::vector<unsigned char> encrypted_net_port(sizeof(unsigned) + crypto_box_MACBYTES + crypto_box_NONCEBYTES);
-			res = recv(clientSock, reinterpret_cast<char*>(encrypted_net_port.data()), encrypted_net_port.size(), 0);
-			if (res == SOCKET_ERROR)
+			unsigned short net_port = 0;
+			if (info.field(1).size() == sizeof(net_port))
 			{
-				throw std::runtime_error("[-] Error receiving port");
+				std::memcpy(&net_port, info.field(1).data(), sizeof(net_port));
 			}
-			std::vector<unsigned char> net_port_v = util::decrypt(encrypted_net_port, server_public_key, secret_key);
-			unsigned port = ntohs(util::vectorToData<unsigned int>(net_port_v));
+			unsigned port = ntohs(net_port);
 
-			std::string peer_IP = recvIP(); // Get the IP
+			std::string peer_IP(info.field(2)); // Get the IP
 
 			port = 51000;
 			FileTransfer ft(peer_IP, port, peer_pk, secret_key);
@@ -161,38 +177,6 @@ public:
 			throw std::runtime_error("[-] Connection Failed");
 	}
 
-	std::string recvIP()
-	{
-		try
-		{
-			std::vector<unsigned char> e_bin_size(sizeof(int32_t) + crypto_box_MACBYTES + crypto_box_NONCEBYTES);
-			int res = recv(clientSock, reinterpret_cast<char*>(e_bin_size.data()), e_bin_size.size(), 0);
-			if (res == SOCKET_ERROR)
-			{
-				throw std::runtime_error("[-] Error receiving IP");
-			}
-
-			std::vector <unsigned char> bin_size = util::decrypt(e_bin_size, server_public_key, secret_key);
-			int32_t net_size = util::vectorToInt32(bin_size);
-			int32_t size = ntohs(net_size);
-			std::vector<unsigned char> encrypted_IP(size);
-
-			res = recv(clientSock, reinterpret_cast<char*>(encrypted_IP.data()), encrypted_IP.size(), 0);
-			if (res == SOCKET_ERROR)
-			{
-				return "";
-			}
-			std::vector<unsigned char> bin_IP = util::decrypt(encrypted_IP, server_public_key, secret_key);
-			std::string IP(bin_IP.begin(), bin_IP.begin() + bin_IP.size());
-
-			return IP;
-		}
-		catch (std::exception& e)
-		{
-			return "";
-		}
-	}
-	
 	std::vector <unsigned char> get_public_key()
 	{
 		return public_key;
@@ -251,42 +235,134 @@ public:
 		return username;
 	}
 
-	void sendMessage(std::string msg)
+	SOCKET getSocket()
 	{
-		msg = username + msg;
-		std::vector <unsigned char> message(msg.begin(), msg.end());
-		std::vector <unsigned char> msg_to_send = util::encrypt(message, server_public_key, secret_key);
-		
-		int res = send(clientSock, reinterpret_cast<char*> (msg_to_send.data()), msg_to_send.size(), 0);
-		if (res == SOCKET_ERROR)
+		return clientSock;
+	}
+
+	void sendFrame(const Frame& frame)
+	{
+		SOCKET sock;
+		std::shared_ptr<SharedChannel> shared;
+		{
+			std::lock_guard <std::mutex> lock(connection_mutex);
+			sock = clientSock;
+			shared = channel;
+		}
+		bool sent = shared ? shared->sendFrame(frame) : protocol::sendFrame(sock, frame, server_public_key, secret_key);
+		if (!sent)
 			throw std::runtime_error("[-] Error: Message not sent!");
 	}
 
-	// Receives messages
-	std::string recvMessage()
+	// False when the connection was closed or the frame was malformed
+	bool recvFrame(Frame& frame)
 	{
-		try
+		SOCKET sock;
+		std::shared_ptr<SharedChannel> shared;
+		{
+			std::lock_guard <std::mutex> lock(connection_mutex);
+			sock = clientSock;
+			shared = channel;
+		}
+		if (shared)
+			return shared->recvFrame(frame);
+		return protocol::recvFrame(sock, frame, server_public_key, secret_key);
+	}
+
+	void setTicket(const std::string& ticket)
+	{
+		std::lock_guard <std::mutex> lock(ticket_mutex);
+		this->ticket = ticket;
+	}
+
+	bool hasTicket()
+	{
+		std::lock_guard <std::mutex> lock(ticket_mutex);
+		return !ticket.empty();
+	}
+
+	// Reconnects to the same server with the last ticket, the same key pair and RESUME instead of a new key pair
+	// and LOGIN, so the session (username and room) is back two round trips after connecting, the second
+	// returning the servers challenge with the ticket so a recorded RESUME is refused.
+	// False if the server is unreachable, or refused is set when it will not take the ticket, ex.) it restarted.
+	// The new connection stays on TCP even if the old one used shared memory.
+	bool resume(bool& refused)
+	{
+		refused = false;
+		std::string presented;
+		{
+			std::lock_guard <std::mutex> lock(ticket_mutex);
+			presented = ticket;
+		}
+		if (presented.empty())
 		{
-			char buffer[BUFFER_SIZE];
-			memset(buffer, 0, BUFFER_SIZE); // Zero buffer before receiving response
+			refused = true;
+			return false;
+		}
 
-			int res = recv(clientSock, buffer, sizeof(buffer), 0);
-			if (res == SOCKET_ERROR)
-				throw std::runtime_error("[-] Message not received");
+		SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sock == INVALID_SOCKET)
+			return false;
+		if (connect(sock, (sockaddr*)&server, sizeof(server)) == SOCKET_ERROR)
+		{
+			closesocket(sock);
+			return false;
+		}
 
-			std::vector <unsigned char> encrypted_message(buffer, buffer + res);
-			if (encrypted_message.empty())
-			{
-				throw std::runtime_error("[-] Empty Message received");
-			}
+		// Our key and the challenge request go out without waiting for the servers key, which is known already
+		std::vector<unsigned char> wire(public_key);
+		std::vector<unsigned char> data = protocol::encode(Frame(Opcode::RESUME));
+		protocol::appendEncrypted(wire, util::encrypt(data, server_public_key, secret_key));
+		std::vector<unsigned char> server_pk(crypto_box_PUBLICKEYBYTES);
+		bool keyed = protocol::sendAll(sock, wire.data(), wire.size()) && protocol::recvAll(sock, server_pk.data(), server_pk.size());
+		refused = keyed && server_pk != server_public_key; // A restarted server has new keys and could not open the ticket
+
+		Frame challenge;
+		bool challenged = keyed && !refused && protocol::recvFrame(sock, challenge, server_public_key, secret_key) && challenge.opcode == Opcode::RESUME
+			&& protocol::sendFrame(sock, Frame(Opcode::RESUME, { presented, std::string(challenge.field(0)) }), server_public_key, secret_key);
+
+		Frame result;
+		bool answered = challenged && protocol::recvFrame(sock, result, server_public_key, secret_key) && result.opcode == Opcode::LOGIN_RESULT;
+		if (!answered || static_cast<LoginStatus>(result.byte(0)) != LoginStatus::ACCEPTED)
+		{
+			refused = refused || answered;
+			closesocket(sock);
+			return false;
+		}
 
-			std::vector <unsigned char> decrypted_message = util::decrypt(encrypted_message, server_public_key, secret_key);
-			return std::string(decrypted_message.begin(), decrypted_message.end());
+		SOCKET old;
+		{
+			std::lock_guard <std::mutex> lock(connection_mutex);
+			old = clientSock;
+			clientSock = sock;
+			channel.reset();
 		}
-		catch (std::exception& e)
+		closesocket(old);
+		return true;
+	}
+
+	// Asks the server to move this connection to shared memory, after the key exchange and before LOGIN
+	// Returns false if the server refused, ex.) it is on another machine, or the channel could not be opened,
+	// ex.) the server runs in another session, the connection then stays on TCP
+	bool attachSharedMemory()
+	{
+		sendFrame(Frame(Opcode::LOCAL_ATTACH));
+		Frame answer;
+		if (!recvFrame(answer) || answer.opcode != Opcode::LOCAL_ATTACH)
+			throw std::runtime_error("[-] Connection closed during login");
+		if (answer.fields.empty())
+			return false;
+
+		std::shared_ptr<SharedChannel> opened = std::make_shared<SharedChannel>();
+		if (!opened->open(std::string(answer.field(0)), clientSock))
 		{
-			return "";
+			sendFrame(Frame(Opcode::LOCAL_ATTACH, { protocol::byteField(0) }));
+			return false;
 		}
+		sendFrame(Frame(Opcode::LOCAL_ATTACH, { protocol::byteField(1) })); // The server switches once it reads this
+		std::lock_guard <std::mutex> lock(connection_mutex);
+		channel = opened;
+		return true;
 	}
 
 };
@@ -3,15 +3,17 @@
 
 #include "ThreadPool.h"
 #include "Client.h"
+#include "Commands.h"
+#include "HdrHistogram.h"
 
 class ClientChatRoom
 {
 private:
 
 	Client client;
+	MemberList members; // Current rooms members, only touched by recvMessageLoop
 
 	std::string uploadFile;
-	std::vector <std::string> commands = { "/sys","/upload","/whisper","/commands", "/users", "/quit"};
 
 	std::mutex shutdownMutex;
 	std::mutex transfer_mutex;
@@ -22,6 +24,14 @@ private:
 	std::atomic <bool> fileTransfer = false;
 	std::atomic <bool> transferComplete = false;
 	std::atomic <bool> decided = false;
+	std::atomic <bool> stampMessages = false; // /latency on, chats and whispers carry a send timestamp
+	bool sameHost = false; // The server is on this machine, set by login, so its timestamps are on our clock
+
+	// Microseconds per hop of timestamped frames received, recorded by recvMessageLoop
+	HdrHistogram uplinkLatency; // Sender -> server
+	HdrHistogram serverLatency; // Server receive -> server write
+	HdrHistogram downlinkLatency; // Server write -> us
+	HdrHistogram endToEndLatency; // Sender -> us
 
 	std::condition_variable shutdownCondition;
 	std::condition_variable transfer_condition;
@@ -29,6 +39,9 @@ private:
 
 	ThreadPool threadPool;
 
+	static const unsigned RECONNECT_ATTEMPTS = 6;
+	static const unsigned RECONNECT_FIRST_MS = 250; // Doubles after each failed attempt
+
 	void signalShutdown()
 	{
 		shouldQuit = true;
@@ -57,23 +70,60 @@ private:
 		std::cout << "\n> ";
 	}
 
+	// The servers own hop is always on one clock, the others only when the server is on this machine,
+	// and the sender hops only when the sender is on it too, which the server marks with LOCAL_SENDER
+	void recordLatency(const Frame& frame, uint64_t arrived)
+	{
+		const Timestamps& t = frame.stamps;
+		if (t.forwarded < t.received || t.received == 0)
+			return;
+		serverLatency.record(t.forwarded - t.received);
+
+		if (!sameHost)
+			return;
+		downlinkLatency.record(arrived - std::min(t.forwarded, arrived));
+		if (!(frame.flags & LOCAL_SENDER) || t.sent == 0)
+			return;
+		uplinkLatency.record(t.received - std::min(t.sent, t.received));
+		endToEndLatency.record(arrived - std::min(t.sent, arrived));
+	}
+
+	// /latency on, /latency off, or /latency for the percentiles so far
+	void latencyCMD(std::string_view arg)
+	{
+		while (!arg.empty() && arg.back() == ' ')
+			arg.remove_suffix(1);
+		if (arg == "on" || arg == "off")
+		{
+			stampMessages = arg == "on";
+			util::print(stampMessages ? "[*] Timestamping Messages" : "[*] Stopped Timestamping Messages");
+			return;
+		}
+
+		std::string str = "Latency (us, same host clocks only except server)\n-------\n";
+		str += "uplink:     " + uplinkLatency.summary("us") + "\n";
+		str += "server:     " + serverLatency.summary("us") + "\n";
+		str += "downlink:   " + downlinkLatency.summary("us") + "\n";
+		str += "end to end: " + endToEndLatency.summary("us");
+		util::print(str);
+	}
+
 	// Handles outgoing messages
 	void handleOutgoingMessage(std::string& message)
 	{
 		try
 		{
-			if (message.find("/quit") != std::string::npos)
+			util::MessageView msg = util::parseText(message);
+			switch (commands::lookup(msg.command, CLIENT_SCOPE))
 			{
-				client.sendMessage(message);
+			case Command::QUIT:
+				client.sendFrame(Frame(Opcode::QUIT));
 				signalShutdown();
 				return;
-			}
-			if (message.find("/sys") != std::string::npos)
-			{
+			case Command::SYS:
 				systemCMD(message);
 				return;
-			}
-			if (message.find("/upload") != std::string::npos)
+			case Command::UPLOAD:
 			{
 				if (message.find_last_of('.') == std::string::npos || message.find_last_of('.') == message.length() - 1)
 				{
@@ -81,25 +131,36 @@ private:
 					util::print(str);
 					return;
 				}
-				std::string str = client.getUsername() + message;
-				std::string filename = util::getMessage(str);
-				str = message + util::getFileSize(filename);
-				client.sendMessage(str);
-				send_fileTransfer(message);
+				std::string filename(msg.body);
+				client.sendFrame(Frame(Opcode::TRANSFER_OFFER, { std::string(msg.target), filename, util::getFileSize(filename) }));
+				send_fileTransfer(filename);
+				return;
 			}
-			else
+			case Command::WHISPER:
 			{
-				std::string str = client.getUsername() + message;
-				str = util::getCommand(str);
-				if (str.find("/") != std::string::npos && util::search(commands, str) == nullptr)
-				{
-					str = "[!] Command Not Found";
-					util::print(str);
-					return;
-				}
-				client.sendMessage(message);
+				Frame whisper(Opcode::WHISPER, { std::string(msg.target), std::string(msg.body) });
+				if (stampMessages)
+					protocol::stamp(whisper);
+				client.sendFrame(whisper);
+				return;
+			}
+			case Command::LATENCY:
+				latencyCMD(msg.target);
+				return;
+			case Command::UNKNOWN:
+				util::print("[!] Command Not Found");
+				return;
+			case Command::NONE:
+			{
+				Frame chat(Opcode::CHAT, { message });
+				if (stampMessages)
+					protocol::stamp(chat);
+				client.sendFrame(chat);
+				return;
+			}
+			default:
+				client.sendFrame(Frame(Opcode::COMMAND, { message }));
 			}
-			
 		}
 		catch (std::exception& e)
 		{
@@ -110,13 +171,12 @@ private:
 		}
 	}
 
-	void send_fileTransfer(std::string& message)
+	void send_fileTransfer(const std::string& fileName)
 	{
 		std::unique_lock <std::mutex> lock(transfer_mutex);
 
 		fileTransfer = true;
-		message = client.getUsername() + message;
-		setUploadFileName(util::getMessage(message));
+		setUploadFileName(fileName);
 		transfer_condition.wait(lock, [this] {return decided.load(); }); // Wait for transfer to complete
 		decided = false;
 
@@ -130,28 +190,32 @@ private:
 		transfer_complete_condition.notify_one();
 	}
 
-	void receive_fileTransfer(const std::string& message)
+	void receive_fileTransfer(const Frame& offer)
 	{
 		std::unique_lock <std::mutex> lock(transfer_mutex);
 
-		util::print(message);
+		util::print(protocol::render(offer));
 		fileTransfer = true;
 		transfer_condition.wait(lock, [this] {return decided.load(); }); // Wait for decision
 		decided = false;
 
 		if (fileTransfer) // Transfer approved
 		{
-			std::string response = "$Yes";
-			client.sendMessage(response);
+			client.sendFrame(Frame(Opcode::TRANSFER_DECISION, { protocol::byteField(1) }));
 
-			response = client.recvMessage();
-			util::print(response);
-			client.downloadFile();
+			Frame result;
+			if (client.recvFrame(result))
+			{
+				util::print(protocol::render(result));
+				if (result.opcode == Opcode::TRANSFER_RESULT && static_cast<TransferResult>(result.byte(0)) == TransferResult::APPROVED)
+				{
+					client.downloadFile();
+				}
+			}
 		}
 		else 
 		{
-			std::string response = "$No";
-			client.sendMessage(response);
+			client.sendFrame(Frame(Opcode::TRANSFER_DECISION, { protocol::byteField(0) }));
 		}
 
 		// Unblock sendMessageLoop
@@ -159,28 +223,62 @@ private:
 		transfer_complete_condition.notify_one();
 	}
 
-	// Handles incoming messages
-	void handleIncomingMessage(const std::string& message)
+	// Handles incoming frames
+	void handleIncomingMessage(const Frame& frame)
 	{
 		if (shouldQuit) // Connection closed for other reason
 			return;
-		if (message.find("/end") != std::string::npos) // Host closed server
+
+		switch (frame.opcode)
 		{
-			util::print("[!] Server has been Closed!");
+		case Opcode::SHUTDOWN: // Host closed server
+			util::print(protocol::render(frame));
 			signalShutdown();
 			return;
-		}
-		if (message.find("File Transfer Request:") != std::string::npos)
+		case Opcode::TICKET: // Kept for reconnect
+			client.setTicket(std::string(frame.field(0)));
+			return;
+		case Opcode::TRANSFER_OFFER:
+			receive_fileTransfer(frame);
+			return;
+		case Opcode::PRESENCE: // Only changes to the cached member list are shown
 		{
-			receive_fileTransfer(message);
+			std::string text = protocol::render(members.apply(frame));
+			if (!text.empty())
+				util::print(text);
 			return;
 		}
-		if (fileTransfer && message.find("[-] Transfer Denied"))
+		default:
 		{
-			
+			std::string text = protocol::render(frame);
+			if (!text.empty())
+				util::print(text);
+		}
+		}
+	}
+
+	// Resumes the session after the connection dropped, with backoff while the server is unreachable
+	// False without a ticket or when the server refused it, the client then closes as before
+	bool reconnect()
+	{
+		if (!client.hasTicket())
+			return false;
+
+		util::print("[!] Connection to server lost, reconnecting ...");
+		unsigned delayMs = RECONNECT_FIRST_MS;
+		for (unsigned attempt = 0; attempt < RECONNECT_ATTEMPTS && !shouldQuit; attempt++, delayMs *= 2)
+		{
+			Sleep(delayMs + randombytes_uniform(delayMs)); // Jitter, so clients dropped together do not return together
+			bool refused;
+			if (client.resume(refused))
+			{
+				util::print("[+] Reconnected");
+				return true;
+			}
+			if (refused)
+				break;
 		}
-		else
-			util::print(message);
+		return false;
 	}
 
 	// Receive chats
@@ -188,37 +286,37 @@ private:
 	{
 		try
 		{
-			std::string message;
+			Frame frame;
 			while (!shouldQuit)
 			{
-				message = client.recvMessage();
-				if (message.empty())
-					continue;
-
-				if (fileTransfer)
+				if (!client.recvFrame(frame))
 				{
-					std::unique_lock <std::mutex> lock(transfer_complete_mutex);
-					util::print(message);
-					if (message.find("[+] Transfer Approved") != std::string::npos)
-					{
-						decided = true;
-						fileTransfer = true;
-						transfer_condition.notify_one();
-						transfer_complete_condition.wait(lock, [this] { return transferComplete.load(); }); // wait till transfer is complete
-						transferComplete = false;
-					}
-					else
+					if (!shouldQuit && reconnect())
+						continue;
+					if (!shouldQuit)
 					{
-						decided = true;
-						fileTransfer = false;
-						transfer_condition.notify_one();
-						transfer_complete_condition.wait(lock, [this] { return transferComplete.load(); }); // wait till transfer is complete
-						transferComplete = false;
+						util::print("[!] Connection to server lost");
+						signalShutdown();
 					}
+					return;
+				}
+				if (frame.flags & TIMESTAMPED)
+					recordLatency(frame, protocol::monotonicMicros());
+
+				// Waiting on the recipient of our upload
+				if (fileTransfer && frame.opcode == Opcode::TRANSFER_RESULT)
+				{
+					std::unique_lock <std::mutex> lock(transfer_complete_mutex);
+					util::print(protocol::render(frame));
+					decided = true;
+					fileTransfer = static_cast<TransferResult>(frame.byte(0)) == TransferResult::APPROVED;
+					transfer_condition.notify_one();
+					transfer_complete_condition.wait(lock, [this] { return transferComplete.load(); }); // wait till transfer is complete
+					transferComplete = false;
 					continue;
 				}
 				
-				handleIncomingMessage(message);
+				handleIncomingMessage(frame);
 			}
 		}
 		catch (std::exception& e)
@@ -274,7 +372,7 @@ private:
 	void login()
 	{
 		std::string server_ip;
-		std::string username, response;
+		std::string username;
 		
 		std::cout << "[*] Enter Server's IP: ";
 		std::cin >> server_ip;
@@ -283,6 +381,7 @@ private:
 		Sleep(1000);
 		client.initializeClient();
 		client.connectToServer(server_ip);
+		sameHost = server_ip.rfind("127.", 0) == 0;
 		std::cout << "\033[2K\r[+] Connected!\n";
 
 		if (!util::sodium_startup())
@@ -303,6 +402,11 @@ private:
 			throw std::runtime_error("[-] Failed to send public key");
 		}
 
+		if (server_ip.rfind("127.", 0) == 0 && client.attachSharedMemory()) // Same machine, skip TCP and encryption
+		{
+			util::print("[+] Using Shared Memory");
+		}
+
 		while (true)
 		{
 			std::cout << "[*] Enter Username: ";
@@ -310,15 +414,20 @@ private:
 			username = "</" + username + "> ";
 
 			client.setUsername(username);
-			client.sendMessage("");
-			response = client.recvMessage();
-			if (response == "$Valid")
+			client.sendFrame(Frame(Opcode::LOGIN, { username }));
+
+			Frame result;
+			if (!client.recvFrame(result))
+			{
+				throw std::runtime_error("[-] Connection closed during login");
+			}
+			if (result.opcode == Opcode::LOGIN_RESULT && static_cast<LoginStatus>(result.byte(0)) == LoginStatus::ACCEPTED)
 			{	
 				break;
 			}
 			else
 			{
-				std::cout << response;
+				std::cout << protocol::render(result);
 			}
 		}
 	}
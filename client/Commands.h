@@ -0,0 +1,161 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum class Command : uint8_t
+{
+	NONE = 0x00, UNKNOWN = 0x01, SYS = 0x02, UPLOAD = 0x03,
+	WHISPER = 0x04, COMMANDS = 0x05, USERS = 0x06, END = 0x07,
+	QUIT = 0x08, JOIN = 0x09, LEAVE = 0x0A, ROOMS = 0x0B, SEARCH = 0x0C,
+	STATS = 0x0D, TRACE = 0x0E, LOCKS = 0x0F, LATENCY = 0x10, CAPTURE = 0x11,
+};
+
+// Who may issue a command
+enum CommandScope : uint8_t
+{
+	HOST_SCOPE = 0x01, CLIENT_SCOPE = 0x02, ANY_SCOPE = 0x03,
+};
+
+struct CommandInfo
+{
+	std::string_view name;
+	Command command;
+	uint8_t scope;
+	std::string_view help;
+};
+
+namespace commands
+{
+	// Every command the chat room understands, also drives the /commands listing (in this order)
+	constexpr CommandInfo TABLE[] =
+	{
+		{ "/whisper",  Command::WHISPER,  ANY_SCOPE,    "Direct message a user by username(</recipient>)" },
+		{ "/users",    Command::USERS,    ANY_SCOPE,    "List all users" },
+		{ "/sys",      Command::SYS,      ANY_SCOPE,    "Execute an OS command(ex. /sys dir)" },
+		{ "/upload",   Command::UPLOAD,   ANY_SCOPE,    "Upload file to another user" },
+		{ "/join",     Command::JOIN,     ANY_SCOPE,    "Join or create a room(ex. /join dev)" },
+		{ "/leave",    Command::LEAVE,    ANY_SCOPE,    "Leave the current room for the lobby" },
+		{ "/rooms",    Command::ROOMS,    ANY_SCOPE,    "List all rooms" },
+		{ "/search",   Command::SEARCH,   ANY_SCOPE,    "Search the chat history(ex. /search release notes)" },
+		{ "/commands", Command::COMMANDS, ANY_SCOPE,    "List all commands" },
+		{ "/stats",    Command::STATS,    HOST_SCOPE,   "Show server metrics" },
+		{ "/locks",    Command::LOCKS,    HOST_SCOPE,   "Show lock contention, most waited on first" },
+		{ "/trace",    Command::TRACE,    HOST_SCOPE,   "Trace hot paths(/trace on, /trace off, /trace dump file.json)" },
+		{ "/capture",  Command::CAPTURE,  HOST_SCOPE,   "Record client traffic for benchmarks/replay(/capture start file.cap, /capture stop)" },
+		{ "/end",      Command::END,      HOST_SCOPE,   "Close the server" },
+		{ "/latency",  Command::LATENCY,  CLIENT_SCOPE, "Timestamp your messages and show delivery latency(/latency on, /latency off, /latency)" },
+		{ "/quit",     Command::QUIT,     CLIENT_SCOPE, "Leave the chatroom" },
+	};
+
+	constexpr size_t COUNT = sizeof(TABLE) / sizeof(TABLE[0]);
+	constexpr size_t SLOTS = 64; // Power of two
+	constexpr uint8_t EMPTY_SLOT = 0xFF;
+	constexpr uint32_t NO_SEED = 0xFFFFFFFF;
+
+	// FNV-1a, the seed is mixed into the offset basis
+	constexpr uint32_t hash(std::string_view str, uint32_t seed)
+	{
+		uint32_t h = 2166136261u ^ seed;
+		for (char c : str)
+		{
+			h ^= static_cast<uint8_t>(c);
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	constexpr bool collisionFree(uint32_t seed)
+	{
+		bool used[SLOTS] = {};
+		for (size_t i = 0; i < COUNT; i++)
+		{
+			size_t slot = hash(TABLE[i].name, seed) & (SLOTS - 1);
+			if (used[slot])
+				return false;
+			used[slot] = true;
+		}
+		return true;
+	}
+
+	// Searches for a seed that gives every name its own slot, making the hash perfect for this table
+	constexpr uint32_t findSeed()
+	{
+		for (uint32_t seed = 0; seed < 4096; seed++)
+		{
+			if (collisionFree(seed))
+				return seed;
+		}
+		return NO_SEED;
+	}
+
+	constexpr uint32_t SEED = findSeed();
+	static_assert(SEED != NO_SEED, "No perfect hash seed found for the command table, increase SLOTS");
+
+	constexpr size_t slotOf(std::string_view name)
+	{
+		return hash(name, SEED) & (SLOTS - 1);
+	}
+
+	// Maps hash slot -> TABLE index, built at compile time
+	constexpr std::array<uint8_t, SLOTS> buildIndex()
+	{
+		std::array<uint8_t, SLOTS> index{};
+		for (size_t i = 0; i < SLOTS; i++)
+			index[i] = EMPTY_SLOT;
+		for (size_t i = 0; i < COUNT; i++)
+			index[slotOf(TABLE[i].name)] = static_cast<uint8_t>(i);
+		return index;
+	}
+
+	constexpr std::array<uint8_t, SLOTS> INDEX = buildIndex();
+
+	// First space delimited word of text, ex.) "/whisper </j> hi" -> "/whisper"
+	constexpr std::string_view token(std::string_view text)
+	{
+		size_t end = text.find(' ');
+		return end == std::string_view::npos ? text : text.substr(0, end);
+	}
+
+	// NONE for plain chat, UNKNOWN for a '/' token missing from the table
+	constexpr const CommandInfo* find(std::string_view tok)
+	{
+		uint8_t i = INDEX[slotOf(tok)];
+		if (i != EMPTY_SLOT && TABLE[i].name == tok)
+			return &TABLE[i];
+		return nullptr;
+	}
+
+	constexpr Command lookup(std::string_view tok, uint8_t scope)
+	{
+		if (tok.empty() || tok[0] != '/')
+			return Command::NONE;
+
+		const CommandInfo* info = find(tok);
+		if (info == nullptr || !(info->scope & scope))
+			return Command::UNKNOWN;
+		return info->command;
+	}
+
+	static_assert(lookup("/whisper", CLIENT_SCOPE) == Command::WHISPER, "Command table lookup broken");
+	static_assert(lookup("hello", CLIENT_SCOPE) == Command::NONE, "Command table lookup broken");
+	static_assert(lookup("/end", CLIENT_SCOPE) == Command::UNKNOWN, "Command table lookup broken");
+
+	// Help listing for /commands
+	inline std::string listing(uint8_t scope)
+	{
+		std::string cmds = "Commands\n--------\n";
+		for (const CommandInfo& info : TABLE)
+		{
+			if (!(info.scope & scope))
+				continue;
+			cmds += std::string(info.name) + ": " + std::string(info.help) + "\n";
+		}
+		return cmds;
+	}
+}
+
+#endif
@@ -0,0 +1,337 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Console and file output for every thread, behind util::print, debug_log and log_error
+// A caller formats its line and pushes it onto a lock free multi producer queue, one writer thread drains
+// the queue and writes each batch with a single console write and a single file write. Logging never waits
+// on the console, the disk or another logging thread, only on the allocation of its record. If the writer
+// falls MAX_PENDING records behind, new records are dropped and counted instead of queued.
+namespace logging
+{
+	enum class Level : uint8_t
+	{
+		PRINT = 0x01, // Chat and command output, redraws the "> " prompt after it
+		RAW = 0x02, // Written as is, ex.) a prompt without a newline
+		DEBUG_LOG = 0x03,
+		ERROR_LOG = 0x04,
+	};
+
+	struct Record
+	{
+		std::atomic <Record*> next = nullptr;
+		Level level = Level::RAW;
+		std::string text;
+		std::chrono::system_clock::time_point time;
+	};
+
+	class Logger
+	{
+	private:
+		// Intrusive MPSC queue (Vyukov), producers swap themselves in at head, the writer pops from tail
+		std::atomic <Record*> head;
+		Record* tail;
+		Record stub;
+
+		std::atomic <size_t> pending = 0;
+		std::atomic <uint64_t> pushed = 0;
+		std::atomic <uint64_t> written = 0;
+		std::atomic <uint64_t> dropped = 0;
+		uint64_t reportedDropped = 0; // Writer only
+
+		std::ostream* console;
+		std::ofstream file; // Writer only once open
+		std::string pendingPath;
+		std::mutex file_mutex; // Guards pendingPath, never taken by producers
+
+		std::thread writer;
+		std::atomic <bool> running = true;
+		std::atomic <bool> sleeping = false;
+		std::mutex wake_mutex;
+		std::condition_variable wake_condition;
+		std::mutex flushed_mutex;
+		std::condition_variable flushed_condition;
+
+		void push(Record* record)
+		{
+			record->next.store(nullptr, std::memory_order_relaxed);
+			Record* prev = head.exchange(record, std::memory_order_acq_rel);
+			prev->next.store(record, std::memory_order_release);
+		}
+
+		// nullptr when empty or when a producer is between its two steps, the record is picked up next pass
+		Record* pop()
+		{
+			Record* current = tail;
+			Record* next = current->next.load(std::memory_order_acquire);
+			if (current == &stub)
+			{
+				if (next == nullptr)
+					return nullptr;
+				tail = next;
+				current = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next != nullptr)
+			{
+				tail = next;
+				return current;
+			}
+			if (current != head.load(std::memory_order_acquire))
+				return nullptr;
+
+			push(&stub);
+			next = current->next.load(std::memory_order_acquire);
+			if (next != nullptr)
+			{
+				tail = next;
+				return current;
+			}
+			return nullptr;
+		}
+
+		static void appendTime(std::string& out, std::chrono::system_clock::time_point time)
+		{
+			std::time_t seconds = std::chrono::system_clock::to_time_t(time);
+			std::tm local{};
+#ifdef _WIN32
+			localtime_s(&local, &seconds);
+#else
+			localtime_r(&seconds, &local);
+#endif
+			char stamp[40];
+			size_t len = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+			int ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000);
+			std::snprintf(stamp + len, sizeof(stamp) - len, ".%03d ", ms);
+			out += stamp;
+		}
+
+		// The text without terminal control, ex.) "\033[2K\r[+] Upload Complete\n> " -> "[+] Upload Complete"
+		static void appendPlain(std::string& lines, const Record& record)
+		{
+			std::string text;
+			for (size_t i = 0; i < record.text.size(); i++)
+			{
+				if (record.text.compare(i, 4, "\033[2K") == 0)
+					i += 3;
+				else if (record.text[i] != '\r')
+					text += record.text[i];
+			}
+			if (text.size() >= 2 && text.compare(text.size() - 2, 2, "> ") == 0)
+				text.resize(text.size() - 2);
+			while (!text.empty() && (text.back() == '\n' || text.front() == '\n'))
+				text.erase(text.back() == '\n' ? text.size() - 1 : 0, 1);
+			if (text.empty())
+				return;
+
+			appendTime(lines, record.time);
+			lines += text + "\n";
+		}
+
+		void format(const Record& record, std::string& screen, std::string& lines)
+		{
+			switch (record.level)
+			{
+			case Level::PRINT:
+				screen += "\033[2K\r" + record.text + "\n> ";
+				break;
+			case Level::RAW:
+				screen += record.text;
+				break;
+			case Level::DEBUG_LOG:
+				screen += "\n[*] " + record.text + "\n";
+				break;
+			case Level::ERROR_LOG:
+				screen += "\n[-] " + record.text + "\n";
+				break;
+			}
+
+			if (file.is_open())
+				appendPlain(lines, record);
+		}
+
+		void openPendingFile()
+		{
+			std::lock_guard <std::mutex> lock(file_mutex);
+			if (pendingPath.empty())
+				return;
+			if (file.is_open())
+				file.close();
+			file.open(pendingPath, std::ios::binary | std::ios::app);
+			pendingPath.clear();
+		}
+
+		void writerLoop()
+		{
+			std::string screen, lines;
+			while (true)
+			{
+				openPendingFile();
+
+				uint64_t batch = 0;
+				Record* record;
+				while ((record = pop()) != nullptr)
+				{
+					format(*record, screen, lines);
+					delete record;
+					batch++;
+				}
+
+				if (batch == 0)
+				{
+					if (!running)
+						return;
+
+					// Producers seeing sleeping take wake_mutex before notifying, so a push between the
+					// check and the wait still wakes us
+					std::unique_lock <std::mutex> lock(wake_mutex);
+					sleeping.store(true);
+					record = pop();
+					if (record == nullptr)
+						wake_condition.wait_for(lock, std::chrono::milliseconds(IDLE_WAIT_MS));
+					sleeping.store(false);
+					if (record != nullptr)
+					{
+						lock.unlock();
+						format(*record, screen, lines);
+						delete record;
+						batch++;
+					}
+					else
+					{
+						continue;
+					}
+				}
+
+				uint64_t lost = dropped.load(std::memory_order_relaxed);
+				if (lost != reportedDropped)
+				{
+					screen += "\033[2K\r[!] " + std::to_string(lost - reportedDropped) + " Log Lines Dropped\n> ";
+					reportedDropped = lost;
+				}
+
+				console->write(screen.data(), screen.size());
+				console->flush();
+				if (file.is_open() && !lines.empty())
+				{
+					file.write(lines.data(), lines.size());
+					file.flush();
+				}
+				screen.clear();
+				lines.clear();
+
+				pending.fetch_sub(batch, std::memory_order_relaxed);
+				written.fetch_add(batch, std::memory_order_release);
+				{
+					std::lock_guard <std::mutex> lock(flushed_mutex);
+				}
+				flushed_condition.notify_all();
+			}
+		}
+
+	public:
+		static const size_t MAX_PENDING = 1 << 16;
+		static constexpr unsigned IDLE_WAIT_MS = 100; // constexpr, wait_for binds it by reference
+
+		Logger(std::ostream& console = std::cout) : head(&stub), tail(&stub), console(&console)
+		{
+			writer = std::thread(&Logger::writerLoop, this);
+		}
+
+		// Writes everything queued before returning
+		~Logger()
+		{
+			running = false;
+			{
+				std::lock_guard <std::mutex> lock(wake_mutex);
+			}
+			wake_condition.notify_one();
+			writer.join();
+		}
+
+		Logger(const Logger&) = delete;
+		Logger& operator=(const Logger&) = delete;
+
+		// Queues text for the writer, false when it was dropped because the writer is too far behind
+		bool write(Level level, std::string text)
+		{
+			if (pending.fetch_add(1, std::memory_order_relaxed) >= MAX_PENDING)
+			{
+				pending.fetch_sub(1, std::memory_order_relaxed);
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+
+			Record* record = new Record();
+			record->level = level;
+			record->text = std::move(text);
+			record->time = std::chrono::system_clock::now();
+			pushed.fetch_add(1, std::memory_order_relaxed);
+			push(record);
+
+			if (sleeping.load())
+			{
+				{
+					std::lock_guard <std::mutex> lock(wake_mutex);
+				}
+				wake_condition.notify_one();
+			}
+			return true;
+		}
+
+		// Also appends every record to path, with a timestamp per line, from the next batch on
+		void openFile(const std::string& path)
+		{
+			{
+				std::lock_guard <std::mutex> lock(file_mutex);
+				pendingPath = path;
+			}
+			write(Level::RAW, ""); // Wakes the writer to open it
+		}
+
+		// Blocks until everything queued before the call is written, ex.) before exiting or reading stdin
+		void flush()
+		{
+			uint64_t target = pushed.load();
+			std::unique_lock <std::mutex> lock(flushed_mutex);
+			flushed_condition.wait(lock, [this, target] { return written.load(std::memory_order_acquire) >= target; });
+		}
+
+		uint64_t getDropped() const
+		{
+			return dropped.load(std::memory_order_relaxed);
+		}
+
+		size_t getPending() const
+		{
+			return pending.load(std::memory_order_relaxed);
+		}
+	};
+
+	// Never destroyed, threads still running during exit can keep logging, everything queued
+	// before exit is written by an atexit handler
+	Logger& logger()
+	{
+		static Logger* instance = []
+		{
+			Logger* logger = new Logger();
+			std::atexit([] { logging::logger().flush(); });
+			return logger;
+		}();
+		return *instance;
+	}
+}
+
+#endif
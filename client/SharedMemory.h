@@ -0,0 +1,322 @@
+#ifndef SHAREDMEMORY_H
+#define SHAREDMEMORY_H
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include "Protocol.h"
+
+// Frames between a client and a server on the same machine through two single producer, single consumer
+// byte rings in one named file mapping, instead of TCP and crypto_box. The connection starts over TCP as
+// usual. A client that sends LOCAL_ATTACH before LOGIN is answered with a channel name, and from then on
+// both sides read and write the rings. The TCP connection stays open and idle, its closing is how either
+// side learns the other is gone.
+//
+// Mapping: [Ring up][up bytes][Ring down][down bytes], up carries client -> server
+// Ring data: [u32 length][frame] as on the wire, unencrypted
+// The writer advances head and the reader tail, both only grow and index modulo capacity. A side that runs
+// out of work spins for SPIN_ITERATIONS, then sets its waiting flag, checks again and sleeps on a named
+// auto reset event. The other side only signals the event when the flag is set, so a busy ring makes no
+// system calls.
+// Either side can scribble over the mapping, so a Ring's capacity is read at most once, by the client when it
+// maps, and each side keeps its own copy. Only head and tail are read after that, and a pair further apart
+// than the capacity closes the channel.
+class SharedChannel
+{
+private:
+	struct Ring
+	{
+		alignas(64) std::atomic <uint64_t> head; // Bytes ever written
+		alignas(64) std::atomic <uint64_t> tail; // Bytes ever read
+		alignas(64) std::atomic <uint32_t> readerWaiting;
+		std::atomic <uint32_t> writerWaiting;
+		std::atomic <uint32_t> closed;
+		uint32_t capacity;
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring counters are shared between processes");
+
+	// One direction, as this side sees it
+	struct End
+	{
+		Ring* ring = nullptr;
+		unsigned char* bytes = nullptr;
+		uint64_t capacity = 0; // Local copy, never reread from ring
+		HANDLE dataEvent = NULL; // Set by the writer, waited on by the reader
+		HANDLE spaceEvent = NULL; // Set by the reader, waited on by the writer
+	};
+
+	HANDLE mapping = NULL;
+	unsigned char* view = nullptr;
+	End in, out;
+	SOCKET lifeline = INVALID_SOCKET;
+	std::mutex send_mutex; // Several client threads send, ex.) a transfer decision from the receive thread
+
+	static size_t ringSize(size_t capacity)
+	{
+		return sizeof(Ring) + (capacity + 63) / 64 * 64;
+	}
+
+	static bool openEvents(End& end, const std::string& name, bool create)
+	{
+		std::string data = name + "_data", space = name + "_space";
+		end.dataEvent = create ? CreateEventA(NULL, FALSE, FALSE, data.c_str()) : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, data.c_str());
+		end.spaceEvent = create ? CreateEventA(NULL, FALSE, FALSE, space.c_str()) : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, space.c_str());
+		return end.dataEvent != NULL && end.spaceEvent != NULL;
+	}
+
+	// Nothing is sent over the TCP connection once attached, so readable means it closed
+	bool lifelineOpen()
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(lifeline, &readable);
+		timeval now{ 0, 0 };
+		if (select(1, &readable, NULL, NULL, &now) == 0)
+			return true;
+
+		char byte;
+		return ::recv(lifeline, &byte, 1, MSG_PEEK) > 0;
+	}
+
+	// Waits until ready() or the channel closes, false on close
+	template <typename Ready>
+	bool await(Ring* ring, std::atomic <uint32_t>& waiting, HANDLE event, Ready&& ready)
+	{
+		for (unsigned i = 0; i < SPIN_ITERATIONS; i++)
+		{
+			if (ready())
+				return true;
+		}
+
+		while (true)
+		{
+			waiting.store(1);
+			if (ready())
+			{
+				waiting.store(0);
+				return true;
+			}
+			if (ring->closed.load())
+				return false;
+			if (WaitForSingleObject(event, WAIT_MS) == WAIT_TIMEOUT && !lifelineOpen())
+				return false;
+		}
+	}
+
+	// The other side is asleep on event once it set waiting
+	static void wake(std::atomic <uint32_t>& waiting, HANDLE event)
+	{
+		if (waiting.load() != 0 && waiting.exchange(0) != 0)
+			SetEvent(event);
+	}
+
+	bool write(const unsigned char* data, size_t size)
+	{
+		Ring* ring = out.ring;
+		uint64_t capacity = out.capacity;
+		while (size > 0)
+		{
+			uint64_t head = ring->head.load(std::memory_order_relaxed);
+			if (!await(ring, ring->writerWaiting, out.spaceEvent, [&] { return head - ring->tail.load() < capacity || ring->closed.load(); }))
+				return false;
+			uint64_t used = head - ring->tail.load();
+			if (ring->closed.load() || used > capacity)
+				return false;
+
+			size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, capacity - used));
+			size_t offset = static_cast<size_t>(head % capacity);
+			size_t first = std::min<size_t>(chunk, static_cast<size_t>(capacity) - offset);
+			std::memcpy(out.bytes + offset, data, first);
+			std::memcpy(out.bytes, data + first, chunk - first);
+			ring->head.store(head + chunk);
+			wake(ring->readerWaiting, out.dataEvent);
+			data += chunk;
+			size -= chunk;
+		}
+		return true;
+	}
+
+	bool read(unsigned char* data, size_t size)
+	{
+		Ring* ring = in.ring;
+		uint64_t capacity = in.capacity;
+		while (size > 0)
+		{
+			uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			if (!await(ring, ring->readerWaiting, in.dataEvent, [&] { return ring->head.load() != tail; }))
+				return false;
+			uint64_t available = ring->head.load() - tail;
+			if (available > capacity)
+				return false;
+
+			size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, available));
+			size_t offset = static_cast<size_t>(tail % capacity);
+			size_t first = std::min<size_t>(chunk, static_cast<size_t>(capacity) - offset);
+			std::memcpy(data, in.bytes + offset, first);
+			std::memcpy(data + first, in.bytes, chunk - first);
+			ring->tail.store(tail + chunk);
+			wake(ring->writerWaiting, in.spaceEvent);
+			data += chunk;
+			size -= chunk;
+		}
+		return true;
+	}
+
+	// The server passes the capacity it created the rings with, the client reads it from the mapping
+	bool map(const std::string& name, bool server, size_t capacity)
+	{
+		view = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+		if (view == nullptr)
+			return false;
+
+		if (!server)
+		{
+			MEMORY_BASIC_INFORMATION region;
+			capacity = reinterpret_cast<Ring*>(view)->capacity;
+			if (VirtualQuery(view, &region, sizeof(region)) == 0 || capacity < protocol::MAX_FRAME_SIZE || 2 * ringSize(capacity) > region.RegionSize)
+				return false;
+		}
+
+		End up, down;
+		up.ring = reinterpret_cast<Ring*>(view);
+		up.bytes = view + sizeof(Ring);
+		down.ring = reinterpret_cast<Ring*>(view + ringSize(capacity));
+		down.bytes = reinterpret_cast<unsigned char*>(down.ring) + sizeof(Ring);
+		up.capacity = down.capacity = capacity;
+		if (!openEvents(up, name + "_up", server) || !openEvents(down, name + "_down", server))
+			return false;
+
+		in = server ? up : down;
+		out = server ? down : up;
+		return true;
+	}
+
+	void closeEvents(End& end)
+	{
+		if (end.dataEvent != NULL)
+			CloseHandle(end.dataEvent);
+		if (end.spaceEvent != NULL)
+			CloseHandle(end.spaceEvent);
+		end = End();
+	}
+
+public:
+	static const size_t DEFAULT_CAPACITY = 1024 * 1024; // Per direction
+	static constexpr size_t MAX_CAPACITY = 1024 * 1024 * 1024; // Ring::capacity is 32 bits
+	static const unsigned SPIN_ITERATIONS = 2000; // Checks before sleeping, waking a sleeper costs far more
+	static const unsigned WAIT_MS = 100; // Sleeps are cut short to check the lifeline
+
+	SharedChannel()
+	{
+	}
+
+	~SharedChannel()
+	{
+		close();
+		closeEvents(in);
+		closeEvents(out);
+		if (view != nullptr)
+			UnmapViewOfFile(view);
+		if (mapping != NULL)
+			CloseHandle(mapping);
+	}
+
+	SharedChannel(const SharedChannel&) = delete;
+	SharedChannel& operator=(const SharedChannel&) = delete;
+
+	// Server side, name should be unguessable, ex.) Local\chat_50000_<random hex>
+	bool create(const std::string& name, size_t capacity, SOCKET lifeline)
+	{
+		capacity = std::clamp<size_t>(capacity, protocol::MAX_FRAME_SIZE, MAX_CAPACITY);
+		uint64_t total = 2 * static_cast<uint64_t>(ringSize(capacity));
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(total >> 32), static_cast<DWORD>(total), name.c_str());
+		if (mapping == NULL || GetLastError() == ERROR_ALREADY_EXISTS)
+			return false;
+
+		view = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+		if (view == nullptr)
+			return false;
+		for (size_t offset : { size_t(0), ringSize(capacity) })
+		{
+			Ring* ring = new (view + offset) Ring();
+			ring->capacity = static_cast<uint32_t>(capacity);
+		}
+		UnmapViewOfFile(view);
+
+		this->lifeline = lifeline;
+		return map(name, true, capacity);
+	}
+
+	// Client side, name as the server sent it in LOCAL_ATTACH
+	bool open(const std::string& name, SOCKET lifeline)
+	{
+		mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+		if (mapping == NULL)
+			return false;
+
+		this->lifeline = lifeline;
+		return map(name, false, 0);
+	}
+
+	// wire holds whole [u32 length][frame] records, ex.) an outbox batch
+	bool send(const std::vector<unsigned char>& wire)
+	{
+		std::lock_guard <std::mutex> lock(send_mutex);
+		return out.ring != nullptr && write(wire.data(), wire.size());
+	}
+
+	bool sendFrame(const Frame& frame)
+	{
+		std::vector<unsigned char> wire;
+		appendFrame(wire, protocol::encode(frame));
+		return send(wire);
+	}
+
+	// Reads one frame, still encoded, false once the channel or the lifeline closed
+	bool recv(std::vector<unsigned char>& data)
+	{
+		uint32_t length;
+		if (in.ring == nullptr || !read(reinterpret_cast<unsigned char*>(&length), 4))
+			return false;
+
+		length = ntohl(length);
+		if (length < protocol::HEADER_SIZE || length > protocol::MAX_FRAME_SIZE)
+			return false;
+		data.resize(length);
+		return read(data.data(), data.size());
+	}
+
+	bool recvFrame(Frame& frame)
+	{
+		std::vector<unsigned char> data;
+		return recv(data) && protocol::decode(data.data(), data.size(), frame);
+	}
+
+	// Both directions, either side may call it, the other wakes and sees the channel closed
+	void close()
+	{
+		for (End* end : { &in, &out })
+		{
+			if (end->ring == nullptr)
+				continue;
+			end->ring->closed.store(1);
+			SetEvent(end->dataEvent);
+			SetEvent(end->spaceEvent);
+		}
+	}
+
+	// Appends an encoded frame and its length prefix to wire, several frames can share one send
+	static void appendFrame(std::vector<unsigned char>& wire, const std::vector<unsigned char>& data)
+	{
+		protocol::appendEncrypted(wire, data); // Only adds the prefix
+	}
+};
+
+#endif
@@ -6,38 +6,34 @@
 #include <string>
 #include <Winsock2.h>
 #include <sstream>
+#include <string_view>
 #include <iomanip>
+#include "Log.h"
 
 #define SODIUM_STATIC
 #include <sodium.h>
 
 namespace util 
 {
-	std::mutex print_mutex;
-
+	// Output is queued for the log writer thread and never blocks the caller, see Log.h
 	void debug_log(std::string msg)
 	{
-		std::lock_guard <std::mutex> lock(print_mutex);
-		std::cout << "\n[*] " << msg << "\n";
+		logging::logger().write(logging::Level::DEBUG_LOG, std::move(msg));
 	}
 
 	void log_error(std::string msg)
 	{
-		std::lock_guard <std::mutex> lock(print_mutex);
-		std::cout << "\n[-] " << msg << "\n";
+		logging::logger().write(logging::Level::ERROR_LOG, std::move(msg));
 	}
 
 	void print(std::string message)
 	{
-		std::lock_guard <std::mutex> lock(print_mutex);
-		std::cout << "\033[2K\r";
-		std::cout << message << "\n> ";
+		logging::logger().write(logging::Level::PRINT, std::move(message));
 	}
 
 	void print(std::string message, int temp)
 	{
-		std::lock_guard <std::mutex> lock(print_mutex);
-		std::cout << message;
+		logging::logger().write(logging::Level::RAW, std::move(message));
 	}
 
 	template <typename T>
@@ -51,24 +47,58 @@ namespace util
 		return nullptr;
 	}
 
-	//</j> /whisper </i> testing
-	std::string getCommand(const std::string& message)
+	// Fields of a chat message, views into the original buffer
+	// ex.) "</j> /whisper </i> hi" -> sender "</j> ", command "/whisper", target "</i> ", body "hi"
+	struct MessageView
+	{
+		std::string_view sender;  // Includes the trailing space, matching stored usernames
+		std::string_view command; // Empty for plain chat
+		std::string_view target;  // Word after the command, includes the trailing space if present
+		std::string_view body;    // Everything after the target, or the whole text for plain chat
+	};
+
+	// Parses text without a sender prefix, ex.) what the host or a client typed
+	MessageView parseText(std::string_view text)
 	{
-		int start = message.find(' ');
-		int end = message.find(' ', start+1);
-		std::string command = message.substr(start + 1, end - start - 1); // /command
-		return command;
+		MessageView view;
+		if (text.empty() || text[0] != '/')
+		{
+			view.body = text;
+			return view;
+		}
+
+		size_t end = text.find(' ');
+		if (end == std::string_view::npos)
+		{
+			view.command = text;
+			return view;
+		}
+		view.command = text.substr(0, end);
+
+		size_t start = end + 1;
+		end = text.find(' ', start);
+		if (end == std::string_view::npos)
+		{
+			view.target = text.substr(start);
+			return view;
+		}
+		view.target = text.substr(start, end - start + 1);
+		view.body = text.substr(end + 1);
+		return view;
 	}
 
-	std::string getMessage(const std::string& message)
+	// Parses a message prefixed with its sender, single pass over the buffer and no allocations
+	MessageView parseMessage(std::string_view message)
 	{
-		std::string str = message;
-		int pos = message.find(' ');
-		int start = message.find(' ', pos + 1);
-		int end = message.find(' ', start + 1);
-		end = message.find(' ', end);
-		str.erase(0, end + 1); // message
-		return str;
+		size_t pos = message.find(' ');
+		if (pos == std::string_view::npos)
+		{
+			return parseText(message);
+		}
+
+		MessageView view = parseText(message.substr(pos + 1));
+		view.sender = message.substr(0, pos + 1);
+		return view;
 	}
 
 	unsigned long checkSum(const char* buffer, const int length)
@@ -0,0 +1,204 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Protocol.h"
+
+// Capture of decrypted client traffic to a compact binary file, ex.) /capture start peak.cap,
+// for benchmarks/replay to drive against a test server at any speed.
+// After a 5 byte header ("CCAP", version) every record is: event type, microseconds since the previous
+// record and the connection id as varints, then for FRAME the received frame as a varint length and its
+// encoding without timestamps. A short chat line costs its text plus about 10 bytes. The connection id is
+// the servers socket handle, a handle only comes back after its DISCONNECT record. While capture is off
+// a hook costs one relaxed load and a branch, while on it appends to a buffer under one mutex and writes
+// FLUSH_BYTES at a time.
+namespace capture
+{
+	const char MAGIC[4] = { 'C', 'C', 'A', 'P' };
+	const uint8_t VERSION = 0x01;
+	const size_t FLUSH_BYTES = 64 * 1024;
+
+	enum class Event : uint8_t
+	{
+		CONNECT = 0x01, // Key exchange done, LOGIN follows as a FRAME
+		FRAME = 0x02, // Frame received from the connection, in arrival order
+		DISCONNECT = 0x03,
+	};
+
+	struct Record
+	{
+		Event event = Event::CONNECT;
+		uint64_t micros = 0; // Since the capture started
+		uint64_t connection = 0;
+		Frame frame; // FRAME only
+	};
+
+	std::atomic <bool> enabled = false;
+
+	// Guarded by file_mutex
+	std::mutex file_mutex;
+	std::ofstream file;
+	std::string pending;
+	std::chrono::steady_clock::time_point started;
+	uint64_t lastMicros = 0;
+	uint64_t records = 0;
+
+	// LEB128, 7 bits per byte, low bits first
+	void putVarint(std::string& out, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out += static_cast<char>((value & 0x7F) | 0x80);
+			value >>= 7;
+		}
+		out += static_cast<char>(value);
+	}
+
+	bool getVarint(const unsigned char*& pos, const unsigned char* end, uint64_t& value)
+	{
+		value = 0;
+		for (unsigned shift = 0; pos < end && shift < 64; shift += 7)
+		{
+			uint8_t byte = *pos++;
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	void append(Event event, uint64_t connection, const Frame* frame)
+	{
+		std::lock_guard <std::mutex> lock(file_mutex);
+		if (!file.is_open()) // Stopped after the caller checked enabled
+			return;
+
+		uint64_t micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+		pending += static_cast<char>(event);
+		putVarint(pending, micros - lastMicros);
+		putVarint(pending, connection);
+		if (frame != nullptr)
+		{
+			std::vector<unsigned char> data = protocol::encode(*frame, false);
+			putVarint(pending, data.size());
+			pending.append(reinterpret_cast<const char*>(data.data()), data.size());
+		}
+		lastMicros = micros;
+		records++;
+
+		if (pending.size() >= FLUSH_BYTES)
+		{
+			file.write(pending.data(), pending.size());
+			pending.clear();
+		}
+	}
+
+	void connect(uint64_t connection)
+	{
+		if (enabled.load(std::memory_order_relaxed))
+			append(Event::CONNECT, connection, nullptr);
+	}
+
+	void frame(uint64_t connection, const Frame& frame)
+	{
+		if (enabled.load(std::memory_order_relaxed))
+			append(Event::FRAME, connection, &frame);
+	}
+
+	void disconnect(uint64_t connection)
+	{
+		if (enabled.load(std::memory_order_relaxed))
+			append(Event::DISCONNECT, connection, nullptr);
+	}
+
+	// Writes what is buffered and closes the file, returns the number of records captured
+	uint64_t stop()
+	{
+		enabled = false;
+		std::lock_guard <std::mutex> lock(file_mutex);
+		if (!file.is_open())
+			return 0;
+
+		file.write(pending.data(), pending.size());
+		pending.clear();
+		file.close();
+		return records;
+	}
+
+	// Replaces any capture in progress, false if path cannot be written
+	bool start(const std::string& path)
+	{
+		stop();
+		std::lock_guard <std::mutex> lock(file_mutex);
+		file.open(path, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+
+		file.write(MAGIC, sizeof(MAGIC));
+		file.put(static_cast<char>(VERSION));
+		started = std::chrono::steady_clock::now();
+		lastMicros = 0;
+		records = 0;
+		enabled = true;
+		return true;
+	}
+
+	// Reads a capture back record by record, ex.) in benchmarks/replay
+	class Reader
+	{
+	private:
+		std::vector<unsigned char> data;
+		size_t offset = 0;
+		uint64_t micros = 0;
+
+	public:
+		// False if path is missing or not a capture of this version
+		bool open(const std::string& path)
+		{
+			std::ifstream in(path, std::ios::binary);
+			if (!in.is_open())
+				return false;
+
+			data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			offset = sizeof(MAGIC) + 1;
+			micros = 0;
+			return data.size() >= offset && std::equal(MAGIC, MAGIC + sizeof(MAGIC), data.begin()) && data[sizeof(MAGIC)] == VERSION;
+		}
+
+		// False at the end of the file or at a truncated record, ex.) the server stopped mid write
+		bool next(Record& record)
+		{
+			const unsigned char* pos = data.data() + offset;
+			const unsigned char* end = data.data() + data.size();
+			if (pos >= end)
+				return false;
+
+			record.event = static_cast<Event>(*pos++);
+			uint64_t delta, length;
+			if (!getVarint(pos, end, delta) || !getVarint(pos, end, record.connection))
+				return false;
+			record.frame = Frame();
+			if (record.event == Event::FRAME)
+			{
+				if (!getVarint(pos, end, length) || length > static_cast<uint64_t>(end - pos) || !protocol::decode(pos, static_cast<size_t>(length), record.frame))
+					return false;
+				pos += length;
+			}
+
+			micros += delta;
+			record.micros = micros;
+			offset = pos - data.data();
+			return true;
+		}
+	};
+}
+
+#endif
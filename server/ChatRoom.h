@@ -1,7 +1,10 @@
 #ifndef CHATROOM_H
 #define CHATROOM_H
 
+#include <Windows.h>
+#include <csignal>
 #include "Server.h"
+#include "Commands.h"
 
 class ChatRoom
 {
@@ -11,8 +14,36 @@ private:
 	std::condition_variable shutdownCondition;
 	std::mutex shutdownMutex;
 	User host;
+	ServerConfig config;
 	ThreadPool thread_pool;
-	std::vector <std::string> commands = { "/sys","/upload","/whisper","/commands", "/users", "/end" };
+	const std::string TRACE_FILE = "chat_trace.json";
+	const std::string CAPTURE_FILE = "chat_capture.cap";
+	const std::string HEADLESS_HOST = "host";
+	const unsigned STOP_POLL_MS = 100; // How soon a headless server notices SIGINT or SIGTERM
+
+	static inline std::atomic <bool> stopRequested = false; // Set by the signal handler, headless only
+
+	static void requestStop(int)
+	{
+		stopRequested = true;
+	}
+
+	// Keeps the calling thread on one core, ex.) acceptor 5 on a 4 core machine runs on core 1
+	static void pinToCore(size_t index)
+	{
+		size_t cores = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), sizeof(DWORD_PTR) * 8);
+		SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << (index % cores));
+	}
+
+	// Tells every client the server is closing and wakes run_chat_room
+	void endServer(User& host)
+	{
+		server.broadcastMessageExceptSender(Frame(Opcode::SHUTDOWN), host);
+		server.stopFederation();
+		shouldQuit = true;
+		server.stopAccepting(); // Wakes the acceptors blocked in accept
+		shutdownCondition.notify_one();
+	}
 
 	// message: /sys cmd, ex.) /sys cls
 	void systemCMD(std::string& message)
@@ -41,59 +72,152 @@ private:
 	}
 
 	// For /whisper cmd
-	//</sender> /whisper </recipient> message ----> </sender> whispered: message
-	void whisperCMD(std::string& message, User& user)
+	// WHISPER(</recipient>, message) ----> WHISPER(</sender>, message), keeping the timestamps of source
+	void whisperCMD(const std::string& recipient, const std::string& body, User& user, const Frame& source = Frame())
 	{
-		std::string recipient = util::getRecipient(message);
-
-		User* receiver = server.findUserBySocket(server.findSocketByUsername(recipient));
+		User* receiver = server.findUserByUsername(recipient);
+		Frame whisper(Opcode::WHISPER, { user.getUsername(), body });
+		whisper.carryTimestamps(source);
+		if (receiver == nullptr && server.forwardWhisper(recipient, whisper)) // On a linked node
+		{
+			server.logFrame(recipient, whisper);
+			return;
+		}
 		if (receiver == nullptr) // User not found
 		{
-			message = "[!] User Not Found";
-			if (user.getSocket() == server.getListenSocket())
-				util::print(message);
-			else
-				send(user.getSocket(), message.c_str(), message.length(), 0);
+			server.sendMessage("[!] User Not Found", &user);
+			return;
+		}
+
+		server.logFrame(recipient, whisper);
+		server.sendFrame(whisper, receiver);
+	}
+
+	// /join name, /leave and /rooms for both the host and clients
+	void roomCMD(Command command, std::string_view target, User& user)
+	{
+		switch (command)
+		{
+		case Command::JOIN:
+		{
+			std::string name(target);
+			while (!name.empty() && name.back() == ' ')
+				name.pop_back();
+			if (!name.empty() && name[0] == '#')
+				name.erase(0, 1);
+
+			if (!RoomRegistry::validName(name))
+			{
+				server.sendMessage("[!] Invalid Room Name(letters, digits, - and _ only)", &user);
+				return;
+			}
+			server.joinRoom(&user, name);
+			return;
+		}
+		case Command::LEAVE:
+			server.joinRoom(&user, RoomRegistry::LOBBY);
+			return;
+		default:
+			server.sendMessage(server.getRooms_str(), &user);
+		}
+	}
 
+	// /search terms, whatever follows the command is the query
+	void searchCMD(std::string_view text, size_t commandLength, User& user)
+	{
+		std::string_view terms = text.substr(std::min(commandLength + 1, text.size()));
+		if (terms.empty())
+		{
+			server.sendMessage("[!] Missing Search Terms", &user);
 			return;
 		}
+		server.sendMessage(server.searchHistory(terms, user), &user);
+	}
+
+	// /trace on, /trace off, /trace dump [file], host only
+	void traceCMD(std::string_view action, std::string_view file)
+	{
+		std::string command(action);
+		while (!command.empty() && command.back() == ' ')
+			command.pop_back();
+
+		if (command == "on")
+		{
+			trace::start();
+			util::print("[+] Tracing On");
+		}
+		else if (command == "off")
+		{
+			trace::stop();
+			util::print("[+] Tracing Off");
+		}
+		else if (command == "dump")
+		{
+			std::string path = file.empty() ? TRACE_FILE : std::string(file);
+			if (trace::dump(path))
+				util::print("[+] Trace Written To " + path + ", Open It In ui.perfetto.dev");
+			else
+				util::print("[-] Could Not Write " + path);
+		}
+		else
+		{
+			util::print("[!] Usage: /trace on, /trace off, /trace dump [file]");
+		}
+	}
+
+	// /capture start [file], /capture stop, host only
+	void captureCMD(std::string_view action, std::string_view file)
+	{
+		std::string command(action);
+		while (!command.empty() && command.back() == ' ')
+			command.pop_back();
 
-		message = util::getSender(message) + "whispered: " + util::getMessage(message);
-		server.sendMessage(message, receiver);
+		if (command == "start")
+		{
+			std::string path = file.empty() ? CAPTURE_FILE : std::string(file);
+			if (server.startCapture(path))
+				util::print("[+] Capturing To " + path);
+			else
+				util::print("[-] Could Not Write " + path);
+		}
+		else if (command == "stop")
+		{
+			util::print("[+] Capture Stopped, " + std::to_string(capture::stop()) + " Records");
+		}
+		else
+		{
+			util::print("[!] Usage: /capture start [file], /capture stop");
+		}
 	}
 
 	void listCMDS(User& user)
 	{
-		std::string cmds = "Commands\n--------\n";
-		cmds += "/whisper: Direct message a user by username(</recipient>)\n/users: List all users\n";
-		cmds += "/sys: Execute an OS command(ex. /sys dir)\n/upload: Upload file to another user\n";
 		if (user.getSocket() == server.getListenSocket())
 		{
-			cmds += "/end: Close the server\n";
-			util::print(cmds);
+			util::print(commands::listing(HOST_SCOPE));
 		}
 		else
 		{
-			cmds += "/quit: Leave the chatroom\n";
+			std::string cmds = commands::listing(CLIENT_SCOPE);
 			User* user_ptr = &user;
 			server.sendMessage(cmds, user_ptr);
 		}
 	}
 
-	void fileTransfer(std::string& message, User& user)
+	void fileTransfer(const std::string& recipient, const std::string& fileName, std::string fileSize, User& user)
 	{
-		std::string msg_to_send;
-		std::string recipient = util::getRecipient(message);
-		std::string fileName = util::getMessage(message);
-		
 		User* recipUser = server.findUserByUsername(recipient);
 		User* sender = &user;
 
 		if (recipUser == nullptr || *recipUser == user) // User DNE, cannot send transfer to self
 		{
-			msg_to_send = "[!] Invalid Username";
-			User* user_ptr = &user;
-			server.sendMessage(msg_to_send, user_ptr);
+			server.sendFrame(protocol::transferResult(TransferResult::INVALID_USER), sender);
+			return;
+		}
+
+		if (config.headless && recipUser->getSocket() == server.getListenSocket()) // Nobody to answer for the host
+		{
+			server.sendFrame(protocol::transferResult(TransferResult::DENIED), sender);
 			return;
 		}
 
@@ -101,22 +225,19 @@ private:
 		recipUser->signalStartOfTransfer();
 		user.signalStartOfTransfer();
 		
-		msg_to_send = user.getUsername() + "File Transfer Request: " + fileName;
 		if (user.getSocket() == server.getListenSocket())
 		{
-			msg_to_send += util::getFileSize(fileName); // Attach file size if the server is uploading
+			fileSize = util::getFileSize(fileName); // Attach file size if the server is uploading
 		}
 
-		msg_to_send += "\n[*] Accept Transfer (y/n): ";
 		try
 		{
-			server.sendMessage(msg_to_send, recipUser);
+			server.sendFrame(Frame(Opcode::TRANSFER_OFFER, { user.getUsername(), fileName, fileSize }), recipUser);
 			if (recipUser->awaitDecision())
 			{
-				msg_to_send = "[+] Transfer Approved";
-				
-				server.sendMessage(msg_to_send, sender);
-				server.sendMessage(msg_to_send, recipUser);
+				Frame approved = protocol::transferResult(TransferResult::APPROVED);
+				server.sendFrame(approved, sender);
+				server.sendFrame(approved, recipUser);
 				server.sendTransferInfo(sender, recipUser); 
 				
 				if (user.getSocket() == server.getListenSocket()) // Server is uploading
@@ -131,18 +252,18 @@ private:
 			}
 			else
 			{
-				msg_to_send = "[-] Transfer Denied";
-				server.sendMessage(msg_to_send, sender);
-				server.sendMessage(msg_to_send, recipUser);
+				Frame denied = protocol::transferResult(TransferResult::DENIED);
+				server.sendFrame(denied, sender);
+				server.sendFrame(denied, recipUser);
 			}
 		}
 		catch (std::exception& e)
 		{
-			std::string error_message = "[-] Transfer Failed";
-			server.sendMessage(error_message, recipUser);
-			server.sendMessage(error_message, recipUser);
+			Frame failed = protocol::transferResult(TransferResult::FAILED);
+			server.sendFrame(failed, sender);
+			server.sendFrame(failed, recipUser);
 			util::print("[-] FAILED TRANSFER");
-			error_message = "[-] Error: " + GetLastError();
+			std::string error_message = "[-] Error: " + std::to_string(GetLastError());
 			error_message += "\n[-] Exception: " + std::string(e.what());
 			util::print(error_message);
 		}
@@ -155,21 +276,17 @@ private:
 	// Handles messages sent from the host
 	void handleOutgoingMessages(std::string& message, User& user)
 	{
-		// Check for commands
-		if (message.find("/sys") != std::string::npos)
+		util::MessageView msg = util::parseText(message);
+		Command command = commands::lookup(msg.command, HOST_SCOPE);
+		switch (command)
 		{
+		case Command::SYS:
 			systemCMD(message);
 			return;
-		}
-		if (message.find("/end") != std::string::npos)
-		{
-			server.broadcastMessageExceptSender(message, user);
-			shouldQuit = true;
-			shutdownCondition.notify_one();
+		case Command::END:
+			endServer(user);
 			return;
-		}
-		if (message.find("/upload") != std::string::npos)
-		{
+		case Command::UPLOAD:
 			if (message.find_last_of('.') == std::string::npos || message.find_last_of('.') == message.length() - 1)
 			{
 				std::string str = "[!] Missing File Extension";
@@ -177,110 +294,158 @@ private:
 				return;
 			}
 
-			message = user.getUsername() + message;
-			fileTransfer(message, user);
+			fileTransfer(std::string(msg.target), std::string(msg.body), "", user);
 			return;
-		}
-		if (message.find("/commands") != std::string::npos)
-		{
+		case Command::COMMANDS:
 			listCMDS(user);
 			return;
-		}
-		if (message.find("/users") != std::string::npos)
-		{
+		case Command::USERS:
 			listUsersCMD(user);
 			return;
-		}
-		if (message.find("/whisper") != std::string::npos)
-		{
-			message = user.getUsername() + message;
-			whisperCMD(message, user);
+		case Command::STATS:
+			util::print(server.getStats_str());
 			return;
-		}
-		message = user.getUsername() + message;
-		std::string str = util::getCommand(message);
-		if (str.find("/") != std::string::npos && util::search(commands, str) == nullptr)
-		{
-			str = "[!] Command Not Found";
-			util::print(str);
+		case Command::TRACE:
+			traceCMD(msg.target, msg.body);
+			return;
+		case Command::LOCKS:
+			util::print(locks::report());
+			return;
+		case Command::CAPTURE:
+			captureCMD(msg.target, msg.body);
 			return;
+		case Command::WHISPER:
+			whisperCMD(std::string(msg.target), std::string(msg.body), user);
+			return;
+		case Command::JOIN:
+		case Command::LEAVE:
+		case Command::ROOMS:
+			roomCMD(command, msg.target, user);
+			return;
+		case Command::SEARCH:
+			searchCMD(message, msg.command.size(), user);
+			return;
+		case Command::UNKNOWN:
+			util::print("[!] Command Not Found");
+			return;
+		default:
+			break;
 		}
-		server.broadcastMessageExceptSender(message, user);
+
+		server.broadcastToRoom(Frame(Opcode::CHAT, { user.getUsername(), message }), user);
 	}
 
-	void handleIncomingMessages(std::string& message, User& user)
+	// Routes a frame received from a client, only COMMAND frames are parsed as text
+	void handleIncomingMessages(Frame& frame, User& user)
 	{
-		// Check for commands
-		if (message.find("/quit") != std::string::npos)
+		switch (frame.opcode)
 		{
-			server.removeUser(user);
+		case Opcode::CHAT:
+		{
+			Frame chat(Opcode::CHAT, { user.getUsername(), frame.fields.empty() ? "" : frame.fields[0] });
+			chat.carryTimestamps(frame);
+			server.broadcastToRoom(chat, user);
 			return;
 		}
-		if (message.find("/users") != std::string::npos)
-		{
-			listUsersCMD(user);
+		case Opcode::WHISPER:
+			whisperCMD(std::string(frame.field(0)), std::string(frame.field(1)), user, frame);
+			return;
+		case Opcode::TRANSFER_OFFER:
+			fileTransfer(std::string(frame.field(0)), std::string(frame.field(1)), std::string(frame.field(2)), user);
+			return;
+		case Opcode::QUIT:
+			server.disconnectUser(&user);
+			return;
+		case Opcode::COMMAND:
+			break;
+		default: // Decisions outside of a transfer and server side opcodes are ignored
 			return;
 		}
-		if (message.find("/whisper") != std::string::npos)
+
+		util::MessageView msg = util::parseText(frame.field(0));
+		Command command;
 		{
-			whisperCMD(message, user);
-			return;
+			trace::Scope span("command_lookup");
+			command = commands::lookup(msg.command, CLIENT_SCOPE);
 		}
-		if (message.find("/commands") != std::string::npos)
+		switch (command)
 		{
+		case Command::JOIN:
+		case Command::LEAVE:
+		case Command::ROOMS:
+			roomCMD(command, msg.target, user);
+			return;
+		case Command::SEARCH:
+			searchCMD(frame.field(0), msg.command.size(), user);
+			return;
+		case Command::USERS:
+			listUsersCMD(user);
+			return;
+		case Command::COMMANDS:
 			listCMDS(user);
 			return;
-		}
-		if (message.find("/upload") != std::string::npos)
-		{
-			fileTransfer(message, user);
+		default:
+			server.sendMessage("[!] Command Not Found", &user);
 			return;
 		}
+	}
 
-		server.broadcastMessageExceptSender(message, user);
+	// Charges frame to the senders token buckets before any dispatch or fan out
+	// Over the limit frames are delayed on this users thread, or dropped if the wait would be too long
+	// QUIT and transfer decisions always pass
+	bool admitFrame(const Frame& frame, User& user)
+	{
+		if (frame.opcode == Opcode::QUIT || frame.opcode == Opcode::TRANSFER_DECISION)
+			return true;
+
+		std::chrono::milliseconds delay;
+		switch (user.rateLimiter().admit(protocol::encodedSize(frame), delay))
+		{
+		case RateDecision::DELAY:
+			serverMetrics().rateDelayed.add();
+			if (user.rateLimiter().shouldWarn())
+				server.sendMessage("[!] Slow Down, Your Messages Are Being Delayed", &user);
+			std::this_thread::sleep_for(delay);
+			return true;
+		case RateDecision::DROP:
+			serverMetrics().rateDropped.add();
+			if (user.rateLimiter().shouldWarn())
+				server.sendMessage("[!] Rate Limit Exceeded, Message Dropped", &user);
+			return false;
+		default:
+			return true;
+		}
 	}
 
 	// Handles client relay
 	void handleClient(User* user)
 	{
-		std::string username = user->getUsername(); // Only for exit message, to avoid referencing a nullptr when
-													//  the User obj is removed from the server
 		try
 		{
-			std::string message;
 			while (!shouldQuit)
 			{
-				message = server.recvMessage(*user);
+				Frame frame = server.recvFrame(*user);
+				trace::Scope span("dispatch");
+				if (!admitFrame(frame, *user))
+					continue;
 				
 				if (user->inFileTransfer())
 				{
-					if (message.find("$Yes") != std::string::npos)
-					{
-						user->setTransferDecision(true);
-					}
-					else
-					{
-						user->setTransferDecision(false);
-					}
+					bool accepted = frame.opcode == Opcode::TRANSFER_DECISION && frame.byte(0) == 1;
+					user->setTransferDecision(accepted);
 
 					user->wait_completeTransfer();
 					continue;
 				}
 
-				handleIncomingMessages(message, *user);
+				handleIncomingMessages(frame, *user);
 			}
 		}
 		catch (std::exception& e)
 		{
 			if (shouldQuit)
 				return;
-			if (!server.userExists(username))
-			{
-				std::string user_exit_message = "[!] " + username + "Has Left The Chat";
-				server.broadcastMessage(user_exit_message);
-				return;
-			}
-			std::cout << e.what() << std::endl;
+			server.disconnectUser(user); // No-op after /quit, the LEAVE was already sent to the users room
 		}
 	}
 
@@ -322,42 +487,88 @@ private:
 		}
 	}
 
-	void getConnections()
+	// One per acceptor, all block in accept on the servers listener until endServer closes it
+	void getConnections(size_t acceptor)
 	{
 		std::string username;
-		std::string msg_to_send;
 
-		util::print("[*] Listening for connections ...");
+		if (config.pinAcceptors)
+			pinToCore(acceptor);
+		if (acceptor == 0)
+			util::print("[*] Listening for connections ...");
 		while (!shouldQuit)
 		{
-			if (!server.pendingConnection())
-				continue;
-
 			User* user = server.getConnection();
 			if (user == nullptr)
-			{
-				std::cerr << "[-] Client Socket Creation Failed" << std::endl;
 				continue;
-			}
 
 			util::print("[+] Client Connected");
 
-			while (true)
+			bool peer = false;
+			std::string room = RoomRegistry::LOBBY;
+			std::string challenge; // Last one sent for RESUME, used once
+			try
 			{
-				username = server.recvMessage(*user);
-				if (server.userExists(username))
-				{
-					msg_to_send = "[!] Username Taken\n";
-					server.sendMessage(msg_to_send, user);
-				}
-				else
+				while (true)
 				{
-					msg_to_send = "$Valid";
-					server.sendMessage(msg_to_send, user);
-					user->setUsername(username);
-					break;
+					Frame login = server.recvFrame(*user);
+					if (login.opcode == Opcode::PEER_HELLO) // Another node linking, not a user
+					{
+						server.adoptPeer(user, login);
+						peer = true;
+						break;
+					}
+					if (login.opcode == Opcode::LOCAL_ATTACH) // Same machine, the rest goes over shared memory
+					{
+						server.attachSharedMemory(user);
+						continue;
+					}
+					if (login.opcode == Opcode::RESUME && login.fields.empty()) // Asks for the challenge to resume with
+					{
+						challenge = Server::resumeChallenge();
+						server.sendFrame(Frame(Opcode::RESUME, { challenge }), user);
+						continue;
+					}
+					if (login.opcode == Opcode::RESUME) // Back after a drop, the ticket has the username and room
+					{
+						bool resumed = server.resumeUser(user, login, challenge, room);
+						challenge.clear();
+						if (resumed)
+						{
+							Frame accepted(Opcode::LOGIN_RESULT, { protocol::byteField(static_cast<uint8_t>(LoginStatus::ACCEPTED)), "" });
+							server.sendFrame(accepted, user);
+							break;
+						}
+						Frame refused(Opcode::LOGIN_RESULT, { protocol::byteField(static_cast<uint8_t>(LoginStatus::RESUME_REFUSED)), "[!] Session Expired, Log In Again\n" });
+						server.sendFrame(refused, user);
+						continue;
+					}
+					username = std::string(login.field(0));
+					if (login.opcode != Opcode::LOGIN || username.empty())
+						continue;
+
+					if (!server.loginUser(user, username))
+					{
+						Frame taken(Opcode::LOGIN_RESULT, { protocol::byteField(static_cast<uint8_t>(LoginStatus::USERNAME_TAKEN)), "[!] Username Taken\n" });
+						server.sendFrame(taken, user);
+					}
+					else
+					{
+						Frame accepted(Opcode::LOGIN_RESULT, { protocol::byteField(static_cast<uint8_t>(LoginStatus::ACCEPTED)), "" });
+						server.sendFrame(accepted, user);
+						break;
+					}
 				}
 			}
+			catch (std::exception& e) // Client left before choosing a username
+			{
+				server.disconnectUser(user);
+				continue;
+			}
+			if (peer)
+				continue;
+
+			server.joinRoom(user, room);
 			
 			thread_pool.pushTask(&ChatRoom::handleClient, this, user);
 		}
@@ -365,19 +576,35 @@ private:
 
 public:
 
+	ChatRoom(const ServerConfig& config = ServerConfig())
+		: config(config), thread_pool(static_cast<int>(config.threads))
+	{
+	}
+
+	// Asks for the IP and host username unless the config has them, headless never reads stdin
 	void run_chat_room()
 	{
 		try 
 		{
 			std::unique_lock <std::mutex> lock(shutdownMutex);
-			std::string username, IP;
+			std::string username = config.host, IP = config.ip;
+			if (config.threads < config.acceptors + 2) // Or no client would ever get a thread
+				throw std::runtime_error("[-] threads Must Be At Least acceptors + 2");
 			
-			std::cout << "[*] Enter IP: ";
-			std::cin >> IP;
+			if (IP.empty() && config.headless)
+			{
+				IP = config.bind;
+			}
+			else if (IP.empty())
+			{
+				std::cout << "[*] Enter IP: ";
+				std::cin >> IP;
+			}
+			server.configure(config);
 			server.setIP(IP);
 
 			server.initializeServer();
-			std::cout << "[*] Hosting Server!";
+			std::cout << "[*] Hosting Server On " << config.bind << ":" << config.port << "!";
 
 			if (!util::sodium_startup)
 			{
@@ -387,8 +614,15 @@ public:
 			std::pair <std::vector<unsigned char>, std::vector <unsigned char>> key_pair = util::generate_key_pair();
 			server.set_encryption_keys(key_pair.first, key_pair.second);
 
-			std::cout << "\n[*] Enter username: ";
-			std::cin >> username;
+			if (username.empty() && config.headless)
+			{
+				username = config.node.empty() ? HEADLESS_HOST : config.node; // Host names must differ across linked nodes
+			}
+			else if (username.empty())
+			{
+				std::cout << "\n[*] Enter username: ";
+				std::cin >> username;
+			}
 			username = "</" + username + "> ";
 
 			auto host = std::make_unique<User>(server.getListenSocket(), username);
@@ -397,11 +631,30 @@ public:
 			host->setPort(51000);
 			User* user = host.get();
 			server.addUser(host);
+			server.joinRoom(user, RoomRegistry::LOBBY);
+			server.startFederation();
 
-			thread_pool.pushTask(&ChatRoom::getConnections, this);
-			thread_pool.pushTask(&ChatRoom::sendMessageLoop, this, user);
-
-			shutdownCondition.wait(lock, [this] {return this->shouldQuit.load();  });
+			for (size_t acceptor = 0; acceptor < config.acceptors; acceptor++)
+			{
+				thread_pool.pushTask(&ChatRoom::getConnections, this, acceptor);
+			}
+			if (config.headless)
+			{
+				std::cout << std::endl;
+				std::signal(SIGINT, &ChatRoom::requestStop);
+				std::signal(SIGTERM, &ChatRoom::requestStop);
+				while (!shouldQuit)
+				{
+					shutdownCondition.wait_for(lock, std::chrono::milliseconds(STOP_POLL_MS));
+					if (stopRequested && !shouldQuit)
+						endServer(*user);
+				}
+			}
+			else
+			{
+				thread_pool.pushTask(&ChatRoom::sendMessageLoop, this, user);
+				shutdownCondition.wait(lock, [this] {return this->shouldQuit.load();  });
+			}
 		}
 		catch (const std::exception& e)
 		{
@@ -409,7 +662,7 @@ public:
 			std::cerr << "[-] Error: " << WSAGetLastError() << std::endl;
 			return;
 		}
-		std::cout << "\033[2K\r[+] Server Closed";
+		util::print("\033[2K\r[+] Server Closed", 0);
 	}
 };
 #endif 
@@ -0,0 +1,266 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "RateLimiter.h"
+#include "Outbox.h"
+#include "Presence.h"
+#include "MessageLog.h"
+#include "Ticket.h"
+
+// Startup settings of the server: the defaults, then the file given with --config, then the other flags, ex.)
+//   server --config chat.conf --port 50001 --headless
+// The file holds one "key = value" per line and # starts a comment. Every key is also a flag, --key value,
+// and --headless alone means true. Sizes take a K, M or G suffix. Unknown keys and bad values throw.
+struct ServerConfig
+{
+	std::string ip; // Address peers are given to reach the host for transfers, asked for when empty
+	std::string bind = "0.0.0.0";
+	unsigned port = 50000;
+	std::string host; // Host username, asked for when empty
+	bool headless = false; // No console or prompts, offers to the host are denied, SIGINT or SIGTERM closes the server
+	unsigned threads = 10; // ChatRoom pool, each logged in client holds one, each acceptor one and the console one
+	unsigned acceptors = 1; // Threads accepting and logging in clients, all on one listener
+	bool pinAcceptors = false; // Acceptor n runs on core n modulo the core count
+	bool sharedMemory = false; // Clients on this machine may switch to shared memory rings, see SharedMemory.h
+	size_t sharedMemoryRing = SharedChannel::DEFAULT_CAPACITY; // Bytes per direction and client
+	unsigned ticketLifetimeS = TicketKeeper::DEFAULT_LIFETIME_S; // How long a dropped client can resume its session, 0 turns it off
+	size_t socketBuffer = 0; // SO_SNDBUF and SO_RCVBUF of client connections, 0 keeps the system default
+	size_t backlogMessages = 50; // Most recent messages replayed on join, the room keeps up to MessageHistory::DEFAULT_MESSAGES
+	RateLimits rateLimits;
+	OutboxLimits outboxLimits;
+	unsigned presenceIntervalMs = PresenceBatcher::DEFAULT_INTERVAL_MS;
+	std::string metricsFile = "chat_metrics.prom";
+	unsigned metricsIntervalMs = 10000;
+	std::string consoleLog = "chat_server.log"; // Everything the host sees, timestamped
+	std::string logDir = "chat_log";
+	FsyncPolicy logFsync = FsyncPolicy::INTERVAL;
+	unsigned logFsyncIntervalMs = 100;
+	std::string node; // Name among federated nodes, ip:port when empty
+	std::vector<std::string> peers; // host:port of the other nodes to link with, see Federation.h
+	std::string federationSecret; // Shared by every node, required to federate
+
+	static constexpr const char* USAGE =
+		"Usage: server [--config file] [--key value ...]\n"
+		"  ip, bind (0.0.0.0), port (50000), host, headless (false), threads (10), acceptors (1), pin_acceptors (false), socket_buffer (0)\n"
+		"  shared_memory (false), shared_memory_ring (1M), ticket_lifetime_s (3600)\n"
+		"  backlog_messages (50), presence_interval_ms (250), metrics_file, metrics_interval_ms (10000), console_log\n"
+		"  rate_messages_per_sec (10), rate_message_burst (20), rate_bytes_per_sec (16K), rate_byte_burst (64K), rate_max_delay_ms (500), a rate of 0 is unlimited\n"
+		"  outbox_drop_bytes (256K), outbox_snapshot_bytes (1M), outbox_snapshot_age_ms (2000), outbox_disconnect_bytes (4M), outbox_disconnect_age_ms (10000)\n"
+		"  log_dir (chat_log), log_fsync (never, interval, commit), log_fsync_interval_ms (100)\n"
+		"  node, peers (host:port,host:port), federation_secret\n";
+
+	// Sets key from its text value, throws on an unknown key or a bad value
+	void set(const std::string& key, const std::string& value)
+	{
+		if (key == "ip") ip = value;
+		else if (key == "bind") bind = value;
+		else if (key == "port") port = toUnsigned(key, value, 1, 65535);
+		else if (key == "host") host = value;
+		else if (key == "headless") headless = toBool(key, value);
+		else if (key == "threads") threads = toUnsigned(key, value, 2, 4096);
+		else if (key == "acceptors") acceptors = toUnsigned(key, value, 1, 64);
+		else if (key == "pin_acceptors") pinAcceptors = toBool(key, value);
+		else if (key == "shared_memory") sharedMemory = toBool(key, value);
+		else if (key == "shared_memory_ring") sharedMemoryRing = toSize(key, value, SharedChannel::MAX_CAPACITY);
+		else if (key == "ticket_lifetime_s") ticketLifetimeS = toUnsigned(key, value);
+		else if (key == "socket_buffer") socketBuffer = toSize(key, value);
+		else if (key == "backlog_messages") backlogMessages = toSize(key, value);
+		else if (key == "presence_interval_ms") presenceIntervalMs = toUnsigned(key, value, 1);
+		else if (key == "metrics_file") metricsFile = value;
+		else if (key == "metrics_interval_ms") metricsIntervalMs = toUnsigned(key, value, 1);
+		else if (key == "console_log") consoleLog = value;
+		else if (key == "rate_messages_per_sec") rateLimits.messagesPerSec = toDouble(key, value);
+		else if (key == "rate_message_burst") rateLimits.messageBurst = toDouble(key, value);
+		else if (key == "rate_bytes_per_sec") rateLimits.bytesPerSec = static_cast<double>(toSize(key, value));
+		else if (key == "rate_byte_burst") rateLimits.byteBurst = static_cast<double>(toSize(key, value));
+		else if (key == "rate_max_delay_ms") rateLimits.maxDelayMs = toUnsigned(key, value);
+		else if (key == "outbox_drop_bytes") outboxLimits.dropBytes = toSize(key, value);
+		else if (key == "outbox_snapshot_bytes") outboxLimits.snapshotBytes = toSize(key, value);
+		else if (key == "outbox_snapshot_age_ms") outboxLimits.snapshotAgeMs = toUnsigned(key, value);
+		else if (key == "outbox_disconnect_bytes") outboxLimits.disconnectBytes = toSize(key, value);
+		else if (key == "outbox_disconnect_age_ms") outboxLimits.disconnectAgeMs = toUnsigned(key, value);
+		else if (key == "log_dir") logDir = value;
+		else if (key == "log_fsync") logFsync = toFsyncPolicy(key, value);
+		else if (key == "log_fsync_interval_ms") logFsyncIntervalMs = toUnsigned(key, value, 1);
+		else if (key == "node") node = value;
+		else if (key == "peers") peers = toList(value);
+		else if (key == "federation_secret") federationSecret = value;
+		else throw std::runtime_error("[-] Unknown Setting: " + key);
+	}
+
+	// Throws if path cannot be read, errors name the line
+	void load(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file.is_open())
+			throw std::runtime_error("[-] Could Not Read " + path);
+
+		std::string line;
+		for (size_t number = 1; std::getline(file, line); number++)
+		{
+			line = trim(line.substr(0, line.find('#')));
+			if (line.empty())
+				continue;
+
+			size_t equals = line.find('=');
+			try
+			{
+				if (equals == std::string::npos)
+					throw std::runtime_error("[-] Expected key = value");
+				set(trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+			}
+			catch (std::exception& e)
+			{
+				throw std::runtime_error(std::string(e.what()) + " (" + path + ":" + std::to_string(number) + ")");
+			}
+		}
+	}
+
+	// --config is loaded before the other flags wherever it appears, so flags override the file
+	void parseArgs(int argc, char** argv)
+	{
+		for (int i = 1; i + 1 < argc; i++)
+		{
+			if (std::string(argv[i]) == "--config")
+				load(argv[i + 1]);
+		}
+
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg.compare(0, 2, "--") != 0)
+				throw std::runtime_error("[-] Unexpected Argument: " + arg);
+
+			std::string key = arg.substr(2), value;
+			size_t equals = key.find('=');
+			if (equals != std::string::npos) // --key=value
+			{
+				value = key.substr(equals + 1);
+				key.erase(equals);
+			}
+			else if (i + 1 < argc && std::string(argv[i + 1]).compare(0, 2, "--") != 0)
+			{
+				value = argv[++i];
+			}
+			else if (key == "headless")
+			{
+				value = "true";
+			}
+			else
+			{
+				throw std::runtime_error("[-] Missing Value For --" + key);
+			}
+
+			for (char& c : key)
+			{
+				if (c == '-')
+					c = '_';
+			}
+			if (key != "config")
+				set(key, value);
+		}
+	}
+
+private:
+	static std::string trim(const std::string& text)
+	{
+		size_t first = text.find_first_not_of(" \t\r");
+		if (first == std::string::npos)
+			return "";
+		return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+	}
+
+	static unsigned toUnsigned(const std::string& key, const std::string& value, unsigned min = 0, unsigned max = UINT_MAX)
+	{
+		size_t used = 0;
+		unsigned long long number = 0;
+		try
+		{
+			number = std::stoull(value, &used);
+		}
+		catch (std::exception&)
+		{
+		}
+		if (used == 0 || used != value.size() || number < min || number > max)
+			throw std::runtime_error("[-] " + key + " Must Be A Whole Number From " + std::to_string(min) + " To " + std::to_string(max));
+		return static_cast<unsigned>(number);
+	}
+
+	// ex.) 65536, 64K, 4M
+	static size_t toSize(const std::string& key, const std::string& value, size_t max = SIZE_MAX)
+	{
+		size_t multiplier = 1;
+		std::string digits = value;
+		char suffix = digits.empty() ? '\0' : digits.back();
+		if (suffix == 'K' || suffix == 'k') multiplier = 1ULL << 10;
+		else if (suffix == 'M' || suffix == 'm') multiplier = 1ULL << 20;
+		else if (suffix == 'G' || suffix == 'g') multiplier = 1ULL << 30;
+		if (multiplier != 1)
+			digits.pop_back();
+		size_t size = static_cast<size_t>(toUnsigned(key, digits)) * multiplier;
+		if (size > max)
+			throw std::runtime_error("[-] " + key + " Must Be At Most " + std::to_string(max));
+		return size;
+	}
+
+	// 0 or more, ex.) a rate, where 0 turns the bucket off
+	static double toDouble(const std::string& key, const std::string& value)
+	{
+		size_t used = 0;
+		double number = 0;
+		try
+		{
+			number = std::stod(value, &used);
+		}
+		catch (std::exception&)
+		{
+		}
+		if (used == 0 || used != value.size() || !(number >= 0))
+			throw std::runtime_error("[-] " + key + " Must Be A Number From 0");
+		return number;
+	}
+
+	static bool toBool(const std::string& key, const std::string& value)
+	{
+		if (value == "true" || value == "1" || value == "yes")
+			return true;
+		if (value == "false" || value == "0" || value == "no")
+			return false;
+		throw std::runtime_error("[-] " + key + " Must Be true Or false");
+	}
+
+	// ex.) 10.0.0.2:50000,10.0.0.3:50000
+	static std::vector<std::string> toList(const std::string& value)
+	{
+		std::vector<std::string> items;
+		size_t start = 0;
+		while (start <= value.size())
+		{
+			size_t comma = std::min(value.find(',', start), value.size());
+			std::string item = trim(value.substr(start, comma - start));
+			if (!item.empty())
+				items.push_back(item);
+			start = comma + 1;
+		}
+		return items;
+	}
+
+	static FsyncPolicy toFsyncPolicy(const std::string& key, const std::string& value)
+	{
+		if (value == "never")
+			return FsyncPolicy::NEVER;
+		if (value == "interval")
+			return FsyncPolicy::INTERVAL;
+		if (value == "commit")
+			return FsyncPolicy::EVERY_COMMIT;
+		throw std::runtime_error("[-] " + key + " Must Be never, interval Or commit");
+	}
+};
+
+#endif
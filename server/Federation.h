@@ -0,0 +1,745 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Protocol.h"
+#include "Outbox.h"
+#include "Metrics.h"
+#include "ProfiledMutex.h"
+
+// What the server does with traffic from other nodes, called on the federation threads without its lock held
+struct FederationHandlers
+{
+	std::function<void(const std::string& node)> linkUp; // Send node the local room members with sendTo
+	std::function<void(const Frame& frame)> chat; // PEER_CHAT, deliver to the local members of the room
+	std::function<void(const Frame& frame)> whisper; // PEER_WHISPER, deliver to the recipient if still here
+	std::function<void(const std::string& room, const std::vector<std::pair<PresenceEvent, std::string>>& changes)> presence;
+	std::function<void(const std::string& username)> conflict; // A local user lost its name to another node
+};
+
+// Links between server nodes that share rooms, ex.) two nodes on one host:
+//   server --headless --node a --port 50000 --peers 127.0.0.1:50001 --federation_secret s
+//   server --headless --node b --port 50001 --peers 127.0.0.1:50000 --federation_secret s
+// Every node dials every address in peers and accepts nodes that open with PEER_HELLO and the same secret
+// on its client port. Frames are never relayed, so the nodes must form a full mesh. Over a link:
+//   room chat goes once to each node with members in that room, which fans it out to its own users
+//   whispers go to the node holding the recipient
+//   presence deltas go out once per flush, the full membership when the link comes up
+//   a login claims its username first, every linked node must grant it. Of two nodes claiming one name
+//   at once the lower node name wins, and names that clash after a partition heals stay with the lower
+//   node name, the other node disconnects its user.
+// A node's users and memberships are dropped with its link, dialed links are retried every RECONNECT_MS.
+class Federation
+{
+private:
+	struct Link
+	{
+		std::string node;
+		SOCKET sock = INVALID_SOCKET;
+		std::vector<unsigned char> pk; // The other node's server key
+		Outbox outbox;
+	};
+
+	struct Claim
+	{
+		std::set<std::string> waiting; // Nodes that have not answered
+		bool lost = false;
+	};
+
+	typedef std::vector<std::pair<PresenceEvent, std::string>> Changes;
+
+	std::string self;
+	std::string secret;
+	std::vector<std::string> peers; // IPv4 host:port to dial
+	std::vector<unsigned char> public_key;
+	std::vector<unsigned char> secret_key;
+	OutboxLimits limits;
+	FederationHandlers handlers;
+
+	// Guarded by federation_mutex, never held while calling handlers
+	ProfiledMutex federation_mutex{ "Federation::federation_mutex" };
+	std::condition_variable_any claim_condition;
+	std::unordered_map<std::string, std::shared_ptr<Link>> links; // node -> link
+	std::unordered_map<std::string, std::string> dialedNodes; // peer address -> node it answered as
+	std::unordered_set<std::string> local; // Usernames held on this node
+	std::unordered_map<std::string, std::string> directory; // Username -> node, users of other nodes
+	std::unordered_map<std::string, Claim> claims; // Local logins waiting on the other nodes
+	std::unordered_map<std::string, std::unordered_map<std::string, std::set<std::string>>> members; // node -> room -> usernames
+	std::vector<std::shared_ptr<Link>> superseded; // Duplicate links, read but never written until the higher node closes them
+	std::vector<std::shared_ptr<Link>> retired; // Dropped links, closed by the reader so it never selects a reused handle
+
+	std::atomic <bool> running = false;
+	std::vector<std::thread> dialers;
+	std::thread reader;
+	std::mutex stop_mutex;
+	std::condition_variable stop_condition;
+
+	// federation_mutex must be held
+	void send(Link& link, const Frame& frame)
+	{
+		if (link.outbox.push(frame) == OutboxAction::DISCONNECT) // The reader sees the closed socket and drops the link
+			::shutdown(link.sock, SD_BOTH);
+		serverMetrics().peerFramesOut.add();
+	}
+
+	// federation_mutex must be held
+	void sendAll(const Frame& frame)
+	{
+		for (auto& link : links)
+		{
+			send(*link.second, frame);
+		}
+	}
+
+	// Waits up to ms, false once stopping
+	bool pause(unsigned ms)
+	{
+		std::unique_lock <std::mutex> lock(stop_mutex);
+		stop_condition.wait_for(lock, std::chrono::milliseconds(ms), [this] { return !running; });
+		return running;
+	}
+
+	bool validHello(const Frame& hello)
+	{
+		std::string_view node = hello.field(0), key = hello.field(1);
+		return hello.opcode == Opcode::PEER_HELLO && !node.empty() && node != self && key.size() == secret.size() &&
+			sodium_memcmp(key.data(), secret.data(), secret.size()) == 0;
+	}
+
+	// Sends link the names held here and the claims in flight, federation_mutex must be held
+	void greet(Link& link)
+	{
+		Frame users(Opcode::PEER_USERS); // Split to fit MAX_FIELDS
+		for (const std::string& name : local)
+		{
+			users.fields.push_back(name);
+			if (users.fields.size() == protocol::MAX_FIELDS)
+			{
+				send(link, users);
+				users.fields.clear();
+			}
+		}
+		if (!users.fields.empty())
+			send(link, users);
+
+		for (auto& claim : claims)
+		{
+			claim.second.waiting.insert(link.node);
+			send(link, Frame(Opcode::PEER_CLAIM, { claim.first }));
+		}
+	}
+
+	// Of two links between the same nodes the one dialed by the lower node name is kept, so both ends agree.
+	// The other is superseded: still read, never written. The higher node closes it once the kept link
+	// carries a frame, so neither end sees its only link close while the other is still being set up.
+	void addLink(const std::string& node, SOCKET sock, const std::vector<unsigned char>& pk, bool dialed)
+	{
+		auto link = std::make_shared<Link>();
+		link->node = node;
+		link->sock = sock;
+		link->pk = pk;
+		link->outbox.start(sock, pk, secret_key, limits, false);
+		bool replacing;
+		{
+			std::lock_guard <ProfiledMutex> lock(federation_mutex);
+			auto existing = links.find(node);
+			replacing = existing != links.end();
+			if (replacing && dialed != (self < node))
+			{
+				superseded.push_back(link);
+				return;
+			}
+			if (replacing)
+				superseded.push_back(existing->second);
+			links[node] = link;
+			greet(*link);
+		}
+		if (!replacing)
+			util::print("[+] Linked With Node " + node);
+		handlers.linkUp(node);
+	}
+
+	// A frame on the kept link means the lower node has it too, the higher node closes the duplicates
+	void closeSuperseded(const std::shared_ptr<Link>& link)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		auto it = links.find(link->node);
+		if (superseded.empty() || self < link->node || it == links.end() || it->second != link)
+			return;
+
+		for (auto other = superseded.begin(); other != superseded.end();)
+		{
+			if ((*other)->node != link->node)
+			{
+				++other;
+				continue;
+			}
+			::shutdown((*other)->sock, SD_BOTH);
+			retired.push_back(*other);
+			other = superseded.erase(other);
+		}
+	}
+
+	// Forgets node's users and memberships unless another link to node is still open, its room members are told they left
+	void dropLink(const std::shared_ptr<Link>& link)
+	{
+		std::unordered_map<std::string, std::set<std::string>> gone;
+		bool current = false, promoted = false;
+		{
+			std::lock_guard <ProfiledMutex> lock(federation_mutex);
+			auto duplicate = std::find(superseded.begin(), superseded.end(), link);
+			if (duplicate != superseded.end())
+			{
+				superseded.erase(duplicate);
+				retired.push_back(link);
+			}
+			auto it = links.find(link->node);
+			if (it != links.end() && it->second == link)
+			{
+				current = true;
+				retired.push_back(link);
+				auto standby = std::find_if(superseded.begin(), superseded.end(), [&](const std::shared_ptr<Link>& other) { return other->node == link->node; });
+				if (standby != superseded.end()) // ex.) the kept link failed while being set up
+				{
+					promoted = true;
+					it->second = *standby;
+					superseded.erase(standby);
+					greet(*it->second);
+				}
+				else
+				{
+					links.erase(it);
+					for (auto entry = directory.begin(); entry != directory.end();)
+					{
+						entry = entry->second == link->node ? directory.erase(entry) : std::next(entry);
+					}
+					gone = std::move(members[link->node]);
+					members.erase(link->node);
+					for (auto& claim : claims)
+					{
+						claim.second.waiting.erase(link->node);
+					}
+					claim_condition.notify_all();
+				}
+			}
+		}
+
+		if (!current)
+			return;
+
+		::shutdown(link->sock, SD_BOTH);
+		if (promoted)
+		{
+			handlers.linkUp(link->node);
+			return;
+		}
+		util::print("[!] Lost Node " + link->node);
+		for (auto& room : gone)
+		{
+			Changes changes;
+			for (const std::string& name : room.second)
+			{
+				changes.emplace_back(PresenceEvent::LEAVE, name);
+			}
+			handlers.presence(room.first, changes);
+		}
+	}
+
+	// Applies a frame from node, handlers run after the lock is released
+	void handle(const std::string& node, const Frame& frame)
+	{
+		std::vector<std::string> conflicts;
+		Changes changes;
+		{
+			std::lock_guard <ProfiledMutex> lock(federation_mutex);
+			auto link = links.find(node);
+			if (link == links.end())
+				return;
+
+			switch (frame.opcode)
+			{
+			case Opcode::PEER_CLAIM:
+			{
+				std::string name(frame.field(0));
+				auto held = directory.find(name);
+				bool grant = local.count(name) == 0 && (held == directory.end() || held->second == node);
+				auto pending = claims.find(name);
+				if (pending != claims.end())
+				{
+					if (node < self)
+					{
+						pending->second.lost = true;
+						claim_condition.notify_all();
+					}
+					else
+					{
+						grant = false;
+					}
+				}
+				if (grant)
+					directory[name] = node;
+				send(*link->second, Frame(Opcode::PEER_CLAIMED, { name, protocol::byteField(grant ? 1 : 0) }));
+				return;
+			}
+			case Opcode::PEER_CLAIMED:
+			{
+				auto pending = claims.find(std::string(frame.field(0)));
+				if (pending == claims.end())
+					return;
+				pending->second.waiting.erase(node);
+				if (frame.byte(1) != 1)
+					pending->second.lost = true;
+				claim_condition.notify_all();
+				return;
+			}
+			case Opcode::PEER_RELEASE:
+			{
+				auto held = directory.find(std::string(frame.field(0)));
+				if (held != directory.end() && held->second == node)
+					directory.erase(held);
+				return;
+			}
+			case Opcode::PEER_USERS:
+				for (const std::string& name : frame.fields)
+				{
+					if (local.count(name) > 0)
+					{
+						if (node > self) // Ours to keep, node disconnects its user
+							continue;
+						conflicts.push_back(name);
+					}
+					auto held = directory.find(name);
+					if (held == directory.end() || node < held->second)
+						directory[name] = node;
+				}
+				break;
+			case Opcode::PEER_PRESENCE:
+			{
+				std::set<std::string>& roomMembers = members[node][std::string(frame.field(0))];
+				for (size_t i = 1; i < frame.fields.size(); i++)
+				{
+					PresenceEvent event = static_cast<PresenceEvent>(frame.byte(i));
+					std::string name = frame.fields[i].substr(1);
+					if (event == PresenceEvent::JOIN ? roomMembers.insert(name).second : roomMembers.erase(name) > 0)
+						changes.emplace_back(event, name);
+				}
+				if (roomMembers.empty())
+					members[node].erase(std::string(frame.field(0)));
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		switch (frame.opcode)
+		{
+		case Opcode::PEER_USERS:
+			for (const std::string& name : conflicts)
+			{
+				util::print("[!] " + name + "Is Also Logged In On Node " + node + ", It Keeps The Name");
+				handlers.conflict(name);
+			}
+			return;
+		case Opcode::PEER_PRESENCE:
+			if (!changes.empty())
+				handlers.presence(std::string(frame.field(0)), changes);
+			return;
+		case Opcode::PEER_CHAT:
+			handlers.chat(frame);
+			return;
+		case Opcode::PEER_WHISPER:
+			handlers.whisper(frame);
+			return;
+		default:
+			return;
+		}
+	}
+
+	// Flushes and closes dropped links, only from the reader or after it stopped
+	void closeRetired()
+	{
+		std::vector<std::shared_ptr<Link>> closing;
+		{
+			std::lock_guard <ProfiledMutex> lock(federation_mutex);
+			closing.swap(retired);
+		}
+		for (auto& link : closing)
+		{
+			link->outbox.close();
+			closesocket(link->sock);
+		}
+	}
+
+	// Reads every link, a link is dropped when its socket closes or a frame fails to decrypt
+	void readerLoop()
+	{
+		while (running)
+		{
+			closeRetired();
+			std::vector<std::shared_ptr<Link>> current;
+			{
+				std::lock_guard <ProfiledMutex> lock(federation_mutex);
+				for (auto& link : links)
+				{
+					current.push_back(link.second);
+				}
+				current.insert(current.end(), superseded.begin(), superseded.end());
+			}
+			if (current.empty())
+			{
+				pause(READ_POLL_MS);
+				continue;
+			}
+
+			fd_set readable;
+			FD_ZERO(&readable);
+			SOCKET maxSock = 0;
+			for (auto& link : current)
+			{
+				FD_SET(link->sock, &readable);
+				maxSock = std::max(maxSock, link->sock);
+			}
+			timeval timeout{ 0, static_cast<long>(READ_POLL_MS * 1000) };
+			if (select(static_cast<int>(maxSock) + 1, &readable, nullptr, nullptr, &timeout) <= 0)
+				continue;
+
+			for (auto& link : current)
+			{
+				if (!FD_ISSET(link->sock, &readable))
+					continue;
+
+				Frame frame;
+				if (!protocol::recvFrame(link->sock, frame, link->pk, secret_key))
+				{
+					dropLink(link);
+					continue;
+				}
+				serverMetrics().peerFramesIn.add();
+				closeSuperseded(link);
+				handle(link->node, frame);
+			}
+		}
+	}
+
+	// Connects to address, host:port, and runs the same key exchange as a client before PEER_HELLO
+	// node is set to self if address turns out to be this server
+	SOCKET dial(const std::string& address, std::vector<unsigned char>& pk, std::string& node)
+	{
+		size_t colon = address.rfind(':');
+		sockaddr_in peer{};
+		peer.sin_family = AF_INET;
+		peer.sin_port = htons(static_cast<u_short>(std::atoi(address.c_str() + colon + 1)));
+		if (colon == std::string::npos || inet_pton(AF_INET, address.substr(0, colon).c_str(), &peer.sin_addr) != 1)
+			return INVALID_SOCKET;
+
+		SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sock == INVALID_SOCKET)
+			return INVALID_SOCKET;
+
+		pk.resize(crypto_box_PUBLICKEYBYTES);
+		Frame hello;
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(sock, &readable);
+		timeval timeout{ static_cast<long>(HELLO_TIMEOUT_MS / 1000), static_cast<long>(HELLO_TIMEOUT_MS % 1000 * 1000) };
+		bool ok = connect(sock, reinterpret_cast<sockaddr*>(&peer), sizeof(peer)) != SOCKET_ERROR &&
+			protocol::recvAll(sock, pk.data(), pk.size());
+		if (ok && pk == public_key) // ex.) one peers list shared by every node
+		{
+			protocol::sendAll(sock, public_key.data(), public_key.size()); // Completes the exchange, the accept loop sees a client leave
+			closesocket(sock);
+			node = self;
+			return INVALID_SOCKET;
+		}
+		ok = ok && protocol::sendAll(sock, public_key.data(), public_key.size()) &&
+			protocol::sendFrame(sock, Frame(Opcode::PEER_HELLO, { self, secret }), pk, secret_key) &&
+			select(static_cast<int>(sock) + 1, &readable, nullptr, nullptr, &timeout) > 0 && // Not another node if it stays silent
+			protocol::recvFrame(sock, hello, pk, secret_key) && validHello(hello);
+		if (!ok)
+		{
+			closesocket(sock);
+			return INVALID_SOCKET;
+		}
+		node = std::string(hello.field(0));
+		return sock;
+	}
+
+	// Keeps one link to address, redialing while it is down
+	void dialerLoop(std::string address)
+	{
+		bool warned = false;
+		while (running)
+		{
+			std::string node;
+			std::vector<unsigned char> pk;
+			bool linked;
+			{
+				std::lock_guard <ProfiledMutex> lock(federation_mutex);
+				auto known = dialedNodes.find(address);
+				linked = known != dialedNodes.end() && links.count(known->second) > 0;
+			}
+			if (!linked)
+			{
+				SOCKET sock = dial(address, pk, node);
+				if (node == self)
+					return;
+				if (sock != INVALID_SOCKET)
+				{
+					{
+						std::lock_guard <ProfiledMutex> lock(federation_mutex);
+						dialedNodes[address] = node;
+					}
+					addLink(node, sock, pk, true);
+					warned = false;
+				}
+				else if (!warned)
+				{
+					util::print("[!] Could Not Link With " + address + ", Retrying Every " + std::to_string(RECONNECT_MS / 1000) + "s");
+					warned = true;
+				}
+			}
+			pause(RECONNECT_MS);
+		}
+	}
+
+public:
+	static const unsigned RECONNECT_MS = 2000;
+	static const unsigned HELLO_TIMEOUT_MS = 2000;
+	static constexpr unsigned CLAIM_TIMEOUT_MS = 2000; // A node that does not answer a claim in time refuses it
+	static const unsigned READ_POLL_MS = 100;
+
+	~Federation()
+	{
+		stop();
+	}
+
+	bool enabled()
+	{
+		return running;
+	}
+
+	// Starts dialing peers and accepting nodes, localUsers are the names already held here, ex.) the host
+	void start(const std::string& node, const std::string& secret, const std::vector<std::string>& peers,
+		const std::vector<unsigned char>& pk, const std::vector<unsigned char>& sk, const OutboxLimits& limits,
+		const std::vector<std::string>& localUsers, FederationHandlers handlers)
+	{
+		if (running)
+			return;
+
+		self = node;
+		this->secret = secret;
+		this->peers = peers;
+		public_key = pk;
+		secret_key = sk;
+		this->limits = limits;
+		this->handlers = std::move(handlers);
+		local.insert(localUsers.begin(), localUsers.end());
+
+		running = true;
+		reader = std::thread(&Federation::readerLoop, this);
+		for (const std::string& address : peers)
+		{
+			dialers.emplace_back(&Federation::dialerLoop, this, address);
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard <std::mutex> lock(stop_mutex);
+			if (!running)
+				return;
+			running = false;
+		}
+		stop_condition.notify_all();
+		for (auto& dialer : dialers)
+		{
+			dialer.join();
+		}
+		reader.join();
+
+		std::vector<std::shared_ptr<Link>> current;
+		{
+			std::lock_guard <ProfiledMutex> lock(federation_mutex);
+			for (auto& link : links)
+			{
+				current.push_back(link.second);
+			}
+			current.insert(current.end(), superseded.begin(), superseded.end());
+		}
+		for (auto& link : current)
+		{
+			dropLink(link);
+		}
+		closeRetired();
+	}
+
+	// A connection to the client port that opened with PEER_HELLO, closed unless its secret matches
+	void accept(SOCKET sock, const std::vector<unsigned char>& pk, const Frame& hello)
+	{
+		std::vector<unsigned char> peer_pk = pk;
+		if (!running || !validHello(hello) || !protocol::sendFrame(sock, Frame(Opcode::PEER_HELLO, { self, secret }), peer_pk, secret_key))
+		{
+			closesocket(sock);
+			return;
+		}
+		addLink(std::string(hello.field(0)), sock, pk, false);
+	}
+
+	// Blocks until every linked node granted username, or one refused or timed out. The name is held
+	// here until release. Always true without links.
+	bool claim(const std::string& username)
+	{
+		std::unique_lock <ProfiledMutex> lock(federation_mutex);
+		if (local.count(username) > 0 || directory.count(username) > 0 || claims.count(username) > 0)
+			return false;
+
+		Claim& claim = claims[username];
+		for (auto& link : links)
+		{
+			claim.waiting.insert(link.first);
+			send(*link.second, Frame(Opcode::PEER_CLAIM, { username }));
+		}
+
+		claim_condition.wait_for(lock, std::chrono::milliseconds(CLAIM_TIMEOUT_MS), [&] { return claim.waiting.empty() || claim.lost; });
+		bool won = claim.waiting.empty() && !claim.lost;
+		claims.erase(username);
+		if (won)
+			local.insert(username);
+		else if (!links.empty())
+			sendAll(Frame(Opcode::PEER_RELEASE, { username })); // Nodes that granted it hold it for us
+		return won;
+	}
+
+	// After the user holding username logged out
+	void release(const std::string& username)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		if (local.erase(username) > 0)
+			sendAll(Frame(Opcode::PEER_RELEASE, { username }));
+	}
+
+	// True if username is logged in on another node
+	bool knows(const std::string& username)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		return directory.count(username) > 0;
+	}
+
+	// Users of other nodes as "username (node)" lines, for /users
+	std::string remoteUsers()
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		std::set<std::string> lines;
+		for (auto& entry : directory)
+		{
+			lines.insert(entry.first + "(" + entry.second + ")");
+		}
+
+		std::string str;
+		for (const std::string& line : lines)
+		{
+			str += line + "\n";
+		}
+		return str;
+	}
+
+	// Members of room on other nodes
+	std::vector<std::string> remoteMembers(const std::string& room)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		std::vector<std::string> names;
+		for (auto& node : members)
+		{
+			auto it = node.second.find(room);
+			if (it != node.second.end())
+				names.insert(names.end(), it->second.begin(), it->second.end());
+		}
+		return names;
+	}
+
+	// Room chat, once to each node with members in the room
+	void forwardChat(const std::string& room, const Frame& chat)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		if (links.empty())
+			return;
+
+		Frame frame(Opcode::PEER_CHAT, { room, std::string(chat.field(0)), std::string(chat.field(1)) });
+		frame.carryTimestamps(chat);
+		for (auto& link : links)
+		{
+			auto node = members.find(link.first);
+			if (node != members.end() && node->second.count(room) > 0)
+				send(*link.second, frame);
+		}
+	}
+
+	// To the node holding recipient, false if no node does
+	bool forwardWhisper(const std::string& recipient, const Frame& whisper)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		auto held = directory.find(recipient);
+		if (held == directory.end())
+			return false;
+		auto link = links.find(held->second);
+		if (link == links.end())
+			return false;
+
+		Frame frame(Opcode::PEER_WHISPER, { recipient, std::string(whisper.field(0)), std::string(whisper.field(1)) });
+		frame.carryTimestamps(whisper);
+		send(*link->second, frame);
+		return true;
+	}
+
+	// Presence changes of local users, to every node
+	void forwardPresence(const std::string& room, const Changes& changes)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		if (links.empty())
+			return;
+
+		for (Frame& frame : protocol::presence(room, changes))
+		{
+			frame.opcode = Opcode::PEER_PRESENCE;
+			sendAll(frame);
+		}
+	}
+
+	// To one node, ex.) the local room members from FederationHandlers::linkUp
+	void sendTo(const std::string& node, const Frame& frame)
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		auto link = links.find(node);
+		if (link != links.end())
+			send(*link->second, frame);
+	}
+
+	size_t linkCount()
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		return links.size();
+	}
+
+	size_t remoteUserCount()
+	{
+		std::lock_guard <ProfiledMutex> lock(federation_mutex);
+		return directory.size();
+	}
+};
+
+#endif
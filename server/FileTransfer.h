@@ -3,17 +3,21 @@
 
 #include <WinSock2.h>
 #include <Ws2tcpip.h>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <limits>
 #include <string>
 #include <vector>
 #include "Util.h"
+#include "Trace.h"
 
 enum class TransferStatus : uint8_t
 {
 	SUCCESS = 0x01, FAILURE = 0x02, HASH_FAILED = 0x03,
 	CONNECTION_CLOSED = 0x04, SIZE_MISMATCH = 0x05, INCOMPLETE_RECV = 0x06,
 	INCOMPLETE_SEND = 0x07, MISSING_FILE_EXTENSION = 0x08,
-	BUFFER_TOO_SMALL = 0x09,
+	BUFFER_TOO_SMALL = 0x09, FILE_TOO_LARGE = 0x0A,
 };
 
 enum class TransferHeader : uint8_t
@@ -22,6 +26,19 @@ enum class TransferHeader : uint8_t
 	FILE_SIZE = 0x04, HASH = 0x05, HASH_NOT_RECV = 0x06,
 };
 
+enum class TransferCipher : uint8_t
+{
+	BOX = 0x01, // The whole file in one crypto_box, hashed and encrypted before the first chunk is sent
+	STREAM = 0x02, // A crypto_secretstream message per chunk, each read, sealed and sent in turn
+};
+
+// Both ends of a transfer must use the same options
+struct TransferOptions
+{
+	size_t chunkSize = 64 * 1024; // Bytes after each CHUNK header
+	TransferCipher cipher = TransferCipher::BOX;
+};
+
 class FileTransfer
 {
 private:
@@ -39,20 +56,56 @@ private:
 	std::vector <unsigned char> initial_pk;
 	std::vector <unsigned char> initial_sk;
 
+	TransferOptions options;
+	size_t fileSize = 0; // Plaintext bytes
+	std::chrono::steady_clock::time_point firstChunk;
+
+	bool sendAll(SOCKET socket, const unsigned char* data, size_t size)
+	{
+		size_t bytesSent = 0;
+		while (bytesSent < size)
+		{
+			int res = send(socket, reinterpret_cast<const char*>(data + bytesSent), static_cast<int>(size - bytesSent), 0);
+			if (res == SOCKET_ERROR || res == 0)
+			{
+				return false;
+			}
+			bytesSent += res;
+		}
+		return true;
+	}
+
+	bool recvAll(SOCKET socket, unsigned char* data, size_t size)
+	{
+		size_t bytesRead = 0;
+		while (bytesRead < size)
+		{
+			int res = recv(socket, reinterpret_cast<char*>(data + bytesRead), static_cast<int>(size - bytesRead), 0);
+			if (res == SOCKET_ERROR || res == 0)
+			{
+				return false;
+			}
+			bytesRead += res;
+		}
+		return true;
+	}
+
 	size_t recvFileSize(SOCKET socket)
 	{
 		std::vector<unsigned char> encrypted_data(crypto_box_NONCEBYTES + crypto_box_MACBYTES + sizeof(int32_t));
 
 		// receive the encrypted file size
-		int res = recv(socket, reinterpret_cast<char*>(encrypted_data.data()), encrypted_data.size(), 0);
-		if (res == SOCKET_ERROR)
+		if (!recvAll(socket, encrypted_data.data(), encrypted_data.size()))
 		{
 			return 0;
 		}
 		std::vector <unsigned char> decrypted_data = util::decrypt(encrypted_data, peer_public_key, secret_key);
+		if (decrypted_data.size() != sizeof(int32_t))
+		{
+			return 0;
+		}
 		int32_t net_fileSize = util::vectorToInt32(decrypted_data);
-		size_t fileSize = ntohl(net_fileSize);
-		return fileSize;
+		return ntohl(net_fileSize);
 	}
 
 	bool sendHeader(SOCKET sock, TransferHeader header)
@@ -74,14 +127,17 @@ private:
 		// Recv the header, check for errors
 		std::vector<unsigned char> encrypted_header(crypto_box_NONCEBYTES + crypto_box_MACBYTES + sizeof(uint8_t));
 
-		int res = recv(socket, reinterpret_cast<char*>(encrypted_header.data()), encrypted_header.size(), 0);
+		if (!recvAll(socket, encrypted_header.data(), encrypted_header.size()))
+		{
+			return false;
+		}
 		std::vector <unsigned char> decrypted_header = util::decrypt(encrypted_header, peer_public_key, secret_key);
-		TransferHeader header = static_cast<TransferHeader> (decrypted_header[0]);
-		
-		if (res == SOCKET_ERROR)
+		if (decrypted_header.empty())
 		{
 			return false;
 		}
+
+		TransferHeader header = static_cast<TransferHeader> (decrypted_header[0]);
 		if (header == TransferHeader::FAILURE)
 		{
 			return false;
@@ -100,15 +156,26 @@ private:
 	{
 		// Compute a hash
 		std::vector<unsigned char> file_hash(crypto_hash_sha256_BYTES);
-		crypto_hash_sha256(file_hash.data(), reinterpret_cast<unsigned char*>(buffer.data()), buffer.size());
+		{
+			trace::Scope span("transfer_hash");
+			crypto_hash_sha256(file_hash.data(), reinterpret_cast<unsigned char*>(buffer.data()), buffer.size());
+		}
 
 		// Encrypt the data
 		encrypted_buffer.clear();
-		encrypted_buffer = util::encrypt(buffer, peer_public_key, secret_key);
+		{
+			trace::Scope span("transfer_encrypt");
+			span.arg(buffer.size());
+			encrypted_buffer = util::encrypt(buffer, peer_public_key, secret_key);
+		}
 
-		size_t bytesLeft = encrypted_buffer.size(), bytesSent = 0;
-		while (bytesLeft > 0)
+		trace::Scope span("transfer_send");
+		span.arg(encrypted_buffer.size());
+		size_t bytesSent = 0;
+		while (bytesSent < encrypted_buffer.size())
 		{
+			size_t chunk = std::min(options.chunkSize, encrypted_buffer.size() - bytesSent);
+
 			// Send the header
 			if (!sendHeader(socket, TransferHeader::CHUNK))
 			{
@@ -117,30 +184,179 @@ private:
 			}
 
 			// Send the data
-			int res = send(socket, reinterpret_cast<char*>(encrypted_buffer.data() + bytesSent), bytesLeft, 0); // Send the file contents to the server
-			if (res == SOCKET_ERROR)
+			if (!sendAll(socket, encrypted_buffer.data() + bytesSent, chunk))
 			{
 				sendHeader(socket, TransferHeader::FAILURE);
 				return TransferStatus::FAILURE;
 			}
+			bytesSent += chunk;
+		}
 
-			bytesSent += res;
-			bytesLeft -= res;
+		if (!confirmFileHash_send(file_hash, socket)) // Check sums match
+		{
+			return TransferStatus::FAILURE;
 		}
-		
-		if (bytesSent != encrypted_buffer.size())
+		return TransferStatus::SUCCESS;
+	}
+
+	// Only one chunk of the file is in memory at a time
+	TransferStatus sendFileStream(SOCKET socket, std::ifstream& file)
+	{
+		std::vector<unsigned char> key(crypto_secretstream_xchacha20poly1305_KEYBYTES);
+		std::vector<unsigned char> stream_header(crypto_secretstream_xchacha20poly1305_HEADERBYTES);
+		crypto_secretstream_xchacha20poly1305_state state;
+		bool ready = crypto_box_beforenm(key.data(), peer_public_key.data(), secret_key.data()) == 0
+			&& crypto_secretstream_xchacha20poly1305_init_push(&state, stream_header.data(), key.data()) == 0;
+		sodium_memzero(key.data(), key.size());
+		if (!ready || !sendAll(socket, stream_header.data(), stream_header.size()))
 		{
-			sendHeader(socket, TransferHeader::FAILURE);
-			return TransferStatus::INCOMPLETE_SEND;
+			return TransferStatus::FAILURE;
 		}
 
-		if (!confirmFileHash_send(file_hash, socket)) // Check sums match
+		crypto_hash_sha256_state hash_state;
+		crypto_hash_sha256_init(&hash_state);
+		buffer.resize(std::min(options.chunkSize, fileSize));
+		encrypted_buffer.resize(buffer.size() + crypto_secretstream_xchacha20poly1305_ABYTES);
+
+		trace::Scope span("transfer_send");
+		span.arg(fileSize);
+		size_t bytesSent = 0;
+		while (bytesSent < fileSize)
+		{
+			size_t chunk = std::min(options.chunkSize, fileSize - bytesSent);
+			if (!file.read(reinterpret_cast<char*>(buffer.data()), chunk))
+			{
+				sendHeader(socket, TransferHeader::FAILURE);
+				return TransferStatus::FAILURE;
+			}
+			crypto_hash_sha256_update(&hash_state, buffer.data(), chunk);
+
+			unsigned char tag = bytesSent + chunk == fileSize ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : 0;
+			crypto_secretstream_xchacha20poly1305_push(&state, encrypted_buffer.data(), nullptr, buffer.data(), chunk, nullptr, 0, tag);
+			if (!sendHeader(socket, TransferHeader::CHUNK) || !sendAll(socket, encrypted_buffer.data(), chunk + crypto_secretstream_xchacha20poly1305_ABYTES))
+			{
+				sendHeader(socket, TransferHeader::FAILURE);
+				return TransferStatus::FAILURE;
+			}
+			bytesSent += chunk;
+		}
+
+		std::vector<unsigned char> file_hash(crypto_hash_sha256_BYTES);
+		crypto_hash_sha256_final(&hash_state, file_hash.data());
+		if (!confirmFileHash_send(file_hash, socket))
 		{
 			return TransferStatus::FAILURE;
 		}
 		return TransferStatus::SUCCESS;
 	}
 
+	TransferStatus recvFile(SOCKET socket, std::vector<unsigned char>& file_hash)
+	{
+		encrypted_buffer.clear(); // Reset the buffer
+		encrypted_buffer.resize(fileSize + crypto_box_MACBYTES + crypto_box_NONCEBYTES);
+
+		// Receive file contents
+		trace::Scope recvSpan("transfer_recv");
+		recvSpan.arg(encrypted_buffer.size());
+		size_t bytesRead = 0;
+		while (bytesRead < encrypted_buffer.size())
+		{
+			// Check header for an error
+			if (!recvHeader(socket))
+			{
+				return TransferStatus::FAILURE;
+			}
+			if (bytesRead == 0)
+			{
+				firstChunk = std::chrono::steady_clock::now();
+			}
+
+			size_t chunk = std::min(options.chunkSize, encrypted_buffer.size() - bytesRead);
+			if (!recvAll(socket, encrypted_buffer.data() + bytesRead, chunk))
+			{
+				sendHeader(socket, TransferHeader::FAILURE);
+				return TransferStatus::CONNECTION_CLOSED;
+			}
+			bytesRead += chunk;
+		}
+
+		// Decrypt the file
+		buffer.clear();
+		{
+			trace::Scope span("transfer_decrypt");
+			span.arg(encrypted_buffer.size());
+			buffer = util::decrypt(encrypted_buffer, peer_public_key, secret_key);
+		}
+
+		// Compute a hash
+		{
+			trace::Scope span("transfer_hash");
+			crypto_hash_sha256(file_hash.data(), reinterpret_cast<unsigned char*> (buffer.data()), buffer.size());
+		}
+		return TransferStatus::SUCCESS;
+	}
+
+	// Opens each chunk as it arrives, the plaintext is the only full copy of the file in memory
+	TransferStatus recvFileStream(SOCKET socket, std::vector<unsigned char>& file_hash)
+	{
+		std::vector<unsigned char> key(crypto_secretstream_xchacha20poly1305_KEYBYTES);
+		std::vector<unsigned char> stream_header(crypto_secretstream_xchacha20poly1305_HEADERBYTES);
+		crypto_secretstream_xchacha20poly1305_state state;
+		bool ready = crypto_box_beforenm(key.data(), peer_public_key.data(), secret_key.data()) == 0
+			&& recvAll(socket, stream_header.data(), stream_header.size())
+			&& crypto_secretstream_xchacha20poly1305_init_pull(&state, stream_header.data(), key.data()) == 0;
+		sodium_memzero(key.data(), key.size());
+		if (!ready)
+		{
+			return TransferStatus::FAILURE;
+		}
+
+		crypto_hash_sha256_state hash_state;
+		crypto_hash_sha256_init(&hash_state);
+		buffer.clear();
+		buffer.resize(fileSize);
+		encrypted_buffer.resize(std::min(options.chunkSize, fileSize) + crypto_secretstream_xchacha20poly1305_ABYTES);
+
+		trace::Scope recvSpan("transfer_recv");
+		recvSpan.arg(fileSize);
+		size_t bytesRead = 0;
+		unsigned char tag = 0;
+		while (bytesRead < fileSize)
+		{
+			if (!recvHeader(socket))
+			{
+				return TransferStatus::FAILURE;
+			}
+			if (bytesRead == 0)
+			{
+				firstChunk = std::chrono::steady_clock::now();
+			}
+
+			size_t chunk = std::min(options.chunkSize, fileSize - bytesRead);
+			if (!recvAll(socket, encrypted_buffer.data(), chunk + crypto_secretstream_xchacha20poly1305_ABYTES))
+			{
+				sendHeader(socket, TransferHeader::FAILURE);
+				return TransferStatus::CONNECTION_CLOSED;
+			}
+			if (crypto_secretstream_xchacha20poly1305_pull(&state, buffer.data() + bytesRead, nullptr, &tag, encrypted_buffer.data(),
+				chunk + crypto_secretstream_xchacha20poly1305_ABYTES, nullptr, 0) != 0)
+			{
+				sendHeader(socket, TransferHeader::FAILURE);
+				return TransferStatus::HASH_FAILED;
+			}
+			crypto_hash_sha256_update(&hash_state, buffer.data() + bytesRead, chunk);
+			bytesRead += chunk;
+		}
+
+		if (tag != crypto_secretstream_xchacha20poly1305_TAG_FINAL) // Truncated stream
+		{
+			sendHeader(socket, TransferHeader::FAILURE);
+			return TransferStatus::INCOMPLETE_RECV;
+		}
+		crypto_hash_sha256_final(&hash_state, file_hash.data());
+		return TransferStatus::SUCCESS;
+	}
+
 	bool confirmFileHash_send(std::vector<unsigned char>& hash, SOCKET socket)
 	{
 		size_t bytesLeft = hash.size(), bytesSent = 0;
@@ -348,6 +564,24 @@ public:
 		closesocket(sock);
 	}
 
+	// Chunk size and cipher, set the same on both ends before upload or download
+	void setOptions(const TransferOptions& options)
+	{
+		this->options = options;
+	}
+
+	// Plaintext size of the file after upload or download
+	size_t getFileSize()
+	{
+		return fileSize;
+	}
+
+	// When download received the first chunk, ex.) for time to first byte
+	std::chrono::steady_clock::time_point getFirstChunkTime()
+	{
+		return firstChunk;
+	}
+
 	TransferStatus download()
 	{
 		if (!prepareListenSock())
@@ -376,66 +610,22 @@ public:
 		send_pk(peerSock, initial_pk, initial_sk);
 
 		// Receive the file size
-		size_t fileSize = recvFileSize(peerSock);
+		fileSize = recvFileSize(peerSock);
 		if (fileSize == 0)
 		{
 			closesocket(peerSock);
 			return TransferStatus::FAILURE;
 		}
-		encrypted_buffer.clear(); // Reset the buffer
-		encrypted_buffer.resize(fileSize + crypto_box_MACBYTES + crypto_box_NONCEBYTES);
-		fileSize = encrypted_buffer.size();
-
-		// Receive file contents
-		size_t bytesRead = 0;
-		int res;
-		while (bytesRead < fileSize)
-		{
-			// Check header for an error
-			if (!recvHeader(peerSock))
-			{
-				closesocket(peerSock);
-				return TransferStatus::FAILURE;
-			}
-
-			// Receive file contents
-			res = recv(peerSock, reinterpret_cast<char*>(encrypted_buffer.data() + bytesRead), fileSize - bytesRead, 0);
-			if (res == SOCKET_ERROR)
-			{
-				// send error 
-				sendHeader(peerSock, TransferHeader::FAILURE);
-				closesocket(peerSock);
-				return TransferStatus::FAILURE;
-			}
-			if (res == 0) // Server closed connection
-			{
-				if (bytesRead == fileSize)
-				{
-					break;
-				}
-				sendHeader(peerSock, TransferHeader::FAILURE);
-				closesocket(peerSock);
-				return TransferStatus::CONNECTION_CLOSED;
-			}
-
-			bytesRead += res;
-		}
 
-		if (bytesRead != fileSize) // Not all bytes received
+		// Receive, decrypt and hash the file contents
+		std::vector<unsigned char> file_hash(crypto_hash_sha256_BYTES);
+		TransferStatus status = options.cipher == TransferCipher::STREAM ? recvFileStream(peerSock, file_hash) : recvFile(peerSock, file_hash);
+		if (status != TransferStatus::SUCCESS)
 		{
-			sendHeader(peerSock, TransferHeader::FAILURE);
 			closesocket(peerSock);
-			return TransferStatus::INCOMPLETE_RECV;
+			return status;
 		}
 
-		// Decrypt the file
-		buffer.clear();
-		buffer = util::decrypt(encrypted_buffer, peer_public_key, secret_key);
-		
-		// Compute a hash
-		std::vector<unsigned char> file_hash(crypto_hash_sha256_BYTES);
-		crypto_hash_sha256(file_hash.data(), reinterpret_cast<unsigned char*> (buffer.data()), buffer.size());
-
 		// Ensure correct data
 		if (confirmFileHash_recv(file_hash, peerSock))
 		{
@@ -468,9 +658,8 @@ public:
 		send_pk(sock, initial_pk, initial_sk);
 
 		peer_public_key = receive_pk(sock);
-		if (peer_public_key.empty())
+		if (peer_public_key.empty()) // Nothing to encrypt a FAILURE header with
 		{
-			sendHeader(sock, TransferHeader::FAILURE);
 			return TransferStatus::FAILURE;
 		}
 
@@ -480,32 +669,44 @@ public:
 			sendHeader(sock, TransferHeader::FAILURE);
 			return TransferStatus::FAILURE;
 		}
-		int32_t fileSize = file.tellg(); // Get the file size
-		buffer.clear(); // Reset the buffer
-		buffer.resize(fileSize); // Set buffer to correct size
+		std::streamoff size = file.tellg(); // Get the file size
+		if (size < 0 || size > std::numeric_limits<int32_t>::max()) // Sent as an int32
+		{
+			sendHeader(sock, TransferHeader::FAILURE);
+			return TransferStatus::FILE_TOO_LARGE;
+		}
+		fileSize = static_cast<size_t>(size);
 
 		// Send the file size
-		
-		int32_t netFileSize = htonl(fileSize); // Convert file to network byte order
+		int32_t netFileSize = htonl(static_cast<int32_t>(fileSize)); // Convert file to network byte order
 		std::vector<unsigned char> fileSizeVector = util::int32ToVector(netFileSize);
 		std::vector<unsigned char> encrypted_fileSize = util::encrypt(fileSizeVector, peer_public_key, secret_key);
-
-		int res = send(sock, reinterpret_cast<char*>(encrypted_fileSize.data()), encrypted_fileSize.size(), 0);
-		if (res == SOCKET_ERROR)
+		if (!sendAll(sock, encrypted_fileSize.data(), encrypted_fileSize.size()))
 		{
 			sendHeader(sock, TransferHeader::FAILURE);
 			return TransferStatus::FAILURE;
 		}
 
-		// Read the contents of the file into buffer
 		file.seekg(0, std::ios::beg);
-		if (!file.read(reinterpret_cast<char*>(buffer.data()), fileSize))
+		if (options.cipher == TransferCipher::STREAM)
+		{
+			return sendFileStream(sock, file);
+		}
+
+		// Read the contents of the file into buffer
+		buffer.clear(); // Reset the buffer
+		buffer.resize(fileSize); // Set buffer to correct size
 		{
+			trace::Scope span("transfer_read");
+			span.arg(fileSize);
+			if (!file.read(reinterpret_cast<char*>(buffer.data()), fileSize))
+			{
+				file.close();
+				sendHeader(sock, TransferHeader::FAILURE);
+				return TransferStatus::FAILURE;
+			}
 			file.close();
-			sendHeader(sock, TransferHeader::FAILURE);
-			return TransferStatus::FAILURE;
 		}
-		file.close();
 
 		return sendFile(sock); // Send the file contents
 	}
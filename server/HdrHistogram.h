@@ -0,0 +1,139 @@
+#ifndef HDRHISTOGRAM_H
+#define HDRHISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// High dynamic range histogram of non-negative integer values, ex.) latencies in microseconds
+// Values are kept to within 1 / HALF_COUNT (under 1%) of their size over the whole range, so p99.9 of a
+// latency that spans microseconds to minutes is still exact enough to compare. Buckets are log-linear:
+// the first SUB_BUCKETS values are exact, then every doubling of the value is split into HALF_COUNT
+// linear steps. Recording is a few shifts and a relaxed atomic add, safe from any number of threads.
+class HdrHistogram
+{
+public:
+	static const unsigned SUB_BITS = 7;
+	static const uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BITS;
+	static const uint64_t HALF_COUNT = SUB_BUCKETS / 2;
+	static const unsigned MAX_SHIFT = 34; // Largest tracked value about 2^41, ex.) 25 days in microseconds
+	static const size_t BUCKETS = SUB_BUCKETS + MAX_SHIFT * HALF_COUNT;
+
+private:
+	std::atomic <uint64_t> counts[BUCKETS] = {};
+	std::atomic <uint64_t> total = 0;
+	std::atomic <uint64_t> sum = 0;
+	std::atomic <uint64_t> maximum = 0;
+
+	static unsigned bitWidth(uint64_t value)
+	{
+		unsigned width = 0;
+		while (value != 0)
+		{
+			value >>= 1;
+			width++;
+		}
+		return width;
+	}
+
+	static size_t indexOf(uint64_t value)
+	{
+		if (value < SUB_BUCKETS)
+			return static_cast<size_t>(value);
+
+		unsigned shift = bitWidth(value) - SUB_BITS;
+		if (shift > MAX_SHIFT)
+			return BUCKETS - 1;
+		return static_cast<size_t>(SUB_BUCKETS + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT));
+	}
+
+	// Largest value that lands in bucket index
+	static uint64_t highestEquivalent(size_t index)
+	{
+		if (index < SUB_BUCKETS)
+			return index;
+
+		uint64_t shift = (index - SUB_BUCKETS) / HALF_COUNT + 1;
+		uint64_t offset = (index - SUB_BUCKETS) % HALF_COUNT;
+		return ((HALF_COUNT + offset + 1) << shift) - 1;
+	}
+
+public:
+	void record(uint64_t value)
+	{
+		counts[indexOf(value)].fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+
+		uint64_t current = maximum.load(std::memory_order_relaxed);
+		while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void reset()
+	{
+		for (auto& count : counts)
+			count.store(0, std::memory_order_relaxed);
+		total = 0;
+		sum = 0;
+		maximum = 0;
+	}
+
+	uint64_t count() const
+	{
+		return total.load(std::memory_order_relaxed);
+	}
+
+	uint64_t getSum() const
+	{
+		return sum.load(std::memory_order_relaxed);
+	}
+
+	uint64_t max() const
+	{
+		return maximum.load(std::memory_order_relaxed);
+	}
+
+	double mean() const
+	{
+		uint64_t n = count();
+		return n == 0 ? 0 : static_cast<double>(getSum()) / n;
+	}
+
+	// Value at or below which fraction q (0..1) of the recorded values fall
+	uint64_t percentile(double q) const
+	{
+		uint64_t n = count();
+		if (n == 0)
+			return 0;
+
+		uint64_t rank = static_cast<uint64_t>(q * n + 0.5);
+		rank = rank == 0 ? 1 : (rank > n ? n : rank);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			seen += counts[i].load(std::memory_order_relaxed);
+			if (seen >= rank)
+			{
+				uint64_t value = highestEquivalent(i);
+				return value < max() ? value : max();
+			}
+		}
+		return max();
+	}
+
+	// One line, ex.) "count=120 p50=410 p90=690 p99=1200 p99.9=2100 max=2300 us"
+	std::string summary(const std::string& unit) const
+	{
+		char line[256];
+		std::snprintf(line, sizeof(line), "count=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu %s",
+			static_cast<unsigned long long>(count()), static_cast<unsigned long long>(percentile(0.5)),
+			static_cast<unsigned long long>(percentile(0.9)), static_cast<unsigned long long>(percentile(0.99)),
+			static_cast<unsigned long long>(percentile(0.999)), static_cast<unsigned long long>(max()), unit.c_str());
+		return line;
+	}
+};
+
+#endif
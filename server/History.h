@@ -0,0 +1,108 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "ProfiledMutex.h"
+
+// Recent encoded frames of a room, bounded by message count and by bytes
+// Frames are packed back to back in one arena that is reused as a ring, the index
+// only holds offsets so recording a message never allocates.
+class MessageHistory
+{
+private:
+	struct Entry
+	{
+		size_t offset;
+		size_t size;
+	};
+
+	std::vector<unsigned char> arena;
+	std::vector<Entry> entries; // Ring of maxMessages slots, oldest at head
+	size_t head = 0;
+	size_t count = 0;
+	size_t tail = 0; // Next free byte in the arena
+	size_t bytes = 0;
+	ProfiledMutex history_mutex{ "MessageHistory::history_mutex" };
+
+	void popOldest()
+	{
+		bytes -= entries[head].size;
+		head = (head + 1) % entries.size();
+		count--;
+	}
+
+	bool overlaps(const Entry& entry, size_t offset, size_t size)
+	{
+		return entry.offset < offset + size && offset < entry.offset + entry.size;
+	}
+
+public:
+	static const size_t DEFAULT_MESSAGES = 100;
+	static const size_t DEFAULT_BYTES = 64 * 1024;
+
+	MessageHistory(size_t maxMessages = DEFAULT_MESSAGES, size_t maxBytes = DEFAULT_BYTES)
+	{
+		arena.resize(maxBytes);
+		entries.resize(maxMessages > 0 ? maxMessages : 1);
+	}
+
+	// Frames larger than the whole arena are not kept
+	bool append(const std::vector<unsigned char>& frame)
+	{
+		size_t size = frame.size();
+		if (size == 0 || size > arena.size())
+			return false;
+
+		std::lock_guard <ProfiledMutex> lock(history_mutex);
+		if (tail + size > arena.size())
+		{
+			// Whatever is left past tail was written on the previous lap, older than anything at the front
+			while (count > 0 && entries[head].offset >= tail)
+				popOldest();
+			tail = 0;
+		}
+
+		// The oldest entry is always the next one after tail in the arena
+		while (count > 0 && (count == entries.size() || overlaps(entries[head], tail, size)))
+			popOldest();
+
+		std::memcpy(arena.data() + tail, frame.data(), size);
+		entries[(head + count) % entries.size()] = { tail, size };
+		count++;
+		tail += size;
+		bytes += size;
+		return true;
+	}
+
+	// Copies out the newest limit frames, oldest first
+	std::vector<std::vector<unsigned char>> recent(size_t limit = DEFAULT_MESSAGES)
+	{
+		std::lock_guard <ProfiledMutex> lock(history_mutex);
+		size_t n = count < limit ? count : limit;
+
+		std::vector<std::vector<unsigned char>> frames;
+		frames.reserve(n);
+		for (size_t i = count - n; i < count; i++)
+		{
+			const Entry& entry = entries[(head + i) % entries.size()];
+			frames.emplace_back(arena.begin() + entry.offset, arena.begin() + entry.offset + entry.size);
+		}
+		return frames;
+	}
+
+	size_t size()
+	{
+		std::lock_guard <ProfiledMutex> lock(history_mutex);
+		return count;
+	}
+
+	size_t byteSize()
+	{
+		std::lock_guard <ProfiledMutex> lock(history_mutex);
+		return bytes;
+	}
+};
+
+#endif
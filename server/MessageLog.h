@@ -0,0 +1,662 @@
+#ifndef MESSAGELOG_H
+#define MESSAGELOG_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ProfiledMutex.h"
+
+// Append only, on disk record of the chat
+//
+// <dir>/<base sequence>.log  records back to back, a new segment starts once SEGMENT_SIZE is reached
+// <dir>/<base sequence>.idx  sparse index, {sequence, offset} for every INDEX_INTERVAL'th record
+//
+// Record: [u32 size of the rest][u64 sequence][i64 unix time ms][u8 channel length][channel][encoded frame]
+// Channels: "#room" for room chat, "*" for server wide frames, the recipients username for whispers
+enum class FsyncPolicy : uint8_t
+{
+	NEVER = 0x01, INTERVAL = 0x02, EVERY_COMMIT = 0x03,
+};
+
+struct LogRecord
+{
+	uint64_t sequence = 0;
+	int64_t timestamp = 0;
+	std::string channel;
+	std::vector<unsigned char> frame;
+};
+
+// Read only view of a whole file, released on destruction
+class MappedFile
+{
+private:
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	const unsigned char* view = nullptr;
+	size_t length = 0;
+
+public:
+	MappedFile(const std::string& path)
+	{
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) // Empty files cannot be mapped
+			return;
+
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL)
+			return;
+
+		view = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (view != nullptr)
+			length = static_cast<size_t>(size.QuadPart);
+	}
+
+	~MappedFile()
+	{
+		if (view != nullptr)
+			UnmapViewOfFile(view);
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const unsigned char* data() const
+	{
+		return view;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+};
+
+class MessageLog
+{
+private:
+	struct IndexEntry
+	{
+		uint64_t sequence;
+		uint64_t offset;
+	};
+
+	static const size_t RECORD_HEADER = 4 + 8 + 8 + 1;
+	static const size_t MAX_RECORD_SIZE = 1024 * 1024;
+
+	std::string directory;
+	size_t segmentSize;
+	FsyncPolicy policy;
+	std::chrono::milliseconds fsyncInterval;
+
+	// Filled by append, swapped out whole by the writer thread (group commit)
+	std::vector<unsigned char> pending;
+	ProfiledMutex pending_mutex{ "MessageLog::pending_mutex" };
+	std::condition_variable_any pending_condition;
+	uint64_t nextSequence = 0;
+	bool running = false;
+	bool syncRequested = false;
+
+	// Writer thread state
+	std::thread writer;
+	HANDLE segmentFile = INVALID_HANDLE_VALUE;
+	HANDLE indexFile = INVALID_HANDLE_VALUE;
+	uint64_t segmentBytes = 0;
+	uint64_t segmentRecords = 0;
+
+	// Segment bases and how far the files are written, shared with readers
+	std::vector<uint64_t> segments;
+	ProfiledMutex segments_mutex{ "MessageLog::segments_mutex" };
+	std::condition_variable_any written_condition;
+	uint64_t writtenSequence = 0; // Every record below this is in the segment files or counted in dropped
+	uint64_t syncedSequence = 0;  // ... and below this also flushed to disk
+
+	std::atomic <uint64_t> dropped = 0;
+
+	std::string segmentPath(uint64_t base, const char* extension)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(base));
+		return (std::filesystem::path(directory) / (std::string(name) + extension)).string();
+	}
+
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	static bool writeAll(HANDLE file, const unsigned char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1 << 30));
+			DWORD written = 0;
+			if (!WriteFile(file, data, chunk, &written, NULL) || written == 0)
+				return false;
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	// Parses the record at data[pos], false if it is cut short or corrupt
+	static bool parseRecord(const unsigned char* data, size_t size, size_t pos, LogRecord* record, size_t& next)
+	{
+		if (pos + RECORD_HEADER > size)
+			return false;
+
+		uint32_t length;
+		std::memcpy(&length, data + pos, 4);
+		if (length < RECORD_HEADER - 4 || length > MAX_RECORD_SIZE || pos + 4 + length > size)
+			return false;
+
+		size_t channelLength = data[pos + 20];
+		if (RECORD_HEADER - 4 + channelLength > length)
+			return false;
+
+		if (record != nullptr)
+		{
+			std::memcpy(&record->sequence, data + pos + 4, 8);
+			std::memcpy(&record->timestamp, data + pos + 12, 8);
+			const unsigned char* channel = data + pos + RECORD_HEADER;
+			record->channel.assign(reinterpret_cast<const char*>(channel), channelLength);
+			record->frame.assign(channel + channelLength, data + pos + 4 + length);
+		}
+		next = pos + 4 + length;
+		return true;
+	}
+
+	static uint64_t recordSequence(const unsigned char* data, size_t pos)
+	{
+		uint64_t sequence;
+		std::memcpy(&sequence, data + pos + 4, 8);
+		return sequence;
+	}
+
+	void closeSegment()
+	{
+		if (segmentFile != INVALID_HANDLE_VALUE)
+		{
+			FlushFileBuffers(segmentFile);
+			CloseHandle(segmentFile);
+			segmentFile = INVALID_HANDLE_VALUE;
+		}
+		if (indexFile != INVALID_HANDLE_VALUE)
+		{
+			FlushFileBuffers(indexFile);
+			CloseHandle(indexFile);
+			indexFile = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	bool openSegment(uint64_t base, DWORD disposition)
+	{
+		segmentFile = CreateFileA(segmentPath(base, ".log").c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+		indexFile = CreateFileA(segmentPath(base, ".idx").c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+		return segmentFile != INVALID_HANDLE_VALUE && indexFile != INVALID_HANDLE_VALUE;
+	}
+
+	bool rollSegment(uint64_t base)
+	{
+		closeSegment();
+		if (!openSegment(base, CREATE_ALWAYS))
+		{
+			closeSegment();
+			return false;
+		}
+
+		segmentBytes = 0;
+		segmentRecords = 0;
+		std::lock_guard <ProfiledMutex> lock(segments_mutex);
+		segments.push_back(base);
+		return true;
+	}
+
+	// Finds where the newest segment really ends and rebuilds its index, a crash can leave a torn record behind
+	bool recover()
+	{
+		std::vector<uint64_t> bases;
+		for (auto& entry : std::filesystem::directory_iterator(directory))
+		{
+			if (entry.path().extension() != ".log")
+				continue;
+			try
+			{
+				bases.push_back(std::stoull(entry.path().stem().string()));
+			}
+			catch (std::exception&)
+			{
+				continue; // Not one of ours
+			}
+		}
+		std::sort(bases.begin(), bases.end());
+
+		if (bases.empty())
+			return rollSegment(0);
+
+		uint64_t last = bases.back();
+		size_t end = 0;
+		uint64_t next = last;
+		std::vector<IndexEntry> index;
+		{
+			MappedFile file(segmentPath(last, ".log"));
+			size_t pos = 0, after;
+			while (parseRecord(file.data(), file.size(), pos, nullptr, after))
+			{
+				uint64_t sequence = recordSequence(file.data(), pos);
+				if (segmentRecords % INDEX_INTERVAL == 0)
+					index.push_back({ sequence, pos });
+				segmentRecords++;
+				next = sequence + 1;
+				pos = after;
+			}
+			end = pos;
+		}
+
+		// Cut the torn tail and rewrite the index
+		HANDLE file = CreateFileA(segmentPath(last, ".log").c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER offset;
+		offset.QuadPart = static_cast<LONGLONG>(end);
+		bool truncated = SetFilePointerEx(file, offset, NULL, FILE_BEGIN) && SetEndOfFile(file);
+		CloseHandle(file);
+		if (!truncated)
+			return false;
+
+		HANDLE idx = CreateFileA(segmentPath(last, ".idx").c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (idx == INVALID_HANDLE_VALUE)
+			return false;
+		bool rebuilt = writeAll(idx, reinterpret_cast<const unsigned char*>(index.data()), index.size() * sizeof(IndexEntry));
+		CloseHandle(idx);
+		if (!rebuilt || !openSegment(last, OPEN_EXISTING))
+			return false;
+
+		segmentBytes = end;
+		segments = bases;
+		nextSequence = next;
+		writtenSequence = next;
+		syncedSequence = next;
+		return true;
+	}
+
+	// Writes a batch of whole records, rolling segments on record boundaries
+	// end is the sequence after the batch, readers see the batch once it is written
+	// A failed write abandons the segment, so a segment only ever holds whole records at indexed offsets, and
+	// the next record starts a new one. Records that did not make it into a .log are counted in dropped.
+	void writeBatch(const std::vector<unsigned char>& batch, uint64_t end)
+	{
+		std::vector<IndexEntry> index;
+		size_t start = 0, pos = 0, after;
+		uint64_t bytes = segmentBytes, records = segmentRecords; // Including batch[start, pos)
+
+		auto flushRange = [&]
+		{
+			bool logged = writeAll(segmentFile, batch.data() + start, pos - start);
+			if (!logged || !writeAll(indexFile, reinterpret_cast<const unsigned char*>(index.data()), index.size() * sizeof(IndexEntry)))
+			{
+				if (!logged)
+					dropped += records - segmentRecords;
+				closeSegment();
+			}
+			segmentBytes = bytes;
+			segmentRecords = records;
+			index.clear();
+			start = pos;
+		};
+
+		while (parseRecord(batch.data(), batch.size(), pos, nullptr, after))
+		{
+			uint64_t sequence = recordSequence(batch.data(), pos);
+			size_t size = after - pos;
+			bool full = bytes > 0 && bytes + size > segmentSize;
+			if (full)
+				flushRange();
+			if (full || segmentFile == INVALID_HANDLE_VALUE)
+			{
+				if (!rollSegment(sequence))
+				{
+					for (; parseRecord(batch.data(), batch.size(), pos, nullptr, after); pos = after)
+						dropped++; // Nowhere to write them, the next batch tries a new segment again
+					start = pos;
+					break;
+				}
+				bytes = 0;
+				records = 0;
+			}
+
+			if (records % INDEX_INTERVAL == 0)
+				index.push_back({ sequence, bytes });
+			records++;
+			bytes += size;
+			pos = after;
+		}
+		if (start < pos)
+			flushRange();
+
+		std::lock_guard <ProfiledMutex> lock(segments_mutex);
+		writtenSequence = end;
+		written_condition.notify_all();
+	}
+
+	void sync()
+	{
+		FlushFileBuffers(segmentFile);
+		FlushFileBuffers(indexFile);
+
+		std::lock_guard <ProfiledMutex> lock(segments_mutex);
+		syncedSequence = writtenSequence;
+		written_condition.notify_all();
+	}
+
+	void writerLoop()
+	{
+		std::vector<unsigned char> batch;
+		auto lastSync = std::chrono::steady_clock::now();
+		bool unsynced = false;
+
+		while (true)
+		{
+			uint64_t end;
+			bool forced;
+			{
+				std::unique_lock <ProfiledMutex> lock(pending_mutex);
+				pending_condition.wait_for(lock, fsyncInterval, [this] { return !running || syncRequested || !pending.empty(); });
+				if (pending.empty() && !running)
+					break;
+				batch.swap(pending);
+				end = nextSequence;
+				forced = syncRequested;
+				syncRequested = false;
+			}
+
+			if (!batch.empty())
+			{
+				writeBatch(batch, end);
+				batch.clear();
+				unsynced = true;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			if (forced || (unsynced && (policy == FsyncPolicy::EVERY_COMMIT || (policy == FsyncPolicy::INTERVAL && now - lastSync >= fsyncInterval))))
+			{
+				sync();
+				lastSync = now;
+				unsynced = false;
+			}
+		}
+		sync();
+	}
+
+public:
+	static const uint64_t INDEX_INTERVAL = 64;
+	static const size_t SEGMENT_SIZE = 64 * 1024 * 1024;
+	static const size_t MAX_PENDING = 64 * 1024 * 1024; // Appends past this are dropped rather than blocking the caller
+
+	MessageLog(const std::string& directory = "chat_log", FsyncPolicy policy = FsyncPolicy::INTERVAL,
+		unsigned fsyncIntervalMs = 100, size_t segmentSize = SEGMENT_SIZE)
+	{
+		this->directory = directory;
+		this->policy = policy;
+		this->fsyncInterval = std::chrono::milliseconds(fsyncIntervalMs > 0 ? fsyncIntervalMs : 1);
+		this->segmentSize = segmentSize;
+	}
+
+	~MessageLog()
+	{
+		close();
+	}
+
+	// Before open, ex.) from the servers config
+	void configure(const std::string& directory, FsyncPolicy policy, unsigned fsyncIntervalMs)
+	{
+		this->directory = directory;
+		this->policy = policy;
+		this->fsyncInterval = std::chrono::milliseconds(fsyncIntervalMs > 0 ? fsyncIntervalMs : 1);
+	}
+
+	// Opens or recovers the log and starts the writer, false if the directory is unusable
+	bool open()
+	{
+		if (running)
+			return true;
+
+		try
+		{
+			std::filesystem::create_directories(directory);
+			if (!recover())
+				return false;
+		}
+		catch (std::exception&)
+		{
+			return false;
+		}
+
+		running = true;
+		writer = std::thread(&MessageLog::writerLoop, this);
+		return true;
+	}
+
+	// Drains everything appended so far to disk and stops the writer
+	void close()
+	{
+		{
+			std::lock_guard <ProfiledMutex> lock(pending_mutex);
+			if (!running)
+				return;
+			running = false;
+		}
+		pending_condition.notify_one();
+		writer.join();
+		closeSegment();
+	}
+
+	bool isOpen()
+	{
+		std::lock_guard <ProfiledMutex> lock(pending_mutex);
+		return running;
+	}
+
+	// Copies the record into the pending batch and returns, the disk is only touched by the writer thread
+	// Returns the records sequence number, or UINT64_MAX if the log is closed or too far behind
+	uint64_t append(const std::string& channel, const std::vector<unsigned char>& frame)
+	{
+		size_t channelLength = std::min<size_t>(channel.size(), 0xFF);
+		uint32_t length = static_cast<uint32_t>(RECORD_HEADER - 4 + channelLength + frame.size());
+		if (length > MAX_RECORD_SIZE)
+		{
+			dropped++;
+			return UINT64_MAX;
+		}
+		int64_t timestamp = now();
+
+		std::unique_lock <ProfiledMutex> lock(pending_mutex);
+		if (!running || pending.size() + 4 + length > MAX_PENDING)
+		{
+			dropped++;
+			return UINT64_MAX;
+		}
+
+		uint64_t sequence = nextSequence++;
+		size_t pos = pending.size();
+		bool wake = pos == 0;
+		pending.resize(pos + 4 + length);
+		unsigned char* out = pending.data() + pos;
+		std::memcpy(out, &length, 4);
+		std::memcpy(out + 4, &sequence, 8);
+		std::memcpy(out + 12, &timestamp, 8);
+		out[20] = static_cast<unsigned char>(channelLength);
+		std::memcpy(out + RECORD_HEADER, channel.data(), channelLength);
+		if (!frame.empty())
+			std::memcpy(out + RECORD_HEADER + channelLength, frame.data(), frame.size());
+		lock.unlock();
+
+		if (wake)
+			pending_condition.notify_one();
+		return sequence;
+	}
+
+	// Blocks until every record appended before the call is written, and flushed to disk if durable is set
+	void flush(bool durable = false)
+	{
+		uint64_t target;
+		{
+			std::lock_guard <ProfiledMutex> lock(pending_mutex);
+			if (!running)
+				return;
+			target = nextSequence;
+			syncRequested = syncRequested || durable;
+		}
+		pending_condition.notify_one();
+
+		std::unique_lock <ProfiledMutex> lock(segments_mutex);
+		written_condition.wait(lock, [&] { return (durable ? syncedSequence : writtenSequence) >= target; });
+	}
+
+	// Up to maxCount records starting at sequence from, located through the sparse index and read via mmap
+	std::vector<LogRecord> read(uint64_t from, size_t maxCount)
+	{
+		std::vector<LogRecord> records;
+		std::vector<uint64_t> bases;
+		uint64_t end;
+		{
+			std::lock_guard <ProfiledMutex> lock(segments_mutex);
+			bases = segments;
+			end = writtenSequence;
+		}
+
+		auto it = std::upper_bound(bases.begin(), bases.end(), from);
+		size_t segment = it == bases.begin() ? 0 : static_cast<size_t>(it - bases.begin() - 1);
+
+		for (; segment < bases.size() && records.size() < maxCount && from < end; segment++)
+		{
+			size_t pos = 0;
+			{
+				MappedFile idx(segmentPath(bases[segment], ".idx"));
+				const IndexEntry* entries = reinterpret_cast<const IndexEntry*>(idx.data());
+				size_t count = idx.size() / sizeof(IndexEntry);
+				const IndexEntry* hit = std::upper_bound(entries, entries + count, from,
+					[](uint64_t sequence, const IndexEntry& entry) { return sequence < entry.sequence; });
+				if (hit != entries)
+					pos = static_cast<size_t>((hit - 1)->offset);
+			}
+
+			MappedFile log(segmentPath(bases[segment], ".log"));
+			size_t after;
+			LogRecord record;
+			while (records.size() < maxCount && parseRecord(log.data(), log.size(), pos, nullptr, after))
+			{
+				uint64_t sequence = recordSequence(log.data(), pos);
+				if (sequence >= end)
+					break;
+				if (sequence >= from)
+				{
+					parseRecord(log.data(), log.size(), pos, &record, after);
+					records.push_back(record);
+					from = sequence + 1;
+				}
+				pos = after;
+			}
+		}
+		return records;
+	}
+
+	// The records with the given sequence numbers in the order asked for, those not in the log left out
+	// Each segment is mapped once however many of them it holds, ex.) the hits of a search
+	std::vector<LogRecord> read(const std::vector<uint64_t>& sequences)
+	{
+		std::vector<uint64_t> bases;
+		uint64_t end;
+		{
+			std::lock_guard <ProfiledMutex> lock(segments_mutex);
+			bases = segments;
+			end = writtenSequence;
+		}
+
+		std::vector<uint64_t> wanted(sequences);
+		std::sort(wanted.begin(), wanted.end());
+		wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+		std::vector<LogRecord> found; // Ascending
+		size_t next = 0;
+		while (next < wanted.size() && wanted[next] < end)
+		{
+			auto it = std::upper_bound(bases.begin(), bases.end(), wanted[next]);
+			if (it == bases.begin())
+			{
+				next++;
+				continue;
+			}
+			size_t segment = static_cast<size_t>(it - bases.begin() - 1);
+			uint64_t limit = segment + 1 < bases.size() ? std::min(bases[segment + 1], end) : end;
+
+			MappedFile idx(segmentPath(bases[segment], ".idx"));
+			MappedFile log(segmentPath(bases[segment], ".log"));
+			const IndexEntry* entries = reinterpret_cast<const IndexEntry*>(idx.data());
+			size_t count = idx.size() / sizeof(IndexEntry);
+			size_t pos = 0, after;
+			for (; next < wanted.size() && wanted[next] < limit; next++)
+			{
+				const IndexEntry* hit = std::upper_bound(entries, entries + count, wanted[next],
+					[](uint64_t sequence, const IndexEntry& entry) { return sequence < entry.sequence; });
+				if (hit != entries)
+					pos = std::max(pos, static_cast<size_t>((hit - 1)->offset));
+				while (parseRecord(log.data(), log.size(), pos, nullptr, after) && recordSequence(log.data(), pos) < wanted[next])
+					pos = after;
+
+				LogRecord record;
+				if (parseRecord(log.data(), log.size(), pos, &record, after) && record.sequence == wanted[next])
+				{
+					found.push_back(std::move(record));
+					pos = after;
+				}
+			}
+		}
+
+		std::vector<LogRecord> records;
+		for (uint64_t sequence : sequences)
+		{
+			auto hit = std::lower_bound(found.begin(), found.end(), sequence, [](const LogRecord& record, uint64_t sequence) { return record.sequence < sequence; });
+			if (hit != found.end() && hit->sequence == sequence)
+				records.push_back(*hit);
+		}
+		return records;
+	}
+
+	uint64_t getDropped()
+	{
+		return dropped;
+	}
+
+	// Appended bytes the writer has not picked up yet
+	size_t getPendingBytes()
+	{
+		std::lock_guard <ProfiledMutex> lock(pending_mutex);
+		return pending.size();
+	}
+
+	uint64_t getNextSequence()
+	{
+		std::lock_guard <ProfiledMutex> lock(pending_mutex);
+		return nextSequence;
+	}
+};
+
+#endif
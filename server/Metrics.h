@@ -0,0 +1,483 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HdrHistogram.h"
+
+// Counters, gauges and histograms for the server, exported in Prometheus text format and summarized by /stats
+// Updates are a relaxed atomic add on a slot owned by the calling thread, so hot paths never share a cache line
+// or take a lock. Reads sum the slots and may be slightly behind concurrent updates.
+namespace metrics
+{
+	const size_t SHARDS = 16; // Threads beyond this share slots, still lock free
+
+	// Slot of the calling thread, assigned round robin on first use
+	size_t shard()
+	{
+		static std::atomic <size_t> next = 0;
+		thread_local size_t index = next++ % SHARDS;
+		return index;
+	}
+
+	struct alignas(64) Slot
+	{
+		std::atomic <uint64_t> value = 0;
+	};
+
+	class Counter
+	{
+	private:
+		Slot slots[SHARDS];
+
+	public:
+		void add(uint64_t amount = 1)
+		{
+			slots[shard()].value.fetch_add(amount, std::memory_order_relaxed);
+		}
+
+		uint64_t value() const
+		{
+			uint64_t total = 0;
+			for (const Slot& slot : slots)
+				total += slot.value.load(std::memory_order_relaxed);
+			return total;
+		}
+	};
+
+	// Current level of something, ex.) connected users, set by whoever owns it
+	class Gauge
+	{
+	private:
+		std::atomic <int64_t> current = 0;
+
+	public:
+		void set(int64_t value)
+		{
+			current.store(value, std::memory_order_relaxed);
+		}
+
+		void add(int64_t amount)
+		{
+			current.fetch_add(amount, std::memory_order_relaxed);
+		}
+
+		int64_t value() const
+		{
+			return current.load(std::memory_order_relaxed);
+		}
+	};
+
+	// Power of two buckets over integer values, bucket i holds values of bit width i (0, 1, 2-3, 4-7, ...)
+	// scale converts recorded units to exported ones, ex.) 1e-9 for nanoseconds exported as seconds
+	class Histogram
+	{
+	public:
+		static constexpr size_t MAX_BUCKETS = 48;
+
+		struct Snapshot
+		{
+			std::vector<uint64_t> buckets;
+			uint64_t count = 0;
+			uint64_t sum = 0;
+
+			// Upper bound of the bucket holding quantile q, in recorded units
+			uint64_t quantile(double q) const
+			{
+				if (count == 0)
+					return 0;
+				uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+				uint64_t seen = 0;
+				for (size_t i = 0; i < buckets.size(); i++)
+				{
+					seen += buckets[i];
+					if (seen >= rank)
+						return upperBound(i);
+				}
+				return upperBound(buckets.size() - 1);
+			}
+		};
+
+	private:
+		struct alignas(64) Shard
+		{
+			std::atomic <uint64_t> buckets[MAX_BUCKETS] = {};
+			std::atomic <uint64_t> count = 0;
+			std::atomic <uint64_t> sum = 0;
+		};
+
+		Shard shards[SHARDS];
+		size_t bucketCount;
+
+	public:
+		const double scale;
+
+		Histogram(size_t bucketCount, double scale)
+			: bucketCount(std::min(bucketCount, MAX_BUCKETS)), scale(scale)
+		{
+		}
+
+		static uint64_t upperBound(size_t bucket)
+		{
+			return bucket == 0 ? 0 : (bucket >= 64 ? UINT64_MAX : (uint64_t(1) << bucket) - 1);
+		}
+
+		void record(uint64_t value)
+		{
+			size_t bucket = 0;
+			for (uint64_t v = value; v != 0; v >>= 1)
+				bucket++;
+			bucket = std::min(bucket, bucketCount - 1); // Larger values land in the last bucket
+
+			Shard& s = shards[shard()];
+			s.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+			s.count.fetch_add(1, std::memory_order_relaxed);
+			s.sum.fetch_add(value, std::memory_order_relaxed);
+		}
+
+		Snapshot snapshot() const
+		{
+			Snapshot snap;
+			snap.buckets.assign(bucketCount, 0);
+			for (const Shard& s : shards)
+			{
+				for (size_t i = 0; i < bucketCount; i++)
+					snap.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+				snap.count += s.count.load(std::memory_order_relaxed);
+				snap.sum += s.sum.load(std::memory_order_relaxed);
+			}
+			return snap;
+		}
+	};
+
+	// Times a scope into a histogram recorded in nanoseconds
+	class Timer
+	{
+	private:
+		Histogram& histogram;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	public:
+		Timer(Histogram& histogram) : histogram(histogram)
+		{
+		}
+
+		~Timer()
+		{
+			histogram.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+		}
+	};
+
+	// Owns every metric, registration happens once at startup, updates never touch the registry
+	class Registry
+	{
+	private:
+		enum class Kind : uint8_t
+		{
+			COUNTER = 0x01, GAUGE = 0x02, HISTOGRAM = 0x03, LATENCY = 0x04,
+		};
+
+		struct Entry
+		{
+			std::string name;
+			std::string help;
+			Kind kind;
+			void* metric;
+			double scale = 1; // LATENCY only, histograms keep their own
+		};
+
+		std::deque<Counter> counters; // deque, references stay valid as metrics are added
+		std::deque<Gauge> gauges;
+		std::deque<Histogram> histograms;
+		std::deque<HdrHistogram> latencies;
+		std::vector<Entry> entries;
+		std::mutex registry_mutex;
+
+		static std::string number(double value)
+		{
+			std::ostringstream out;
+			out << std::setprecision(12) << value;
+			return out.str();
+		}
+
+	public:
+		Counter& counter(const std::string& name, const std::string& help)
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			counters.emplace_back();
+			entries.push_back({ name, help, Kind::COUNTER, &counters.back() });
+			return counters.back();
+		}
+
+		Gauge& gauge(const std::string& name, const std::string& help)
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			gauges.emplace_back();
+			entries.push_back({ name, help, Kind::GAUGE, &gauges.back() });
+			return gauges.back();
+		}
+
+		Histogram& histogram(const std::string& name, const std::string& help, size_t buckets, double scale = 1)
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			histograms.emplace_back(buckets, scale);
+			entries.push_back({ name, help, Kind::HISTOGRAM, &histograms.back() });
+			return histograms.back();
+		}
+
+		// Percentiles to under 1% error, exported as a Prometheus summary
+		HdrHistogram& latency(const std::string& name, const std::string& help, double scale = 1)
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			latencies.emplace_back();
+			entries.push_back({ name, help, Kind::LATENCY, &latencies.back(), scale });
+			return latencies.back();
+		}
+
+		// Prometheus text exposition format
+		std::string prometheus()
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			std::string out;
+			for (const Entry& entry : entries)
+			{
+				out += "# HELP " + entry.name + " " + entry.help + "\n";
+				switch (entry.kind)
+				{
+				case Kind::COUNTER:
+					out += "# TYPE " + entry.name + " counter\n";
+					out += entry.name + " " + std::to_string(static_cast<Counter*>(entry.metric)->value()) + "\n";
+					break;
+				case Kind::GAUGE:
+					out += "# TYPE " + entry.name + " gauge\n";
+					out += entry.name + " " + std::to_string(static_cast<Gauge*>(entry.metric)->value()) + "\n";
+					break;
+				case Kind::HISTOGRAM:
+				{
+					Histogram* histogram = static_cast<Histogram*>(entry.metric);
+					Histogram::Snapshot snap = histogram->snapshot();
+					out += "# TYPE " + entry.name + " histogram\n";
+					uint64_t cumulative = 0;
+					for (size_t i = 0; i + 1 < snap.buckets.size(); i++)
+					{
+						cumulative += snap.buckets[i];
+						out += entry.name + "_bucket{le=\"" + number(Histogram::upperBound(i) * histogram->scale) + "\"} " + std::to_string(cumulative) + "\n";
+					}
+					out += entry.name + "_bucket{le=\"+Inf\"} " + std::to_string(snap.count) + "\n";
+					out += entry.name + "_sum " + number(snap.sum * histogram->scale) + "\n";
+					out += entry.name + "_count " + std::to_string(snap.count) + "\n";
+					break;
+				}
+				case Kind::LATENCY:
+				{
+					HdrHistogram* latency = static_cast<HdrHistogram*>(entry.metric);
+					double scale = entry.scale;
+					out += "# TYPE " + entry.name + " summary\n";
+					for (double q : { 0.5, 0.9, 0.99, 0.999 })
+						out += entry.name + "{quantile=\"" + number(q) + "\"} " + number(latency->percentile(q) * scale) + "\n";
+					out += entry.name + "_sum " + number(latency->getSum() * scale) + "\n";
+					out += entry.name + "_count " + std::to_string(latency->count()) + "\n";
+					break;
+				}
+				}
+			}
+			return out;
+		}
+
+		// One line per metric for /stats, histograms as count, mean, p50, p99 and max bucket, latencies as exact percentiles
+		std::string summary()
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			std::string out;
+			for (const Entry& entry : entries)
+			{
+				switch (entry.kind)
+				{
+				case Kind::COUNTER:
+					out += entry.name + " " + std::to_string(static_cast<Counter*>(entry.metric)->value()) + "\n";
+					break;
+				case Kind::GAUGE:
+					out += entry.name + " " + std::to_string(static_cast<Gauge*>(entry.metric)->value()) + "\n";
+					break;
+				case Kind::HISTOGRAM:
+				{
+					Histogram* histogram = static_cast<Histogram*>(entry.metric);
+					Histogram::Snapshot snap = histogram->snapshot();
+					double scale = histogram->scale;
+					out += entry.name + " count=" + std::to_string(snap.count);
+					if (snap.count > 0)
+					{
+						out += " mean=" + number(static_cast<double>(snap.sum) / snap.count * scale)
+							+ " p50<=" + number(snap.quantile(0.5) * scale)
+							+ " p99<=" + number(snap.quantile(0.99) * scale)
+							+ " max<=" + number(snap.quantile(1.0) * scale);
+					}
+					out += "\n";
+					break;
+				}
+				case Kind::LATENCY:
+				{
+					HdrHistogram* latency = static_cast<HdrHistogram*>(entry.metric);
+					out += entry.name + " count=" + std::to_string(latency->count());
+					if (latency->count() > 0)
+					{
+						out += " p50=" + number(latency->percentile(0.5) * entry.scale)
+							+ " p90=" + number(latency->percentile(0.9) * entry.scale)
+							+ " p99=" + number(latency->percentile(0.99) * entry.scale)
+							+ " p99.9=" + number(latency->percentile(0.999) * entry.scale)
+							+ " max=" + number(latency->max() * entry.scale);
+					}
+					out += "\n";
+					break;
+				}
+				}
+			}
+			return out;
+		}
+	};
+
+	Registry& registry()
+	{
+		static Registry instance;
+		return instance;
+	}
+
+	// Rewrites path with the Prometheus text every interval, for a node exporter textfile collector or a
+	// script to pick up. collect runs first, ex.) to refresh gauges that are cheaper to compute on demand.
+	// Written to a temporary file and renamed, readers never see a half written file.
+	class FileExporter
+	{
+	private:
+		std::string path;
+		unsigned intervalMs = 10000;
+		std::function<void()> collect;
+		std::thread exporter;
+		std::mutex exporter_mutex;
+		std::condition_variable exporter_condition;
+		bool running = false;
+
+		void exporterLoop()
+		{
+			std::unique_lock <std::mutex> lock(exporter_mutex);
+			while (running)
+			{
+				exporter_condition.wait_for(lock, std::chrono::milliseconds(intervalMs), [this] { return !running; });
+				lock.unlock();
+				write();
+				lock.lock();
+			}
+		}
+
+	public:
+		~FileExporter()
+		{
+			stop();
+		}
+
+		void start(const std::string& path, unsigned intervalMs, std::function<void()> collect)
+		{
+			std::lock_guard <std::mutex> lock(exporter_mutex);
+			if (running)
+				return;
+			this->path = path;
+			this->intervalMs = intervalMs;
+			this->collect = std::move(collect);
+			running = true;
+			exporter = std::thread(&FileExporter::exporterLoop, this);
+		}
+
+		// Writes one last time, so the file reflects the final counts
+		void stop()
+		{
+			{
+				std::lock_guard <std::mutex> lock(exporter_mutex);
+				if (!running)
+					return;
+				running = false;
+			}
+			exporter_condition.notify_one();
+			exporter.join();
+			write();
+		}
+
+		bool write()
+		{
+			if (collect)
+				collect();
+
+			std::string temp = path + ".tmp";
+			{
+				std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+				if (!file.is_open())
+					return false;
+				file << registry().prometheus();
+			}
+			std::remove(path.c_str());
+			return std::rename(temp.c_str(), path.c_str()) == 0;
+		}
+	};
+}
+
+// The servers metrics, registered once on first use
+struct ServerMetrics
+{
+	metrics::Counter& connections = metrics::registry().counter("chat_connections_total", "Accepted client connections");
+	metrics::Counter& disconnects = metrics::registry().counter("chat_disconnects_total", "Clients removed, after /quit or a failed connection");
+	metrics::Counter& resumes = metrics::registry().counter("chat_resumes_total", "Clients that came back with a resumption ticket instead of logging in");
+	metrics::Counter& resumesRefused = metrics::registry().counter("chat_resumes_refused_total", "Resumption tickets refused as expired, forged or for another key");
+	metrics::Gauge& users = metrics::registry().gauge("chat_users", "Connected users including the host");
+	metrics::Gauge& rooms = metrics::registry().gauge("chat_rooms", "Existing rooms");
+
+	metrics::Counter& framesIn = metrics::registry().counter("chat_frames_received_total", "Frames received from clients");
+	metrics::Counter& bytesIn = metrics::registry().counter("chat_bytes_received_total", "Encrypted bytes received from clients, length prefixes included");
+	metrics::Counter& framesOut = metrics::registry().counter("chat_frames_sent_total", "Frames written to client sockets");
+	metrics::Counter& bytesOut = metrics::registry().counter("chat_bytes_sent_total", "Encrypted bytes written to client sockets, length prefixes included");
+	metrics::Histogram& fanout = metrics::registry().histogram("chat_broadcast_fanout", "Recipients per broadcast", 20);
+	metrics::Histogram& encryptTime = metrics::registry().histogram("chat_encrypt_seconds", "Time to encrypt one outgoing frame", 40, 1e-9);
+	metrics::Histogram& decryptTime = metrics::registry().histogram("chat_decrypt_seconds", "Time to decrypt one incoming frame", 40, 1e-9);
+	HdrHistogram& uplinkLatency = metrics::registry().latency("chat_uplink_latency_seconds", "Timestamped frames, client send to server receive, same host clocks only", 1e-6);
+	HdrHistogram& serverLatency = metrics::registry().latency("chat_server_latency_seconds", "Timestamped frames, server receive to written out, including outbox queueing", 1e-6);
+
+	metrics::Gauge& outboxBytes = metrics::registry().gauge("chat_outbox_queued_bytes", "Unsent bytes over every client outbox");
+	metrics::Gauge& outboxMaxBytes = metrics::registry().gauge("chat_outbox_max_queued_bytes", "Unsent bytes of the most backed up client");
+	metrics::Gauge& outboxMaxAge = metrics::registry().gauge("chat_outbox_max_age_ms", "Age of the oldest unsent frame over every client");
+	metrics::Counter& outboxSnapshots = metrics::registry().counter("chat_outbox_snapshots_total", "Slow clients whose queued chat was replaced by recent history");
+	metrics::Counter& outboxDisconnects = metrics::registry().counter("chat_outbox_disconnects_total", "Clients cut off for not reading");
+	metrics::Counter& rateDelayed = metrics::registry().counter("chat_rate_limited_delayed_total", "Incoming frames delayed by the rate limiter");
+	metrics::Counter& rateDropped = metrics::registry().counter("chat_rate_limited_dropped_total", "Incoming frames dropped by the rate limiter");
+
+	metrics::Gauge& logPending = metrics::registry().gauge("chat_log_pending_bytes", "Message log bytes waiting for the writer");
+	metrics::Gauge& logDropped = metrics::registry().gauge("chat_log_dropped", "Records the message log dropped since startup");
+	metrics::Gauge& logSequence = metrics::registry().gauge("chat_log_next_sequence", "Sequence number of the next logged record");
+	metrics::Gauge& consolePending = metrics::registry().gauge("chat_console_pending_lines", "Console lines waiting for the log writer");
+	metrics::Gauge& consoleDropped = metrics::registry().gauge("chat_console_dropped_lines", "Console lines dropped since startup because the log writer fell behind");
+
+	metrics::Gauge& peerLinks = metrics::registry().gauge("chat_federation_links", "Linked server nodes");
+	metrics::Gauge& remoteUsers = metrics::registry().gauge("chat_federation_remote_users", "Users logged in on linked nodes");
+	metrics::Counter& peerFramesIn = metrics::registry().counter("chat_federation_frames_received_total", "Frames received from linked nodes");
+	metrics::Counter& peerFramesOut = metrics::registry().counter("chat_federation_frames_sent_total", "Frames queued to linked nodes, once per node rather than per remote user");
+
+	metrics::Counter& transferBytes = metrics::registry().counter("chat_transfer_bytes_total", "File bytes uploaded or downloaded by the host");
+	metrics::Histogram& transferRate = metrics::registry().histogram("chat_transfer_bytes_per_second", "Throughput of host file transfers", 40);
+};
+
+ServerMetrics& serverMetrics()
+{
+	static ServerMetrics instance;
+	return instance;
+}
+
+#endif
@@ -0,0 +1,384 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <WinSock2.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Protocol.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ProfiledMutex.h"
+#include "SharedMemory.h"
+
+// Frames waiting to go out to one client. Broadcasters only queue, a writer thread per
+// connection encrypts and sends, so a client that stops reading stalls nobody but itself.
+// Once attached to a shared memory channel the writer sends there instead, unencrypted.
+//
+// As the unsent backlog (bytes or age of the oldest frame) grows, policies kick in:
+//   dropBytes        LOW priority frames (presence) are discarded, the caller resends the member list later
+//   snapshotBytes/Ms queued chat is skipped, the caller replaces it with the rooms recent history
+//   disconnectBytes/Ms  the client is cut off
+struct OutboxLimits
+{
+	size_t dropBytes = 256 * 1024;
+	size_t snapshotBytes = 1024 * 1024;
+	unsigned snapshotAgeMs = 2000;
+	size_t disconnectBytes = 4 * 1024 * 1024;
+	unsigned disconnectAgeMs = 10000;
+};
+
+enum class OutboxPriority : uint8_t
+{
+	LOW = 0x01, NORMAL = 0x02, CRITICAL = 0x03,
+};
+
+// What the caller must do after a push
+enum class OutboxAction : uint8_t
+{
+	NONE = 0x01, SNAPSHOT = 0x02, DISCONNECT = 0x03, RESYNC = 0x04,
+};
+
+struct OutboxStats
+{
+	size_t queuedBytes = 0;
+	size_t queuedFrames = 0;
+	uint64_t ageMs = 0;
+	uint64_t sent = 0;
+	uint64_t dropped = 0;
+	uint64_t skipped = 0;
+	uint64_t snapshots = 0;
+	bool disconnected = false;
+};
+
+class Outbox
+{
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Entry
+	{
+		Frame frame;
+		std::vector<unsigned char> wire; // Already sealed with seal(), frame is unused
+		OutboxPriority priority;
+		Clock::time_point queued;
+		size_t size;
+	};
+
+	// Length prefix, nonce and MAC added to every frame on the wire
+	static const size_t WIRE_OVERHEAD = 4 + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
+	static constexpr unsigned DRAIN_MS = 1000;
+
+	std::deque<Entry> queue;
+	ProfiledMutex outbox_mutex{ "Outbox::outbox_mutex" };
+	std::condition_variable_any outbox_condition;
+
+	SOCKET sock = INVALID_SOCKET;
+	std::vector<unsigned char> public_key;
+	std::vector<unsigned char> secret_key;
+	std::shared_ptr<SharedChannel> channel; // Set once by attach, replaces sock and the keys
+	OutboxLimits limits;
+	bool timed = true; // Records server latency, off for federation links where the frame is not leaving for a client
+
+	std::thread writer;
+	bool running = false;
+	bool failed = false; // Send error or disconnect, nothing more is queued
+
+	size_t queuedBytes = 0;
+	size_t inflightBytes = 0;
+	bool inflight = false;
+	Clock::time_point inflightSince;
+	bool snapshotted = false;
+	Clock::time_point lastSnapshot;
+	OutboxStats counters;
+
+	static OutboxPriority priorityOf(Opcode opcode)
+	{
+		switch (opcode)
+		{
+		case Opcode::PRESENCE:
+			return OutboxPriority::LOW;
+		case Opcode::CHAT:
+			return OutboxPriority::NORMAL; // Recoverable from the rooms history
+		default:
+			return OutboxPriority::CRITICAL;
+		}
+	}
+
+	// outbox_mutex must be held
+	Clock::duration oldestAge(Clock::time_point now)
+	{
+		if (inflight)
+			return now - inflightSince;
+		if (!queue.empty())
+			return now - queue.front().queued;
+		return Clock::duration::zero();
+	}
+
+	// Removes queued entries matching pred, outbox_mutex must be held
+	template <typename Pred>
+	size_t purge(Pred&& pred)
+	{
+		size_t removed = 0;
+		for (auto it = queue.begin(); it != queue.end();)
+		{
+			if (pred(*it))
+			{
+				queuedBytes -= it->size;
+				it = queue.erase(it);
+				removed++;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		return removed;
+	}
+
+	void enqueue(Entry&& entry)
+	{
+		queuedBytes += entry.size;
+		queue.push_back(std::move(entry));
+		outbox_condition.notify_one();
+	}
+
+	void writerLoop()
+	{
+		std::vector<Entry> batch;
+		std::vector<unsigned char> wire;
+		std::shared_ptr<SharedChannel> ring;
+		while (true)
+		{
+			{
+				std::unique_lock <ProfiledMutex> lock(outbox_mutex);
+				outbox_condition.wait(lock, [this] { return !running || failed || !queue.empty(); });
+				if (failed || (queue.empty() && !running))
+				{
+					outbox_condition.notify_all();
+					return;
+				}
+
+				// Everything queued goes out in one send
+				batch.assign(std::make_move_iterator(queue.begin()), std::make_move_iterator(queue.end()));
+				queue.clear();
+				inflight = true;
+				inflightSince = batch.front().queued;
+				inflightBytes = queuedBytes;
+				queuedBytes = 0;
+				ring = channel;
+			}
+
+			ServerMetrics& stats = serverMetrics();
+			wire.clear();
+			{
+				trace::Scope span("encrypt");
+				span.arg(batch.size());
+				for (Entry& entry : batch)
+				{
+					if (!entry.wire.empty())
+					{
+						wire.insert(wire.end(), entry.wire.begin(), entry.wire.end());
+						continue;
+					}
+					if (entry.frame.flags & TIMESTAMPED)
+					{
+						const Timestamps& stamps = entry.frame.stamps;
+						entry.frame.stamps.forwarded = protocol::monotonicMicros();
+						if (timed && stamps.received != 0 && stamps.forwarded >= stamps.received)
+							stats.serverLatency.record(stamps.forwarded - stamps.received);
+					}
+					std::vector<unsigned char> data = protocol::encode(entry.frame);
+					if (ring)
+					{
+						SharedChannel::appendFrame(wire, data);
+						continue;
+					}
+					metrics::Timer timer(stats.encryptTime);
+					protocol::appendEncrypted(wire, util::encrypt(data, public_key, secret_key));
+				}
+			}
+
+			bool sent;
+			{
+				trace::Scope span("send");
+				span.arg(wire.size());
+				sent = ring ? ring->send(wire) : protocol::sendAll(sock, wire.data(), wire.size());
+			}
+			if (sent)
+			{
+				stats.framesOut.add(batch.size());
+				stats.bytesOut.add(wire.size());
+			}
+
+			std::lock_guard <ProfiledMutex> lock(outbox_mutex);
+			inflight = false;
+			inflightBytes = 0;
+			counters.sent += batch.size();
+			batch.clear();
+			if (!sent)
+			{
+				failed = true;
+				purge([](const Entry&) { return true; });
+			}
+			outbox_condition.notify_all();
+		}
+	}
+
+public:
+	Outbox()
+	{
+	}
+
+	~Outbox()
+	{
+		close();
+	}
+
+	Outbox(const Outbox&) = delete;
+	Outbox& operator=(const Outbox&) = delete;
+
+	void start(SOCKET sock, const std::vector<unsigned char>& pk, const std::vector<unsigned char>& sk, const OutboxLimits& limits, bool timed = true)
+	{
+		std::lock_guard <ProfiledMutex> lock(outbox_mutex);
+		if (running)
+			return;
+
+		this->sock = sock;
+		this->public_key = pk;
+		this->secret_key = sk;
+		this->limits = limits;
+		this->timed = timed;
+		running = true;
+		writer = std::thread(&Outbox::writerLoop, this);
+	}
+
+	// Sends what is queued, giving a stalled reader DRAIN_MS before its socket is shut down
+	void close()
+	{
+		std::unique_lock <ProfiledMutex> lock(outbox_mutex);
+		if (!running)
+			return;
+		running = false;
+		outbox_condition.notify_all();
+
+		bool drained = outbox_condition.wait_for(lock, std::chrono::milliseconds(DRAIN_MS), [this] { return failed || (queue.empty() && !inflight); });
+		lock.unlock();
+		if (!drained)
+		{
+			::shutdown(sock, SD_BOTH);
+			if (channel)
+				channel->close();
+		}
+		writer.join();
+	}
+
+	// Queues frame and applies the backlog policies, the caller handles SNAPSHOT, DISCONNECT and RESYNC
+	// Presence is already batched per room upstream, so it is dropped rather than coalesced here
+	OutboxAction push(const Frame& frame)
+	{
+		OutboxPriority priority = priorityOf(frame.opcode);
+		size_t size = protocol::encodedSize(frame) + WIRE_OVERHEAD;
+		Clock::time_point now = Clock::now();
+
+		std::lock_guard <ProfiledMutex> lock(outbox_mutex);
+		if (!running || failed)
+			return OutboxAction::NONE;
+
+		size_t backlog = queuedBytes + inflightBytes;
+		Clock::duration age = oldestAge(now);
+
+		if (backlog > limits.disconnectBytes || age > std::chrono::milliseconds(limits.disconnectAgeMs))
+		{
+			failed = true;
+			counters.disconnected = true;
+			purge([](const Entry&) { return true; });
+			outbox_condition.notify_all();
+			return OutboxAction::DISCONNECT;
+		}
+
+		// Snapshot at most once per snapshotAgeMs, a reader still stuck after that heads for a disconnect
+		bool behind = backlog > limits.snapshotBytes || age > std::chrono::milliseconds(limits.snapshotAgeMs);
+		if (behind && (!snapshotted || now - lastSnapshot > std::chrono::milliseconds(limits.snapshotAgeMs)))
+		{
+			counters.skipped += purge([](const Entry& e) { return e.priority != OutboxPriority::CRITICAL; });
+			counters.snapshots++;
+			snapshotted = true;
+			lastSnapshot = now;
+			if (priority != OutboxPriority::CRITICAL)
+			{
+				counters.skipped++; // Covered by the snapshot
+				return OutboxAction::SNAPSHOT;
+			}
+			enqueue({ frame, {}, priority, now, size });
+			return OutboxAction::SNAPSHOT;
+		}
+
+		if (backlog > limits.dropBytes)
+		{
+			size_t dropped = purge([](const Entry& e) { return e.priority == OutboxPriority::LOW; });
+			counters.dropped += dropped;
+			if (priority == OutboxPriority::LOW)
+			{
+				counters.dropped++;
+				return OutboxAction::RESYNC;
+			}
+			if (dropped > 0)
+			{
+				enqueue({ frame, {}, priority, now, size });
+				return OutboxAction::RESYNC;
+			}
+		}
+
+		enqueue({ frame, {}, priority, now, size });
+		return OutboxAction::NONE;
+	}
+
+	// Frames queued after this go out over channel, waits for what is queued or in flight to reach the socket first
+	// Returns false if the connection failed meanwhile
+	bool attach(std::shared_ptr<SharedChannel> channel)
+	{
+		std::unique_lock <ProfiledMutex> lock(outbox_mutex);
+		outbox_condition.wait(lock, [this] { return failed || (queue.empty() && !inflight); });
+		if (failed)
+			return false;
+		this->channel = std::move(channel);
+		return true;
+	}
+
+	// Appends data to wire the way the writer would send it, for pushSealed
+	void seal(std::vector<unsigned char>& wire, std::vector<unsigned char>& data)
+	{
+		if (channel)
+			SharedChannel::appendFrame(wire, data);
+		else
+			protocol::appendEncrypted(wire, util::encrypt(data, public_key, secret_key));
+	}
+
+	// Queues frames sealed by the caller, ex.) a history backlog built as one burst
+	void pushSealed(std::vector<unsigned char>&& wire)
+	{
+		std::lock_guard <ProfiledMutex> lock(outbox_mutex);
+		if (!running || failed || wire.empty())
+			return;
+
+		size_t size = wire.size();
+		enqueue({ Frame(), std::move(wire), OutboxPriority::CRITICAL, Clock::now(), size });
+	}
+
+	OutboxStats stats()
+	{
+		std::lock_guard <ProfiledMutex> lock(outbox_mutex);
+		OutboxStats stats = counters;
+		stats.queuedBytes = queuedBytes + inflightBytes;
+		stats.queuedFrames = queue.size();
+		stats.ageMs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(oldestAge(Clock::now())).count());
+		return stats;
+	}
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "Protocol.h"
+#include "ProfiledMutex.h"
+
+class User;
+
+// Joins and leaves in one room during a batching window, the last change per user wins
+struct PresenceDelta
+{
+	std::vector<std::pair<PresenceEvent, std::string>> changes;
+	std::unordered_map<std::string, size_t> positions; // username -> index in changes
+};
+
+struct PresenceBatch
+{
+	std::unordered_map<std::string, PresenceDelta> rooms;
+	std::unordered_set<User*> resync; // Owed their rooms full member list instead of a delta
+
+	bool empty() const
+	{
+		return rooms.empty() && resync.empty();
+	}
+};
+
+// Buffers presence changes and hands them to a flush callback every interval, so a burst of joins
+// and leaves (ex. a reconnect storm) reaches each member as one delta per room instead of one
+// frame per change. A leave and rejoin in the same window is sent as a single JOIN, which clients
+// that still list the user render as nothing.
+class PresenceBatcher
+{
+private:
+	PresenceBatch pending;
+	ProfiledMutex presence_mutex{ "PresenceBatcher::presence_mutex" };
+
+	std::function<void()> flush;
+	unsigned intervalMs;
+	std::thread flusher;
+	std::mutex flusher_mutex;
+	std::condition_variable flusher_condition;
+	bool running = false;
+
+	void flusherLoop()
+	{
+		std::unique_lock <std::mutex> lock(flusher_mutex);
+		while (running)
+		{
+			flusher_condition.wait_for(lock, std::chrono::milliseconds(intervalMs), [this] { return !running; });
+			lock.unlock();
+			flush();
+			lock.lock();
+		}
+	}
+
+public:
+	static const unsigned DEFAULT_INTERVAL_MS = 250;
+
+	PresenceBatcher(unsigned intervalMs = DEFAULT_INTERVAL_MS)
+	{
+		this->intervalMs = intervalMs;
+	}
+
+	~PresenceBatcher()
+	{
+		stop();
+	}
+
+	// Before start, ex.) from the servers config
+	void setInterval(unsigned intervalMs)
+	{
+		this->intervalMs = intervalMs;
+	}
+
+	// flush is called from the batchers thread every interval, it drains the batch with take()
+	void start(std::function<void()> flush)
+	{
+		std::lock_guard <std::mutex> lock(flusher_mutex);
+		if (running)
+			return;
+		this->flush = std::move(flush);
+		running = true;
+		flusher = std::thread(&PresenceBatcher::flusherLoop, this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard <std::mutex> lock(flusher_mutex);
+			if (!running)
+				return;
+			running = false;
+		}
+		flusher_condition.notify_one();
+		flusher.join();
+	}
+
+	void record(const std::string& room, PresenceEvent event, const std::string& username)
+	{
+		std::lock_guard <ProfiledMutex> lock(presence_mutex);
+		PresenceDelta& delta = pending.rooms[room];
+		auto it = delta.positions.find(username);
+		if (it != delta.positions.end())
+		{
+			delta.changes[it->second].first = event;
+			return;
+		}
+		delta.positions.emplace(username, delta.changes.size());
+		delta.changes.emplace_back(event, username);
+	}
+
+	// user gets its rooms full member list on the next flush, ex.) after joining or after presence was dropped
+	void resync(User* user)
+	{
+		std::lock_guard <ProfiledMutex> lock(presence_mutex);
+		pending.resync.insert(user);
+	}
+
+	// Called before user is freed
+	void forget(User* user)
+	{
+		std::lock_guard <ProfiledMutex> lock(presence_mutex);
+		pending.resync.erase(user);
+	}
+
+	bool empty()
+	{
+		std::lock_guard <ProfiledMutex> lock(presence_mutex);
+		return pending.empty();
+	}
+
+	PresenceBatch take()
+	{
+		std::lock_guard <ProfiledMutex> lock(presence_mutex);
+		PresenceBatch batch = std::move(pending);
+		pending = PresenceBatch();
+		return batch;
+	}
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef PROFILEDMUTEX_H
+#define PROFILEDMUTEX_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Metrics.h"
+
+// Contention profile shared by every mutex created with the same name, ex.) all Room::members_mutex
+struct LockStats
+{
+	std::string name;
+	metrics::Counter acquisitions;
+	metrics::Counter contended; // Acquisitions that had to wait
+	metrics::Histogram waitTime{ 40, 1e-9 }; // ns, contended acquisitions only
+	metrics::Histogram holdTime{ 40, 1e-9 }; // ns
+};
+
+namespace locks
+{
+	std::vector<std::unique_ptr<LockStats>> registry;
+	std::mutex registry_mutex;
+
+	LockStats& stats(const std::string& name)
+	{
+		std::lock_guard <std::mutex> lock(registry_mutex);
+		for (auto& stats : registry)
+		{
+			if (stats->name == name)
+				return *stats;
+		}
+		registry.push_back(std::make_unique<LockStats>());
+		registry.back()->name = name;
+		return *registry.back();
+	}
+
+	uint64_t now()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Every named lock, most total wait first, times in microseconds
+	std::string report()
+	{
+		struct Row
+		{
+			LockStats* stats;
+			metrics::Histogram::Snapshot wait;
+			metrics::Histogram::Snapshot hold;
+		};
+
+		std::vector<Row> rows;
+		{
+			std::lock_guard <std::mutex> lock(registry_mutex);
+			for (auto& stats : registry)
+			{
+				rows.push_back({ stats.get(), stats->waitTime.snapshot(), stats->holdTime.snapshot() });
+			}
+		}
+		std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.wait.sum > b.wait.sum; });
+
+		std::string str = "Locks (us, p99 and max are bucket upper bounds)\n-----\n";
+		char line[256];
+		for (const Row& row : rows)
+		{
+			uint64_t acquired = row.stats->acquisitions.value();
+			uint64_t contended = row.stats->contended.value();
+			std::snprintf(line, sizeof(line), "%s: %llu acquired, %.1f%% contended, wait total %.0f p99 %.1f max %.1f, hold mean %.2f p99 %.1f max %.1f\n",
+				row.stats->name.c_str(), static_cast<unsigned long long>(acquired), acquired > 0 ? 100.0 * contended / acquired : 0.0,
+				row.wait.sum / 1e3, row.wait.quantile(0.99) / 1e3, row.wait.quantile(1.0) / 1e3,
+				row.hold.count > 0 ? row.hold.sum / 1e3 / row.hold.count : 0.0, row.hold.quantile(0.99) / 1e3, row.hold.quantile(1.0) / 1e3);
+			str += line;
+		}
+		return str;
+	}
+}
+
+#ifndef CHAT_NO_LOCK_PROFILE
+// Drop in for std::mutex that records acquisitions, time spent waiting and time held under its name
+// An uncontended lock costs a try_lock and two clock reads. Use std::condition_variable_any to wait on it.
+class ProfiledMutex
+{
+private:
+	std::mutex mutex;
+	LockStats& stats;
+	uint64_t acquiredAt = 0; // Only touched by the holder
+
+public:
+	ProfiledMutex(const std::string& name) : stats(locks::stats(name))
+	{
+	}
+
+	ProfiledMutex(const ProfiledMutex&) = delete;
+	ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+	void lock()
+	{
+		if (!mutex.try_lock())
+		{
+			uint64_t start = locks::now();
+			mutex.lock();
+			acquiredAt = locks::now();
+			stats.contended.add();
+			stats.waitTime.record(acquiredAt - start);
+		}
+		else
+		{
+			acquiredAt = locks::now();
+		}
+		stats.acquisitions.add();
+	}
+
+	bool try_lock()
+	{
+		if (!mutex.try_lock())
+			return false;
+		acquiredAt = locks::now();
+		stats.acquisitions.add();
+		return true;
+	}
+
+	void unlock()
+	{
+		uint64_t held = locks::now() - acquiredAt;
+		mutex.unlock();
+		stats.holdTime.record(held);
+	}
+};
+#else
+// Profiling compiled out, a plain std::mutex that accepts a name
+class ProfiledMutex
+{
+private:
+	std::mutex mutex;
+
+public:
+	ProfiledMutex(const std::string&)
+	{
+	}
+
+	void lock() { mutex.lock(); }
+	bool try_lock() { return mutex.try_lock(); }
+	void unlock() { mutex.unlock(); }
+};
+#endif
+
+#endif
@@ -0,0 +1,450 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <WinSock2.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Util.h"
+
+// Chat and control traffic travels in typed frames, routing is a switch on the opcode
+// so user text can never be mistaken for control.
+//
+// Wire:  [u32 length][encrypted frame]          (length in network order)
+// Frame: [opcode][flags][field count][timestamps] then per field [u16 length][bytes]
+//        timestamps are 3 x u64 (network order) and only present when flags has TIMESTAMPED
+enum class Opcode : uint8_t
+{
+	CHAT = 0x01, WHISPER = 0x02, COMMAND = 0x03, NOTICE = 0x04,
+	LOGIN = 0x10, LOGIN_RESULT = 0x11, LOCAL_ATTACH = 0x12, RESUME = 0x13, TICKET = 0x14,
+	TRANSFER_OFFER = 0x20, TRANSFER_DECISION = 0x21, TRANSFER_RESULT = 0x22,
+	TRANSFER_INFO = 0x23,
+	PRESENCE = 0x30, QUIT = 0x31, SHUTDOWN = 0x32,
+	PEER_HELLO = 0x40, PEER_CLAIM = 0x41, PEER_CLAIMED = 0x42, PEER_RELEASE = 0x43,
+	PEER_USERS = 0x44, PEER_PRESENCE = 0x45, PEER_CHAT = 0x46, PEER_WHISPER = 0x47,
+};
+
+// Field layouts, (client -> server) / (server -> client)
+// CHAT               body / sender, body
+// WHISPER            recipient, body / sender, body
+// COMMAND            command line, ex.) "/users"
+// NOTICE             - / text
+// LOGIN              username
+// LOGIN_RESULT       - / LoginStatus, text
+// LOCAL_ATTACH       no fields, then 1 opened or 0 refused once named / shared memory channel name, no fields when refused
+//                    (before LOGIN, see SharedMemory.h), the server switches only after the client opened the channel
+// RESUME             no fields, then ticket, challenge / challenge, instead of LOGIN, the second is answered with
+//                    LOGIN_RESULT (see server/Ticket.h)
+// TICKET             - / ticket, after each join
+// TRANSFER_OFFER     recipient, file name, file size / sender, file name, file size
+// TRANSFER_DECISION  1 accept, 0 decline
+// TRANSFER_RESULT    - / TransferResult
+// TRANSFER_INFO      - / peer public key[, port (u16 network order), peer IP]
+// PRESENCE           - / room, then one [PresenceEvent][username] field per change
+// QUIT, SHUTDOWN     no fields
+//
+// Between server nodes, see server/Federation.h
+// PEER_HELLO         node name, federation secret (first frame of a link, each way)
+// PEER_CLAIM         username
+// PEER_CLAIMED       username, 1 granted, 0 refused
+// PEER_RELEASE       username
+// PEER_USERS         one username per field, the senders users when the link comes up
+// PEER_PRESENCE      as PRESENCE, joins and leaves only
+// PEER_CHAT          room, sender, body
+// PEER_WHISPER       recipient, sender, body
+
+enum class LoginStatus : uint8_t
+{
+	ACCEPTED = 0x01, USERNAME_TAKEN = 0x02, RESUME_REFUSED = 0x03,
+};
+
+enum class TransferResult : uint8_t
+{
+	APPROVED = 0x01, DENIED = 0x02, FAILED = 0x03, INVALID_USER = 0x04,
+};
+
+// RESET clears the receivers member list, the JOINs after it are the rooms current members
+// LISTING continues such a list when it did not fit in one frame
+enum class PresenceEvent : uint8_t
+{
+	JOIN = 0x01, LEAVE = 0x02, RESET = 0x03, LISTING = 0x04,
+};
+
+// Bits of the frame flags byte
+enum FrameFlag : uint8_t
+{
+	TIMESTAMPED = 0x01,
+	LOCAL_SENDER = 0x02, // Set by the server when sent is on its clock, ex.) the sender is on its machine
+};
+
+// Microseconds on the monotonic clock of whoever stamped them, 0 for a hop not reached yet
+// sent by the sending client, received when the server read it, forwarded when the server wrote it out
+struct Timestamps
+{
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t forwarded = 0;
+};
+
+struct Frame
+{
+	Opcode opcode = Opcode::NOTICE;
+	uint8_t flags = 0;
+	Timestamps stamps; // Only meaningful with TIMESTAMPED
+	std::vector<std::string> fields;
+
+	Frame() {}
+
+	Frame(Opcode opcode, std::vector<std::string> fields = {})
+	{
+		this->opcode = opcode;
+		this->fields = std::move(fields);
+	}
+
+	std::string_view field(size_t i) const
+	{
+		return i < fields.size() ? std::string_view(fields[i]) : std::string_view();
+	}
+
+	// Single byte fields, enums and flags
+	uint8_t byte(size_t i) const
+	{
+		std::string_view f = field(i);
+		return f.empty() ? 0 : static_cast<uint8_t>(f[0]);
+	}
+
+	// Keeps the timestamps of source, ex.) on the CHAT the server forwards for a CHAT it received
+	void carryTimestamps(const Frame& source)
+	{
+		flags = (flags & ~(TIMESTAMPED | LOCAL_SENDER)) | (source.flags & (TIMESTAMPED | LOCAL_SENDER));
+		stamps = source.stamps;
+	}
+};
+
+namespace protocol
+{
+	const size_t HEADER_SIZE = 3;
+	const size_t TIMESTAMPS_SIZE = 24;
+	const size_t MAX_FIELD_SIZE = 0xFFFF;
+	const size_t MAX_FRAME_SIZE = 256 * 1024; // Encrypted frames above this are rejected as malformed
+	const size_t MAX_FIELDS = 0xFF;
+	const size_t MAX_PRESENCE_BYTES = 32 * 1024; // Presence changes per frame, longer batches are split
+
+	std::string byteField(uint8_t value)
+	{
+		return std::string(1, static_cast<char>(value));
+	}
+
+	// Clock for Timestamps, steady across processes on one host so hops between them can be subtracted
+	uint64_t monotonicMicros()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Marks frame to carry timestamps, sent now
+	void stamp(Frame& frame)
+	{
+		frame.flags |= TIMESTAMPED;
+		frame.stamps = Timestamps();
+		frame.stamps.sent = monotonicMicros();
+	}
+
+	// Bytes encode(frame, timestamps) will produce
+	size_t encodedSize(const Frame& frame, bool timestamps = true)
+	{
+		size_t size = HEADER_SIZE;
+		if (timestamps && (frame.flags & TIMESTAMPED))
+			size += TIMESTAMPS_SIZE;
+		for (const std::string& f : frame.fields)
+			size += 2 + std::min(f.size(), MAX_FIELD_SIZE);
+		return size;
+	}
+
+	// Without timestamps the TIMESTAMPED flag is cleared, ex.) for frames kept in history and replayed later
+	std::vector<unsigned char> encode(const Frame& frame, bool timestamps = true)
+	{
+		bool stamped = timestamps && (frame.flags & TIMESTAMPED);
+		std::vector<unsigned char> data;
+		data.reserve(encodedSize(frame, timestamps));
+		data.push_back(static_cast<unsigned char>(frame.opcode));
+		data.push_back(stamped ? frame.flags : static_cast<uint8_t>(frame.flags & ~TIMESTAMPED));
+		data.push_back(static_cast<unsigned char>(frame.fields.size()));
+
+		if (stamped)
+		{
+			for (uint64_t t : { frame.stamps.sent, frame.stamps.received, frame.stamps.forwarded })
+			{
+				for (int shift = 56; shift >= 0; shift -= 8)
+					data.push_back(static_cast<unsigned char>((t >> shift) & 0xFF));
+			}
+		}
+
+		for (const std::string& f : frame.fields)
+		{
+			size_t len = std::min(f.size(), MAX_FIELD_SIZE); // Longer fields are truncated
+			data.push_back(static_cast<unsigned char>((len >> 8) & 0xFF));
+			data.push_back(static_cast<unsigned char>(len & 0xFF));
+			data.insert(data.end(), f.begin(), f.begin() + len);
+		}
+		return data;
+	}
+
+	bool decode(const unsigned char* data, size_t size, Frame& frame)
+	{
+		if (size < HEADER_SIZE)
+			return false;
+
+		frame.opcode = static_cast<Opcode>(data[0]);
+		frame.flags = data[1];
+		size_t count = data[2];
+		frame.fields.clear();
+		frame.fields.reserve(count);
+		frame.stamps = Timestamps();
+
+		size_t pos = HEADER_SIZE;
+		if (frame.flags & TIMESTAMPED)
+		{
+			if (size < HEADER_SIZE + TIMESTAMPS_SIZE)
+				return false;
+			for (uint64_t* t : { &frame.stamps.sent, &frame.stamps.received, &frame.stamps.forwarded })
+			{
+				for (size_t i = 0; i < 8; i++)
+					*t = (*t << 8) | data[pos++];
+			}
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			if (pos + 2 > size)
+				return false;
+
+			size_t len = (static_cast<size_t>(data[pos]) << 8) | data[pos + 1];
+			pos += 2;
+			if (pos + len > size)
+				return false;
+
+			frame.fields.emplace_back(reinterpret_cast<const char*>(data + pos), len);
+			pos += len;
+		}
+		return pos == size;
+	}
+
+	Frame notice(const std::string& text)
+	{
+		return Frame(Opcode::NOTICE, { text });
+	}
+
+	// Presence changes for room as few frames as fit, with reset the changes are the full member list
+	std::vector<Frame> presence(const std::string& room, const std::vector<std::pair<PresenceEvent, std::string>>& changes, bool reset = false)
+	{
+		std::vector<Frame> frames;
+		size_t next = 0;
+		do
+		{
+			Frame frame(Opcode::PRESENCE, { room });
+			if (reset)
+				frame.fields.push_back(byteField(static_cast<uint8_t>(frames.empty() ? PresenceEvent::RESET : PresenceEvent::LISTING)));
+
+			size_t bytes = 0;
+			while (next < changes.size() && frame.fields.size() < MAX_FIELDS && (bytes == 0 || bytes + changes[next].second.size() < MAX_PRESENCE_BYTES))
+			{
+				frame.fields.push_back(byteField(static_cast<uint8_t>(changes[next].first)) + changes[next].second);
+				bytes += changes[next].second.size() + 3;
+				next++;
+			}
+			frames.push_back(std::move(frame));
+		} while (next < changes.size());
+		return frames;
+	}
+
+	Frame transferResult(TransferResult result)
+	{
+		return Frame(Opcode::TRANSFER_RESULT, { byteField(static_cast<uint8_t>(result)) });
+	}
+
+	// Text shown to a person for a frame, used by the client and for frames addressed to the host
+	std::string render(const Frame& frame)
+	{
+		switch (frame.opcode)
+		{
+		case Opcode::CHAT:
+			return std::string(frame.field(0)) + std::string(frame.field(1));
+		case Opcode::WHISPER:
+			return std::string(frame.field(0)) + "whispered: " + std::string(frame.field(1));
+		case Opcode::NOTICE:
+		case Opcode::COMMAND:
+			return std::string(frame.field(0));
+		case Opcode::LOGIN_RESULT:
+			return std::string(frame.field(1));
+		case Opcode::TRANSFER_OFFER:
+			return std::string(frame.field(0)) + "File Transfer Request: " + std::string(frame.field(1))
+				+ std::string(frame.field(2)) + "\n[*] Accept Transfer (y/n): ";
+		case Opcode::TRANSFER_RESULT:
+			switch (static_cast<TransferResult>(frame.byte(0)))
+			{
+			case TransferResult::APPROVED: return "[+] Transfer Approved";
+			case TransferResult::DENIED: return "[-] Transfer Denied";
+			case TransferResult::INVALID_USER: return "[!] Invalid Username";
+			default: return "[-] Transfer Failed";
+			}
+		case Opcode::PRESENCE:
+		{
+			std::string joined, left;
+			size_t joins = 0, leaves = 0;
+			for (size_t i = 1; i < frame.fields.size(); i++)
+			{
+				std::string_view username = frame.field(i).substr(std::min<size_t>(1, frame.field(i).size()));
+				switch (static_cast<PresenceEvent>(frame.byte(i)))
+				{
+				case PresenceEvent::JOIN: joined += username; joins++; break;
+				case PresenceEvent::LEAVE: left += username; leaves++; break;
+				default: break;
+				}
+			}
+
+			std::string where = "#" + std::string(frame.field(0));
+			std::string text;
+			if (joins > 0)
+				text += "[+] " + joined + (joins == 1 ? "Has Joined " : "Have Joined ") + where;
+			if (leaves > 0)
+				text += (text.empty() ? "[!] " : "\n[!] ") + left + (leaves == 1 ? "Has Left " : "Have Left ") + where;
+			return text;
+		}
+		case Opcode::SHUTDOWN:
+			return "[!] Server has been Closed!";
+		default:
+			return "";
+		}
+	}
+
+	bool sendAll(SOCKET sock, const unsigned char* data, size_t size)
+	{
+		size_t bytesSent = 0;
+		while (bytesSent < size)
+		{
+			int res = send(sock, reinterpret_cast<const char*>(data + bytesSent), static_cast<int>(size - bytesSent), 0);
+			if (res == SOCKET_ERROR || res <= 0)
+				return false;
+			bytesSent += res;
+		}
+		return true;
+	}
+
+	bool recvAll(SOCKET sock, unsigned char* data, size_t size)
+	{
+		size_t bytesRecv = 0;
+		while (bytesRecv < size)
+		{
+			int res = recv(sock, reinterpret_cast<char*>(data + bytesRecv), static_cast<int>(size - bytesRecv), 0);
+			if (res == SOCKET_ERROR || res <= 0)
+				return false;
+			bytesRecv += res;
+		}
+		return true;
+	}
+
+	// Appends an already encrypted frame and its length prefix to wire, several frames can share one send
+	void appendEncrypted(std::vector<unsigned char>& wire, const std::vector<unsigned char>& encrypted)
+	{
+		uint32_t length = htonl(static_cast<uint32_t>(encrypted.size()));
+		const unsigned char* prefix = reinterpret_cast<const unsigned char*>(&length);
+		wire.insert(wire.end(), prefix, prefix + 4);
+		wire.insert(wire.end(), encrypted.begin(), encrypted.end());
+	}
+
+	// Prefixes an already encrypted frame with its length and sends it
+	bool sendEncrypted(SOCKET sock, const std::vector<unsigned char>& encrypted)
+	{
+		if (encrypted.empty())
+			return false;
+
+		std::vector<unsigned char> wire;
+		wire.reserve(4 + encrypted.size());
+		appendEncrypted(wire, encrypted);
+		return sendAll(sock, wire.data(), wire.size());
+	}
+
+	bool sendFrame(SOCKET sock, const Frame& frame, std::vector<unsigned char>& pk, std::vector<unsigned char>& sk)
+	{
+		std::vector<unsigned char> data = encode(frame);
+		return sendEncrypted(sock, util::encrypt(data, pk, sk));
+	}
+
+	// Reads one length prefixed encrypted frame, false when the connection closed or the length is out of range
+	bool recvEncrypted(SOCKET sock, std::vector<unsigned char>& encrypted)
+	{
+		uint32_t length;
+		if (!recvAll(sock, reinterpret_cast<unsigned char*>(&length), 4))
+			return false;
+
+		length = ntohl(length);
+		if (length < crypto_box_NONCEBYTES + crypto_box_MACBYTES + HEADER_SIZE || length > MAX_FRAME_SIZE)
+			return false;
+
+		encrypted.resize(length);
+		return recvAll(sock, encrypted.data(), encrypted.size());
+	}
+
+	// False when the connection closed or the frame failed to decrypt or decode
+	bool recvFrame(SOCKET sock, Frame& frame, std::vector<unsigned char>& pk, std::vector<unsigned char>& sk)
+	{
+		std::vector<unsigned char> encrypted;
+		if (!recvEncrypted(sock, encrypted))
+			return false;
+
+		std::vector<unsigned char> data = util::decrypt(encrypted, pk, sk);
+		return decode(data.data(), data.size(), frame);
+	}
+}
+
+// Members of the room this side is in, kept current from PRESENCE frames
+// Only touched by the thread receiving the frames
+class MemberList
+{
+private:
+	std::string room;
+	std::set<std::string> members;
+
+public:
+	// Applies a PRESENCE frame, returns the changes that actually altered the list for render
+	// A full list renders as nothing, as do repeated changes ex.) a reconnect within one batch
+	Frame apply(const Frame& frame)
+	{
+		Frame changes(Opcode::PRESENCE, { std::string(frame.field(0)) });
+		PresenceEvent first = static_cast<PresenceEvent>(frame.byte(1));
+		bool listing = first == PresenceEvent::RESET || first == PresenceEvent::LISTING;
+		if (first == PresenceEvent::RESET)
+		{
+			room = frame.field(0);
+			members.clear();
+		}
+		else if (frame.field(0) != room) // Sent before we moved rooms
+		{
+			return changes;
+		}
+
+		for (size_t i = listing ? 2 : 1; i < frame.fields.size(); i++)
+		{
+			if (frame.field(i).size() < 2)
+				continue;
+
+			std::string username(frame.field(i).substr(1));
+			bool changed = false;
+			switch (static_cast<PresenceEvent>(frame.byte(i)))
+			{
+			case PresenceEvent::JOIN: changed = members.insert(username).second; break;
+			case PresenceEvent::LEAVE: changed = members.erase(username) > 0; break;
+			default: break;
+			}
+			if (changed && !listing)
+				changes.fields.push_back(frame.fields[i]);
+		}
+		return changes;
+	}
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Per user limits, a rate of 0 disables that bucket
+struct RateLimits
+{
+	double messagesPerSec = 10;
+	double messageBurst = 20;
+	double bytesPerSec = 16 * 1024;
+	double byteBurst = 64 * 1024;
+	unsigned maxDelayMs = 500; // Frames that would wait longer than this are dropped instead
+};
+
+enum class RateDecision : uint8_t
+{
+	ALLOW = 0x01, DELAY = 0x02, DROP = 0x03,
+};
+
+class TokenBucket
+{
+private:
+	using Clock = std::chrono::steady_clock;
+
+	double rate = 0;
+	double capacity = 0;
+	double tokens = 0;
+	Clock::time_point last = Clock::now();
+
+	void refill(Clock::time_point now)
+	{
+		double elapsed = std::chrono::duration<double>(now - last).count();
+		tokens = std::min(capacity, tokens + elapsed * rate);
+		last = now;
+	}
+
+public:
+	void configure(double rate, double burst)
+	{
+		this->rate = rate;
+		this->capacity = std::max(burst, 1.0);
+		this->tokens = this->capacity;
+		this->last = Clock::now();
+	}
+
+	// Seconds until amount tokens are available, 0 when they already are
+	double delayFor(double amount, Clock::time_point now)
+	{
+		if (rate <= 0)
+			return 0;
+
+		refill(now);
+		if (tokens >= amount)
+			return 0;
+		return (amount - tokens) / rate;
+	}
+
+	// May leave the bucket negative, a delayed frame borrows from the next refill
+	void take(double amount)
+	{
+		if (rate > 0)
+			tokens -= amount;
+	}
+};
+
+// Message and byte buckets for one user, only touched by the thread serving that user
+class RateLimiter
+{
+private:
+	using Clock = std::chrono::steady_clock;
+
+	TokenBucket messages;
+	TokenBucket bytes;
+	std::chrono::milliseconds maxDelay{ 500 };
+	Clock::time_point lastWarning;
+	bool warned = false;
+
+	uint64_t delayedCount = 0;
+	uint64_t droppedCount = 0;
+
+public:
+	static constexpr unsigned WARNING_INTERVAL_MS = 1000;
+
+	RateLimiter()
+	{
+		configure(RateLimits());
+	}
+
+	void configure(const RateLimits& limits)
+	{
+		messages.configure(limits.messagesPerSec, limits.messageBurst);
+		bytes.configure(limits.bytesPerSec, limits.byteBurst);
+		maxDelay = std::chrono::milliseconds(limits.maxDelayMs);
+	}
+
+	// Charges one message of size bytes, delay is set to how long the caller must wait on DELAY
+	// Dropped frames are not charged
+	RateDecision admit(size_t size, std::chrono::milliseconds& delay)
+	{
+		Clock::time_point now = Clock::now();
+		double wait = std::max(messages.delayFor(1, now), bytes.delayFor(static_cast<double>(size), now));
+		delay = std::chrono::milliseconds(static_cast<int64_t>(wait * 1000 + 0.999));
+
+		if (delay > maxDelay)
+		{
+			droppedCount++;
+			return RateDecision::DROP;
+		}
+
+		messages.take(1);
+		bytes.take(static_cast<double>(size));
+		if (delay.count() == 0)
+			return RateDecision::ALLOW;
+
+		delayedCount++;
+		return RateDecision::DELAY;
+	}
+
+	// True at most once per WARNING_INTERVAL_MS, so the feedback cannot become a flood of its own
+	bool shouldWarn()
+	{
+		Clock::time_point now = Clock::now();
+		if (warned && now - lastWarning < std::chrono::milliseconds(WARNING_INTERVAL_MS))
+			return false;
+
+		warned = true;
+		lastWarning = now;
+		return true;
+	}
+
+	uint64_t delayed() const
+	{
+		return delayedCount;
+	}
+
+	uint64_t dropped() const
+	{
+		return droppedCount;
+	}
+};
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "History.h"
+#include "ProfiledMutex.h"
+
+class User;
+
+// A named channel, broadcasts only visit the members set
+class Room
+{
+private:
+	std::string name;
+	std::unordered_set<User*> members;
+	ProfiledMutex members_mutex{ "Room::members_mutex" };
+	MessageHistory chatHistory;
+
+public:
+	Room(const std::string& name)
+	{
+		this->name = name;
+	}
+
+	const std::string& getName() const
+	{
+		return name;
+	}
+
+	// Recent chat, replayed to members as they join
+	MessageHistory& history()
+	{
+		return chatHistory;
+	}
+
+	void add(User* user)
+	{
+		std::lock_guard <ProfiledMutex> lock(members_mutex);
+		members.insert(user);
+	}
+
+	void remove(User* user)
+	{
+		std::lock_guard <ProfiledMutex> lock(members_mutex);
+		members.erase(user);
+	}
+
+	size_t size()
+	{
+		std::lock_guard <ProfiledMutex> lock(members_mutex);
+		return members.size();
+	}
+
+	bool contains(User* user)
+	{
+		std::lock_guard <ProfiledMutex> lock(members_mutex);
+		return members.count(user) > 0;
+	}
+
+	// Calls func for every member while holding the room lock, members cannot leave mid broadcast
+	template <typename Func>
+	void forEachMember(Func&& func)
+	{
+		std::lock_guard <ProfiledMutex> lock(members_mutex);
+		for (User* member : members)
+		{
+			func(member);
+		}
+	}
+};
+
+// Owns every room, kept separate from the servers user list
+// Lock order: Server::usersMutex -> rooms_mutex -> Room::members_mutex
+class RoomRegistry
+{
+private:
+	std::unordered_map<std::string, std::unique_ptr<Room>> rooms;
+	ProfiledMutex rooms_mutex{ "RoomRegistry::rooms_mutex" };
+
+public:
+	static constexpr const char* LOBBY = "lobby";
+	static const size_t MAX_NAME_LENGTH = 32;
+
+	RoomRegistry()
+	{
+		rooms.emplace(LOBBY, std::make_unique<Room>(LOBBY));
+	}
+
+	// Letters, digits, '-' and '_'
+	static bool validName(const std::string& name)
+	{
+		if (name.empty() || name.size() > MAX_NAME_LENGTH)
+			return false;
+
+		for (char c : name)
+		{
+			if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+				return false;
+		}
+		return true;
+	}
+
+	Room* lobby()
+	{
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+		return rooms[LOBBY].get();
+	}
+
+	// Moves user from its current room (nullptr if none) into name, creating the room if needed
+	// Empty rooms other than the lobby are deleted. Returns the joined room.
+	Room* move(User* user, Room* current, const std::string& name)
+	{
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+
+		auto it = rooms.find(name);
+		if (it == rooms.end())
+		{
+			it = rooms.emplace(name, std::make_unique<Room>(name)).first;
+		}
+		Room* next = it->second.get();
+		if (next == current)
+			return next;
+
+		next->add(user);
+		if (current != nullptr)
+		{
+			current->remove(user);
+			deleteIfEmpty(current);
+		}
+		return next;
+	}
+
+	void leave(User* user, Room* current)
+	{
+		if (current == nullptr)
+			return;
+
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+		current->remove(user);
+		deleteIfEmpty(current);
+	}
+
+	// Calls func with room name while holding the registry lock, so the room cannot be deleted meanwhile
+	// Returns false if there is no such room
+	template <typename Func>
+	bool withRoom(const std::string& name, Func&& func)
+	{
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+		auto it = rooms.find(name);
+		if (it == rooms.end())
+			return false;
+
+		func(it->second.get());
+		return true;
+	}
+
+	// Same for the room user is a member of, safe from threads other than the one moving user
+	template <typename Func>
+	bool withRoomOf(User* user, Func&& func)
+	{
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+		for (auto& room : rooms)
+		{
+			if (room.second->contains(user))
+			{
+				func(room.second.get());
+				return true;
+			}
+		}
+		return false;
+	}
+
+	size_t count()
+	{
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+		return rooms.size();
+	}
+
+	// Rooms and their member counts, for /rooms
+	std::string listing()
+	{
+		std::lock_guard <ProfiledMutex> lock(rooms_mutex);
+		std::vector<std::pair<std::string, size_t>> entries;
+		for (auto& room : rooms)
+		{
+			entries.emplace_back(room.first, room.second->size());
+		}
+		std::sort(entries.begin(), entries.end());
+
+		std::string str = "Rooms\n-----\n";
+		for (auto& entry : entries)
+		{
+			str += "#" + entry.first + " (" + std::to_string(entry.second) + ")\n";
+		}
+		return str;
+	}
+
+private:
+	// rooms_mutex must be held
+	void deleteIfEmpty(Room* room)
+	{
+		if (room->getName() != LOBBY && room->size() == 0)
+		{
+			std::string name = room->getName(); // Copy, the key is owned by the room being erased
+			rooms.erase(name);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "MessageLog.h"
+#include "ProfiledMutex.h"
+#include "Protocol.h"
+
+// Inverted index over the chat text kept in the MessageLog, term -> log sequences containing it
+// A background thread tails the log, so nothing is done on the receive path. Posting lists are
+// stored as varint encoded gaps between ascending sequence numbers.
+class SearchIndex
+{
+private:
+	struct PostingList
+	{
+		std::vector<unsigned char> bytes;
+		uint64_t last = 0;
+		uint32_t count = 0;
+
+		void add(uint64_t sequence)
+		{
+			if (count > 0 && sequence <= last) // Term repeated in the same message
+				return;
+
+			uint64_t gap = count == 0 ? sequence : sequence - last;
+			while (gap >= 0x80)
+			{
+				bytes.push_back(static_cast<unsigned char>(gap | 0x80));
+				gap >>= 7;
+			}
+			bytes.push_back(static_cast<unsigned char>(gap));
+			last = sequence;
+			count++;
+		}
+
+		std::vector<uint64_t> decode() const
+		{
+			std::vector<uint64_t> sequences;
+			sequences.reserve(count);
+			uint64_t value = 0;
+			size_t pos = 0;
+			while (pos < bytes.size())
+			{
+				uint64_t gap = 0;
+				int shift = 0;
+				while (bytes[pos] & 0x80)
+				{
+					gap |= static_cast<uint64_t>(bytes[pos++] & 0x7F) << shift;
+					shift += 7;
+				}
+				gap |= static_cast<uint64_t>(bytes[pos++]) << shift;
+				value += gap;
+				sequences.push_back(value);
+			}
+			return sequences;
+		}
+
+		// Keeps the entries of sequences that are also in this list, streams through the gaps without a full decode
+		void intersect(std::vector<uint64_t>& sequences) const
+		{
+			size_t out = 0, in = 0, pos = 0;
+			uint64_t value = 0;
+			while (pos < bytes.size() && in < sequences.size())
+			{
+				uint64_t gap = 0;
+				int shift = 0;
+				while (bytes[pos] & 0x80)
+				{
+					gap |= static_cast<uint64_t>(bytes[pos++] & 0x7F) << shift;
+					shift += 7;
+				}
+				gap |= static_cast<uint64_t>(bytes[pos++]) << shift;
+				value += gap;
+
+				while (in < sequences.size() && sequences[in] < value)
+					in++;
+				if (in < sequences.size() && sequences[in] == value)
+					sequences[out++] = sequences[in++];
+			}
+			sequences.resize(out);
+		}
+	};
+
+	MessageLog& log;
+	std::unordered_map<std::string, PostingList> terms;
+	ProfiledMutex index_mutex{ "SearchIndex::index_mutex" };
+	size_t postingBytes = 0;
+
+	std::thread indexer;
+	std::mutex indexer_mutex;
+	std::condition_variable indexer_condition;
+	bool running = false;
+	std::atomic <uint64_t> indexedSequence = 0; // Every log record below this is indexed
+
+	static const size_t READ_BATCH = 4096;
+
+	void indexRecords(const std::vector<LogRecord>& records)
+	{
+		std::vector<std::string> tokens;
+		std::lock_guard <ProfiledMutex> lock(index_mutex);
+		for (const LogRecord& record : records)
+		{
+			Frame frame;
+			if (!protocol::decode(record.frame.data(), record.frame.size(), frame))
+				continue;
+			if (frame.opcode != Opcode::CHAT && frame.opcode != Opcode::WHISPER)
+				continue;
+
+			tokenize(frame.field(1), tokens);
+			for (const std::string& token : tokens)
+			{
+				PostingList& list = terms[token];
+				size_t before = list.bytes.size();
+				list.add(record.sequence);
+				postingBytes += list.bytes.size() - before;
+			}
+		}
+	}
+
+	void indexerLoop()
+	{
+		uint64_t next = indexedSequence;
+		while (true)
+		{
+			std::vector<LogRecord> records = log.read(next, READ_BATCH);
+			if (!records.empty())
+			{
+				indexRecords(records);
+				next = records.back().sequence + 1;
+				indexedSequence = next;
+				continue;
+			}
+
+			// Caught up, the log writer commits at most every fsync interval anyway
+			std::unique_lock <std::mutex> lock(indexer_mutex);
+			indexer_condition.wait_for(lock, std::chrono::milliseconds(POLL_MS), [this] { return !running; });
+			if (!running)
+				return;
+		}
+	}
+
+public:
+	static const size_t MIN_TERM = 2;
+	static const size_t MAX_TERM = 32;
+	static constexpr unsigned POLL_MS = 200;
+
+	SearchIndex(MessageLog& log) : log(log)
+	{
+	}
+
+	~SearchIndex()
+	{
+		stop();
+	}
+
+	// Indexes whatever the log already holds, then follows new records
+	void start()
+	{
+		std::lock_guard <std::mutex> lock(indexer_mutex);
+		if (running)
+			return;
+		running = true;
+		indexer = std::thread(&SearchIndex::indexerLoop, this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard <std::mutex> lock(indexer_mutex);
+			if (!running)
+				return;
+			running = false;
+		}
+		indexer_condition.notify_one();
+		indexer.join();
+	}
+
+	// Lower cased runs of letters and digits, bytes above 0x7F are kept so UTF-8 words survive
+	// Terms outside MIN_TERM..MAX_TERM are skipped
+	static void tokenize(std::string_view text, std::vector<std::string>& tokens)
+	{
+		tokens.clear();
+		std::string token;
+		for (size_t i = 0; i <= text.size(); i++)
+		{
+			unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+			if (isalnum(c) || c >= 0x80)
+			{
+				token.push_back(static_cast<char>(tolower(c)));
+				continue;
+			}
+			if (token.size() >= MIN_TERM && token.size() <= MAX_TERM)
+				tokens.push_back(token);
+			token.clear();
+		}
+	}
+
+	// Sequences of the messages containing every term of query, newest first
+	std::vector<uint64_t> query(std::string_view query)
+	{
+		std::vector<std::string> tokens;
+		tokenize(query, tokens);
+		std::sort(tokens.begin(), tokens.end());
+		tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+		if (tokens.empty())
+			return {};
+
+		std::vector<uint64_t> matches;
+		{
+			std::lock_guard <ProfiledMutex> lock(index_mutex);
+			std::vector<const PostingList*> lists;
+			for (const std::string& token : tokens)
+			{
+				auto it = terms.find(token);
+				if (it == terms.end())
+					return {};
+				lists.push_back(&it->second);
+			}
+
+			// Start from the rarest term, the candidate set only shrinks from there
+			std::sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) { return a->count < b->count; });
+			matches = lists[0]->decode();
+			for (size_t i = 1; i < lists.size() && !matches.empty(); i++)
+			{
+				lists[i]->intersect(matches);
+			}
+		}
+		std::reverse(matches.begin(), matches.end());
+		return matches;
+	}
+
+	uint64_t indexed()
+	{
+		return indexedSequence;
+	}
+
+	size_t termCount()
+	{
+		std::lock_guard <ProfiledMutex> lock(index_mutex);
+		return terms.size();
+	}
+
+	size_t postingSize()
+	{
+		std::lock_guard <ProfiledMutex> lock(index_mutex);
+		return postingBytes;
+	}
+};
+
+#endif
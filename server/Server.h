@@ -10,9 +10,22 @@
 #include <stdexcept>
 #include <iomanip>
 #include <memory>
+#include <atomic>
+#include <unordered_set>
 #include "ThreadPool.h"
 #include "Util.h"
 #include "User.h"
+#include "Protocol.h"
+#include "Room.h"
+#include "MessageLog.h"
+#include "SearchIndex.h"
+#include "Presence.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Config.h"
+#include "Federation.h"
+#include "Ticket.h"
 
 #pragma comment (lib,  "Ws2_32.lib")
 
@@ -28,22 +41,38 @@ class Server
 private:
 	sockaddr_in server;
 	WSADATA wsaData;
-	SOCKET listeningSocket;
-	const int LISTENING_SERVER_PORT = 50000;
+	SOCKET listeningSocket = INVALID_SOCKET; // Also the hosts socket, shared by every acceptor
+	std::atomic <bool> accepting = false; // Until stopAccepting closes listeningSocket
 	int BUFFER_SIZE = 1024;
 	std::string IP;
+	ServerConfig config; // Ports, limits and files, see configure
 
 	std::vector <std::unique_ptr<User>> users;
 	std::vector <unsigned char> public_key;
 	std::vector <unsigned char> secret_key;
-	std::mutex usersMutex;
+	ProfiledMutex usersMutex{ "Server::usersMutex" };
+	std::unordered_set<std::string> loggingIn; // Names an acceptor is claiming, guarded by usersMutex
+	RoomRegistry rooms;
+	MessageLog messageLog;
+	SearchIndex searchIndex{ messageLog };
+	PresenceBatcher presence;
+	MemberList hostMembers; // Only touched by the presence flush
+	const size_t SEARCH_RESULTS = 10;
+	const size_t SEARCH_SCAN_LIMIT = 1000; // Matches read back per query at most, hidden whispers are skipped
+	const size_t PEER_DISCONNECT_BYTES = 64 * 1024 * 1024;
+	const unsigned PEER_DISCONNECT_AGE_MS = 30000;
+	const unsigned RESUME_TAKEOVER_MS = 2000; // A resumed client waits this long for its stale connection to be cleaned up
+	std::condition_variable_any usersCondition; // Signalled when disconnectUser removes a user, with usersMutex
+	TicketKeeper tickets;
 
 	std::condition_variable shutdownCondition;
 	std::mutex shutdownMutex;
-	std::mutex file_mutex;
+	ProfiledMutex file_mutex{ "Server::file_mutex" };
 	std::string fileName;
 
 	ThreadPool threadPool;
+	Federation federation; // Stopped before the users and rooms its threads deliver to
+	metrics::FileExporter metricsExporter; // Last, stopped before the state it reads is destroyed
 
 	void shutdown()
 	{
@@ -53,7 +82,7 @@ private:
 		}
 
 		WSACleanup();
-		closesocket(listeningSocket);
+		stopAccepting();
 	}
 
 	size_t getFileSize(std::string& filename)
@@ -80,7 +109,7 @@ public:
 
 	unsigned getListenPort()
 	{
-		return LISTENING_SERVER_PORT;
+		return config.port;
 	}
 
 	std::string getIP()
@@ -93,6 +122,29 @@ public:
 		this->IP = IP;
 	}
 
+	// Applies to users connecting after the call
+	void setRateLimits(const RateLimits& limits)
+	{
+		config.rateLimits = limits;
+	}
+
+	// Applies to users connecting after the call
+	void setOutboxLimits(const OutboxLimits& limits)
+	{
+		config.outboxLimits = limits;
+	}
+
+	// Before initializeServer, the address, port, files and intervals are only read there
+	void configure(const ServerConfig& config)
+	{
+		this->config = config;
+		if (!config.ip.empty())
+			IP = config.ip;
+		presence.setInterval(config.presenceIntervalMs);
+		tickets.setLifetime(config.ticketLifetimeS);
+		messageLog.configure(config.logDir, config.logFsync, config.logFsyncIntervalMs);
+	}
+
 	void initializeServer()
 	{
 		// Initialize WSA 
@@ -102,30 +154,26 @@ public:
 
 		// Initialize Server sockaddr_in struct
 		server.sin_family = AF_INET; // Set IPv4
-		server.sin_port = htons(LISTENING_SERVER_PORT); // Set port to listen on
-		server.sin_addr.s_addr = htonl(INADDR_ANY); // Listen on any address
-
-		// Create and bind Socket
-		listeningSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-		// Sets sock option to allow connection in TIME_WAIT phase
-		int yes = 1;
-		if (setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes)) == SOCKET_ERROR)
-			throw std::runtime_error(" [-] setsockopt(SO_REUSEADDR) Failed");
-
-		res = bind(listeningSocket, (sockaddr*)&server, sizeof(server));
-		if (res == SOCKET_ERROR)
-			throw std::runtime_error("[-] Socket Bind Failed");
-
-		// Set Socket to listen
-		res = listen(listeningSocket, SOMAXCONN);
-		if (res == SOCKET_ERROR)
-			throw std::runtime_error("[-] Socket Listen Failed");
+		server.sin_port = htons(static_cast<u_short>(config.port)); // Set port to listen on
+		if (inet_pton(AF_INET, config.bind.c_str(), &server.sin_addr) != 1) // ex.) 0.0.0.0 for any address
+			throw std::runtime_error("[-] Invalid Bind Address: " + config.bind);
+
+		// Every acceptor blocks in accept on this one listener, each connection wakes one of them
+		listeningSocket = openListener();
+		accepting = true;
+
+		logging::logger().openFile(config.consoleLog);
+		presence.start([this] { flushPresence(); });
+		metricsExporter.start(config.metricsFile, config.metricsIntervalMs, [this] { collectMetrics(); });
+		if (messageLog.open())
+			searchIndex.start();
+		else
+			util::print("[!] Message Log Unavailable, Chat Will Not Be Saved");
 	}
 
 	void setFile(std::string fileName)
 	{
-		std::lock_guard <std::mutex> lock(file_mutex);
+		std::lock_guard <ProfiledMutex> lock(file_mutex);
 		this->fileName = fileName;
 	}
 
@@ -133,18 +181,20 @@ public:
 	{
 		try
 		{
-			std::cout << "\033[2K\r[+] Uploading ...";
+			util::print("\033[2K\r[+] Uploading ...", 0);
 
 			std::vector <unsigned char> download_pk = download_user->get_pk();
 			FileTransfer ft(download_user->getIP(), 51000, download_pk, secret_key);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 			TransferStatus upload_status = ft.upload(fileName);
 			if (upload_status != TransferStatus::SUCCESS)
 			{
 				throw std::runtime_error("[-] Tranfer Failed");
 			}
+			recordTransfer(ft.getFileSize(), start);
 			// Can check for other errors here later
 
-			std::cout << "\033[2K\r[+] Upload Complete\n> ";
+			util::print("\033[2K\r[+] Upload Complete\n> ", 0);
 		}
 		catch (std::exception& e)
 		{
@@ -158,22 +208,25 @@ public:
 		size_t res;
 		std::string str;
 
-		std::cout << "\033[2K\r[+] Downloading ...";
+		util::print("\033[2K\r[+] Downloading ...", 0);
 		try
 		{
 			std::vector <unsigned char> peer_pk = upload_user->get_pk();
 			FileTransfer ft(peer_pk, secret_key);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 			TransferStatus download_status = ft.download();
 			if (download_status != TransferStatus::SUCCESS)
 			{
 				throw std::runtime_error("[-] Transfer Failed");
 			}
+			recordTransfer(ft.getFileSize(), start);
 			// Can also check here for other error codes later
 
 			str = "[+] Download Complete";
 			util::print(str);
 
 			std::string filename;
+			logging::logger().flush(); // Queued output before the prompt
 			while (true)
 			{
 				std::cout << "\033[2K\r[*] Save as: ";
@@ -210,50 +263,88 @@ public:
 		}
 	}
 
-	void removeUser(User& user)
+	// Queues the exit for the users rooms next presence delta, closes the socket and frees the User
+	// Returns false if the user was already removed
+	bool disconnectUser(User* user)
 	{
-		std::lock_guard <std::mutex> lock(usersMutex);
-
-		for (auto it = users.begin(); it != users.end(); ++it)
+		std::unique_ptr<User> removed;
 		{
-			if (it->get()->getSocket() == user.getSocket())
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
+			for (auto it = users.begin(); it != users.end(); ++it)
 			{
-				closesocket(user.getSocket());
+				if (it->get() != user)
+					continue;
+
+				Room* room = user->getRoom();
+				if (room != nullptr)
+				{
+					presence.record(room->getName(), PresenceEvent::LEAVE, user->getUsername());
+					rooms.leave(user, room);
+					user->setRoom(nullptr);
+				}
+				presence.forget(user);
+				if (!user->getUsername().empty()) // Before the name is free here, so a new claim is never released
+					federation.release(user->getUsername());
+				removed = std::move(*it);
 				users.erase(it);
-				return;
+				usersCondition.notify_all();
+				break;
 			}
 		}
+		if (!removed)
+			return false;
+
+		// Outside usersMutex, a slow reader only holds up its own thread
+		user->outbox().close(); // Sends what is queued, shuts the socket down if the reader stalls for DRAIN_MS
+		::shutdown(user->getSocket(), SD_BOTH);
+		if (std::shared_ptr<SharedChannel> channel = user->sharedChannel())
+			channel->close();
+		capture::disconnect(user->getSocket()); // Before the handle can be reused
+		closesocket(user->getSocket());
+		serverMetrics().disconnects.add();
+		return true;
 	}
 
-	bool pendingConnection()
+	// A listening socket bound to the servers address
+	SOCKET openListener()
 	{
-		fd_set read_fds;
-		FD_ZERO(&read_fds);
-		FD_SET(listeningSocket, &read_fds);
+		SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener == INVALID_SOCKET)
+			throw std::runtime_error("[-] Socket Creation Failed");
 
-		// Set timeout to 3s
-		struct timeval timeout;
-		timeout.tv_sec = 3;
-		timeout.tv_usec = 0;
+		// Sets sock option to allow connection in TIME_WAIT phase
+		int yes = 1;
+		if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes)) == SOCKET_ERROR)
+			throw std::runtime_error(" [-] setsockopt(SO_REUSEADDR) Failed");
 
-		// Check to see if any sockets are ready for reading
-		// If listeningSocket is ready, it means a new connection is pending
-		if (select(1, &read_fds, NULL, NULL, &timeout) > 0)
+		// Accepted sockets inherit the buffers, set before listen so the window scale is negotiated with them
+		if (config.socketBuffer > 0)
 		{
-			// Check if listeningSocket is in the set
-			if (FD_ISSET(listeningSocket, &read_fds))
-			{
-				return true; // New connection is pending
-			}
+			int bytes = static_cast<int>(std::min<size_t>(config.socketBuffer, INT_MAX));
+			if (setsockopt(listener, SOL_SOCKET, SO_RCVBUF, (char*)&bytes, sizeof(bytes)) == SOCKET_ERROR ||
+				setsockopt(listener, SOL_SOCKET, SO_SNDBUF, (char*)&bytes, sizeof(bytes)) == SOCKET_ERROR)
+				throw std::runtime_error("[-] setsockopt(SO_RCVBUF, SO_SNDBUF) Failed");
 		}
 
-		// No pending connections or select error
-		return false;
+		if (bind(listener, (sockaddr*)&server, sizeof(server)) == SOCKET_ERROR)
+			throw std::runtime_error("[-] Socket Bind Failed");
+
+		// Set Socket to listen
+		if (listen(listener, SOMAXCONN) == SOCKET_ERROR)
+			throw std::runtime_error("[-] Socket Listen Failed");
+		return listener;
+	}
+
+	// Wakes every acceptor blocked in getConnection by closing the listener, they get nullptr from then on
+	void stopAccepting()
+	{
+		if (accepting.exchange(false))
+			closesocket(listeningSocket);
 	}
 
 	void addUser(std::unique_ptr<User>& user)
 	{
-		std::lock_guard <std::mutex> lock(usersMutex);
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
 		users.push_back(std::move(user));
 	}
 
@@ -298,6 +389,7 @@ public:
 		}
 	}
 
+	// Blocks until a client connects, nullptr if the key exchange failed or stopAccepting was called
 	User* getConnection()
 	{
 		SOCKET clientSock;
@@ -306,35 +398,44 @@ public:
 
 		clientSock = accept(listeningSocket, reinterpret_cast<struct sockaddr*>(&clientInfo),&addrSize);
 		if (clientSock == SOCKET_ERROR)
-			return nullptr;
-
-		send_pk(clientSock);
-		std::unique_ptr<User> newUser = std::make_unique<User>(clientSock);
-		std::vector<unsigned char> client_pk = receive_pk(clientSock);
-		if (client_pk.empty())
 		{
+			if (accepting)
+				std::cerr << "[-] Client Socket Creation Failed" << std::endl;
 			return nullptr;
 		}
-		newUser->set_public_key(client_pk);
 
+		send_pk(clientSock);
+		std::vector<unsigned char> client_pk = receive_pk(clientSock);
 		char client_IP[INET_ADDRSTRLEN];
-		if (inet_ntop(AF_INET, &clientInfo.sin_addr, client_IP, sizeof(client_IP)) == NULL)
+		if (client_pk.empty() || inet_ntop(AF_INET, &clientInfo.sin_addr, client_IP, sizeof(client_IP)) == NULL)
 		{
+			std::cerr << "[-] Client Socket Creation Failed" << std::endl;
+			closesocket(clientSock);
 			return nullptr;
 		}
-		
-		unsigned int clientPort = ntohs(clientInfo.sin_port);
-		newUser->setIP(client_IP);
+		return addConnection(clientSock, client_pk, client_IP);
+	}
+
+	// Registers a connected socket whose key exchange is done, ex.) from getConnection or a benchmark
+	User* addConnection(SOCKET clientSock, std::vector<unsigned char>& client_pk, const std::string& ip)
+	{
+		std::unique_ptr<User> newUser = std::make_unique<User>(clientSock);
+		newUser->set_public_key(client_pk);
+		newUser->rateLimiter().configure(config.rateLimits);
+		newUser->outbox().start(clientSock, client_pk, secret_key, config.outboxLimits);
+		newUser->setIP(ip);
 		newUser->setPort(51000);
 		User* user = newUser.get();
 
 		addUser(newUser);
+		serverMetrics().connections.add();
+		capture::connect(clientSock);
 		return user;
 	}
 
 	std::string getUsers_str()
 	{
-		std::lock_guard <std::mutex> lock(usersMutex);
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
 		std::string usernames = "";
 
 		for (auto& user : users)
@@ -342,30 +443,159 @@ public:
 			usernames += user->getUsername() + "\n";
 		}
 
-		return usernames;
+		return usernames + federation.remoteUsers();
 	}
 
 	void set_encryption_keys(std::vector<unsigned char>& pk, std::vector<unsigned char>& sk)
 	{
 		public_key = pk;
 		secret_key = sk;
+		tickets.rekey(); // Tickets name client keys paired with these
 	}
 
-	// Only checks based off of username
+	// Only checks based off of username, users of linked nodes included
 	bool userExists(std::string username)
 	{
-		std::lock_guard< std::mutex> lock(usersMutex);
-		for (auto& user_ : users)
 		{
-			if (user_->getUsername() == username)
-				return true;
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
+			for (auto& user_ : users)
+			{
+				if (user_->getUsername() == username)
+					return true;
+			}
 		}
-		return false;
+		return federation.knows(username);
+	}
+
+	// Gives user username unless it is taken here, mid login on another acceptor or on a linked node
+	bool loginUser(User* user, const std::string& username)
+	{
+		{
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
+			for (auto& user_ : users)
+			{
+				if (user_->getUsername() == username)
+					return false;
+			}
+			if (!loggingIn.insert(username).second)
+				return false;
+		}
+
+		bool claimed = !federation.knows(username) && federation.claim(username); // Blocks on the other nodes answers
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
+		loggingIn.erase(username);
+		if (claimed)
+			user->setUsername(username);
+		return claimed;
+	}
+
+	// A random value for RESUME to carry back, one per attempt, so a recorded RESUME cannot be replayed
+	static std::string resumeChallenge()
+	{
+		std::string challenge(16, '\0');
+		randombytes_buf(challenge.data(), challenge.size());
+		return challenge;
+	}
+
+	// Cuts off a connection still holding the tickets username with its key, ex.) the server never saw the client drop,
+	// and waits up to RESUME_TAKEOVER_MS for disconnectUser to remove it. False if there was none or it is still there.
+	bool evictStale(User* user, const ResumeTicket& ticket)
+	{
+		std::unique_lock <ProfiledMutex> lock(usersMutex);
+		User* stale = nullptr;
+		for (auto& other : users)
+		{
+			if (other.get() != user && other->getUsername() == ticket.username && other->get_pk() == ticket.public_key)
+			{
+				stale = other.get();
+				break;
+			}
+		}
+		if (stale == nullptr)
+			return false;
+
+		::shutdown(stale->getSocket(), SD_BOTH); // Its handleClient thread sees the closed socket and cleans up
+		if (std::shared_ptr<SharedChannel> channel = stale->sharedChannel())
+			channel->close();
+		return usersCondition.wait_for(lock, std::chrono::milliseconds(RESUME_TAKEOVER_MS), [this, stale]
+		{
+			for (auto& other : users)
+			{
+				if (other.get() == stale)
+					return false;
+			}
+			return true;
+		});
+	}
+
+	// Logs user in from a RESUME ticket instead of LOGIN, room is set to the room it was issued in
+	// The ticket must be for the key this connection uses and come back with challenge, the one this connection
+	// was sent. A connection still holding the username with that key is stale and user takes over, see evictStale.
+	bool resumeUser(User* user, const Frame& resume, const std::string& challenge, std::string& room)
+	{
+		ResumeTicket ticket;
+		if (challenge.empty() || resume.field(1) != challenge || !tickets.open(resume.field(0), ticket) || ticket.public_key != user->get_pk())
+		{
+			serverMetrics().resumesRefused.add();
+			return false;
+		}
+
+		bool resumed = loginUser(user, ticket.username);
+		if (!resumed && evictStale(user, ticket))
+			resumed = loginUser(user, ticket.username);
+		if (!resumed)
+		{
+			serverMetrics().resumesRefused.add();
+			return false;
+		}
+
+		room = ticket.room.empty() ? RoomRegistry::LOBBY : ticket.room;
+		serverMetrics().resumes.add();
+		return true;
+	}
+
+	// Answers LOCAL_ATTACH before login, a client on this machine is given a channel name and once it
+	// confirms over TCP that it opened the channel its frames travel over shared memory.
+	// Refused with an empty answer when disabled or the client is remote, the client can refuse too, ex.) another session.
+	void attachSharedMemory(User* user)
+	{
+		std::string name;
+		std::shared_ptr<SharedChannel> channel;
+		if (config.sharedMemory && user->getIP().rfind("127.", 0) == 0 && !user->sharedChannel())
+		{
+			unsigned char nonce[16]; // Only the client, told over its encrypted connection, can find the channel
+			char hex[sizeof(nonce) * 2 + 1];
+			randombytes_buf(nonce, sizeof(nonce));
+			sodium_bin2hex(hex, sizeof(hex), nonce, sizeof(nonce));
+			name = "Local\\chat_" + std::to_string(config.port) + "_" + hex;
+
+			channel = std::make_shared<SharedChannel>();
+			if (!channel->create(name, config.sharedMemoryRing, user->getSocket()))
+			{
+				std::cerr << "[-] Shared Memory Channel Creation Failed" << std::endl;
+				channel.reset();
+			}
+		}
+		if (!channel)
+		{
+			sendFrame(Frame(Opcode::LOCAL_ATTACH), user);
+			return;
+		}
+
+		sendFrame(Frame(Opcode::LOCAL_ATTACH, { name }), user);
+		Frame answer = recvFrame(*user); // Still over TCP, nothing else is sent before the client answers
+		if (answer.opcode != Opcode::LOCAL_ATTACH || answer.byte(0) != 1)
+		{
+			util::print("[!] Client Could Not Open Shared Memory, Staying On TCP");
+			return;
+		}
+		if (user->outbox().attach(channel)) // The name still goes out over TCP
+			user->setSharedChannel(channel);
 	}
 
 	User* findUserBySocket(SOCKET sock)
 	{
-		std::lock_guard <std::mutex> lock(usersMutex);
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
 
 		for (auto& user : users)
 		{
@@ -380,7 +610,8 @@ public:
 
 	User* findUserByUsername(const std::string& username)
 	{
-		std::lock_guard <std::mutex> lock(usersMutex);
+		trace::Scope span("user_lookup");
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
 		for (auto& user : users)
 		{
 			if (username == user->getUsername())
@@ -393,7 +624,7 @@ public:
 
 	SOCKET findSocketByUsername(const std::string& username)
 	{
-		std::lock_guard <std::mutex> lock(usersMutex); 
+		std::lock_guard <ProfiledMutex> lock(usersMutex); 
 		for (auto& user : users)
 		{
 			if (username == user->getUsername())
@@ -402,19 +633,23 @@ public:
 		return INVALID_SOCKET;
 	}
 
-	void broadcastMessageExceptSender(std::string& message, User& sender)
+	void broadcastMessageExceptSender(const Frame& frame, User& sender)
 	{
+		logFrame("*", frame);
 		try
 		{
-			std::lock_guard <std::mutex> lock(usersMutex);
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
 
+			uint64_t recipients = 0;
 			for (int i = 0; i < users.size(); i++)
 			{
 				if (sender == *users[i] || users[i]->isTransfering)
 					continue;
 
-				sendMessage(message, users[i].get());
+				sendFrame(frame, users[i].get());
+				recipients++;
 			}
+			serverMetrics().fanout.record(recipients);
 		}
 		catch (std::exception& e)
 		{
@@ -422,103 +657,574 @@ public:
 		}
 	}
 
-	void broadcastMessage(std::string& message)
+	void broadcastMessage(const Frame& frame)
 	{
-		std::lock_guard <std::mutex> lock(usersMutex);
+		logFrame("*", frame);
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
 
+		uint64_t recipients = 0;
 		for (int i = 0; i < users.size(); i++)
 		{
 			if (!users[i]->isTransfering)
 			{
-				sendMessage(message, users[i].get());
+				sendFrame(frame, users[i].get());
+				recipients++;
+			}
+		}
+		serverMetrics().fanout.record(recipients);
+	}
+
+	// Sends to the members of room only, skipping except and users in a file transfer
+	void broadcastToRoom(const Frame& frame, Room* room, User* except)
+	{
+		try
+		{
+			trace::Scope span("broadcast");
+			uint64_t recipients = 0;
+			room->forEachMember([&](User* member)
+			{
+				if (member != except && !member->isTransfering)
+				{
+					sendFrame(frame, member);
+					recipients++;
+				}
+			});
+			serverMetrics().fanout.record(recipients);
+			span.arg(recipients);
+		}
+		catch (std::exception& e)
+		{
+			std::cerr << "\n" << "Exception: " << e.what() << "\n";
+		}
+	}
+
+	// Chat from sender reaches the room it is currently in, and is kept for members joining later
+	void broadcastToRoom(const Frame& frame, User& sender)
+	{
+		Room* room = sender.getRoom();
+		if (room != nullptr)
+		{
+			std::vector<unsigned char> data = protocol::encode(frame, false); // Replayed later, stale timestamps would skew latency
+			{
+				trace::Scope span("history_append");
+				room->history().append(data);
+				messageLog.append("#" + room->getName(), data);
 			}
+			broadcastToRoom(frame, room, &sender);
+			federation.forwardChat(room->getName(), frame);
+		}
+	}
+
+	// To a user on a linked node, false if no linked node has recipient
+	bool forwardWhisper(const std::string& recipient, const Frame& whisper)
+	{
+		return federation.forwardWhisper(recipient, whisper);
+	}
+
+	// Starts capturing client traffic to path, users already logged in are recorded as connecting,
+	// logging in and joining their room at the start so a replay sees them
+	bool startCapture(const std::string& path)
+	{
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
+		if (!capture::start(path))
+			return false;
+
+		for (auto& user : users)
+		{
+			if (user->getSocket() == listeningSocket || user->getUsername().empty())
+				continue;
+			capture::connect(user->getSocket());
+			capture::frame(user->getSocket(), Frame(Opcode::LOGIN, { user->getUsername() }));
+			Room* room = user->getRoom();
+			if (room != nullptr && room->getName() != RoomRegistry::LOBBY)
+				capture::frame(user->getSocket(), Frame(Opcode::COMMAND, { "/join " + room->getName() }));
 		}
+		return true;
 	}
 
-	// Only encrypt msg if it is leaving the server
-	void sendMessage(std::string& msg, User* user)
+	// Newest logged messages containing every term, whispers are only shown to their sender and recipient
+	std::string searchHistory(std::string_view terms, User& user)
+	{
+		std::vector<uint64_t> matches = searchIndex.query(terms);
+		if (matches.size() > SEARCH_SCAN_LIMIT)
+			matches.resize(SEARCH_SCAN_LIMIT);
+		std::vector<LogRecord> records = messageLog.read(matches);
+		std::string username = user.getUsername();
+		std::string results;
+		size_t shown = 0;
+
+		for (size_t i = 0; i < records.size() && shown < SEARCH_RESULTS; i++)
+		{
+			Frame frame;
+			if (!protocol::decode(records[i].frame.data(), records[i].frame.size(), frame))
+				continue;
+
+			const std::string& channel = records[i].channel;
+			if (frame.opcode == Opcode::WHISPER && channel != username && frame.field(0) != username)
+				continue;
+
+			std::string where = channel[0] == '#' ? channel : (frame.opcode == Opcode::WHISPER ? "whisper" : "*");
+			results += "[" + where + "] " + protocol::render(frame) + "\n";
+			shown++;
+		}
+
+		if (shown == 0)
+			return "[!] No Matches";
+		return "Search Results\n--------------\n" + results;
+	}
+
+	// Queues frame for the on disk log, returns without waiting on the disk
+	void logFrame(const std::string& channel, const Frame& frame)
+	{
+		messageLog.append(channel, protocol::encode(frame, false));
+	}
+
+	// Replays the rooms recent chat to user, every frame is sealed up front and the
+	// whole backlog leaves in a single send instead of one per message
+	void sendBacklog(User* user, Room* room)
+	{
+		std::vector<std::vector<unsigned char>> frames = room->history().recent(config.backlogMessages);
+		if (frames.empty())
+			return;
+
+		std::string header = "[*] Recent messages in #" + room->getName();
+		if (user->getSocket() == listeningSocket)
+		{
+			util::print(header);
+			for (auto& data : frames)
+			{
+				Frame frame;
+				if (protocol::decode(data.data(), data.size(), frame))
+					util::print(protocol::render(frame));
+			}
+			return;
+		}
+
+		Outbox& outbox = user->outbox();
+		std::vector<unsigned char> notice = protocol::encode(protocol::notice(header));
+		std::vector<unsigned char> burst;
+		outbox.seal(burst, notice);
+		for (auto& data : frames)
+		{
+			outbox.seal(burst, data);
+		}
+		outbox.pushSealed(std::move(burst));
+	}
+
+	// Moves user into room name (created on first join), a user is in exactly one room at a time
+	// Only called from the thread serving user, so its current room cannot change underneath
+	void joinRoom(User* user, const std::string& name)
+	{
+		Room* current = user->getRoom();
+		if (current != nullptr && current->getName() == name)
+		{
+			sendMessage("[!] Already in #" + name, user);
+			return;
+		}
+
+		// Both rooms hear about it with the next presence flush, user gets the new rooms member list then
+		if (current != nullptr)
+			presence.record(current->getName(), PresenceEvent::LEAVE, user->getUsername());
+
+		Room* next;
+		{
+			trace::Scope span("room_move");
+			next = rooms.move(user, current, name);
+		}
+		user->setRoom(next);
+
+		presence.record(name, PresenceEvent::JOIN, user->getUsername());
+		presence.resync(user);
+		sendBacklog(user, next);
+		sendMessage("[+] Joined #" + name, user);
+		if (user->getSocket() != listeningSocket && tickets.enabled()) // Lets the client come back here after a drop
+			sendFrame(Frame(Opcode::TICKET, { tickets.issue(user->get_pk(), user->getUsername(), name) }), user);
+	}
+
+	std::string getRooms_str()
+	{
+		return rooms.listing();
+	}
+
+	// Sends the presence changes batched since the last flush, one delta per room to each member
+	// and the full member list to users owed one. Runs on the batchers thread every interval.
+	// usersMutex is held from take() on, so no User in the batch can be freed underneath.
+	void flushPresence()
+	{
+		if (presence.empty())
+			return;
+
+		trace::Scope span("presence_flush");
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
+		PresenceBatch batch = presence.take();
+		span.arg(batch.rooms.size());
+
+		for (User* user : batch.resync)
+		{
+			if (user->isTransfering) // Mid transfer the client reads transfer frames only
+			{
+				presence.resync(user);
+				continue;
+			}
+
+			rooms.withRoomOf(user, [&](Room* room)
+			{
+				std::vector<std::pair<PresenceEvent, std::string>> members;
+				room->forEachMember([&](User* member)
+				{
+					members.emplace_back(PresenceEvent::JOIN, member->getUsername());
+				});
+				for (const std::string& name : federation.remoteMembers(room->getName()))
+				{
+					members.emplace_back(PresenceEvent::JOIN, name);
+				}
+				for (const Frame& frame : protocol::presence(room->getName(), members, true))
+				{
+					sendFrame(frame, user);
+				}
+			});
+		}
+
+		for (auto& delta : batch.rooms)
+		{
+			federation.forwardPresence(delta.first, delta.second.changes);
+			std::vector<Frame> frames = protocol::presence(delta.first, delta.second.changes);
+			rooms.withRoom(delta.first, [&](Room* room)
+			{
+				room->forEachMember([&](User* member)
+				{
+					if (batch.resync.count(member) > 0) // Its full list already covers these changes
+						return;
+					if (member->isTransfering)
+					{
+						presence.resync(member);
+						return;
+					}
+					for (const Frame& frame : frames)
+					{
+						sendFrame(frame, member);
+					}
+				});
+			});
+		}
+	}
+
+	// Queues the frame on the users outbox, the host is shown the rendered text
+	void sendFrame(const Frame& frame, User* user)
 	{
 		if (user->getSocket() == listeningSocket)
 		{
-			util::print(msg);
+			std::string text = protocol::render(frame.opcode == Opcode::PRESENCE ? hostMembers.apply(frame) : frame);
+			if (!text.empty())
+				util::print(text);
+			return;
+		}
+
+		switch (user->outbox().push(frame))
+		{
+		case OutboxAction::SNAPSHOT: // Queued chat was skipped, catch the user up from the rooms history
+		{
+			serverMetrics().outboxSnapshots.add();
+			sendFrame(protocol::notice("[!] You Fell Behind, Skipped Messages Are Replaced By Recent History"), user);
+			Room* room = user->getRoom();
+			if (room != nullptr)
+				sendBacklog(user, room);
+			presence.resync(user);
+			return;
+		}
+		case OutboxAction::RESYNC: // Presence was dropped, the next flush sends the full member list
+			presence.resync(user);
+			return;
+		case OutboxAction::DISCONNECT: // Not reading, its handleClient thread sees the closed socket and cleans up
+			util::print("[!] " + user->getUsername() + "Disconnected, Not Reading Messages");
+			serverMetrics().outboxDisconnects.add();
+			::shutdown(user->getSocket(), SD_BOTH);
+			if (std::shared_ptr<SharedChannel> channel = user->sharedChannel())
+				channel->close();
+			return;
+		default:
+			return;
+		}
+	}
+
+	// Sends msg as a NOTICE frame
+	void sendMessage(const std::string& msg, User* user)
+	{
+		sendFrame(protocol::notice(msg), user);
+	}
+
+	Frame recvFrame(User& user)
+	{
+		std::shared_ptr<SharedChannel> channel = user.sharedChannel();
+		std::vector<unsigned char> encrypted;
+		{
+			trace::Scope span("recv"); // Includes waiting for the client to send
+			if (!(channel ? channel->recv(encrypted) : protocol::recvEncrypted(user.getSocket(), encrypted)))
+			{
+				throw std::exception("[-] Error: Client Unresponsive!");
+			}
+			span.arg(encrypted.size());
+		}
+		uint64_t receivedAt = protocol::monotonicMicros();
+		size_t wireBytes = 4 + encrypted.size();
+
+		ServerMetrics& stats = serverMetrics();
+		std::vector<unsigned char> data;
+		if (channel) // Frames on the rings are not encrypted
+		{
+			data = std::move(encrypted);
 		}
 		else
 		{
-			std::vector<unsigned char> message(msg.begin(), msg.end());
-			std::vector<unsigned char> public_key = user->get_pk();
-			std::vector <unsigned char> encrypted_msg = util::encrypt(message, public_key, secret_key);
-			send(user->getSocket(), reinterpret_cast<char*>(encrypted_msg.data()), encrypted_msg.size(), 0);
+			trace::Scope span("decrypt");
+			metrics::Timer timer(stats.decryptTime);
+			std::vector<unsigned char> pk = user.get_pk();
+			data = util::decrypt(encrypted, pk, secret_key);
 		}
+
+		Frame frame;
+		{
+			trace::Scope span("parse");
+			if (!protocol::decode(data.data(), data.size(), frame))
+			{
+				throw std::exception("[-] Error: Client Unresponsive!");
+			}
+		}
+		if (frame.flags & TIMESTAMPED)
+		{
+			frame.stamps.received = receivedAt;
+			frame.flags &= ~LOCAL_SENDER;
+			if (channel || user.getIP().rfind("127.", 0) == 0) // Otherwise sent is on another hosts clock
+				frame.flags |= LOCAL_SENDER;
+			if ((frame.flags & LOCAL_SENDER) && frame.stamps.sent != 0)
+				stats.uplinkLatency.record(receivedAt - std::min(frame.stamps.sent, receivedAt));
+		}
+		stats.framesIn.add();
+		stats.bytesIn.add(wireBytes);
+		if (frame.opcode != Opcode::PEER_HELLO) // Carries the federation secret
+			capture::frame(user.getSocket(), frame);
+		return frame;
 	}
 
-	std::string recvMessage(SOCKET sock)
+	// Refreshes the gauges that are computed on demand, before /stats or an export
+	void collectMetrics()
 	{
-		char buffer[1024];
-		int res = recv(sock, buffer, sizeof(buffer), 0);
+		ServerMetrics& stats = serverMetrics();
+		{
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
+			int64_t queued = 0, maxQueued = 0, maxAge = 0;
+			for (auto& user : users)
+			{
+				OutboxStats outbox = user->outbox().stats();
+				queued += outbox.queuedBytes;
+				maxQueued = std::max<int64_t>(maxQueued, outbox.queuedBytes);
+				maxAge = std::max<int64_t>(maxAge, outbox.ageMs);
+			}
+			stats.users.set(static_cast<int64_t>(users.size()));
+			stats.outboxBytes.set(queued);
+			stats.outboxMaxBytes.set(maxQueued);
+			stats.outboxMaxAge.set(maxAge);
+		}
+		stats.rooms.set(static_cast<int64_t>(rooms.count()));
+		stats.peerLinks.set(static_cast<int64_t>(federation.linkCount()));
+		stats.remoteUsers.set(static_cast<int64_t>(federation.remoteUserCount()));
+		stats.logPending.set(static_cast<int64_t>(messageLog.getPendingBytes()));
+		stats.logDropped.set(static_cast<int64_t>(messageLog.getDropped()));
+		stats.logSequence.set(static_cast<int64_t>(messageLog.getNextSequence()));
+		stats.consolePending.set(static_cast<int64_t>(logging::logger().getPending()));
+		stats.consoleDropped.set(static_cast<int64_t>(logging::logger().getDropped()));
+	}
 
-		if (res == SOCKET_ERROR)
+	std::string getStats_str()
+	{
+		collectMetrics();
+		return "Server Stats\n------------\n" + metrics::registry().summary();
+	}
+
+	void recordTransfer(size_t bytes, std::chrono::steady_clock::time_point start)
+	{
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		serverMetrics().transferBytes.add(bytes);
+		if (seconds > 0)
+			serverMetrics().transferRate.record(static_cast<uint64_t>(bytes / seconds));
+	}
+
+	// After the keys are set and the host added, links with config.peers and accepts other nodes from then on
+	void startFederation()
+	{
+		if (config.peers.empty() && config.federationSecret.empty())
+			return;
+		if (config.federationSecret.empty())
+			throw std::runtime_error("[-] Federation Needs A federation_secret");
+
+		std::vector<std::string> localUsers;
 		{
-			throw std::exception("[-] Error: Client Unresponsive!");
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
+			for (auto& user : users)
+			{
+				if (!user->getUsername().empty())
+					localUsers.push_back(user->getUsername());
+			}
 		}
-			
-		return std::string(buffer, 0, res);
+
+		FederationHandlers handlers;
+		handlers.linkUp = [this](const std::string& node) { syncPeer(node); };
+		handlers.chat = [this](const Frame& frame) { deliverPeerChat(frame); };
+		handlers.whisper = [this](const Frame& frame) { deliverPeerWhisper(frame); };
+		handlers.presence = [this](const std::string& room, const std::vector<std::pair<PresenceEvent, std::string>>& changes) { deliverPeerPresence(room, changes); };
+		handlers.conflict = [this](const std::string& username) { kickUser(username); };
+
+		// Every peer frame is CRITICAL to the outbox, a link is only cut when the other node stops reading
+		OutboxLimits peerLimits;
+		peerLimits.disconnectBytes = PEER_DISCONNECT_BYTES;
+		peerLimits.disconnectAgeMs = PEER_DISCONNECT_AGE_MS;
+
+		std::string node = config.node.empty() ? IP + ":" + std::to_string(config.port) : config.node;
+		federation.start(node, config.federationSecret, config.peers, public_key, secret_key, peerLimits, localUsers, std::move(handlers));
+		util::print("[*] Federating As " + node);
 	}
 
-	std::string recvMessage(User& user)
+	// Links are closed and no longer redialed, ex.) when the server ends
+	void stopFederation()
 	{
-		char buffer[1024];
-		int res = recv(user.getSocket(), buffer, sizeof(buffer), 0);
-		if (res == SOCKET_ERROR)
+		federation.stop();
+	}
+
+	// user opened with PEER_HELLO, its connection becomes a federation link rather than a user
+	void adoptPeer(User* user, const Frame& hello)
+	{
+		SOCKET sock = user->getSocket();
+		std::vector<unsigned char> pk = user->get_pk();
+		{
+			std::lock_guard <ProfiledMutex> lock(usersMutex);
+			for (auto it = users.begin(); it != users.end(); ++it)
+			{
+				if (it->get() == user)
+				{
+					user->outbox().close();
+					users.erase(it);
+					break;
+				}
+			}
+		}
+		capture::disconnect(sock);
+		federation.accept(sock, pk, hello);
+	}
+
+	// Sends node which room every local user is in, as presence joins
+	void syncPeer(const std::string& node)
+	{
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
+		std::unordered_map<std::string, std::vector<std::pair<PresenceEvent, std::string>>> listing;
+		for (auto& user : users)
 		{
-			throw std::exception("[-] Error: Client Unresponsive!");
+			if (user->getUsername().empty())
+				continue;
+			rooms.withRoomOf(user.get(), [&](Room* room)
+			{
+				listing[room->getName()].emplace_back(PresenceEvent::JOIN, user->getUsername());
+			});
 		}
-		
-		std::vector<unsigned char> encrypted_message(buffer, buffer + res);
-		if (encrypted_message.empty())
+
+		for (auto& room : listing)
 		{
-			throw std::exception("[!] Received Empty Message");
+			for (Frame& frame : protocol::presence(room.first, room.second))
+			{
+				frame.opcode = Opcode::PEER_PRESENCE;
+				federation.sendTo(node, frame);
+			}
 		}
+	}
+
+	// Stamps from a linked node are on its hosts clock, the frame is timed again from its arrival here
+	static void restampPeerFrame(Frame& frame)
+	{
+		if (!(frame.flags & TIMESTAMPED))
+			return;
+		frame.stamps = Timestamps();
+		frame.stamps.received = protocol::monotonicMicros();
+		frame.flags &= ~LOCAL_SENDER;
+	}
+
+	// Chat a linked node forwarded, kept and fanned out like local chat to the members here
+	void deliverPeerChat(const Frame& peer)
+	{
+		Frame chat(Opcode::CHAT, { std::string(peer.field(1)), std::string(peer.field(2)) });
+		chat.carryTimestamps(peer);
+		restampPeerFrame(chat);
+		rooms.withRoom(std::string(peer.field(0)), [&](Room* room)
+		{
+			std::vector<unsigned char> data = protocol::encode(chat, false);
+			room->history().append(data);
+			messageLog.append("#" + room->getName(), data);
+			broadcastToRoom(chat, room, nullptr);
+		});
+	}
 
-		std::vector<unsigned char> pk = user.get_pk();
-		std::vector<unsigned char> decrypted_message = util::decrypt(encrypted_message, pk, secret_key);
+	void deliverPeerWhisper(const Frame& peer)
+	{
+		std::string recipient(peer.field(0));
+		User* receiver = findUserByUsername(recipient);
+		if (receiver == nullptr) // Logged out meanwhile
+			return;
+
+		Frame whisper(Opcode::WHISPER, { std::string(peer.field(1)), std::string(peer.field(2)) });
+		whisper.carryTimestamps(peer);
+		restampPeerFrame(whisper);
+		logFrame(recipient, whisper);
+		sendFrame(whisper, receiver);
+	}
 
-		return std::string(decrypted_message.begin(), decrypted_message.end());
+	// Joins and leaves on a linked node, already batched there, so they go out as they arrive
+	void deliverPeerPresence(const std::string& name, const std::vector<std::pair<PresenceEvent, std::string>>& changes)
+	{
+		std::lock_guard <ProfiledMutex> lock(usersMutex); // Serialized with flushPresence, which shares hostMembers
+		std::vector<Frame> frames = protocol::presence(name, changes);
+		rooms.withRoom(name, [&](Room* room)
+		{
+			room->forEachMember([&](User* member)
+			{
+				if (member->isTransfering)
+				{
+					presence.resync(member);
+					return;
+				}
+				for (const Frame& frame : frames)
+				{
+					sendFrame(frame, member);
+				}
+			});
+		});
 	}
 
-	// Send the downloaders information to the uploader
+	// Another node kept username after a partition, its holder here is disconnected
+	void kickUser(const std::string& username)
+	{
+		std::lock_guard <ProfiledMutex> lock(usersMutex);
+		for (auto& user : users)
+		{
+			if (user->getUsername() != username || user->getSocket() == listeningSocket) // The host stays
+				continue;
+			sendMessage("[!] Your Username Is In Use On Another Server, Disconnecting", user.get());
+			::shutdown(user->getSocket(), SD_RECEIVE); // Its handleClient thread sees the closed socket, disconnectUser drains the notice
+			return;
+		}
+	}
+
+	// Send the downloaders information to the uploader, and the uploaders public key to the downloader
 	void sendTransferInfo(User* upload_user, User* download_user)
 	{
-			unsigned port = 51000;
-			std::vector<unsigned char> download_pk = download_user->get_pk();
-			std::vector<unsigned char> upload_pk = upload_user->get_pk();
-
-			std::vector<unsigned char> encrypted_download_pk = util::encrypt(download_pk, upload_pk, secret_key);
-			std::vector<unsigned char> encrypted_upload_pk = util::encrypt(upload_pk, download_pk, secret_key);
-
-			// send the downloaders pub key to the uploader
-			int res = send(upload_user->getSocket(), reinterpret_cast<char*>(encrypted_download_pk.data()), encrypted_download_pk.size(), 0);
-			
-			// send the uploader pub key to the downloader
-			res = send(download_user->getSocket(), reinterpret_cast<char*>(encrypted_upload_pk.data()), encrypted_upload_pk.size(), 0);
-			
-			// Encrypt and send the port
-			unsigned net_port = htons(port);
-			std::vector <unsigned char> net_port_v = util::dataToVector(net_port);
-			std::vector<unsigned char> encrypted_port = util::encrypt(net_port_v, upload_pk, secret_key);
-			res = send(upload_user->getSocket(), reinterpret_cast<char*> (encrypted_port.data()), encrypted_port.size(), 0);
-			
-			// Send the IP to the uploader
-			std::string IP = download_user->getIP();
-			std::vector<unsigned char> IP_v(IP.begin(), IP.end());
-			std::vector<unsigned char> encrypted_IP = util::encrypt(IP_v, upload_pk, secret_key);
-
-			// Send the size first
-			int32_t dataSize = htons(encrypted_IP.size());
-			std::vector <unsigned char> bin_size = util::int32ToVector(dataSize);
-			std::vector<unsigned char> encrypted_size = util::encrypt(bin_size, upload_pk, secret_key);
-			res = send(upload_user->getSocket(), reinterpret_cast<char*>(encrypted_size.data()), encrypted_size.size(), 0);
-			
-			res = send(upload_user->getSocket(), reinterpret_cast<char*>(encrypted_IP.data()), encrypted_IP.size(), 0); // Send the IP
+		unsigned short port = 51000;
+		std::vector<unsigned char> download_pk_v = download_user->get_pk();
+		std::vector<unsigned char> upload_pk_v = upload_user->get_pk();
+		std::string download_pk(download_pk_v.begin(), download_pk_v.end());
+		std::string upload_pk(upload_pk_v.begin(), upload_pk_v.end());
+
+		unsigned short net_port = htons(port);
+		std::string port_field(reinterpret_cast<const char*>(&net_port), sizeof(net_port));
+
+		sendFrame(Frame(Opcode::TRANSFER_INFO, { download_pk, port_field, download_user->getIP() }), upload_user);
+		sendFrame(Frame(Opcode::TRANSFER_INFO, { upload_pk }), download_user);
 	}
 
 };
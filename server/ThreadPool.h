@@ -9,6 +9,7 @@
 #include <unordered_map>
 #include <stdexcept>
 #include <algorithm>
+#include "ProfiledMutex.h"
 
 // Beginning of ThreadPool
 // ***Disclamer***
@@ -16,14 +17,14 @@
 class ThreadPool
 {
 private:
-	const int THREAD_COUNT = 10;
+	static const int THREAD_COUNT = 10; // Default size
 	bool stop;
 
 	std::queue <std::function<void()>> tasks;
 	std::vector <std::thread> threads;
 	
-	std::mutex task_mutex;
-	std::condition_variable cv;
+	ProfiledMutex task_mutex{ "ThreadPool::task_mutex" };
+	std::condition_variable_any cv;
 
 	// Gets tasks from queue
 	void getTask()
@@ -32,7 +33,7 @@ private:
 		{
 			std::function <void()> task;
 			{
-				std::unique_lock < std::mutex> lock(task_mutex);
+				std::unique_lock <ProfiledMutex> lock(task_mutex);
 				cv.wait(lock, [this] {return !tasks.empty() || stop; }); // Wait until new task
 
 				if (stop)
@@ -48,10 +49,10 @@ private:
 public:
 
 	// Constructor
-	ThreadPool()
+	ThreadPool(int threadCount = THREAD_COUNT)
 	{
 		stop = false;
-		for (int i = 0; i < THREAD_COUNT; i++)
+		for (int i = 0; i < threadCount; i++)
 		{
 			threads.emplace_back(std::thread(&ThreadPool::getTask, this));
 		}
@@ -62,7 +63,7 @@ public:
 	{
 		//Tell threads to stop
 		{
-			std::lock_guard <std::mutex> lock(task_mutex);
+			std::lock_guard <ProfiledMutex> lock(task_mutex);
 			stop = true;
 		}
 		cv.notify_all();
@@ -77,7 +78,7 @@ public:
 	// Check if threads are busy
 	const bool busy()
 	{
-		std::lock_guard < std::mutex> lock(task_mutex);
+		std::lock_guard <ProfiledMutex> lock(task_mutex);
 		return !tasks.empty();
 	}
 
@@ -86,7 +87,7 @@ public:
 	void pushTask(Func&& func)
 	{
 		{
-			std::lock_guard<std::mutex> lock(task_mutex);
+			std::lock_guard <ProfiledMutex> lock(task_mutex);
 			tasks.emplace(std::forward <Func> (func));
 		}
 		cv.notify_one();
@@ -97,7 +98,7 @@ public:
 	void pushTask(Func&& func, Arg1&& arg1, Arg2&& arg2)
 	{
 		{
-			std::unique_lock <std::mutex> lock(task_mutex);
+			std::unique_lock <ProfiledMutex> lock(task_mutex);
 
 			// Add task, forward parameters
 			tasks.emplace
@@ -118,7 +119,7 @@ public:
 	void pushTask(Func&& func, Arg1&& arg1)
 	{
 		{
-			std::unique_lock <std::mutex> lock(task_mutex);
+			std::unique_lock <ProfiledMutex> lock(task_mutex);
 
 			// Add task, forward parameters
 			tasks.emplace
@@ -0,0 +1,140 @@
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sodium.h>
+#include "Protocol.h"
+
+// What a session needs to come back after its connection drops
+struct ResumeTicket
+{
+	std::vector<unsigned char> public_key; // The clients, its frames must still be sealed with the matching secret key
+	std::string username;
+	std::string room;
+	uint64_t expiry = 0; // Seconds since the epoch
+};
+
+// Issues and opens resumption tickets. A logged in client is sent a ticket (TICKET) each time it joins a room,
+// and after a dropped connection it reconnects with its old key pair and presents the ticket (RESUME) instead
+// of generating keys and going through the LOGIN loop. The server keeps nothing per ticket, the session is in
+// the ticket, sealed under a key only this server process knows, so tickets die with the server.
+//
+// Ticket: [nonce][crypto_secretbox of a frame with fields: expiry (u64 network order), public key, username, room]
+// A ticket only helps whoever holds the secret key it was issued to, everything after RESUME is crypto_box
+// between that key and the servers. It comes back with a challenge the server sent on that connection,
+// so a recorded RESUME cannot be replayed to cut off the live session.
+class TicketKeeper
+{
+private:
+	unsigned char key[crypto_secretbox_KEYBYTES];
+	bool keyed = false;
+	unsigned lifetimeS = DEFAULT_LIFETIME_S;
+	std::mutex key_mutex;
+
+	static uint64_t now()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+
+	static std::string u64Field(uint64_t value)
+	{
+		std::string field(8, '\0');
+		for (int i = 7; i >= 0; i--, value >>= 8)
+			field[i] = static_cast<char>(value & 0xFF);
+		return field;
+	}
+
+	static uint64_t u64(std::string_view field)
+	{
+		uint64_t value = 0;
+		for (unsigned char byte : field)
+			value = (value << 8) | byte;
+		return value;
+	}
+
+public:
+	static const unsigned DEFAULT_LIFETIME_S = 3600;
+
+	TicketKeeper()
+	{
+	}
+
+	~TicketKeeper()
+	{
+		sodium_memzero(key, sizeof(key));
+	}
+
+	// 0 turns tickets off, nothing is issued and every RESUME is refused
+	void setLifetime(unsigned lifetimeS)
+	{
+		this->lifetimeS = lifetimeS;
+	}
+
+	bool enabled() const
+	{
+		return lifetimeS > 0;
+	}
+
+	// A new key, every ticket issued so far stops opening, after sodium is started
+	void rekey()
+	{
+		std::lock_guard <std::mutex> lock(key_mutex);
+		crypto_secretbox_keygen(key);
+		keyed = true;
+	}
+
+	// Empty when tickets are off
+	std::string issue(const std::vector<unsigned char>& pk, const std::string& username, const std::string& room)
+	{
+		if (!enabled())
+			return "";
+
+		Frame session(Opcode::RESUME, { u64Field(now() + lifetimeS), std::string(pk.begin(), pk.end()), username, room });
+		std::vector<unsigned char> data = protocol::encode(session, false);
+		std::string ticket(crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + data.size(), '\0');
+		unsigned char* out = reinterpret_cast<unsigned char*>(ticket.data());
+		randombytes_buf(out, crypto_secretbox_NONCEBYTES);
+
+		std::lock_guard <std::mutex> lock(key_mutex);
+		if (!keyed)
+			return "";
+		crypto_secretbox_easy(out + crypto_secretbox_NONCEBYTES, data.data(), data.size(), out, key);
+		return ticket;
+	}
+
+	// False if the ticket is forged, from before a rekey, malformed or expired
+	bool open(std::string_view sealed, ResumeTicket& ticket)
+	{
+		if (!enabled() || sealed.size() < crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + protocol::HEADER_SIZE)
+			return false;
+
+		const unsigned char* in = reinterpret_cast<const unsigned char*>(sealed.data());
+		std::vector<unsigned char> data(sealed.size() - crypto_secretbox_NONCEBYTES - crypto_secretbox_MACBYTES);
+		{
+			std::lock_guard <std::mutex> lock(key_mutex);
+			if (!keyed || crypto_secretbox_open_easy(data.data(), in + crypto_secretbox_NONCEBYTES, sealed.size() - crypto_secretbox_NONCEBYTES, in, key) != 0)
+				return false;
+		}
+
+		Frame session;
+		if (!protocol::decode(data.data(), data.size(), session) || session.fields.size() != 4 || session.field(0).size() != 8
+			|| session.field(1).size() != crypto_box_PUBLICKEYBYTES)
+			return false;
+
+		ticket.expiry = u64(session.field(0));
+		if (ticket.expiry < now())
+			return false;
+		ticket.public_key.assign(session.field(1).begin(), session.field(1).end());
+		ticket.username = std::string(session.field(2));
+		ticket.room = std::string(session.field(3));
+		return !ticket.username.empty();
+	}
+};
+
+#endif
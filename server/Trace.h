@@ -0,0 +1,183 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped trace points on the hot paths, ex.) trace::Scope span("decrypt");
+// Each thread writes fixed size records into its own ring, overwriting the oldest, with no locks and no
+// allocation after its first record. While tracing is off a span costs one relaxed load and a branch,
+// building with CHAT_NO_TRACE removes the spans entirely. dump() writes the rings as Chrome trace event
+// JSON, open the file in Perfetto (ui.perfetto.dev) or chrome://tracing.
+namespace trace
+{
+	const size_t RING_SIZE = 8192; // Records per thread, about 320 KiB
+
+	std::atomic <bool> enabled = false;
+	std::atomic <uint64_t> since = 0; // Records older than this were taken before tracing was last switched on
+
+	uint64_t now()
+	{
+		static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+	}
+
+	// Fields are relaxed atomics guarded by seq, a reader only keeps a record if seq is unchanged around its copy
+	struct Record
+	{
+		std::atomic <uint64_t> seq = 0; // Index + 1 once written, 0 while being written
+		std::atomic <const char*> name = nullptr; // Always a string literal
+		std::atomic <uint64_t> start = 0;
+		std::atomic <uint64_t> duration = 0;
+		std::atomic <uint64_t> arg = 0;
+	};
+
+	// Written by its owning thread only
+	struct Ring
+	{
+		uint32_t tid;
+		std::atomic <uint64_t> head = 0;
+		Record records[RING_SIZE];
+
+		void push(const char* name, uint64_t start, uint64_t duration, uint64_t arg)
+		{
+			uint64_t index = head.load(std::memory_order_relaxed);
+			Record& record = records[index % RING_SIZE];
+			record.seq.store(0, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			record.name.store(name, std::memory_order_relaxed);
+			record.start.store(start, std::memory_order_relaxed);
+			record.duration.store(duration, std::memory_order_relaxed);
+			record.arg.store(arg, std::memory_order_relaxed);
+			record.seq.store(index + 1, std::memory_order_release);
+			head.store(index + 1, std::memory_order_release);
+		}
+	};
+
+	// Rings outlive their threads so a dump still sees threads that have exited
+	std::vector<std::unique_ptr<Ring>> rings;
+	std::mutex rings_mutex;
+
+	Ring& threadRing()
+	{
+		thread_local Ring* ring = nullptr;
+		if (ring == nullptr)
+		{
+			std::lock_guard <std::mutex> lock(rings_mutex);
+			rings.push_back(std::make_unique<Ring>());
+			ring = rings.back().get();
+			ring->tid = static_cast<uint32_t>(rings.size());
+		}
+		return *ring;
+	}
+
+	// Starting discards what was recorded before from the next dump
+	void start()
+	{
+		since = now();
+		enabled = true;
+	}
+
+	void stop()
+	{
+		enabled = false;
+	}
+
+#ifndef CHAT_NO_TRACE
+	class Scope
+	{
+	private:
+		const char* name;
+		uint64_t begin = 0;
+		uint64_t value = 0;
+		bool active;
+
+	public:
+		Scope(const char* name) : name(name), active(enabled.load(std::memory_order_relaxed))
+		{
+			if (active)
+				begin = now();
+		}
+
+		~Scope()
+		{
+			if (active)
+				threadRing().push(name, begin, now() - begin, value);
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+		// Shown as args.n in the viewer, ex.) bytes or recipients
+		void arg(uint64_t n)
+		{
+			value = n;
+		}
+	};
+#else
+	class Scope
+	{
+	public:
+		Scope(const char*) {}
+		void arg(uint64_t) {}
+	};
+#endif
+
+	// Every record still in a ring since the last start(), as Chrome trace event JSON (complete "X" events)
+	std::string chromeJson()
+	{
+		std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		bool first = true;
+		uint64_t from = since;
+		char line[256];
+
+		std::lock_guard <std::mutex> lock(rings_mutex);
+		for (auto& ring : rings)
+		{
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			for (uint64_t i = head > RING_SIZE ? head - RING_SIZE : 0; i < head; i++)
+			{
+				Record& record = ring->records[i % RING_SIZE];
+				uint64_t seq = record.seq.load(std::memory_order_acquire);
+				if (seq != i + 1)
+					continue;
+				const char* name = record.name.load(std::memory_order_relaxed);
+				uint64_t start = record.start.load(std::memory_order_relaxed);
+				uint64_t duration = record.duration.load(std::memory_order_relaxed);
+				uint64_t arg = record.arg.load(std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (record.seq.load(std::memory_order_relaxed) != seq || start < from) // Overwritten while copying, or too old
+					continue;
+
+				// Microseconds with ns precision
+				std::snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"args\":{\"n\":%llu}}",
+					first ? "\n" : ",\n", name, ring->tid,
+					static_cast<unsigned long long>(start / 1000), static_cast<unsigned long long>(start % 1000),
+					static_cast<unsigned long long>(duration / 1000), static_cast<unsigned long long>(duration % 1000),
+					static_cast<unsigned long long>(arg));
+				json += line;
+				first = false;
+			}
+		}
+		json += "\n]}\n";
+		return json;
+	}
+
+	bool dump(const std::string& path)
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+		file << chromeJson();
+		return file.good();
+	}
+}
+
+#endif
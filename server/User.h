@@ -3,6 +3,11 @@
 #include <Winsock2.h>
 #include <mutex>
 #include <future>
+#include <memory>
+#include "Room.h"
+#include "RateLimiter.h"
+#include "Outbox.h"
+#include "ProfiledMutex.h"
 
 class User
 {
@@ -12,12 +17,16 @@ private:
 	std::string ip_address;
 	unsigned int port;
 
-	std::mutex transfer_complete_mutex;
-	std::condition_variable transfer_complete_condition;
+	ProfiledMutex transfer_complete_mutex{ "User::transfer_complete_mutex" };
+	std::condition_variable_any transfer_complete_condition;
 	std::promise <bool>  transferDecisionPromise;
 	std::future <bool> transferDecisionFuture;
 
 	std::vector <unsigned char> public_key;
+	std::atomic <Room*> room = nullptr; // Only changed by the thread serving this user
+	RateLimiter limiter;
+	Outbox sendQueue;
+	std::shared_ptr<SharedChannel> channel; // Set before the user logs in, ex.) by Server::attachSharedMemory
 	
 	void resetTransfer()
 	{
@@ -57,6 +66,38 @@ public:
 		resetTransfer();
 	}
 
+	// Everything sent to this user goes through here, the outbox writer is the only thread sending on sock
+	Outbox& outbox()
+	{
+		return sendQueue;
+	}
+
+	// Null unless the client moved to shared memory, then frames are received there instead of on sock
+	std::shared_ptr<SharedChannel> sharedChannel()
+	{
+		return channel;
+	}
+
+	void setSharedChannel(std::shared_ptr<SharedChannel> channel)
+	{
+		this->channel = std::move(channel);
+	}
+
+	RateLimiter& rateLimiter()
+	{
+		return limiter;
+	}
+
+	Room* getRoom()
+	{
+		return room.load();
+	}
+
+	void setRoom(Room* room)
+	{
+		this->room = room;
+	}
+
 	void set_public_key(std::vector<unsigned char>& pk)
 	{
 		public_key = pk;
@@ -106,27 +147,27 @@ public:
 
 	void wait_completeTransfer()
 	{
-		std::unique_lock <std::mutex> lock(transfer_complete_mutex);
+		std::unique_lock <ProfiledMutex> lock(transfer_complete_mutex);
 
 		transfer_complete_condition.wait(lock, [this] {return !isTransfering.load(); });
 	}
 
 	void signalEndOfTransfer()
 	{
-		std::lock_guard <std::mutex> lock(transfer_complete_mutex);
+		std::lock_guard <ProfiledMutex> lock(transfer_complete_mutex);
 		isTransfering = false;
 		transfer_complete_condition.notify_one();
 	}
 
 	void signalStartOfTransfer()
 	{
-		std::lock_guard <std::mutex> lock(transfer_complete_mutex);
+		std::lock_guard <ProfiledMutex> lock(transfer_complete_mutex);
 		isTransfering = true;
 	}
 
 	bool inFileTransfer()
 	{
-		std::lock_guard <std::mutex> lock(transfer_complete_mutex);
+		std::lock_guard <ProfiledMutex> lock(transfer_complete_mutex);
 		return isTransfering;
 	}
 
@@ -1,6 +1,7 @@
 #include "ChatRoom.h"
 
-int main()
+// server [--config file] [--key value ...], see ServerConfig in Config.h
+int main(int argc, char** argv)
 {
 	//std::string ip = "192.168.1.69";
 	//std::vector <unsigned char> bin_ip = util::strToBin_IP(ip);
@@ -10,7 +11,24 @@ int main()
 	//std::cout << "[*] Original IP: " << ip;
 	//std::cout << "\n[*] New IP: " << new_ip;
 
-	ChatRoom chat_room;
+	ServerConfig config;
+	if (argc > 1 && std::string(argv[1]) == "--help")
+	{
+		std::cout << ServerConfig::USAGE;
+		return 0;
+	}
+
+	try
+	{
+		config.parseArgs(argc, argv);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << "\n" << ServerConfig::USAGE;
+		return 1;
+	}
+
+	ChatRoom chat_room(config);
 	chat_room.run_chat_room();
 
 	return 0;